@@ -0,0 +1,88 @@
+// Copyright 2023 Global Phasing Ltd.
+
+// Microbenchmark of all-vs-all RMSD in an ensemble of models (ensemble.hpp).
+// If the file has only one model, an ensemble of 100 models is generated
+// by random perturbation of atomic positions.
+
+#include "gemmi/ensemble.hpp"
+#include "gemmi/mmread_gz.hpp"
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <random>
+
+static gemmi::FlatStructure flat;
+static gemmi::PolymerType ptype = gemmi::PolymerType::PeptideL;
+
+static void pairwise_superpositions(benchmark::State& state) {
+  using namespace gemmi;
+  size_t n = std::min(flat.model_count(), (size_t) 20);
+  while (state.KeepRunning()) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = i + 1; j < n; ++j)
+        sum += calculate_superposition(flat, i, flat, j, ptype, SupSelect::CaP).rmsd;
+    benchmark::DoNotOptimize(sum);
+  }
+}
+
+static void ensemble_rmsd_20(benchmark::State& state) {
+  using namespace gemmi;
+  EnsembleRmsd ens(flat, ptype, SupSelect::CaP);
+  size_t n = std::min(flat.model_count(), (size_t) 20);
+  while (state.KeepRunning()) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = i + 1; j < n; ++j)
+        sum += ens.rmsd(i, j);
+    benchmark::DoNotOptimize(sum);
+  }
+}
+
+static void ensemble_setup(benchmark::State& state) {
+  using namespace gemmi;
+  while (state.KeepRunning()) {
+    EnsembleRmsd ens(flat, ptype, SupSelect::CaP);
+    benchmark::DoNotOptimize(ens);
+  }
+}
+
+static void ensemble_matrix(benchmark::State& state) {
+  using namespace gemmi;
+  EnsembleRmsd ens(flat, ptype, SupSelect::MainChain);
+  int n_threads = (int) state.range(0);
+  while (state.KeepRunning()) {
+    std::vector<double> matrix = ens.calculate_matrix(n_threads);
+    benchmark::DoNotOptimize(matrix);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Call it with path to a coordinate file as an argument.\n");
+    return 1;
+  }
+  gemmi::Structure st = gemmi::read_structure_gz(argv[argc-1]);
+  if (st.models.size() == 1) {
+    std::mt19937 rng(1);
+    std::normal_distribution<double> noise(0., 0.5);
+    gemmi::Model model0 = st.models[0];
+    for (int i = 1; i < 100; ++i) {
+      st.models.push_back(model0);
+      st.models.back().name = std::to_string(i + 1);
+      for (gemmi::Chain& chain : st.models.back().chains)
+        for (gemmi::Residue& res : chain.residues)
+          for (gemmi::Atom& atom : res.atoms)
+            atom.pos += gemmi::Position(noise(rng), noise(rng), noise(rng));
+    }
+  }
+  flat.set_structure(st);
+  printf("%zu models with %zu atoms.\n", flat.model_count(),
+         flat.model_atom_end(0) - flat.model_atom_begin(0));
+  benchmark::RegisterBenchmark("pairwise_superpositions", pairwise_superpositions);
+  benchmark::RegisterBenchmark("ensemble_rmsd_20", ensemble_rmsd_20);
+  benchmark::RegisterBenchmark("ensemble_setup", ensemble_setup);
+  benchmark::RegisterBenchmark("ensemble_matrix", ensemble_matrix)
+    ->Arg(1)->Arg(2)->Arg(4)->UseRealTime();
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+}
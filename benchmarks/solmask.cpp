@@ -0,0 +1,58 @@
+// Copyright 2023 Global Phasing Ltd.
+
+// Microbenchmark of bulk solvent masking (solmask.hpp) on 1-4 threads.
+// Before running benchmarks, masks from multiple threads are checked
+// to be identical to the mask from a single thread.
+
+#include "gemmi/solmask.hpp"
+#include "gemmi/mmread_gz.hpp"
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <cstdint>  // for int8_t
+
+static gemmi::Structure st;
+static double spacing = 0.5;
+
+static gemmi::Grid<std::int8_t> make_mask(gemmi::AtomicRadiiSet radii_set,
+                                            int n_threads) {
+  gemmi::Grid<std::int8_t> grid;
+  grid.setup_from(st, spacing);
+  gemmi::SolventMasker masker(radii_set, 1.5);
+  masker.n_threads = n_threads;
+  masker.put_mask_on_grid(grid, st.models[0]);
+  return grid;
+}
+
+static void put_mask_on_grid(benchmark::State& state) {
+  auto radii_set = (gemmi::AtomicRadiiSet) state.range(0);
+  int n_threads = (int) state.range(1);
+  while (state.KeepRunning()) {
+    gemmi::Grid<std::int8_t> grid = make_mask(radii_set, n_threads);
+    benchmark::DoNotOptimize(grid);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("Call it with path to a coordinate file as an argument.\n");
+    return 1;
+  }
+  st = gemmi::read_structure_gz(argv[argc-1]);
+  for (int radii_set = 0; radii_set < 4; ++radii_set) {
+    auto rs = (gemmi::AtomicRadiiSet) radii_set;
+    std::vector<std::int8_t> data = make_mask(rs, 1).data;
+    for (int n_threads : {2, 3, 4})
+      if (make_mask(rs, n_threads).data != data) {
+        printf("Mask %d from %d threads differs.\n", radii_set, n_threads);
+        return 1;
+      }
+  }
+  printf("Masks from 1-4 threads are identical.\n");
+  auto* bm = benchmark::RegisterBenchmark("put_mask_on_grid", put_mask_on_grid);
+  for (int radii_set = 0; radii_set < 4; ++radii_set)
+    for (int n_threads : {1, 2, 4})
+      bm->Args({radii_set, n_threads});
+  bm->UseRealTime();
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+}
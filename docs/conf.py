@@ -77,6 +77,8 @@ try:
 except ImportError:
     print('Tests that use networkx are disabled.', file=sys.stderr)
     networkx = None
+import gemmi
+can_write_gzip = gemmi.MtzWriter.can_write_gzip()
 import os
 mdm2_unmerged_mtz_path = os.getenv('CCP4')
 if mdm2_unmerged_mtz_path:
@@ -6,9 +6,11 @@
 #define GEMMI_ALIGN_HPP_
 
 #include "model.hpp"
+#include "flat.hpp"      // for FlatStructure
 #include "seqalign.hpp"  // for align_sequences
 #include "qcp.hpp"       // for superpose_positions
 #include "polyheur.hpp"  // for are_connected3
+#include "parallel.hpp"  // for parallel_for
 
 namespace gemmi {
 
@@ -223,15 +225,13 @@ inline SupResult calculate_current_rmsd(ConstResidueSpan fixed,
   return r;
 }
 
-inline SupResult calculate_superposition(ConstResidueSpan fixed,
-                                         ConstResidueSpan movable,
-                                         PolymerType ptype,
-                                         SupSelect sel,
-                                         int trim_cycles=0,
-                                         double trim_cutoff=2.0,
-                                         char altloc='\0') {
-  std::vector<Position> pos1, pos2;
-  prepare_positions_for_superposition(pos1, pos2, fixed, movable, ptype, sel, altloc);
+// Superposes pos2 onto pos1. If trim_cycles > 0, pairs that are further
+// apart than trim_cutoff * RMSD are removed and superposition is repeated.
+// The vectors are modified during trimming.
+inline SupResult superpose_positions_with_trimming(std::vector<Position>& pos1,
+                                                   std::vector<Position>& pos2,
+                                                   int trim_cycles,
+                                                   double trim_cutoff) {
   const double* weights = nullptr;
   size_t len = pos1.size();
   SupResult sr = superpose_positions(pos1.data(), pos2.data(), len, weights);
@@ -261,6 +261,96 @@ inline SupResult calculate_superposition(ConstResidueSpan fixed,
   return sr;
 }
 
+inline SupResult calculate_superposition(ConstResidueSpan fixed,
+                                         ConstResidueSpan movable,
+                                         PolymerType ptype,
+                                         SupSelect sel,
+                                         int trim_cycles=0,
+                                         double trim_cutoff=2.0,
+                                         char altloc='\0') {
+  std::vector<Position> pos1, pos2;
+  prepare_positions_for_superposition(pos1, pos2, fixed, movable, ptype, sel, altloc);
+  return superpose_positions_with_trimming(pos1, pos2, trim_cycles, trim_cutoff);
+}
+
+// helper function: indices (offsets from the model start) of atoms
+// in FlatStructure's model to be used for superposition
+inline std::vector<size_t> select_atoms_for_superposition(const FlatStructure& flat,
+                                                          size_t model,
+                                                          PolymerType ptype,
+                                                          SupSelect sel,
+                                                          char altloc='\0') {
+  size_t begin = flat.model_atom_begin(flat.check_model(model));
+  size_t end = flat.model_atom_end(model);
+  // ids of selected atom names in flat.names
+  std::vector<std::pair<int, El>> used_atoms;
+  if (sel == SupSelect::CaP) {
+    bool is_na = is_polynucleotide(ptype);
+    used_atoms.emplace_back(flat.names.find(is_na ? "P" : "CA"), is_na ? El::P : El::C);
+  } else if (sel == SupSelect::MainChain) {
+    for (const AtomNameElement& ane : get_mainchain_atoms(ptype))
+      used_atoms.emplace_back(flat.names.find(ane.atom_name), ane.el);
+  }
+  std::vector<size_t> selected;
+  for (size_t n = begin; n != end; ++n) {
+    char alt = flat.altloc[n];
+    if (!(altloc == '*' || alt == '\0' || alt == altloc))
+      continue;
+    if (!used_atoms.empty() &&
+        !in_vector(std::make_pair(flat.atom_name[n], flat.element[n]), used_atoms))
+      continue;
+    selected.push_back(n - begin);
+  }
+  return selected;
+}
+
+// Superposition of two models (from the same or different FlatStructure)
+// that have the same atoms in the same order, such as models of NMR
+// ensemble or frames of MD trajectory. Atoms are paired by index,
+// so no sequence alignment is done.
+inline SupResult calculate_superposition(const FlatStructure& fixed,
+                                         size_t fixed_model,
+                                         const FlatStructure& movable,
+                                         size_t movable_model,
+                                         PolymerType ptype,
+                                         SupSelect sel,
+                                         int trim_cycles=0,
+                                         double trim_cutoff=2.0,
+                                         char altloc='\0') {
+  size_t begin1 = fixed.model_atom_begin(fixed.check_model(fixed_model));
+  size_t end1 = fixed.model_atom_end(fixed_model);
+  size_t begin2 = movable.model_atom_begin(movable.check_model(movable_model));
+  if (end1 - begin1 != movable.model_atom_end(movable_model) - begin2)
+    fail("calculate_superposition(): models have different number of atoms");
+  for (size_t n1 = begin1, n2 = begin2; n1 != end1; ++n1, ++n2)
+    if (&fixed == &movable ? fixed.atom_name[n1] != movable.atom_name[n2]
+                           : fixed.get_atom_name(n1) != movable.get_atom_name(n2))
+      fail("calculate_superposition(): different atoms at position ",
+           std::to_string(n1 - begin1));
+  std::vector<Position> pos1, pos2;
+  for (size_t n : select_atoms_for_superposition(fixed, fixed_model, ptype, sel, altloc)) {
+    pos1.push_back(fixed.position(begin1 + n));
+    pos2.push_back(movable.position(begin2 + n));
+  }
+  return superpose_positions_with_trimming(pos1, pos2, trim_cycles, trim_cutoff);
+}
+
+// helper function: range [begin, end) of positions around pos[offset]
+// that are closer than sqrt(radius_sq) to pos[offset], within [low, high).
+inline std::pair<size_t, size_t> get_moving_window(const Position* pos,
+                                                   size_t offset,
+                                                   size_t low, size_t high,
+                                                   double radius_sq) {
+  const Position& ca_pos = pos[offset];
+  size_t a = offset;
+  while (a > low && ca_pos.dist_sq(pos[a-1]) < radius_sq)
+    --a;
+  size_t b = offset + 1;
+  while (b < high && ca_pos.dist_sq(pos[b]) < radius_sq)
+    ++b;
+  return {a, b};
+}
+
 // Returns superpositions for all residues in fixed.first_conformer(),
 // performed by superposing backbone in radius=10.0 from residue's Ca.
 inline std::vector<SupResult> calculate_superpositions_in_moving_window(
@@ -275,22 +365,121 @@ inline std::vector<SupResult> calculate_superpositions_in_moving_window(
   std::vector<int> ca_offsets;
   prepare_positions_for_superposition(pos1, pos2, fixed, movable, ptype,
                                       sel, altloc, &ca_offsets);
-  const double* weights = nullptr;
+  QcpPrefixSums sums(pos1.data(), pos2.data(), pos1.size(), nullptr);
   std::vector<SupResult> result;
+  result.reserve(ca_offsets.size());
   for (int offset : ca_offsets) {
     if (offset == -1) {
       result.push_back(SupResult{NAN, 0, {}, {}, {}});
       continue;
     }
-    const Position& ca_pos = pos1[offset];
-    int a = offset;
-    while (a > 0 && ca_pos.dist_sq(pos1[a-1]) < radius_sq)
-      --a;
-    int b = offset;
-    while (b+1 < (int)pos1.size() && ca_pos.dist_sq(pos1[b+1]) < radius_sq)
-      ++b;
-    result.push_back(superpose_positions(&pos1[a], &pos2[a], b-a+1, weights));
+    auto range = get_moving_window(pos1.data(), offset, 0, pos1.size(), radius_sq);
+    result.push_back(sums.superpose(range.first, range.second));
+  }
+  return result;
+}
+
+// Moving-window superpositions, as above, of all models of an ensemble
+// (NMR models, MD frames) onto model ref_model. Models must have the same
+// atoms in the same order; main chain atoms without altloc are paired
+// by index. Only polymer residues (as in Chain::get_polymer()) are used.
+// Windows are determined from ref_model and don't cross chains.
+// Returns result[model][n] for the n-th residue of ref_model. Residues
+// without Ca (or P) and residues outside of polymers get rmsd=NAN
+// and count=0. Models are processed in parallel on n_threads threads
+// (0 = all hardware threads).
+inline std::vector<std::vector<SupResult>> calculate_superpositions_in_moving_window(
+                                      const FlatStructure& flat,
+                                      size_t ref_model,
+                                      PolymerType ptype,
+                                      double radius=10.0,
+                                      int n_threads=1) {
+  const double radius_sq = radius * radius;
+  const size_t ref_begin = flat.model_atom_begin(flat.check_model(ref_model));
+  const size_t n_atoms = flat.model_atom_end(ref_model) - ref_begin;
+  std::vector<std::pair<int, El>> used_atoms;
+  for (const AtomNameElement& ane : get_mainchain_atoms(ptype))
+    used_atoms.emplace_back(flat.names.find(ane.atom_name), ane.el);
+  const std::pair<int, El> ca_p = used_atoms[is_polynucleotide(ptype) ? 0 : 1];
+
+  // select atoms (as offsets from the model start) in the reference model
+  std::vector<size_t> selected;
+  std::vector<Position> pos1;
+  std::vector<int> ca_offsets;          // for each residue
+  std::vector<size_t> chain_atom_end;   // ends of chains in selected
+  std::vector<size_t> chain_res_end;    // ends of chains in ca_offsets
+  for (size_t c = flat.model_start[ref_model]; c < flat.model_start[ref_model+1]; ++c) {
+    // the same residues as in Chain::get_polymer()
+    size_t poly_begin = flat.chain_start[c];
+    while (poly_begin < flat.chain_start[c+1] &&
+           flat.entity_type[poly_begin] != EntityType::Polymer)
+      ++poly_begin;
+    size_t poly_end = poly_begin;
+    while (poly_end < flat.chain_start[c+1] &&
+           flat.entity_type[poly_end] == EntityType::Polymer &&
+           flat.subchain[poly_end] == flat.subchain[poly_begin])
+      ++poly_end;
+    for (size_t r = flat.chain_start[c]; r < flat.chain_start[c+1]; ++r) {
+      int ca_offset = -1;
+      if (r < poly_begin || r >= poly_end) {
+        ca_offsets.push_back(ca_offset);
+        continue;
+      }
+      // atoms in the order of used_atoms, as in prepare_positions_for_superposition()
+      for (const std::pair<int, El>& atom : used_atoms)
+        for (size_t n = flat.residue_start[r]; n < flat.residue_start[r+1]; ++n)
+          if (flat.atom_name[n] == atom.first && flat.element[n] == atom.second &&
+              flat.altloc[n] == '\0') {
+            if (atom == ca_p)
+              ca_offset = (int) selected.size();
+            selected.push_back(n - ref_begin);
+            pos1.push_back(flat.position(n));
+            break;
+          }
+      ca_offsets.push_back(ca_offset);
+    }
+    chain_atom_end.push_back(selected.size());
+    chain_res_end.push_back(ca_offsets.size());
   }
+  // windows (the same for all models)
+  std::vector<std::pair<size_t, size_t>> windows(ca_offsets.size());
+  for (size_t c = 0, res = 0; c < chain_res_end.size(); ++c) {
+    size_t low = c == 0 ? 0 : chain_atom_end[c-1];
+    for (; res < chain_res_end[c]; ++res)
+      if (ca_offsets[res] != -1)
+        windows[res] = get_moving_window(pos1.data(), ca_offsets[res],
+                                         low, chain_atom_end[c], radius_sq);
+  }
+
+  std::vector<std::vector<SupResult>> result(flat.model_count());
+  parallel_for(flat.model_count(), get_thread_count(n_threads), [&](size_t m) {
+    size_t begin = flat.model_atom_begin(m);
+    if (flat.model_atom_end(m) - begin != n_atoms)
+      fail("calculate_superpositions_in_moving_window(): model #",
+           std::to_string(m), " has different number of atoms");
+    std::vector<Position> pos2(selected.size());
+    for (size_t i = 0; i < selected.size(); ++i) {
+      if (flat.atom_name[begin + selected[i]] != flat.atom_name[ref_begin + selected[i]])
+        fail("calculate_superpositions_in_moving_window(): different atoms in model #",
+             std::to_string(m));
+      pos2[i] = flat.position(begin + selected[i]);
+    }
+    std::vector<SupResult>& out = result[m];
+    out.reserve(ca_offsets.size());
+    for (size_t c = 0, res = 0; c < chain_res_end.size(); ++c) {
+      // separate sums for each chain keep rounding errors small
+      size_t low = c == 0 ? 0 : chain_atom_end[c-1];
+      QcpPrefixSums sums(pos1.data() + low, pos2.data() + low,
+                         chain_atom_end[c] - low, nullptr);
+      for (; res < chain_res_end[c]; ++res) {
+        if (ca_offsets[res] == -1)
+          out.push_back(SupResult{NAN, 0, {}, {}, {}});
+        else
+          out.push_back(sums.superpose(windows[res].first - low,
+                                       windows[res].second - low));
+      }
+    }
+  });
   return result;
 }
 
@@ -90,8 +90,92 @@ inline void ensure_unique_chain_name(const Model& model, Chain& chain) {
   chain.name = namegen.make_short_name(chain.name);
 }
 
+/// Biological assembly that is not materialized. Atoms of the assembly are
+/// generated on the fly by transforming atoms of the original model,
+/// so that large assemblies (e.g. virus capsids) don't need to be stored.
+/// The original Model must outlive the view.
+struct GEMMI_DLL AssemblyView {
+  /// Chain (or a part of it, if generated from subchains) copied with
+  /// one of the operators.
+  struct ChainCopy {
+    std::string name;          // name of the chain in the assembly
+    const Chain* chain;        // original chain
+    size_t oper_idx;           // index in AssemblyView::opers
+    std::vector<std::string> subchains;  // empty means the whole chain
+
+    bool includes(const Residue& res) const {
+      return subchains.empty() || in_vector(res.subchain, subchains);
+    }
+  };
+
+  const Model* model = nullptr;
+  HowToNameCopiedChain how = HowToNameCopiedChain::AddNumber;
+  std::vector<Assembly::Operator> opers;
+  std::vector<ChainCopy> copies;  // in the same order as in make_assembly()
+
+  const Transform& transform(const ChainCopy& copy) const {
+    return opers[copy.oper_idx].transform;
+  }
+
+  /// subchain name of the residue in the copy, as in make_assembly()
+  std::string subchain_name(const ChainCopy& copy, const std::string& subchain) const {
+    if (subchain.empty() || how == HowToNameCopiedChain::Dup)
+      return subchain;
+    if (how == HowToNameCopiedChain::Short)
+      return copy.name + ":" + subchain;
+    return subchain + copy.name.substr(copy.chain->name.size());
+  }
+
+  /// Calls func(copy, residue, atom, pos) for all atoms in the assembly;
+  /// residue and atom are from the original model, pos is transformed.
+  template<typename Func>
+  void for_each_atom(Func func) const {
+    for (const ChainCopy& copy : copies) {
+      const Transform& tr = transform(copy);
+      for (const Residue& res : copy.chain->residues)
+        if (copy.includes(res))
+          for (const Atom& atom : res.atoms)
+            func(copy, res, atom, Position(tr.apply(atom.pos)));
+    }
+  }
+
+  /// atom of the original model, for indices from NeighborSearch::Mark
+  /// (Mark::chain_idx is here the index in copies, so Mark::to_cra()
+  /// cannot be used)
+  const Atom& original_atom(int n_copy, int n_res, int n_atom) const {
+    return copies.at(n_copy).chain->residues.at(n_res).atoms.at(n_atom);
+  }
+
+  SMat33<float> transformed_aniso(const ChainCopy& copy, const Atom& atom) const {
+    if (!atom.aniso.nonzero())
+      return atom.aniso;
+    return atom.aniso.transformed_by<float>(transform(copy).mat);
+  }
+
+  size_t atom_count() const {
+    size_t n = 0;
+    for (const ChainCopy& copy : copies)
+      for (const Residue& res : copy.chain->residues)
+        if (copy.includes(res))
+          n += res.atoms.size();
+    return n;
+  }
+
+  /// Materializes the assembly (the same as make_assembly()).
+  Model to_model() const;
+};
+
+/// Prepares AssemblyView; arguments are the same as in make_assembly().
+GEMMI_DLL AssemblyView make_assembly_view(const Assembly& assembly, const Model& model,
+                                          HowToNameCopiedChain how, std::ostream* out);
+
+/// If merge_dist > 0, copies of an atom that would be placed closer than
+/// merge_dist to an earlier copy of the same atom (i.e. atoms on symmetry
+/// axes) are not added; instead, the position of the earlier copy is averaged
+/// and its occupancy is increased, as in merge_atoms_in_expanded_model().
 GEMMI_DLL Model make_assembly(const Assembly& assembly, const Model& model,
-                              HowToNameCopiedChain how, std::ostream* out);
+                              HowToNameCopiedChain how, std::ostream* out,
+                              double merge_dist=0.);
 
 inline Assembly expand_to_p1(const UnitCell& cell) {
   Assembly assembly("unit_cell");
@@ -107,8 +191,11 @@ inline Assembly expand_to_p1(const UnitCell& cell) {
 
 /// Searches and merges overlapping equivalent atoms from different chains.
 /// To be used after expand_ncs() and make_assembly().
+/// Equivalent atoms are grouped by hashing, the groups are processed
+/// on n_threads threads (0 = all hardware threads).
+/// If max_dist is not positive, nothing is merged.
 GEMMI_DLL void merge_atoms_in_expanded_model(Model& model, const UnitCell& cell,
-                                             double max_dist=0.2);
+                                             double max_dist=0.2, int n_threads=1);
 
 GEMMI_DLL void transform_to_assembly(Structure& st, const std::string& assembly_name,
                                      HowToNameCopiedChain how, std::ostream* out);
@@ -8,6 +8,7 @@
 #include <cstdint>
 
 #include "grid.hpp"
+#include "bitgrid.hpp"  // for BitGrid
 
 namespace gemmi {
 
@@ -218,8 +219,11 @@ inline AsuBrick find_asu_brick(const SpaceGroup* sg) {
 }
 
 
-template<typename T, typename V=std::int8_t> struct MaskedGrid {
-  std::vector<V> mask;
+// V is the type of mask elements. Mask is normally std::vector<V>;
+// with BitGrid (from get_asu_bit_mask()) use BitMaskedGrid below.
+template<typename T, typename V=std::int8_t, typename Mask=std::vector<V>>
+struct MaskedGrid {
+  Mask mask;
   Grid<T>* grid;
 
   struct iterator {
@@ -251,6 +255,8 @@ template<typename T, typename V=std::int8_t> struct MaskedGrid {
   iterator end() { return {*this, mask.size()}; }
 };
 
+template<typename T> using BitMaskedGrid = MaskedGrid<T, bool, BitGrid>;
+
 template<typename V=std::int8_t>
 std::vector<V> get_asu_mask(const GridMeta& grid) {
   std::vector<V> mask(grid.point_count(), 2);
@@ -276,6 +282,34 @@ std::vector<V> get_asu_mask(const GridMeta& grid) {
   return mask;
 }
 
+/// The same as get_asu_mask(), but with 1 bit per point. Set bits
+/// (points outside of the asu) correspond to 1's in get_asu_mask().
+inline BitGrid get_asu_bit_mask(const GridMeta& grid) {
+  BitGrid mask;
+  mask.copy_metadata_from(grid);
+  mask.fill(true);
+  BitGrid assigned;
+  assigned.copy_metadata_from(grid);
+  std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+  auto end = find_asu_brick(grid.spacegroup).uvw_end(grid);
+  for (int w = 0; w < end[2]; ++w)
+    for (int v = 0; v < end[1]; ++v)
+      for (int u = 0; u < end[0]; ++u) {
+        size_t idx = grid.index_q(u, v, w);
+        if (!assigned.get(idx)) {
+          mask.reset(idx);
+          assigned.set(idx);
+          for (const GridOp& op : ops) {
+            std::array<int, 3> t = op.apply(u, v, w);
+            assigned.set(grid.index_n(t[0], t[1], t[2]));
+          }
+        }
+      }
+  if (assigned.count() != grid.point_count())
+    fail("get_asu_bit_mask(): internal error");
+  return mask;
+}
+
 template<typename T>
 MaskedGrid<T> masked_asu(Grid<T>& grid) {
   return {get_asu_mask(grid), &grid};
@@ -7,9 +7,9 @@
 
 #include <vector>
 #include <limits>        // for numeric_limits
-#include <unordered_map> // for unordered_map
 #include "unitcell.hpp"  // for UnitCell
 #include "stats.hpp"     // for Correlation
+#include "hkljoin.hpp"   // for HklIndex
 
 namespace gemmi {
 
@@ -194,14 +194,9 @@ struct HklMatch {
           ++b;
       }
     } else {
-      std::unordered_map<Miller, int, MillerHash> hkl_index;
-      for (int i = 0; i != (int)hkl_size; ++i)
-        hkl_index.emplace(hkl[i], i);
-      for (size_t i = 0; i != ref_size; ++i) {
-        auto it = hkl_index.find(ref[i]);
-        if (it != hkl_index.end())
-          pos[i] = it->second;
-      }
+      HklIndex hkl_index(hkl, hkl_size);
+      for (size_t i = 0; i != ref_size; ++i)
+        pos[i] = hkl_index.find(ref[i]);
     }
   }
 
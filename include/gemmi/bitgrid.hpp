@@ -0,0 +1,126 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// BitGrid: grid with 1 bit per point, for storing masks.
+
+#ifndef GEMMI_BITGRID_HPP_
+#define GEMMI_BITGRID_HPP_
+
+#include <bitset>    // for bitset::count
+#include <cstdint>   // for uint64_t
+#include <vector>
+#include "fail.hpp"  // for fail
+#include "grid.hpp"  // for GridMeta, Grid
+
+namespace gemmi {
+
+/// Mask with 1 bit per grid point, 64 points in one word.
+/// Points are in the same order as in Grid (see index_q()).
+/// Bits in the last word that are past point_count() are always 0,
+/// so that operations on whole words don't need special cases.
+struct BitGrid : GridMeta {
+  std::vector<std::uint64_t> words;
+
+  static size_t word_count(size_t n) { return (n + 63) / 64; }
+
+  void set_size(int nu_, int nv_, int nw_) {
+    check_grid_factors(spacegroup, {{nu_, nv_, nw_}});
+    nu = nu_, nv = nv_, nw = nw_;
+    axis_order = AxisOrder::XYZ;
+    words.assign(word_count(point_count()), 0);
+  }
+
+  /// copy unit_cell, spacegroup, nu, nv, nw, axis_order and clear all bits
+  void copy_metadata_from(const GridMeta& g) {
+    GridMeta::operator=(g);
+    words.assign(word_count(point_count()), 0);
+  }
+
+  size_t size() const { return point_count(); }
+  bool get(size_t idx) const { return (words[idx >> 6] >> (idx & 63)) & 1; }
+  bool operator[](size_t idx) const { return get(idx); }
+  bool get_value_q(int u, int v, int w) const { return get(index_q(u, v, w)); }
+  void set(size_t idx) { words[idx >> 6] |= std::uint64_t(1) << (idx & 63); }
+  void reset(size_t idx) { words[idx >> 6] &= ~(std::uint64_t(1) << (idx & 63)); }
+  void set(size_t idx, bool value) {
+    if (value)
+      set(idx);
+    else
+      reset(idx);
+  }
+
+  void fill(bool value) {
+    words.assign(word_count(point_count()), value ? ~std::uint64_t(0) : 0);
+    clear_padding();
+  }
+
+  void invert() {
+    for (std::uint64_t& word : words)
+      word = ~word;
+    clear_padding();
+  }
+
+  BitGrid& operator&=(const BitGrid& other) {
+    check_same_size(other);
+    for (size_t i = 0; i < words.size(); ++i)
+      words[i] &= other.words[i];
+    return *this;
+  }
+
+  BitGrid& operator|=(const BitGrid& other) {
+    check_same_size(other);
+    for (size_t i = 0; i < words.size(); ++i)
+      words[i] |= other.words[i];
+    return *this;
+  }
+
+  /// number of set bits
+  size_t count() const {
+    size_t n = 0;
+    for (std::uint64_t word : words)
+      n += std::bitset<64>(word).count();
+    return n;
+  }
+
+  /// Sets metadata from grid and bits for points with values != 0.
+  template<typename T> void from_grid(const Grid<T>& grid) {
+    copy_metadata_from(grid);
+    const size_t n = grid.data.size();
+    for (size_t i = 0; i < words.size(); ++i) {
+      size_t start = 64 * i;
+      size_t len = std::min(n - start, (size_t)64);
+      std::uint64_t word = 0;
+      for (size_t j = 0; j < len; ++j)
+        word |= std::uint64_t(grid.data[start + j] != 0) << j;
+      words[i] = word;
+    }
+  }
+
+  /// Writes the mask as values 0 and 1 into grid (e.g. Ccp4<int8_t>::grid).
+  template<typename T> void to_grid(Grid<T>& grid) const {
+    grid.copy_metadata_from(*this);
+    const size_t n = point_count();
+    grid.data.resize(n);
+    for (size_t i = 0; i < words.size(); ++i) {
+      size_t start = 64 * i;
+      size_t len = std::min(n - start, (size_t)64);
+      std::uint64_t word = words[i];
+      for (size_t j = 0; j < len; ++j)
+        grid.data[start + j] = T((word >> j) & 1);
+    }
+  }
+
+private:
+  void clear_padding() {
+    size_t rem = point_count() % 64;
+    if (rem != 0)
+      words.back() &= (std::uint64_t(1) << rem) - 1;
+  }
+
+  void check_same_size(const BitGrid& other) const {
+    if (other.nu != nu || other.nv != nv || other.nw != nw)
+      fail("BitGrid: different grid sizes");
+  }
+};
+
+} // namespace gemmi
+#endif
@@ -6,12 +6,15 @@
 // Implementation of the flood fill algorithm in find_blobs_by_flood_fill()
 // differs from from FloodFill in floodfill.hpp.
 // FloodFill uses more efficient scanline fill, but doesn't use symmetry.
+// find_blobs_by_labeling() finds the same blobs using connected-component
+// labeling from ccl.hpp, which can run on multiple threads.
 
 #ifndef GEMMI_BLOB_HPP_
 #define GEMMI_BLOB_HPP_
 
 #include "grid.hpp"     // for Grid
-#include "asumask.hpp"  // for get_asu_mask
+#include "asumask.hpp"  // for get_asu_bit_mask, BitGrid
+#include "ccl.hpp"      // for GridRuns
 
 namespace gemmi {
 
@@ -38,42 +41,50 @@ struct GridConstPoint {
   float value;
 };
 
-inline Blob make_blob_of_points(const std::vector<GridConstPoint>& points,
-                                const GridMeta& grid,
-                                const BlobCriteria& criteria) {
+// sums: value-weighted grid coordinates
+inline Blob make_blob(size_t point_count, double value_sum, const double (&sums)[3],
+                      double peak_value, int peak_u, int peak_v, int peak_w,
+                      const GridMeta& grid, const BlobCriteria& criteria) {
   Blob blob;
-  if (points.size() < 3)
+  if (point_count < 3)
     return blob;
   double volume_per_point = grid.unit_cell.volume / grid.point_count();
-  double volume = points.size() * volume_per_point;
+  double volume = point_count * volume_per_point;
   if (volume < criteria.min_volume)
     return blob;
+  blob.peak_value = peak_value;
+  if (blob.peak_value < criteria.min_peak)
+    return blob;
+  blob.score = value_sum * volume_per_point;
+  if (blob.score < criteria.min_score)
+    return blob;
+  gemmi::Fractional fract(sums[0] / (value_sum * grid.nu),
+                          sums[1] / (value_sum * grid.nv),
+                          sums[2] / (value_sum * grid.nw));
+  blob.centroid = grid.unit_cell.orthogonalize(fract);
+  blob.peak_pos = grid.get_position(peak_u, peak_v, peak_w);
+  blob.volume = volume;
+  return blob;
+}
+
+inline Blob make_blob_of_points(const std::vector<GridConstPoint>& points,
+                                const GridMeta& grid,
+                                const BlobCriteria& criteria) {
+  if (points.size() < 3)
+    return Blob();
   double sum[3] = {0., 0., 0.};
   const GridConstPoint* peak_point = &points[0];
-  blob.peak_value = points[0].value;
   double score = 0.;
   for (const GridConstPoint& point : points) {
     score += point.value;
-    if (point.value > blob.peak_value) {
-      blob.peak_value = point.value;
+    if (point.value > peak_point->value)
       peak_point = &point;
-    }
     sum[0] += double(point.u) * point.value;
     sum[1] += double(point.v) * point.value;
     sum[2] += double(point.w) * point.value;
   }
-  if (blob.peak_value < criteria.min_peak)
-    return blob;
-  blob.score = score * volume_per_point;
-  if (blob.score < criteria.min_score)
-    return blob;
-  gemmi::Fractional fract(sum[0] / (score * grid.nu),
-                          sum[1] / (score * grid.nv),
-                          sum[2] / (score * grid.nw));
-  blob.centroid = grid.unit_cell.orthogonalize(fract);
-  blob.peak_pos = grid.get_position(peak_point->u, peak_point->v, peak_point->w);
-  blob.volume = volume;
-  return blob;
+  return make_blob(points.size(), score, sum, peak_point->value,
+                   peak_point->u, peak_point->v, peak_point->w, grid, criteria);
 }
 
 } // namespace impl
@@ -86,16 +97,18 @@ inline std::vector<Blob> find_blobs_by_flood_fill(const gemmi::Grid<float>& grid
   std::array<std::array<int, 3>, 6> moves = {{{{-1, 0, 0}}, {{1, 0, 0}},
                                               {{0 ,-1, 0}}, {{0, 1, 0}},
                                               {{0, 0, -1}}, {{0, 0, 1}}}};
-  // the mask will be used as follows:
-  // -1=in blob,  0=in asu, not in blob (so far),  1=in neither
-  std::vector<std::int8_t> mask = gemmi::get_asu_mask(grid);
+  // two masks with 1 bit per point: points already in blobs and points
+  // outside of the asu (incl. symmetry mates of points added to blobs)
+  BitGrid in_blob;
+  in_blob.copy_metadata_from(grid);
+  BitGrid outside = get_asu_bit_mask(grid);
   std::vector<gemmi::GridOp> ops = grid.get_scaled_ops_except_id();
   size_t idx = 0;
   for (int w = 0; w != grid.nw; ++w)
     for (int v = 0; v != grid.nv; ++v)
       for (int u = 0; u != grid.nu; ++u, ++idx) {
         assert(idx == grid.index_q(u, v, w));
-        if (mask[idx] != 0)
+        if (in_blob.get(idx) || outside.get(idx))
           continue;
         float value = grid.data[idx];
         if (negate)
@@ -104,27 +117,25 @@ inline std::vector<Blob> find_blobs_by_flood_fill(const gemmi::Grid<float>& grid
           continue;
         std::vector<impl::GridConstPoint> points;
         points.push_back({u, v, w, value});
-        mask[idx] = -1;
+        in_blob.set(idx);
         for (size_t j = 0; j < points.size()/*increasing!*/; ++j)
           for (const std::array<int, 3>& mv : moves) {
             int nabe_u = points[j].u + mv[0];
             int nabe_v = points[j].v + mv[1];
             int nabe_w = points[j].w + mv[2];
             size_t nabe_idx = grid.index_s(nabe_u, nabe_v, nabe_w);
-            if (mask[nabe_idx] == -1)
+            if (in_blob.get(nabe_idx))
               continue;
             float nabe_value = grid.data[nabe_idx];
             if (negate)
               nabe_value = -nabe_value;
-            if (nabe_value > criteria.cutoff) {
-              if (mask[nabe_idx] != 0)
+            if (nabe_value >= criteria.cutoff) {
+              if (outside.get(nabe_idx))
                 for (const gemmi::GridOp& op : ops) {
                   auto t = op.apply(nabe_u, nabe_v, nabe_w);
-                  size_t mate_idx = grid.index_s(t[0], t[1], t[2]);
-                  if (mask[mate_idx] == 0)
-                    mask[mate_idx] = 1;
+                  outside.set(grid.index_s(t[0], t[1], t[2]));
                 }
-              mask[nabe_idx] = -1;
+              in_blob.set(nabe_idx);
               points.push_back({nabe_u, nabe_v, nabe_w, nabe_value});
             }
           }
@@ -136,5 +147,141 @@ inline std::vector<Blob> find_blobs_by_flood_fill(const gemmi::Grid<float>& grid
   return blobs;
 }
 
+/// Finds the same blobs as find_blobs_by_flood_fill(), but with
+/// connected-component labeling, optionally on multiple threads.
+/// From each set of symmetry-related components (the grid must be symmetric)
+/// the one with the first point in the asu is used, as in flood fill.
+/// Results may differ in the last digits (different order of summation)
+/// and in peak_pos if a blob has more than one maximum; here, the maximum
+/// with the lowest index is used. In both functions, points with values
+/// equal to the cutoff are included in blobs.
+inline std::vector<Blob> find_blobs_by_labeling(const gemmi::Grid<float>& grid,
+                                                const BlobCriteria& criteria,
+                                                bool negate=false,
+                                                int n_threads=1) {
+  const double cutoff = criteria.cutoff;
+  GridRuns cc;
+  cc.label(grid, [&](float x) { return (negate ? -x : x) >= cutoff; },
+           false, n_threads);
+  const size_t n_runs = cc.runs.size();
+  const size_t none = (size_t)-1;
+  BitGrid asu_mask = get_asu_bit_mask(grid);
+
+  // statistics of runs
+  struct RunSums {
+    double value_sum = 0.;
+    double u_sum = 0.;
+    float peak_value;
+    int peak_u;
+    size_t asu_idx = none;  // the first point in the asu
+  };
+  std::vector<RunSums> run_sums(n_runs);
+  parallel_for_chunks(cc.row_start.size() - 1, get_thread_count(n_threads),
+                      [&](size_t begin, size_t end, int) {
+    for (size_t row = begin; row < end; ++row) {
+      size_t row_idx = row * grid.nu;
+      for (size_t i = cc.row_start[row]; i < cc.row_start[row+1]; ++i) {
+        const GridRuns::Run& run = cc.runs[i];
+        RunSums& rs = run_sums[i];
+        rs.peak_u = run.u;
+        rs.peak_value = negate ? -grid.data[row_idx + run.u]
+                               : grid.data[row_idx + run.u];
+        for (int u = run.u; u < run.u + run.len; ++u) {
+          float value = negate ? -grid.data[row_idx + u] : grid.data[row_idx + u];
+          rs.value_sum += value;
+          rs.u_sum += double(u) * value;
+          if (value > rs.peak_value) {
+            rs.peak_value = value;
+            rs.peak_u = u;
+          }
+          if (rs.asu_idx == none && !asu_mask.get(row_idx + u))
+            rs.asu_idx = row_idx + u;
+        }
+      }
+    }
+  });
+
+  // The first run with a point in the asu has the seed point of blob
+  // (as in flood fill). Blob coordinates are unwrapped around this point.
+  std::vector<size_t> seed_run(n_runs, none);
+  for (size_t i = 0; i < n_runs; ++i)
+    if (run_sums[i].asu_idx != none && seed_run[cc.parent[i]] == none)
+      seed_run[cc.parent[i]] = i;
+  auto seed_idx = [&](size_t root) {
+    return seed_run[root] == none ? none : run_sums[seed_run[root]].asu_idx;
+  };
+
+  // statistics of components
+  struct Sums {
+    size_t point_count = 0;
+    double value_sum = 0.;
+    double sums[3] = {0., 0., 0.};
+    float peak_value;
+    int peak[3];
+    size_t peak_idx = none;
+  };
+  std::vector<Sums> comp_sums(n_runs);
+  for (size_t row = 0; row + 1 < cc.row_start.size(); ++row) {
+    int v = int(row % grid.nv);
+    int w = int(row / grid.nv);
+    for (size_t i = cc.row_start[row]; i < cc.row_start[row+1]; ++i) {
+      size_t root = cc.parent[i];
+      if (seed_run[root] == none)
+        continue;
+      const RunSums& rs = run_sums[i];
+      const std::array<int,3>& seed_shift = cc.shift[seed_run[root]];
+      int uvw[3] = {cc.shift[i][0] - seed_shift[0],
+                    v + cc.shift[i][1] - seed_shift[1],
+                    w + cc.shift[i][2] - seed_shift[2]};
+      Sums& c = comp_sums[root];
+      c.point_count += cc.runs[i].len;
+      c.value_sum += rs.value_sum;
+      c.sums[0] += rs.u_sum + uvw[0] * rs.value_sum;
+      c.sums[1] += uvw[1] * rs.value_sum;
+      c.sums[2] += uvw[2] * rs.value_sum;
+      // runs are in the order of index, so the first maximum is kept
+      if (c.peak_idx == none || rs.peak_value > c.peak_value) {
+        c.peak_value = rs.peak_value;
+        c.peak_idx = row * grid.nu + rs.peak_u;
+        c.peak[0] = rs.peak_u + uvw[0];
+        c.peak[1] = uvw[1];
+        c.peak[2] = uvw[2];
+      }
+    }
+  }
+
+  std::vector<Blob> blobs;
+  std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+  for (size_t i = 0; i < n_runs; ++i) {
+    size_t root = cc.parent[i];
+    if (seed_run[root] != i)
+      continue;
+    // skip if a symmetry mate of this component has an earlier seed
+    size_t idx = seed_idx(root);
+    int u = int(idx % grid.nu);
+    int v = int(idx / grid.nu % grid.nv);
+    int w = int(idx / grid.nu / grid.nv);
+    bool first = true;
+    for (const GridOp& op : ops) {
+      std::array<int,3> t = op.apply(u, v, w);
+      size_t mate_run = cc.find_run(modulo(t[0], grid.nu), modulo(t[1], grid.nv),
+                                    modulo(t[2], grid.nw));
+      if (mate_run != n_runs && seed_idx(cc.parent[mate_run]) < idx) {
+        first = false;
+        break;
+      }
+    }
+    if (!first)
+      continue;
+    const Sums& c = comp_sums[root];
+    if (Blob blob = impl::make_blob(c.point_count, c.value_sum, c.sums, c.peak_value,
+                                    c.peak[0], c.peak[1], c.peak[2], grid, criteria))
+      blobs.push_back(blob);
+  }
+  std::sort(blobs.begin(), blobs.end(),
+            [](const Blob& a, const Blob& b) { return a.score > b.score; });
+  return blobs;
+}
+
 } // namespace gemmi
 #endif
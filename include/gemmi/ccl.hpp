@@ -0,0 +1,240 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Connected-component labeling (CCL) in periodic grids.
+// Points are grouped into runs (consecutive points along u) and runs
+// are joined using union-find. Slabs of the grid are labeled in parallel.
+
+#ifndef GEMMI_CCL_HPP_
+#define GEMMI_CCL_HPP_
+
+#include <array>
+#include <vector>
+#include "grid.hpp"      // for Grid
+#include "parallel.hpp"  // for parallel_for_chunks
+
+namespace gemmi {
+
+/// Connected components of points selected by a predicate.
+/// The grid is periodic. Components can cross the unit cell boundary;
+/// shifts of runs are recorded to unwrap such components.
+struct GridRuns {
+  struct Run {
+    int u;    // the first point of the run
+    int len;  // number of points
+  };
+  int nu = 0, nv = 0, nw = 0;
+  std::vector<Run> runs;
+  /// Runs in row (v, w) are runs[row_start[r]] ... runs[row_start[r+1]-1],
+  /// where r = w * nv + v. Runs in a row are sorted by u.
+  std::vector<size_t> row_start;
+  /// union-find forest of runs; after label() it points to the root
+  std::vector<size_t> parent;
+  /// (unwrapped) position of a run in the frame of its parent (after label():
+  /// of the root) minus its position in the grid, in grid points
+  std::vector<std::array<int,3>> shift;
+  /// non-zero for roots of components that wrap around the unit cell
+  std::vector<char> percolating;
+
+  size_t row_index(int v, int w) const { return size_t(w) * nv + v; }
+
+  /// Labels points for which in_component(value) is true.
+  /// full_connectivity: 26 neighbours (faces, edges and corners) if true,
+  /// 6 neighbours (faces) if false.
+  template<typename T, typename Pred>
+  void label(const Grid<T>& grid, Pred in_component, bool full_connectivity,
+             int n_threads=1) {
+    nu = grid.nu;
+    nv = grid.nv;
+    nw = grid.nw;
+    n_threads = get_thread_count(n_threads);
+    // find runs in each slab
+    std::vector<std::vector<Run>> slab_runs(n_threads);
+    row_start.assign(size_t(nv) * nw + 1, 0);
+    parallel_for_chunks(nw, n_threads, [&](size_t begin, size_t end, int n) {
+      for (int w = (int) begin; w < (int) end; ++w)
+        for (int v = 0; v < nv; ++v) {
+          const T* row = &grid.data[grid.index_q(0, v, w)];
+          size_t count = 0;
+          for (int u = 0; u < nu; ++u)
+            if (in_component(row[u])) {
+              int start = u;
+              while (u + 1 < nu && in_component(row[u+1]))
+                ++u;
+              slab_runs[n].push_back({start, u + 1 - start});
+              ++count;
+            }
+          row_start[row_index(v, w) + 1] = count;
+        }
+    });
+    for (size_t i = 1; i < row_start.size(); ++i)
+      row_start[i] += row_start[i-1];
+    runs.clear();
+    runs.reserve(row_start.back());
+    for (const std::vector<Run>& sr : slab_runs)
+      runs.insert(runs.end(), sr.begin(), sr.end());
+    slab_runs.clear();
+    parent.resize(runs.size());
+    for (size_t i = 0; i < parent.size(); ++i)
+      parent[i] = i;
+    shift.assign(runs.size(), {{0, 0, 0}});
+    percolating.assign(runs.size(), 0);
+
+    // Neighbouring rows with lower (wrapped) w or v, i.e. the rows that
+    // were visited earlier. The remaining neighbours see this row as theirs.
+    std::vector<std::array<int,2>> backward = {{{{-1, 0}}, {{0, -1}}}};
+    if (full_connectivity) {
+      backward.push_back({{-1, -1}});
+      backward.push_back({{1, -1}});
+    }
+    int d = full_connectivity ? 1 : 0;
+    // join runs within each slab
+    parallel_for_chunks(nw, n_threads, [&](size_t begin, size_t end, int) {
+      for (int w = (int) begin; w < (int) end; ++w)
+        for (int v = 0; v < nv; ++v) {
+          connect_row_ends(v, w);
+          for (const std::array<int,2>& dvw : backward)
+            if (dvw[1] == 0 || w != (int) begin)
+              connect_rows(v, w, dvw[0], dvw[1], d);
+        }
+    });
+    // join runs on slab boundaries (incl. the boundary of the unit cell);
+    // slabs are the same as chunks in parallel_for_chunks()
+    int n_slabs = std::max(std::min(n_threads, nw), 1);
+    for (int i = 0; i < n_slabs; ++i) {
+      int w = i * (nw / n_slabs) + std::min(i, nw % n_slabs);
+      for (int v = 0; v < nv; ++v)
+        for (const std::array<int,2>& dvw : backward)
+          if (dvw[1] != 0)
+            connect_rows(v, w, dvw[0], dvw[1], d);
+    }
+    // point each run directly to its root
+    for (size_t i = 0; i < runs.size(); ++i)
+      find(i);
+  }
+
+  /// Index of the run that contains point (u,v,w) (0 <= u < nu, etc.),
+  /// or runs.size() if the point is not in any component.
+  size_t find_run(int u, int v, int w) const {
+    size_t r = row_index(v, w);
+    size_t lo = row_start[r];
+    size_t hi = row_start[r+1];
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (runs[mid].u + runs[mid].len <= u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo < row_start[r+1] && runs[lo].u <= u)
+      return lo;
+    return runs.size();
+  }
+
+  /// Returns the root of run x. Compresses the path to the root.
+  size_t find(size_t x) {
+    size_t root = x;
+    std::array<int,3> total = {{0, 0, 0}};
+    for (; parent[root] != root; root = parent[root])
+      add_to(total, shift[root]);
+    while (x != root) {
+      size_t next = parent[x];
+      std::array<int,3> old_shift = shift[x];
+      parent[x] = root;
+      shift[x] = total;
+      for (int i = 0; i < 3; ++i)
+        total[i] -= old_shift[i];
+      x = next;
+    }
+    return root;
+  }
+
+private:
+  static void add_to(std::array<int,3>& a, const std::array<int,3>& b) {
+    for (int i = 0; i < 3; ++i)
+      a[i] += b[i];
+  }
+
+  // Joins run b to run a. s is added to grid coordinates of b to get
+  // coordinates adjacent to run a (in the frame of a).
+  void unite(size_t a, size_t b, std::array<int,3> s) {
+    size_t ra = find(a);
+    size_t rb = find(b);
+    add_to(s, shift[a]);  // now it's relative to the frame of ra
+    if (ra == rb) {
+      if (s != shift[b])
+        percolating[ra] = 1;
+      return;
+    }
+    // the root with lower index stays the root
+    for (int i = 0; i < 3; ++i)
+      s[i] -= shift[b][i];
+    if (ra < rb) {
+      parent[rb] = ra;
+      shift[rb] = s;
+      percolating[ra] |= percolating[rb];
+    } else {
+      parent[ra] = rb;
+      shift[ra] = {{-s[0], -s[1], -s[2]}};
+      percolating[rb] |= percolating[ra];
+    }
+  }
+
+  // the first and the last run in a row can be connected through u=0
+  void connect_row_ends(int v, int w) {
+    size_t r = row_index(v, w);
+    size_t first = row_start[r];
+    size_t last = row_start[r+1];
+    if (first == last)
+      return;
+    --last;
+    if (runs[first].u == 0 && runs[last].u + runs[last].len == nu)
+      unite(last, first, {{nu, 0, 0}});
+  }
+
+  // joins runs in row (v, w) with runs in row (v+dv, w+dw);
+  // d=1 includes diagonal neighbours along u
+  void connect_rows(int v, int w, int dv, int dw, int d) {
+    std::array<int,3> s = {{0, 0, 0}};
+    int v2 = v + dv;
+    int w2 = w + dw;
+    if (v2 < 0) {
+      v2 += nv;
+      s[1] = -nv;
+    } else if (v2 >= nv) {
+      v2 -= nv;
+      s[1] = nv;
+    }
+    if (w2 < 0) {
+      w2 += nw;
+      s[2] = -nw;
+    } else if (w2 >= nw) {
+      w2 -= nw;
+      s[2] = nw;
+    }
+    size_t ra = row_index(v, w);
+    size_t rb = row_index(v2, w2);
+    size_t b_begin = row_start[rb];
+    size_t b_end = row_start[rb+1];
+    if (b_begin == b_end)
+      return;
+    size_t j = b_begin;
+    for (size_t a = row_start[ra]; a < row_start[ra+1]; ++a) {
+      int lo = runs[a].u - d;
+      int hi = runs[a].u + runs[a].len + d;
+      while (j < b_end && runs[j].u + runs[j].len <= lo)
+        ++j;
+      for (size_t k = j; k < b_end && runs[k].u < hi; ++k)
+        unite(a, k, s);
+      if (d != 0) {
+        // diagonal neighbours through u=0
+        if (lo < 0 && runs[b_end-1].u + runs[b_end-1].len == nu)
+          unite(a, b_end-1, {{s[0] - nu, s[1], s[2]}});
+        if (hi > nu && runs[b_begin].u == 0)
+          unite(a, b_begin, {{s[0] + nu, s[1], s[2]}});
+      }
+    }
+  }
+};
+
+} // namespace gemmi
+#endif
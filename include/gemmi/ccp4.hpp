@@ -19,6 +19,7 @@
 #include "fileutil.hpp"  // for file_open, is_little_endian, ...
 #include "input.hpp"     // for FileStream
 #include "grid.hpp"
+#include "half.hpp"      // for Half, half_to_float_array, float_to_half_array
 
 namespace gemmi {
 
@@ -180,8 +181,8 @@ struct Ccp4 : public Ccp4Base {
   /// If the header is empty, prepare it; otherwise, update only MODE
   /// and, if update_stats==true, also DMIN, DMAX, DMEAN and RMS.
   void update_ccp4_header(int mode=-1, bool update_stats=true) {
-    if (mode > 2 && mode != 6)
-      fail("Only modes 0, 1, 2 and 6 are supported.");
+    if (mode > 2 && mode != 6 && mode != 12)
+      fail("Only modes 0, 1, 2, 6 and 12 are supported.");
     if (grid.point_count() == 0)
       fail("update_ccp4_header(): set the grid first (it has size 0)");
     if (grid.axis_order == AxisOrder::Unknown)
@@ -213,6 +214,8 @@ struct Ccp4 : public Ccp4Base {
       return 2;
     if (std::is_same<T, std::uint16_t>::value)
       return 6;
+    if (std::is_same<T, Half>::value)
+      return 12;
     return -1;
   }
 
@@ -277,6 +280,8 @@ struct Ccp4 : public Ccp4Base {
 
   template<typename Stream>
   void read_ccp4_stream(Stream f, const std::string& path);
+  template<typename Stream>
+  void read_half_data(Stream& f);
 
   void read_ccp4_file(const std::string& path) {
     fileptr_t f = file_open(path.c_str(), "rb");
@@ -310,6 +315,21 @@ To translate_map_point(From f) { return static_cast<To>(f); }
 template<> inline
 std::int8_t translate_map_point<float,std::int8_t>(float f) { return f != 0; }
 
+template<typename From, typename To, typename Func>
+void convert_map_points(const From* from, To* to, size_t n, Func func) {
+  for (size_t i = 0; i < n; ++i)
+    to[i] = func(from[i]);
+}
+// conversions between half and single precision can be vectorized
+template<typename Func>
+void convert_map_points(const Half* from, float* to, size_t n, Func) {
+  half_to_float_array(from, to, n);
+}
+template<typename Func>
+void convert_map_points(const float* from, Half* to, size_t n, Func) {
+  float_to_half_array(from, to, n);
+}
+
 template<typename Stream, typename TFile, typename TMem>
 void read_data(Stream& f, std::vector<TMem>& content) {
   if (std::is_same<TFile, TMem>::value) {
@@ -323,8 +343,8 @@ void read_data(Stream& f, std::vector<TMem>& content) {
       size_t len = std::min(chunk_size, content.size() - i);
       if (!f.read(work.data(), sizeof(TFile) * len))
         fail("Failed to read all the data from the map file.");
-      for (size_t j = 0; j < len; ++j)
-        content[i+j] = translate_map_point<TFile,TMem>(work[j]);
+      convert_map_points(work.data(), &content[i], len,
+                         [](TFile x) { return translate_map_point<TFile,TMem>(x); });
     }
   }
 }
@@ -340,8 +360,8 @@ void write_data(const std::vector<TMem>& content, FILE* f) {
     std::vector<TFile> work(chunk_size);
     for (size_t i = 0; i < content.size(); i += chunk_size) {
       size_t len = std::min(chunk_size, content.size() - i);
-      for (size_t j = 0; j < len; ++j)
-        work[j] = static_cast<TFile>(content[i+j]);
+      convert_map_points(&content[i], work.data(), len,
+                         [](TMem x) { return static_cast<TFile>(x); });
       if (std::fwrite(work.data(), sizeof(TFile), len, f) != len)
         sys_fail("Failed to write data to the map file");
     }
@@ -365,13 +385,15 @@ void Ccp4<T>::read_ccp4_stream(Stream f, const std::string& path) {
     impl::read_data<Stream, float>(f, grid.data);
   else if (mode == 6)
     impl::read_data<Stream, std::uint16_t>(f, grid.data);
+  else if (mode == 12)
+    read_half_data(f);
   else
     fail("Mode " + std::to_string(mode) + " is not supported "
-         "(only 0, 1, 2 and 6 are supported).");
+         "(only 0, 1, 2, 6 and 12 are supported).");
   //if (std::fgetc(f) != EOF)
   //  fail("The map file is longer then expected.");
 
-  if (!same_byte_order) {
+  if (!same_byte_order && mode != 12) {
     if (sizeof(T) == 2)
       for (T& value : grid.data)
         swap_two_bytes(&value);
@@ -381,6 +403,26 @@ void Ccp4<T>::read_ccp4_stream(Stream f, const std::string& path) {
   }
 }
 
+// Mode 12 (float16). Here, bytes are swapped before conversion.
+template<typename T> template<typename Stream>
+void Ccp4<T>::read_half_data(Stream& f) {
+  if (same_byte_order) {
+    impl::read_data<Stream, Half>(f, grid.data);
+    return;
+  }
+  constexpr size_t chunk_size = 64 * 1024;
+  std::vector<Half> work(chunk_size);
+  for (size_t i = 0; i < grid.data.size(); i += chunk_size) {
+    size_t len = std::min(chunk_size, grid.data.size() - i);
+    if (!f.read(work.data(), 2 * len))
+      fail("Failed to read all the data from the map file.");
+    for (size_t j = 0; j < len; ++j)
+      swap_two_bytes(&work[j]);
+    impl::convert_map_points(work.data(), &grid.data[i], len,
+                             [](Half x) { return impl::translate_map_point<Half,T>(x); });
+  }
+}
+
 template<typename T>
 void Ccp4<T>::setup(T default_value, MapSetup mode) {
   if (grid.axis_order == AxisOrder::XYZ || ccp4_header.empty())
@@ -479,6 +521,8 @@ void Ccp4<T>::write_ccp4_map(const std::string& path) const {
     impl::write_data<float>(grid.data, f.get());
   else if (mode == 6)
     impl::write_data<std::uint16_t>(grid.data, f.get());
+  else if (mode == 12)
+    impl::write_data<Half>(grid.data, f.get());
 }
 
 } // namespace gemmi
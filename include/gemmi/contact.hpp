@@ -40,6 +40,13 @@ struct ContactSearch {
   template<typename Func>
   void for_each_contact(NeighborSearch& ns, const Func& func);
 
+  // Contacts of a single atom (ns.model->chains[n_ch]...atoms[n_atom]).
+  // Only reads ns, so it can be called from multiple threads.
+  // pt is the polymer type of the chain (used only with AdjacentResidues).
+  template<typename Func>
+  void for_each_contact_of_atom(NeighborSearch& ns, int n_ch, int n_res, int n_atom,
+                                PolymerType pt, const Func& func) const;
+
   struct Result {
     CRA partner1, partner2;
     int image_idx;
@@ -65,70 +72,76 @@ void ContactSearch::for_each_contact(NeighborSearch& ns, const Func& func) {
     PolymerType pt = PolymerType::Unknown;
     if (ignore == Ignore::AdjacentResidues)
       pt = check_polymer_type(chain.get_polymer());
-    for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
-      Residue& res = chain.residues[n_res];
-      for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
-        Atom& atom = res.atoms[n_atom];
-        if (!ns.include_h && is_hydrogen(atom.element))
-          continue;
-        if (atom.occ < min_occupancy)
-          continue;
-        ns.for_each(atom.pos, atom.altloc, search_radius,
-                    [&](NeighborSearch::Mark& m, double dist_sq) {
-            // do not consider connections inside a residue
-            if (ignore != Ignore::Nothing && m.image_idx == 0 &&
-                m.chain_idx == n_ch && m.residue_idx == n_res)
-              return;
-            switch (ignore) {
-              case Ignore::Nothing:
-                break;
-              case Ignore::SameResidue:
-                if (m.image_idx == 0 && m.chain_idx == n_ch)
-                  if (m.residue_idx == n_res)
-                    return;
-                break;
-              case Ignore::AdjacentResidues:
-                if (m.image_idx == 0 && m.chain_idx == n_ch)
-                  if (m.residue_idx == n_res ||
-                      are_connected(res, chain.residues[m.residue_idx], pt) ||
-                      are_connected(chain.residues[m.residue_idx], res, pt))
-                    return;
-                break;
-              case Ignore::SameChain:
-                if (m.image_idx == 0 && m.chain_idx == n_ch)
-                  return;
-                break;
-              case Ignore::SameAsu:
-                if (m.image_idx == 0)
-                  return;
-                break;
-            }
-            // additionally, we may have per-element distances
-            if (!radii.empty()) {
-              double d = radii[atom.element.ordinal()] + radii[m.element.ordinal()];
-              if (d < 0 || dist_sq > d * d)
-                return;
-            }
-            // avoid reporting connections twice (A-B and B-A)
-            if (!twice)
-              if (m.chain_idx < n_ch || (m.chain_idx == n_ch &&
-                    (m.residue_idx < n_res || (m.residue_idx == n_res &&
-                                               m.atom_idx < n_atom))))
-                return;
-            // atom can be linked with its image, but if the image
-            // is too close the atom is likely on special position.
-            if (m.chain_idx == n_ch && m.residue_idx == n_res &&
-                m.atom_idx == n_atom && dist_sq < special_pos_cutoff_sq)
+    for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res)
+      for (int n_atom = 0; n_atom != (int) chain.residues[n_res].atoms.size(); ++n_atom)
+        for_each_contact_of_atom(ns, n_ch, n_res, n_atom, pt, func);
+  }
+}
+
+template<typename Func>
+void ContactSearch::for_each_contact_of_atom(NeighborSearch& ns, int n_ch, int n_res,
+                                             int n_atom, PolymerType pt,
+                                             const Func& func) const {
+  Chain& chain = ns.model->chains[n_ch];
+  Residue& res = chain.residues[n_res];
+  Atom& atom = res.atoms[n_atom];
+  if (!ns.include_h && is_hydrogen(atom.element))
+    return;
+  if (atom.occ < min_occupancy)
+    return;
+  ns.for_each(atom.pos, atom.altloc, search_radius,
+              [&](NeighborSearch::Mark& m, double dist_sq) {
+      // do not consider connections inside a residue
+      if (ignore != Ignore::Nothing && m.image_idx == 0 &&
+          m.chain_idx == n_ch && m.residue_idx == n_res)
+        return;
+      switch (ignore) {
+        case Ignore::Nothing:
+          break;
+        case Ignore::SameResidue:
+          if (m.image_idx == 0 && m.chain_idx == n_ch)
+            if (m.residue_idx == n_res)
               return;
-            CRA cra2 = m.to_cra(*ns.model);
-            // ignore atoms with occupancy below the specified value
-            if (cra2.atom->occ < min_occupancy)
+          break;
+        case Ignore::AdjacentResidues:
+          if (m.image_idx == 0 && m.chain_idx == n_ch)
+            if (m.residue_idx == n_res ||
+                are_connected(res, chain.residues[m.residue_idx], pt) ||
+                are_connected(chain.residues[m.residue_idx], res, pt))
               return;
-            func(CRA{&chain, &res, &atom}, cra2, m.image_idx, dist_sq);
-        });
+          break;
+        case Ignore::SameChain:
+          if (m.image_idx == 0 && m.chain_idx == n_ch)
+            return;
+          break;
+        case Ignore::SameAsu:
+          if (m.image_idx == 0)
+            return;
+          break;
       }
-    }
-  }
+      // additionally, we may have per-element distances
+      if (!radii.empty()) {
+        double d = radii[atom.element.ordinal()] + radii[m.element.ordinal()];
+        if (d < 0 || dist_sq > d * d)
+          return;
+      }
+      // avoid reporting connections twice (A-B and B-A)
+      if (!twice)
+        if (m.chain_idx < n_ch || (m.chain_idx == n_ch &&
+              (m.residue_idx < n_res || (m.residue_idx == n_res &&
+                                         m.atom_idx < n_atom))))
+          return;
+      // atom can be linked with its image, but if the image
+      // is too close the atom is likely on special position.
+      if (m.chain_idx == n_ch && m.residue_idx == n_res &&
+          m.atom_idx == n_atom && dist_sq < special_pos_cutoff_sq)
+        return;
+      CRA cra2 = m.to_cra(*ns.model);
+      // ignore atoms with occupancy below the specified value
+      if (cra2.atom->occ < min_occupancy)
+        return;
+      func(CRA{&chain, &res, &atom}, cra2, m.image_idx, dist_sq);
+  });
 }
 
 } // namespace gemmi
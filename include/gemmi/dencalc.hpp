@@ -7,8 +7,11 @@
 
 #include <cassert>
 #include "addends.hpp"  // for Addends
+#include "assembly.hpp" // for AssemblyView
+#include "flat.hpp"     // for FlatStructure
 #include "formfact.hpp" // for ExpSum
 #include "grid.hpp"     // for Grid
+#include "gridorbits.hpp" // for GridOrbits
 #include "model.hpp"    // for Structure, ...
 
 namespace gemmi {
@@ -82,6 +85,22 @@ inline double get_minimum_b(const Model& model) {
   return b_min;
 }
 
+inline double get_minimum_b(const FlatStructure& flat, size_t model=0) {
+  double b_min = 1000.;
+  flat.check_model(model);
+  for (size_t n = flat.model_atom_begin(model); n < flat.model_atom_end(model); ++n) {
+    if (flat.occ[n] == 0) continue;
+    double b = flat.b_iso[n];
+    if (flat.has_aniso() && flat.aniso[n].nonzero()) {
+      std::array<double,3> eig = flat.aniso[n].calculate_eigenvalues();
+      b = std::min(std::min(eig[0], eig[1]), eig[2]) * u_to_b();
+    }
+    if (b < b_min)
+      b_min = b;
+  }
+  return b_min;
+}
+
 // Usual usage:
 // - set d_min and optionally also other parameters,
 // - set addends to f' values for your wavelength (see fprime.hpp)
@@ -90,6 +109,8 @@ inline double get_minimum_b(const Model& model) {
 // - call put_model_density_on_grid()
 // - do FFT using transform_map_to_f_phi()
 // - if blur is used, multiply the SF by reciprocal_space_multiplier()
+// When only a few atoms change (e.g. a ligand is moved), the density can be
+// updated with update_atom_density() instead of being recalculated.
 template <typename Table, typename Real>
 struct DensityCalculator {
   Grid<Real> grid;
@@ -98,6 +119,19 @@ struct DensityCalculator {
   double blur = 0.;
   float cutoff = 1e-5f;
   Addends addends;
+  /// If set, symmetrize_density() calculates orbits of grid points once
+  /// and reuses them as long as the grid size and space group don't change.
+  /// It's worth it when the density is calculated repeatedly;
+  /// the orbits take 4 bytes per grid point (as much as Grid<float>).
+  bool reuse_orbits = false;
+  /// orbits used if reuse_orbits is set; to free this memory,
+  /// assign GridOrbits() to it.
+  GridOrbits grid_orbits;
+  /// if set, add_atom_density_with_images() appends to changed_regions
+  /// the boxes (in fractional coordinates, not wrapped to the unit cell)
+  /// with modified grid points
+  bool track_changes = false;
+  std::vector<Box<Fractional>> changed_regions;
 
   using coef_type = typename Table::Coef::coef_type;
 
@@ -110,6 +144,13 @@ struct DensityCalculator {
     double b_min = get_minimum_b(model);
     blur = std::max(u_to_b() / 1.1 * sq(spacing) - b_min, 0.);
   }
+  void set_refmac_compatible_blur(const FlatStructure& flat, size_t model=0) {
+    double spacing = requested_grid_spacing();
+    if (spacing <= 0)
+      spacing = grid.min_spacing();
+    double b_min = get_minimum_b(flat, model);
+    blur = std::max(u_to_b() / 1.1 * sq(spacing) - b_min, 0.);
+  }
 
   // pre: check if Table::has(atom.element)
   void add_atom_density_to_grid(const Atom& atom) {
@@ -133,22 +174,70 @@ struct DensityCalculator {
 
   template<typename Coef>
   void do_add_atom_density_to_grid(const Atom& atom, const Coef& coef, float addend) {
-    Fractional fpos = grid.unit_cell.fractionalize(atom.pos);
-    if (!atom.aniso.nonzero()) {
+    do_add_density_to_grid(atom.pos, atom.occ, atom.b_iso, atom.aniso, coef, addend);
+  }
+
+  /// Adds density of the atom and of all its symmetry images, multiplied by
+  /// factor (use -1 to subtract). The added density is already symmetric,
+  /// so this function can modify density from put_model_density_on_grid().
+  /// pre: check if Table::has(atom.element)
+  void add_atom_density_with_images(const Atom& atom, float factor=1.f) {
+    Element el = atom.element;
+    const UnitCell& cell = grid.unit_cell;
+    Fractional fpos = cell.fractionalize(atom.pos);
+    float occ = factor * atom.occ;
+    const std::vector<ImageOp>& ops = get_image_ops();
+    for (size_t i = 0; i < ops.size(); ++i) {
+      Fractional image(ops[i].frac.apply(fpos));
+      Position pos = cell.orthogonalize(image);
+      SMat33<float> aniso = atom.aniso;
+      if (i != 0 && aniso.nonzero())
+        aniso = atom.aniso.transformed_by<float>(ops[i].orth_rot);
+      double radius = do_add_density_to_grid(pos, occ, atom.b_iso, aniso,
+                                             Table::get(el), addends.get(el));
+      if (track_changes) {
+        Fractional margin((int) std::ceil(radius / grid.spacing[0]) / (double) grid.nu,
+                          (int) std::ceil(radius / grid.spacing[1]) / (double) grid.nv,
+                          (int) std::ceil(radius / grid.spacing[2]) / (double) grid.nw);
+        Box<Fractional> box;
+        box.extend(image);
+        box.add_margins(margin);
+        changed_regions.push_back(box);
+      }
+    }
+  }
+
+  /// Updates density after old_atom was changed (e.g. moved) to new_atom.
+  /// It's cheaper than put_model_density_on_grid() if only a few atoms change.
+  /// Differences from the full recalculation are only due to rounding
+  /// errors, which accumulate when the same grid is updated many times.
+  void update_atom_density(const Atom& old_atom, const Atom& new_atom) {
+    add_atom_density_with_images(old_atom, -1.f);
+    add_atom_density_with_images(new_atom, 1.f);
+  }
+
+  // returns radius used for the calculation
+  template<typename Coef>
+  double do_add_density_to_grid(const Position& pos, float occ, float b_iso,
+                                const SMat33<float>& aniso,
+                                const Coef& coef, float addend) {
+    Fractional fpos = grid.unit_cell.fractionalize(pos);
+    double radius;
+    if (!aniso.nonzero()) {
       // isotropic
-      double b = atom.b_iso + blur;
+      double b = b_iso + blur;
       auto precal = coef.precalculate_density_iso(b, addend);
-      double radius = estimate_radius(precal, b);
+      radius = estimate_radius(precal, b);
       grid.template use_points_around<true>(fpos, radius, [&](Real& point, double r2) {
-          point += Real(atom.occ * precal.calculate((Real)r2));
+          point += Real(occ * precal.calculate((Real)r2));
       }, /*fail_on_too_large_radius=*/false);
     } else {
       // anisotropic
-      SMat33<double> aniso_b = atom.aniso.scaled(u_to_b()).added_kI(blur);
+      SMat33<double> aniso_b = aniso.scaled(u_to_b()).added_kI(blur);
       // rough estimate, so we don't calculate eigenvalues
       double b_max = std::max(std::max(aniso_b.u11, aniso_b.u22), aniso_b.u33);
       auto precal_iso = coef.precalculate_density_iso(b_max, addend);
-      double radius = estimate_radius(precal_iso, b_max);
+      radius = estimate_radius(precal_iso, b_max);
       auto precal = coef.precalculate_density_aniso_b(aniso_b, addend);
       int du = (int) std::ceil(radius / grid.spacing[0]);
       int dv = (int) std::ceil(radius / grid.spacing[1]);
@@ -156,13 +245,15 @@ struct DensityCalculator {
       grid.template use_points_in_box<true>(fpos, du, dv, dw,
                              [&](Real& point, const Position& delta, int, int, int) {
         if (delta.length_sq() < radius * radius)
-          point += Real(atom.occ * precal.calculate(delta));
+          point += Real(occ * precal.calculate(delta));
       }, false);
     }
+    return radius;
   }
 
   void initialize_grid() {
     grid.data.clear();
+    changed_regions.clear();
     double spacing = requested_grid_spacing();
     if (spacing > 0)
       grid.set_size_from_spacing(spacing, GridSizeRounding::Up);
@@ -172,6 +263,18 @@ struct DensityCalculator {
       fail("initialize_grid(): d_min is not set");
   }
 
+  /// The same as grid.symmetrize_sum(), but with reuse_orbits
+  /// it's faster when called repeatedly.
+  void symmetrize_density() {
+    if (!reuse_orbits || grid.point_count() > UINT32_MAX) {
+      grid.symmetrize_sum();
+      return;
+    }
+    if (!grid_orbits.matches(grid))
+      grid_orbits.prepare(grid);
+    symmetrize_sum(grid, grid_orbits);
+  }
+
   void add_model_density_to_grid(const Model& model) {
     grid.check_not_empty();
     for (const Chain& chain : model.chains)
@@ -183,7 +286,44 @@ struct DensityCalculator {
   void put_model_density_on_grid(const Model& model) {
     initialize_grid();
     add_model_density_to_grid(model);
-    grid.symmetrize_sum();
+    symmetrize_density();
+  }
+
+  // pre: check if Table::has() all elements in the model
+  void add_model_density_to_grid(const FlatStructure& flat, size_t model=0) {
+    grid.check_not_empty();
+    flat.check_model(model);
+    const SMat33<float> no_aniso = {0, 0, 0, 0, 0, 0};
+    for (size_t n = flat.model_atom_begin(model); n < flat.model_atom_end(model); ++n) {
+      El el = flat.element[n];
+      do_add_density_to_grid(flat.position(n), flat.occ[n], flat.b_iso[n],
+                             flat.has_aniso() ? flat.aniso[n] : no_aniso,
+                             Table::get(el), addends.get(el));
+    }
+  }
+
+  void put_model_density_on_grid(const FlatStructure& flat, size_t model=0) {
+    initialize_grid();
+    add_model_density_to_grid(flat, model);
+    symmetrize_density();
+  }
+
+  // pre: check if Table::has() all elements in the model
+  void add_model_density_to_grid(const AssemblyView& view) {
+    grid.check_not_empty();
+    view.for_each_atom([&](const AssemblyView::ChainCopy& copy, const Residue&,
+                           const Atom& atom, const Position& pos) {
+      El el = atom.element.elem;
+      do_add_density_to_grid(pos, atom.occ, atom.b_iso,
+                             view.transformed_aniso(copy, atom),
+                             Table::get(el), addends.get(el));
+    });
+  }
+
+  void put_model_density_on_grid(const AssemblyView& view) {
+    initialize_grid();
+    add_model_density_to_grid(view);
+    symmetrize_density();
   }
 
   void set_grid_cell_and_spacegroup(const Structure& st) {
@@ -201,6 +341,34 @@ struct DensityCalculator {
     double factor = -mott_bethe_const() / inv_d2;
     return blur == 0 ? factor : factor * reciprocal_space_multiplier(inv_d2);
   }
+
+private:
+  // symmetry operations used in add_atom_density_with_images()
+  struct ImageOp {
+    Transform frac;  // in fractional coordinates
+    Mat33 orth_rot;  // rotation in Cartesian coordinates (for ADPs)
+  };
+  std::vector<ImageOp> image_ops_;
+  const SpaceGroup* image_ops_sg_ = nullptr;
+  UnitCell image_ops_cell_;
+
+  // prepared once and reused as long as grid's space group and cell don't change
+  const std::vector<ImageOp>& get_image_ops() {
+    const UnitCell& cell = grid.unit_cell;
+    if (image_ops_.empty() || image_ops_sg_ != grid.spacegroup || image_ops_cell_ != cell) {
+      image_ops_.clear();
+      image_ops_.push_back({Transform(), Mat33()});  // identity
+      if (grid.spacegroup)
+        for (Op op : grid.spacegroup->operations())
+          if (op != Op::identity()) {
+            Transform tr{rot_as_mat33(op), tran_as_vec3(op)};
+            image_ops_.push_back({tr, cell.orth.mat.multiply(tr.mat).multiply(cell.frac.mat)});
+          }
+      image_ops_sg_ = grid.spacegroup;
+      image_ops_cell_ = cell;
+    }
+    return image_ops_;
+  }
 };
 
 } // namespace gemmi
@@ -0,0 +1,161 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Comparison of models in an ensemble (NMR models, MD frames, cryo-EM
+// multi-model files): RMSD after superposition for all pairs of models.
+
+#ifndef GEMMI_ENSEMBLE_HPP_
+#define GEMMI_ENSEMBLE_HPP_
+
+#include <algorithm>     // for min
+#include <vector>
+#include "align.hpp"     // for select_atoms_for_superposition, SupSelect
+#include "fail.hpp"      // for fail
+#include "flat.hpp"      // for FlatStructure
+#include "parallel.hpp"  // for parallel_for
+#include "qcp.hpp"       // for fast_calc_rmsd_and_rotation
+
+namespace gemmi {
+
+/// Coordinates of selected atoms from all models of FlatStructure,
+/// centered once per model, for calculating many superpositions.
+/// Atoms are paired by index, as in calculate_superposition() for
+/// FlatStructure, so all models must have the same atoms.
+struct EnsembleRmsd {
+  size_t n_models = 0;
+  size_t n_atoms = 0;       // number of selected atoms per model
+  // For each model: x coordinates of all atoms, then y, then z.
+  std::vector<double> coor;
+  std::vector<double> sum_sq;  // sum of squared centered coordinates per model
+  /// square tiles of tile_size x tile_size models are processed together,
+  /// so that coordinates of the models stay in CPU cache
+  size_t tile_size = 16;
+
+  EnsembleRmsd(const FlatStructure& flat, PolymerType ptype, SupSelect sel,
+               char altloc='\0') {
+    n_models = flat.model_count();
+    if (n_models == 0)
+      return;
+    std::vector<size_t> selected =
+      select_atoms_for_superposition(flat, 0, ptype, sel, altloc);
+    n_atoms = selected.size();
+    if (n_atoms == 0)
+      fail("EnsembleRmsd: no atoms selected");
+    size_t begin0 = flat.model_atom_begin(0);
+    size_t model_size = flat.model_atom_end(0) - begin0;
+    coor.resize(n_models * 3 * n_atoms);
+    sum_sq.resize(n_models);
+    for (size_t m = 0; m < n_models; ++m) {
+      size_t begin = flat.model_atom_begin(m);
+      if (flat.model_atom_end(m) - begin != model_size)
+        fail("EnsembleRmsd: model #", std::to_string(m),
+             " has different number of atoms");
+      for (size_t n = 0; n < model_size; ++n)
+        if (flat.atom_name[begin + n] != flat.atom_name[begin0 + n])
+          fail("EnsembleRmsd: different atoms in model #", std::to_string(m));
+      double* x = &coor[m * 3 * n_atoms];
+      double* y = x + n_atoms;
+      double* z = y + n_atoms;
+      Position ctr;
+      for (size_t n : selected)
+        ctr += flat.position(begin + n);
+      ctr /= (double) n_atoms;
+      double sum = 0.;
+      for (size_t i = 0; i < n_atoms; ++i) {
+        Position p = flat.position(begin + selected[i]) - ctr;
+        x[i] = p.x;
+        y[i] = p.y;
+        z[i] = p.z;
+        sum += p.length_sq();
+      }
+      sum_sq[m] = sum;
+    }
+  }
+
+  /// RMSD between models i and j after superposition.
+  double rmsd(size_t i, size_t j) const {
+    if (i == j)
+      return 0.;
+    const double* x1 = &coor[i * 3 * n_atoms];
+    const double* y1 = x1 + n_atoms;
+    const double* z1 = y1 + n_atoms;
+    const double* x2 = &coor[j * 3 * n_atoms];
+    const double* y2 = x2 + n_atoms;
+    const double* z2 = y2 + n_atoms;
+    // correlation matrix A = X1^T X2 (coordinates are already centered)
+    double a00 = 0, a01 = 0, a02 = 0, a10 = 0, a11 = 0, a12 = 0,
+           a20 = 0, a21 = 0, a22 = 0;
+    for (size_t k = 0; k < n_atoms; ++k) {
+      a00 += x1[k] * x2[k];
+      a01 += x1[k] * y2[k];
+      a02 += x1[k] * z2[k];
+      a10 += y1[k] * x2[k];
+      a11 += y1[k] * y2[k];
+      a12 += y1[k] * z2[k];
+      a20 += z1[k] * x2[k];
+      a21 += z1[k] * y2[k];
+      a22 += z1[k] * z2[k];
+    }
+    Mat33 A(a00, a01, a02, a10, a11, a12, a20, a21, a22);
+    double E0 = 0.5 * (sum_sq[i] + sum_sq[j]);
+    double result;
+    fast_calc_rmsd_and_rotation(nullptr, A, &result, E0, (double) n_atoms, -1);
+    return result;
+  }
+
+  /// Calculates RMSD for rows [row_begin, row_end) and all columns
+  /// of the N x N matrix and stores them (row-major) in out.
+  /// Can be used to process a large matrix in parts.
+  void calculate_rows(size_t row_begin, size_t row_end, double* out,
+                      int n_threads=1) const {
+    check_tile_size();
+    row_end = std::min(row_end, n_models);
+    if (row_begin >= row_end)
+      return;
+    size_t row_tiles = (row_end - row_begin + tile_size - 1) / tile_size;
+    size_t col_tiles = (n_models + tile_size - 1) / tile_size;
+    parallel_for(row_tiles * col_tiles, get_thread_count(n_threads), [&](size_t t) {
+      size_t i0 = row_begin + t / col_tiles * tile_size;
+      size_t j0 = t % col_tiles * tile_size;
+      size_t i1 = std::min(i0 + tile_size, row_end);
+      size_t j1 = std::min(j0 + tile_size, n_models);
+      for (size_t i = i0; i < i1; ++i)
+        for (size_t j = j0; j < j1; ++j)
+          out[(i - row_begin) * n_models + j] = rmsd(i, j);
+    });
+  }
+
+  /// Returns the symmetric N x N matrix (row-major) of RMSDs.
+  /// Only tiles on and above the diagonal are calculated.
+  std::vector<double> calculate_matrix(int n_threads=1) const {
+    check_tile_size();
+    std::vector<double> matrix(n_models * n_models, 0.);
+    size_t n_tiles = (n_models + tile_size - 1) / tile_size;
+    std::vector<std::pair<size_t, size_t>> tiles;
+    tiles.reserve(n_tiles * (n_tiles + 1) / 2);
+    for (size_t ti = 0; ti < n_tiles; ++ti)
+      for (size_t tj = ti; tj < n_tiles; ++tj)
+        tiles.emplace_back(ti * tile_size, tj * tile_size);
+    parallel_for(tiles.size(), get_thread_count(n_threads), [&](size_t t) {
+      size_t i0 = tiles[t].first;
+      size_t j0 = tiles[t].second;
+      size_t i1 = std::min(i0 + tile_size, n_models);
+      size_t j1 = std::min(j0 + tile_size, n_models);
+      for (size_t i = i0; i < i1; ++i)
+        for (size_t j = std::max(j0, i + 1); j < j1; ++j) {
+          double r = rmsd(i, j);
+          matrix[i * n_models + j] = r;
+          matrix[j * n_models + i] = r;
+        }
+    });
+    return matrix;
+  }
+
+private:
+  void check_tile_size() const {
+    if (tile_size == 0)
+      fail("EnsembleRmsd: tile_size must be positive");
+  }
+};
+
+} // namespace gemmi
+#endif
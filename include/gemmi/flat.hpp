@@ -0,0 +1,250 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Flattened (columnar) representation of atoms from Structure.
+// Atom properties are stored in contiguous arrays, names are interned,
+// and boundaries of residues, chains and models are stored as offsets.
+
+#ifndef GEMMI_FLAT_HPP_
+#define GEMMI_FLAT_HPP_
+
+#include <string>
+#include <vector>
+#include "fail.hpp"   // for fail
+#include "intern.hpp" // for NameTable
+#include "model.hpp"  // for Structure, Atom, ...
+
+namespace gemmi {
+
+struct FlatStructure {
+  // atoms
+  std::vector<double> x, y, z;
+  std::vector<float> occ;
+  std::vector<float> b_iso;
+  std::vector<SMat33<float>> aniso;  // empty if no atom has anisotropic ADP
+  std::vector<El> element;
+  std::vector<char> altloc;
+  std::vector<signed char> charge;
+  std::vector<int> serial;
+  std::vector<int> atom_name;        // ids in names
+  // residues
+  std::vector<size_t> residue_start; // offsets in atom arrays, size+1
+  std::vector<int> residue_name;
+  std::vector<SeqId> seqid;
+  std::vector<int> segment;
+  std::vector<int> subchain;
+  std::vector<int> entity_id;
+  std::vector<SeqId::OptionalNum> label_seq;
+  std::vector<EntityType> entity_type;
+  std::vector<char> het_flag;
+  // chains
+  std::vector<size_t> chain_start;   // offsets in residue arrays, size+1
+  std::vector<int> chain_name;
+  // models
+  std::vector<size_t> model_start;   // offsets in chain arrays, size+1
+  std::vector<int> model_name;
+  NameTable names;
+  // from Structure
+  std::string name;
+  UnitCell cell;
+  std::string spacegroup_hm;
+
+  FlatStructure() { clear(); }
+  explicit FlatStructure(const Structure& st) { set_structure(st); }
+
+  size_t atom_count() const { return x.size(); }
+  size_t residue_count() const { return residue_start.size() - 1; }
+  size_t chain_count() const { return chain_start.size() - 1; }
+  size_t model_count() const { return model_start.size() - 1; }
+
+  Position position(size_t n) const { return Position(x[n], y[n], z[n]); }
+  void set_position(size_t n, const Position& p) { x[n] = p.x; y[n] = p.y; z[n] = p.z; }
+  bool has_aniso() const { return !aniso.empty(); }
+  const std::string& get_atom_name(size_t n) const { return names[atom_name[n]]; }
+  bool is_hydrogen(size_t n) const { return gemmi::is_hydrogen(element[n]); }
+
+  // atom offsets of a model: [model_atom_begin(m), model_atom_end(m))
+  size_t model_atom_begin(size_t m) const {
+    return residue_start[chain_start[model_start[m]]];
+  }
+  size_t model_atom_end(size_t m) const {
+    return residue_start[chain_start[model_start[m+1]]];
+  }
+  size_t check_model(size_t m) const {
+    if (m >= model_count())
+      fail("FlatStructure: no model #" + std::to_string(m));
+    return m;
+  }
+  /// index of an atom given by indices as in the Model
+  size_t atom_index(size_t m, size_t n_ch, size_t n_res, size_t n_atom) const {
+    return residue_start[chain_start[model_start[m] + n_ch] + n_res] + n_atom;
+  }
+
+  void clear() { reset(0, 0, 0, 0); }
+
+  void set_structure(const Structure& st) {
+    name = st.name;
+    cell = st.cell;
+    spacegroup_hm = st.spacegroup_hm;
+    size_t n_atoms = 0, n_res = 0, n_chains = 0;
+    for (const Model& model : st.models) {
+      n_chains += model.chains.size();
+      for (const Chain& chain : model.chains) {
+        n_res += chain.residues.size();
+        for (const Residue& res : chain.residues)
+          n_atoms += res.atoms.size();
+      }
+    }
+    bool any_aniso = false;
+    reset(n_atoms, n_res, n_chains, st.models.size());
+    for (const Model& model : st.models) {
+      model_name.push_back(names.intern(model.name));
+      for (const Chain& chain : model.chains) {
+        chain_name.push_back(names.intern(chain.name));
+        for (const Residue& res : chain.residues) {
+          residue_name.push_back(names.intern(res.name));
+          seqid.push_back(res.seqid);
+          segment.push_back(names.intern(res.segment));
+          subchain.push_back(names.intern(res.subchain));
+          entity_id.push_back(names.intern(res.entity_id));
+          label_seq.push_back(res.label_seq);
+          entity_type.push_back(res.entity_type);
+          het_flag.push_back(res.het_flag);
+          for (const Atom& atom : res.atoms) {
+            x.push_back(atom.pos.x);
+            y.push_back(atom.pos.y);
+            z.push_back(atom.pos.z);
+            occ.push_back(atom.occ);
+            b_iso.push_back(atom.b_iso);
+            element.push_back(atom.element.elem);
+            altloc.push_back(atom.altloc);
+            charge.push_back(atom.charge);
+            serial.push_back(atom.serial);
+            atom_name.push_back(names.intern(atom.name));
+            if (atom.aniso.nonzero())
+              any_aniso = true;
+          }
+          residue_start.push_back(x.size());
+        }
+        chain_start.push_back(residue_name.size());
+      }
+      model_start.push_back(chain_name.size());
+    }
+    if (any_aniso) {
+      aniso.reserve(n_atoms);
+      for (const Model& model : st.models)
+        for (const Chain& chain : model.chains)
+          for (const Residue& res : chain.residues)
+            for (const Atom& atom : res.atoms)
+              aniso.push_back(atom.aniso);
+    }
+  }
+
+  /// Creates Structure with the data stored here (i.e. without metadata,
+  /// entities, connections, etc).
+  Structure to_structure() const {
+    Structure st;
+    st.name = name;
+    st.cell = cell;
+    st.spacegroup_hm = spacegroup_hm;
+    st.models.reserve(model_count());
+    for (size_t m = 0; m < model_count(); ++m) {
+      st.models.emplace_back(names[model_name[m]]);
+      Model& model = st.models.back();
+      model.chains.reserve(model_start[m+1] - model_start[m]);
+      for (size_t c = model_start[m]; c < model_start[m+1]; ++c) {
+        model.chains.emplace_back(names[chain_name[c]]);
+        Chain& chain = model.chains.back();
+        chain.residues.resize(chain_start[c+1] - chain_start[c]);
+        for (size_t r = chain_start[c]; r < chain_start[c+1]; ++r) {
+          Residue& res = chain.residues[r - chain_start[c]];
+          res.name = names[residue_name[r]];
+          res.seqid = seqid[r];
+          res.segment = names[segment[r]];
+          res.subchain = names[subchain[r]];
+          res.entity_id = names[entity_id[r]];
+          res.label_seq = label_seq[r];
+          res.entity_type = entity_type[r];
+          res.het_flag = het_flag[r];
+          res.atoms.resize(residue_start[r+1] - residue_start[r]);
+          for (size_t n = residue_start[r]; n < residue_start[r+1]; ++n) {
+            Atom& atom = res.atoms[n - residue_start[r]];
+            atom.name = names[atom_name[n]];
+            atom.altloc = altloc[n];
+            atom.charge = charge[n];
+            atom.element = element[n];
+            atom.serial = serial[n];
+            atom.pos = position(n);
+            atom.occ = occ[n];
+            atom.b_iso = b_iso[n];
+            if (has_aniso())
+              atom.aniso = aniso[n];
+          }
+        }
+      }
+    }
+    st.setup_cell_images();
+    return st;
+  }
+
+  /// Writes back coordinates, occupancies and ADPs to the Structure
+  /// from which this object was created (or one with the same layout).
+  void copy_to(Structure& st) const {
+    size_t n = 0;
+    for (Model& model : st.models)
+      for (Chain& chain : model.chains)
+        for (Residue& res : chain.residues)
+          for (Atom& atom : res.atoms) {
+            if (n >= atom_count() || atom_name[n] != names.find(atom.name))
+              fail("FlatStructure::copy_to(): different atoms in Structure");
+            atom.pos = position(n);
+            atom.occ = occ[n];
+            atom.b_iso = b_iso[n];
+            if (has_aniso())
+              atom.aniso = aniso[n];
+            ++n;
+          }
+    if (n != atom_count())
+      fail("FlatStructure::copy_to(): different number of atoms");
+  }
+
+private:
+  template<typename T> static void renew(std::vector<T>& v, size_t n) {
+    v.clear();
+    v.reserve(n);
+  }
+
+  // clears all arrays and reserves memory
+  void reset(size_t n_atoms, size_t n_res, size_t n_chains, size_t n_models) {
+    renew(x, n_atoms);
+    renew(y, n_atoms);
+    renew(z, n_atoms);
+    renew(occ, n_atoms);
+    renew(b_iso, n_atoms);
+    renew(aniso, 0);
+    renew(element, n_atoms);
+    renew(altloc, n_atoms);
+    renew(charge, n_atoms);
+    renew(serial, n_atoms);
+    renew(atom_name, n_atoms);
+    renew(residue_start, n_res + 1);
+    residue_start.push_back(0);
+    renew(residue_name, n_res);
+    renew(seqid, n_res);
+    renew(segment, n_res);
+    renew(subchain, n_res);
+    renew(entity_id, n_res);
+    renew(label_seq, n_res);
+    renew(entity_type, n_res);
+    renew(het_flag, n_res);
+    renew(chain_start, n_chains + 1);
+    chain_start.push_back(0);
+    renew(chain_name, n_chains);
+    renew(model_start, n_models + 1);
+    model_start.push_back(0);
+    renew(model_name, n_models);
+    names = NameTable();
+  }
+};
+
+} // namespace gemmi
+#endif
@@ -125,7 +125,7 @@ private:
       return {0, v, w, len + u, ptr - u};
     for (int i = mask.nu - 1 - u; i > 1; --i)
       if (ptr[i-1] != Land)
-        return {u + i, v, w, len + mask.nu - 2 - i, ptr + i};
+        return {u + i, v, w, len + mask.nu - i, ptr + i};
     return {u, v, w, mask.nu, ptr};
   }
 };
@@ -11,6 +11,7 @@
 #include "math.hpp"      // for rad
 #include "symmetry.hpp"  // for GroupOps, Op
 #include "fail.hpp"      // for fail
+#include "parallel.hpp"  // for parallel_for_chunks
 
 #ifdef __MINGW32__  // MinGW may have problem with std::mutex etc
 # define POCKETFFT_CACHE_SIZE 0
@@ -156,72 +157,135 @@ private:
   size_t f_col_, phi_col_;
 };
 
-// If half_l is true, grid has only data with l>=0.
-// Parameter size can be obtained from get_size_for_hkl().
-template<typename T, typename FPhi>
-FPhiGrid<T> get_f_phi_on_grid(const FPhi& fphi,
-                              std::array<int, 3> size, bool half_l,
-                              AxisOrder axis_order=AxisOrder::XYZ) {
-  FPhiGrid<T> grid;
-  initialize_hkl_grid(grid, fphi, size, half_l, axis_order);
-  const std::complex<T> default_val; // initialized to 0+0i
-  GroupOps ops = grid.spacegroup->operations();
-  for (size_t i = 0; i < fphi.size(); i += fphi.stride()) {
-    Miller hkl = fphi.get_hkl(i);
-    T f = (T) fphi.get_f(i);
-    if (f == 0.f)  // is there enough of F=0 to justify this 'if'?
+namespace impl {
+
+// Places reflections and their symmetry mates on the grid. Values are
+// obtained as make_value(base, m, sign), where base = get_base(offset),
+// m is the phase shift in units of 2pi/DEN and sign is -1 if the value
+// is stored as (-h,-k,-l) (when the grid has only l>=0).
+// If the spacegroup is not centrosymmetric, Friedel mates are filled in
+// the same pass, the same way as in add_friedel_mates().
+// Only get_base(), which may be relatively expensive, runs on n_threads;
+// values are put on the grid in a single, sequential pass.
+template<typename T, typename Base, typename DataProxy,
+         typename GetBase, typename MakeValue>
+void put_reflections_on_grid(ReciprocalGrid<T>& grid, const DataProxy& data,
+                             GetBase get_base, MakeValue make_value,
+                             int n_threads) {
+  // symmetry operations as integer tables: hkl' = rot * hkl,
+  // and the phase shift is -2pi/DEN * dot(hkl, tran)
+  struct HklOp {
+    int rot[3][3];
+    int tran[3];
+  };
+  GroupOps gops = grid.spacegroup->operations();
+  std::vector<HklOp> ops;
+  ops.reserve(gops.sym_ops.size());
+  for (const Op& op : gops.sym_ops) {
+    HklOp hop;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j)
+        hop.rot[i][j] = op.rot[j][i] / Op::DEN;
+      hop.tran[i] = op.tran[i];
+    }
+    ops.push_back(hop);
+  }
+  const bool add_friedel = !gops.is_centrosymmetric();
+  const bool zyx = grid.axis_order == AxisOrder::ZYX;
+  const bool half_l = grid.half_l;
+
+  const size_t n = data.size() / data.stride();
+  std::vector<Miller> hkls(n);
+  std::vector<Base> bases(n);
+  const int nt = get_thread_count(n_threads);
+  parallel_for_chunks(n, nt, [&](size_t begin, size_t end, int) {
+    for (size_t k = begin; k < end; ++k) {
+      hkls[k] = data.get_hkl(k * data.stride());
+      bases[k] = get_base(k * data.stride());
+    }
+  });
+
+  // points set directly (not as Friedel mates) are not overwritten
+  std::vector<bool> direct(grid.data.size(), false);
+  for (size_t k = 0; k < n; ++k) {
+    if (bases[k] == Base())  // skip zeros (as if they were missing)
       continue;
-    double phi = fphi.get_phi(i);
-    for (const Op& op : ops.sym_ops) {
-      auto hklp = op.apply_to_hkl(hkl);
+    const Miller& hkl = hkls[k];
+    for (const HklOp& op : ops) {
+      int hklp[3];
+      for (int i = 0; i < 3; ++i)
+        hklp[i] = op.rot[i][0] * hkl[0] + op.rot[i][1] * hkl[1] + op.rot[i][2] * hkl[2];
       int lp = hklp[2];
-      if (axis_order == AxisOrder::ZYX)
+      if (zyx)
         std::swap(hklp[0], hklp[2]);
       if (!grid.has_index(hklp[0], hklp[1], hklp[2]))
         continue;
       int sign = (!half_l || lp >= 0 ? 1 : -1);
-      size_t idx = grid.index_n(sign * hklp[0], sign * hklp[1], sign * hklp[2]);
-      if (grid.data[idx] == default_val) {
-        T theta = sign * T(phi + op.phase_shift(hkl));
-        grid.data[idx] = std::complex<T>(f * std::cos(theta), f * std::sin(theta));
+      for (int i = 0; i < 3; ++i)
+        hklp[i] *= sign;
+      size_t idx = grid.index_n(hklp[0], hklp[1], hklp[2]);
+      if (direct[idx])
+        continue;
+      int m = modulo(hkl[0] * op.tran[0] + hkl[1] * op.tran[1] +
+                     hkl[2] * op.tran[2], Op::DEN);
+      T value = make_value(bases[k], m, sign);
+      grid.data[idx] = value;
+      direct[idx] = true;
+      if (add_friedel && (!half_l || hklp[zyx ? 0 : 2] == 0)) {
+        size_t mate_idx = grid.index_n(-hklp[0], -hklp[1], -hklp[2]);
+        if (!direct[mate_idx])
+          grid.data[mate_idx] = friedel_mate_value(value);
       }
     }
   }
-  if (!ops.is_centrosymmetric())
-    add_friedel_mates(grid);
+}
+
+} // namespace impl
+
+// If half_l is true, grid has only data with l>=0.
+// Parameter size can be obtained from get_size_for_hkl().
+template<typename T, typename FPhi>
+FPhiGrid<T> get_f_phi_on_grid(const FPhi& fphi,
+                              std::array<int, 3> size, bool half_l,
+                              AxisOrder axis_order=AxisOrder::XYZ,
+                              int n_threads=1) {
+  FPhiGrid<T> grid;
+  initialize_hkl_grid(grid, fphi, size, half_l, axis_order);
+  // phase shifts -2pi*m/DEN as rotations in the complex plane
+  std::complex<T> shift_rot[Op::DEN];
+  for (int m = 0; m < Op::DEN; ++m)
+    shift_rot[m] = std::complex<T>(std::polar(1.0, -2 * pi() * m / Op::DEN));
+  using Complex = std::complex<T>;
+  impl::put_reflections_on_grid<Complex, Complex>(grid, fphi,
+      [&](size_t offset) {
+        T f = (T) fphi.get_f(offset);
+        if (f == 0)  // is there enough of F=0 to justify this 'if'?
+          return Complex();
+        T phi = (T) fphi.get_phi(offset);
+        return Complex(f * std::cos(phi), f * std::sin(phi));
+      },
+      [&](const Complex& base, int m, int sign) {
+        // written out to avoid slow, NaN-aware complex multiplication
+        const Complex& r = shift_rot[m];
+        T re = base.real() * r.real() - base.imag() * r.imag();
+        T im = base.real() * r.imag() + base.imag() * r.real();
+        return Complex(re, sign < 0 ? -im : im);
+      }, n_threads);
   return grid;
 }
 
 template<typename T, typename DataProxy>
 ReciprocalGrid<T> get_value_on_grid(const DataProxy& data, size_t column,
                                     std::array<int, 3> size, bool half_l,
-                                    AxisOrder axis_order=AxisOrder::XYZ) {
+                                    AxisOrder axis_order=AxisOrder::XYZ,
+                                    int n_threads=1) {
   ReciprocalGrid<T> grid;
   initialize_hkl_grid(grid, data, size, half_l, axis_order);
-
   if (column >= data.stride())
     fail("Map coefficients not found.");
-  GroupOps ops = grid.spacegroup->operations();
-  for (size_t i = 0; i < data.size(); i += data.stride()) {
-    Miller hkl = data.get_hkl(i);
-    T val = (T) data.get_num(i + column);
-    if (val != 0.) {
-      for (const Op& op : ops.sym_ops) {
-        auto hklp = op.apply_to_hkl(hkl);
-        int lp = hklp[2];
-        if (axis_order == AxisOrder::ZYX)
-          std::swap(hklp[0], hklp[2]);
-        if (!grid.has_index(hklp[0], hklp[1], hklp[2]))
-          continue;
-        int sign = (!half_l || lp >= 0 ? 1 : -1);
-        size_t idx = grid.index_n(sign * hklp[0], sign * hklp[1], sign * hklp[2]);
-        if (grid.data[idx] == 0.)  // 0 is the default value
-          grid.data[idx] = val;
-      }
-    }
-  }
-  if (!ops.is_centrosymmetric())
-    add_friedel_mates(grid);
+  impl::put_reflections_on_grid<T, T>(grid, data,
+      [&](size_t offset) { return (T) data.get_num(offset + column); },
+      [](T val, int, int) { return val; }, n_threads);
   return grid;
 }
 
@@ -281,6 +345,153 @@ Grid<T> transform_f_phi_grid_to_map(FPhiGrid<T>&& hkl) {
   return map;
 }
 
+/// Calculates the map only in a box: at grid points start[i], ...,
+/// start[i]+shape[i]-1 along each axis (indices are wrapped, start can be
+/// negative). Returns the same values as get_subarray() would return from
+/// the full map calculated with transform_f_phi_grid_to_map(), but only
+/// 1D transforms needed for the box are calculated (lines of zeros are
+/// skipped), and only the box and parts of the reciprocal grid are kept
+/// in memory. Useful for a small region in a large unit cell.
+/// Only grids in XYZ order are supported.
+template<typename T>
+std::vector<T> transform_f_phi_grid_to_map_box(const FPhiGrid<T>& hkl,
+                                               std::array<int, 3> start,
+                                               std::array<int, 3> shape) {
+  using pocketfft::detail::cmplx;
+  if (hkl.axis_order != AxisOrder::XYZ)
+    fail("transform_f_phi_grid_to_map_box(): only XYZ order is supported");
+  if (shape[0] <= 0 || shape[1] <= 0 || shape[2] <= 0)
+    fail("transform_f_phi_grid_to_map_box(): empty box");
+  hkl.check_not_empty();
+  const int nu = hkl.nu;
+  const int nv = hkl.nv;
+  const int nw = hkl.half_l ? 2 * (hkl.nw - 1) : hkl.nw;  // the map size
+  const size_t nwh = hkl.nw;
+  const size_t bu = shape[0], bv = shape[1], bw = shape[2];
+  // the same normalization and conjugation as in transform_f_phi_grid_to_map_()
+  const T norm = T(1.0 / hkl.unit_cell.volume);
+
+  // 1D transforms along u; only columns in the box are kept
+  std::vector<std::complex<T>> a(nwh * nv * bu);
+  std::vector<bool> nonzero_plane(nwh, false);
+  {
+    pocketfft::detail::pocketfft_c<T> plan(nu);
+    std::vector<cmplx<T>> line(nu);
+    for (size_t w = 0; w < nwh; ++w)
+      for (int v = 0; v < nv; ++v) {
+        const std::complex<T>* row = &hkl.data[(w * nv + v) * nu];
+        bool zero = true;
+        for (int u = 0; u < nu; ++u) {
+          if (std::isnan(row[u].imag())) {
+            line[u] = cmplx<T>(0, 0);
+          } else {
+            line[u] = cmplx<T>(row[u].real(), -row[u].imag());
+            if (row[u] != std::complex<T>())
+              zero = false;
+          }
+        }
+        if (zero)
+          continue;
+        nonzero_plane[w] = true;
+        plan.exec(line.data(), norm, pocketfft::BACKWARD);
+        std::complex<T>* out = &a[(w * nv + v) * bu];
+        for (size_t j = 0; j < bu; ++j) {
+          const cmplx<T>& c = line[modulo(start[0] + (int)j, nu)];
+          out[j] = std::complex<T>(c.r, c.i);
+        }
+      }
+  }
+
+  // 1D transforms along v; only rows in the box are kept
+  std::vector<std::complex<T>> b(nwh * bv * bu);
+  {
+    pocketfft::detail::pocketfft_c<T> plan(nv);
+    std::vector<cmplx<T>> line(nv);
+    for (size_t w = 0; w < nwh; ++w) {
+      if (!nonzero_plane[w])
+        continue;
+      for (size_t j = 0; j < bu; ++j) {
+        for (int v = 0; v < nv; ++v) {
+          const std::complex<T>& x = a[(w * nv + v) * bu + j];
+          line[v] = cmplx<T>(x.real(), x.imag());
+        }
+        plan.exec(line.data(), T(1), pocketfft::BACKWARD);
+        for (size_t i = 0; i < bv; ++i) {
+          const cmplx<T>& c = line[modulo(start[1] + (int)i, nv)];
+          b[(w * bv + i) * bu + j] = std::complex<T>(c.r, c.i);
+        }
+      }
+    }
+  }
+  a.clear();
+  a.shrink_to_fit();
+
+  // 1D transforms along w (complex-to-real if half_l)
+  std::vector<T> result(bu * bv * bw);
+  const size_t b_stride = bv * bu;
+  if (hkl.half_l) {
+    pocketfft::detail::pocketfft_r<T> plan(nw);
+    std::vector<T> line(nw);
+    for (size_t i = 0; i < bv; ++i)
+      for (size_t j = 0; j < bu; ++j) {
+        const std::complex<T>* x = &b[i * bu + j];
+        // pocketfft's halfcomplex order: r0, r1, i1, r2, i2, ...
+        line[0] = x[0].real();
+        size_t l = 1;
+        for (; 2 * l < (size_t) nw; ++l) {
+          line[2 * l - 1] = x[l * b_stride].real();
+          line[2 * l] = x[l * b_stride].imag();
+        }
+        if (2 * l == (size_t) nw)
+          line[nw - 1] = x[l * b_stride].real();
+        plan.exec(line.data(), T(1), /*r2hc=*/false);
+        for (size_t k = 0; k < bw; ++k)
+          result[(k * bv + i) * bu + j] = line[modulo(start[2] + (int)k, nw)];
+      }
+  } else {
+    pocketfft::detail::pocketfft_c<T> plan(nw);
+    std::vector<cmplx<T>> line(nw);
+    for (size_t i = 0; i < bv; ++i)
+      for (size_t j = 0; j < bu; ++j) {
+        for (int w = 0; w < nw; ++w) {
+          const std::complex<T>& x = b[w * b_stride + i * bu + j];
+          line[w] = cmplx<T>(x.real(), x.imag());
+        }
+        plan.exec(line.data(), T(1), pocketfft::BACKWARD);
+        for (size_t k = 0; k < bw; ++k)
+          result[(k * bv + i) * bu + j] = line[modulo(start[2] + (int)k, nw)].r;
+      }
+  }
+  return result;
+}
+
+/// Returns mean and RMS deviation of the map that would be calculated
+/// with transform_f_phi_grid_to_map(), obtained from Parseval's theorem
+/// (without calculating the map). Useful with transform_f_phi_grid_to_map_box().
+template<typename T>
+std::array<double, 2> calculate_map_mean_and_rms(const FPhiGrid<T>& hkl) {
+  hkl.check_not_empty();
+  // with half_l, values off the l=0 plane (and the Nyquist plane) count twice
+  bool half_u = hkl.half_l && hkl.axis_order == AxisOrder::ZYX;
+  bool half_w = hkl.half_l && hkl.axis_order != AxisOrder::ZYX;
+  double sum_sq = 0.;
+  size_t idx = 0;
+  for (int w = 0; w != hkl.nw; ++w) {
+    int mult_w = half_w && w != 0 && w != hkl.nw - 1 ? 2 : 1;
+    for (int v = 0; v != hkl.nv; ++v)
+      for (int u = 0; u != hkl.nu; ++u, ++idx) {
+        const std::complex<T>& x = hkl.data[idx];
+        if (idx == 0 || std::isnan(x.imag()))
+          continue;
+        int mult = half_u && u != 0 && u != hkl.nu - 1 ? 2 : mult_w;
+        sum_sq += mult * (double) std::norm(x);
+      }
+  }
+  double norm = 1.0 / hkl.unit_cell.volume;
+  double mean = std::isnan(hkl.data[0].imag()) ? 0. : norm * hkl.data[0].real();
+  return {{mean, norm * std::sqrt(sum_sq)}};
+}
+
 template<typename T, typename FPhi>
 Grid<T> transform_f_phi_to_map(const FPhi& fphi,
                                std::array<int, 3> size,
@@ -6,6 +6,7 @@
 #define GEMMI_GRID_HPP_
 
 #include <cassert>
+#include <climits>    // for INT_MAX
 #include <cstddef>    // for ptrdiff_t
 #include <complex>
 #include <algorithm>  // for fill
@@ -17,6 +18,7 @@
 #include "symmetry.hpp"
 #include "stats.hpp"  // for DataStats
 #include "fail.hpp"   // for fail
+#include "half.hpp"   // for Half (Grid<Half>)
 
 namespace gemmi {
 
@@ -606,8 +608,11 @@ struct Grid : GridBase<T> {
     }
   }
 
+  /// If w_begin/w_end are given, only points with (wrapped) w in
+  /// [w_begin, w_end) are used; it allows processing slabs in parallel.
   template <bool UsePbc, typename Func>
-  void do_use_points_in_box(Fractional fctr, int du, int dv, int dw, Func&& func) {
+  void do_use_points_in_box(Fractional fctr, int du, int dv, int dw, Func&& func,
+                            int w_begin=0, int w_end=INT_MAX) {
     int u0 = iround(fctr.x * nu);
     int v0 = iround(fctr.y * nv);
     int w0 = iround(fctr.z * nw);
@@ -628,6 +633,8 @@ struct Grid : GridBase<T> {
     const Position orth0(unit_cell.orth.mat.column_copy(0));
     for (int w = w_lo; w <= w_hi; ++w) {
       int w_ = UsePbc ? modulo(w, nw) : w;
+      if (w_ < w_begin || w_ >= w_end)
+        continue;
       double fw = w * (1.0 / nw);
       for (int v = v_lo; v <= v_hi; ++v) {
         int v_ = UsePbc ? modulo(v, nv) : v;
@@ -0,0 +1,173 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// GridOrbits: symmetry-related grid points grouped into orbits,
+// for repeated (and multi-threaded) symmetrization of grids.
+
+#ifndef GEMMI_GRIDORBITS_HPP_
+#define GEMMI_GRIDORBITS_HPP_
+
+#include <cstdint>       // for uint32_t
+#include <vector>
+#include "fail.hpp"      // for fail
+#include "grid.hpp"      // for Grid, GridMeta, GridOp
+#include "parallel.hpp"  // for parallel_for_chunks
+
+namespace gemmi {
+
+/// Orbits of grid points under the space group operations. Calculated once
+/// for given grid size and space group, they can be used many times, e.g.
+/// in each cycle of refinement. Symmetrization with orbits doesn't need
+/// index calculations and can run on multiple threads, because each orbit
+/// is processed independently.
+struct GridOrbits {
+  int nu = 0, nv = 0, nw = 0;
+  const SpaceGroup* spacegroup = nullptr;
+  /// number of operations except identity (0 if there is no symmetry)
+  size_t mate_count = 0;
+  /// the first (lowest-index) point of each orbit
+  std::vector<std::uint32_t> representatives;
+  /// mates[i * mate_count + k] is the index of the image of representatives[i]
+  /// under the k-th operation from get_scaled_ops_except_id();
+  /// points on special positions have repeated mates.
+  std::vector<std::uint32_t> mates;
+
+  bool matches(const GridMeta& grid) const {
+    return grid.nu == nu && grid.nv == nv && grid.nw == nw &&
+           grid.spacegroup == spacegroup;
+  }
+
+  void prepare(const GridMeta& grid, int n_threads=1) {
+    std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+    nu = grid.nu;
+    nv = grid.nv;
+    nw = grid.nw;
+    spacegroup = grid.spacegroup;
+    mate_count = ops.size();
+    representatives.clear();
+    mates.clear();
+    if (ops.empty())
+      return;
+    check_grid_factors(grid.spacegroup, {{nu, nv, nw}});
+    if (grid.point_count() > UINT32_MAX)
+      fail("GridOrbits: grid too big");
+    n_threads = get_thread_count(n_threads);
+    if (n_threads == 1) {
+      // cf. Grid::symmetrize_using_ops()
+      std::vector<bool> visited(grid.point_count(), false);
+      // exact if there are no special positions
+      representatives.reserve(grid.point_count() / (mate_count + 1));
+      mates.reserve(representatives.capacity() * mate_count);
+      size_t idx = 0;
+      for (int w = 0; w != nw; ++w)
+        for (int v = 0; v != nv; ++v)
+          for (int u = 0; u != nu; ++u, ++idx) {
+            if (visited[idx])
+              continue;
+            representatives.push_back((std::uint32_t) idx);
+            for (const GridOp& op : ops) {
+              std::array<int,3> t = op.apply(u, v, w);
+              size_t mate = grid.index_n(t[0], t[1], t[2]);
+              mates.push_back((std::uint32_t) mate);
+              visited[mate] = true;
+            }
+          }
+      return;
+    }
+    std::vector<std::vector<std::uint32_t>> chunk_reps(n_threads);
+    std::vector<std::vector<std::uint32_t>> chunk_mates(n_threads);
+    parallel_for_chunks(nw, n_threads, [&](size_t begin, size_t end, int n) {
+      std::vector<std::uint32_t> point_mates(ops.size());
+      for (int w = (int) begin; w < (int) end; ++w)
+        for (int v = 0; v != nv; ++v)
+          for (int u = 0; u != nu; ++u) {
+            size_t idx = grid.index_q(u, v, w);
+            // each orbit is represented by its point with the lowest index
+            bool is_first = true;
+            for (size_t k = 0; k < ops.size(); ++k) {
+              std::array<int,3> t = ops[k].apply(u, v, w);
+              size_t mate = grid.index_n(t[0], t[1], t[2]);
+              if (mate < idx) {
+                is_first = false;
+                break;
+              }
+              point_mates[k] = (std::uint32_t) mate;
+            }
+            if (is_first) {
+              chunk_reps[n].push_back((std::uint32_t) idx);
+              chunk_mates[n].insert(chunk_mates[n].end(),
+                                    point_mates.begin(), point_mates.end());
+            }
+          }
+    });
+    size_t n_orbits = 0;
+    for (const std::vector<std::uint32_t>& reps : chunk_reps)
+      n_orbits += reps.size();
+    representatives.reserve(n_orbits);
+    mates.reserve(n_orbits * mate_count);
+    for (int n = 0; n < n_threads; ++n) {
+      representatives.insert(representatives.end(),
+                             chunk_reps[n].begin(), chunk_reps[n].end());
+      mates.insert(mates.end(), chunk_mates[n].begin(), chunk_mates[n].end());
+    }
+  }
+
+  size_t orbit_count() const { return representatives.size(); }
+};
+
+/// The same as Grid::symmetrize_using_ops(), but with precomputed orbits.
+template<typename T, typename Func>
+void symmetrize_using_orbits(Grid<T>& grid, const GridOrbits& orbits, Func func,
+                             int n_threads=1) {
+  if (!orbits.matches(grid))
+    fail("symmetrize_using_orbits(): orbits are for a different grid");
+  if (orbits.mate_count == 0)
+    return;
+  const size_t mate_count = orbits.mate_count;
+  parallel_for_chunks(orbits.orbit_count(), get_thread_count(n_threads),
+                      [&](size_t begin, size_t end, int) {
+    for (size_t i = begin; i < end; ++i) {
+      size_t idx = orbits.representatives[i];
+      const std::uint32_t* mates = &orbits.mates[i * mate_count];
+      T value = grid.data[idx];
+      for (size_t k = 0; k < mate_count; ++k)
+        value = func(value, grid.data[mates[k]]);
+      grid.data[idx] = value;
+      for (size_t k = 0; k < mate_count; ++k)
+        grid.data[mates[k]] = value;
+    }
+  });
+}
+
+// equivalents of Grid::symmetrize_*() functions
+template<typename T>
+void symmetrize_min(Grid<T>& grid, const GridOrbits& orbits, int n_threads=1) {
+  symmetrize_using_orbits(grid, orbits, [](T a, T b) {
+      return (a < b || !(b == b)) ? a : b;
+  }, n_threads);
+}
+template<typename T>
+void symmetrize_max(Grid<T>& grid, const GridOrbits& orbits, int n_threads=1) {
+  symmetrize_using_orbits(grid, orbits, [](T a, T b) {
+      return (a > b || !(b == b)) ? a : b;
+  }, n_threads);
+}
+template<typename T>
+void symmetrize_abs_max(Grid<T>& grid, const GridOrbits& orbits, int n_threads=1) {
+  symmetrize_using_orbits(grid, orbits, [](T a, T b) {
+      return (std::abs(a) > std::abs(b) || !(b == b)) ? a : b;
+  }, n_threads);
+}
+template<typename T>
+void symmetrize_sum(Grid<T>& grid, const GridOrbits& orbits, int n_threads=1) {
+  symmetrize_using_orbits(grid, orbits, [](T a, T b) { return a + b; }, n_threads);
+}
+template<typename T>
+void symmetrize_nondefault(Grid<T>& grid, const GridOrbits& orbits, T default_,
+                           int n_threads=1) {
+  symmetrize_using_orbits(grid, orbits, [default_](T a, T b) {
+      return impl::is_same(a, default_) ? b : a;
+  }, n_threads);
+}
+
+} // namespace gemmi
+#endif
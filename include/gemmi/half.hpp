@@ -0,0 +1,117 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Half-precision (IEEE 754 binary16) floating-point numbers,
+// used in MRC maps mode 12 and for compact in-memory storage of maps.
+
+#ifndef GEMMI_HALF_HPP_
+#define GEMMI_HALF_HPP_
+
+#include <cstdint>   // for uint16_t, uint32_t
+#include <cstring>   // for memcpy
+#include <cstddef>   // for size_t
+#if defined(__F16C__)
+# include <immintrin.h>
+#endif
+
+namespace gemmi {
+
+/// Conversion with rounding to nearest even. Values too large for half
+/// precision become infinities, NaNs stay NaNs.
+/// (based on public-domain code by Fabian Giesen)
+inline std::uint16_t float_to_half(float f) {
+  std::uint32_t x;
+  std::memcpy(&x, &f, 4);
+  std::uint32_t sign = x & 0x80000000;
+  x ^= sign;
+  std::uint16_t h;
+  if (x >= 0x47800000) {  // |f| >= 65536 (after rounding: inf), inf or NaN
+    h = x > 0x7f800000 ? 0x7e00 : 0x7c00;
+  } else if (x < 0x38800000) {  // subnormal in half precision or 0
+    // adding 0.5 shifts the mantissa bits to the right place and rounds them
+    float t;
+    std::memcpy(&t, &x, 4);
+    t += 0.5f;
+    std::memcpy(&x, &t, 4);
+    h = std::uint16_t(x - 0x3f000000);
+  } else {
+    std::uint32_t mant_odd = (x >> 13) & 1;
+    x += 0xc8000fff + mant_odd;  // re-bias the exponent and round
+    h = std::uint16_t(x >> 13);
+  }
+  return std::uint16_t(h | (sign >> 16));
+}
+
+inline float half_to_float(std::uint16_t h) {
+  const std::uint32_t shifted_exp = 0x7c00 << 13;
+  std::uint32_t x = std::uint32_t(h & 0x7fff) << 13;
+  std::uint32_t exp = x & shifted_exp;
+  x += (127 - 15) << 23;  // re-bias the exponent
+  float f;
+  if (exp == shifted_exp) {  // inf or NaN
+    x += (128 - 16) << 23;
+  } else if (exp == 0) {  // zero or subnormal - renormalize
+    x += 1 << 23;
+    std::memcpy(&f, &x, 4);
+    f -= 6.103515625e-05f;  // 2^-14
+    std::memcpy(&x, &f, 4);
+  }
+  x |= std::uint32_t(h & 0x8000) << 16;
+  std::memcpy(&f, &x, 4);
+  return f;
+}
+
+/// Array conversions. If compiled with F16C instructions enabled
+/// (e.g. -mf16c or -march=native on x86-64), 8 numbers are converted
+/// at once; the results are the same as from the scalar functions,
+/// except for NaNs: F16C keeps the NaN payload, float_to_half() always
+/// returns 0x7e00 (with the sign bit).
+inline void half_to_float_array(const std::uint16_t* in, float* out, size_t n) {
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(out + i,
+        _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+#endif
+  for (; i < n; ++i)
+    out[i] = half_to_float(in[i]);
+}
+
+inline void float_to_half_array(const float* in, std::uint16_t* out, size_t n) {
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+        _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+  for (; i < n; ++i)
+    out[i] = float_to_half(in[i]);
+}
+
+/// Storage type for half-precision numbers, converted implicitly to and
+/// from float. It can be used as Grid<Half> to keep large maps in memory;
+/// arithmetic is done in single precision.
+struct Half {
+  std::uint16_t bits;
+  Half() = default;
+  Half(float f) : bits(float_to_half(f)) {}
+  operator float() const { return half_to_float(bits); }
+};
+
+inline void half_to_float_array(const Half* in, float* out, size_t n) {
+  static_assert(sizeof(Half) == 2, "unexpected padding");
+  half_to_float_array(reinterpret_cast<const std::uint16_t*>(in), out, n);
+}
+inline void float_to_half_array(const float* in, Half* out, size_t n) {
+  float_to_half_array(in, reinterpret_cast<std::uint16_t*>(out), n);
+}
+
+namespace impl {
+// overloads of functions from math.hpp used in Grid
+inline bool is_nan(Half a) { return (a.bits & 0x7fff) > 0x7c00; }
+inline bool is_same(Half a, Half b) {
+  return is_nan(b) ? is_nan(a) : float(a) == float(b);
+}
+} // namespace impl
+
+} // namespace gemmi
+#endif
@@ -0,0 +1,245 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Matching (joining) reflections from one or more datasets by Miller indices.
+// Miller indices are packed into 64-bit keys and looked up either in a dense
+// 3D table (if the hkl box is small enough) or in an open-addressing hash.
+
+#ifndef GEMMI_HKLJOIN_HPP_
+#define GEMMI_HKLJOIN_HPP_
+
+#include <cstdint>       // for uint64_t
+#include <algorithm>     // for sort, unique, min, max
+#include <utility>       // for pair
+#include <vector>
+#include "fail.hpp"      // for fail
+#include "unitcell.hpp"  // for Miller
+#include "parallel.hpp"  // for parallel_for_chunks
+
+namespace gemmi {
+
+// 21 bits per index. Packed keys are ordered in the same way as Miller.
+inline std::uint64_t pack_miller(const Miller& hkl) {
+  const std::uint64_t bias = 1 << 20;
+  return ((std::uint64_t(hkl[0]) + bias) << 42) |
+         (((std::uint64_t(hkl[1]) + bias) & 0x1FFFFF) << 21) |
+         ((std::uint64_t(hkl[2]) + bias) & 0x1FFFFF);
+}
+
+inline Miller unpack_miller(std::uint64_t key) {
+  const int bias = 1 << 20;
+  return {{int(key >> 42) - bias,
+           int((key >> 21) & 0x1FFFFF) - bias,
+           int(key & 0x1FFFFF) - bias}};
+}
+
+/// Maps Miller indices to positions in an array (the first occurrence
+/// is used if the same hkl is present more than once).
+struct HklIndex {
+  // Dense mode is used when the box spanned by hkl is at most this many
+  // times larger than the number of reflections.
+  static constexpr size_t max_dense_ratio = 8;
+
+  bool dense = false;
+  Miller lo = {{0, 0, 0}};
+  Miller extent = {{0, 0, 0}};
+  std::vector<int> table;               // dense mode: box -> position or -1
+  std::vector<std::uint64_t> keys;      // hash mode: open addressing
+  std::vector<int> values;
+  int shift = 64;
+
+  static constexpr std::uint64_t empty_key = ~std::uint64_t(0);
+
+  HklIndex() = default;
+  HklIndex(const Miller* hkl, size_t size) { build(hkl, size); }
+  explicit HklIndex(const std::vector<Miller>& hkl) { build(hkl.data(), hkl.size()); }
+
+  void build(const Miller* hkl, size_t size) {
+    table.clear();
+    keys.clear();
+    values.clear();
+    if (size >= (size_t) INT32_MAX)
+      fail("HklIndex: too many reflections");
+    Miller hi = {{0, 0, 0}};
+    lo = hi;
+    if (size != 0)
+      lo = hi = hkl[0];
+    for (size_t i = 1; i < size; ++i)
+      for (int j = 0; j < 3; ++j) {
+        lo[j] = std::min(lo[j], hkl[i][j]);
+        hi[j] = std::max(hi[j], hkl[i][j]);
+      }
+    for (int j = 0; j < 3; ++j) {
+      if (lo[j] <= -(1 << 20) || hi[j] >= (1 << 20))
+        fail("HklIndex: Miller index out of range");
+      extent[j] = hi[j] - lo[j] + 1;
+    }
+    double volume = double(extent[0]) * extent[1] * extent[2];
+    dense = volume <= double(max_dense_ratio * size + 4096);
+    if (dense) {
+      table.resize((size_t) volume, -1);
+      for (size_t i = 0; i < size; ++i) {
+        int& slot = table[dense_offset(hkl[i])];
+        if (slot < 0)
+          slot = (int) i;
+      }
+    } else {
+      int bits = 4;
+      while ((size_t(1) << bits) < 2 * size)
+        ++bits;
+      shift = 64 - bits;
+      keys.resize(size_t(1) << bits, empty_key);
+      values.resize(keys.size());
+      for (size_t i = 0; i < size; ++i) {
+        std::uint64_t key = pack_miller(hkl[i]);
+        size_t n = hash_slot(key);
+        while (keys[n] != empty_key && keys[n] != key)
+          n = (n + 1) & (keys.size() - 1);
+        if (keys[n] == empty_key) {
+          keys[n] = key;
+          values[n] = (int) i;
+        }
+      }
+    }
+  }
+
+  /// Returns position of hkl or -1 if hkl is not indexed.
+  int find(const Miller& hkl) const {
+    if (dense) {
+      for (int j = 0; j < 3; ++j)
+        if ((unsigned)(hkl[j] - lo[j]) >= (unsigned) extent[j])
+          return -1;
+      return table[dense_offset(hkl)];
+    }
+    if (keys.empty())
+      return -1;
+    std::uint64_t key = pack_miller(hkl);
+    for (size_t n = hash_slot(key); keys[n] != empty_key; n = (n + 1) & (keys.size() - 1))
+      if (keys[n] == key)
+        return values[n];
+    return -1;
+  }
+
+private:
+  size_t dense_offset(const Miller& hkl) const {
+    return (size_t(hkl[0] - lo[0]) * extent[1] + size_t(hkl[1] - lo[1])) * extent[2]
+           + size_t(hkl[2] - lo[2]);
+  }
+  size_t hash_slot(std::uint64_t key) const {
+    return size_t((key * 0x9E3779B97F4A7C15) >> shift);
+  }
+};
+
+/// Result of a multi-way join: sorted union of Miller indices from all
+/// datasets and, for each of them, positions in the datasets (-1 if absent).
+struct HklJoin {
+  std::vector<Miller> hkl;
+  std::vector<int> pos;  // hkl.size() x ncol, row-major
+  size_t ncol = 0;
+
+  int position(size_t row, size_t col) const { return pos[row * ncol + col]; }
+
+  bool is_complete(size_t row) const {
+    for (size_t col = 0; col < ncol; ++col)
+      if (pos[row * ncol + col] < 0)
+        return false;
+    return true;
+  }
+
+  /// Leaves only reflections present in all datasets (intersection).
+  void keep_only_complete() {
+    size_t n = 0;
+    for (size_t row = 0; row < hkl.size(); ++row)
+      if (is_complete(row)) {
+        if (n != row) {
+          hkl[n] = hkl[row];
+          std::copy(pos.begin() + row * ncol, pos.begin() + (row + 1) * ncol,
+                    pos.begin() + n * ncol);
+        }
+        ++n;
+      }
+    hkl.resize(n);
+    pos.resize(n * ncol);
+  }
+
+  /// Values from dataset col re-ordered to match hkl.
+  template <typename T>
+  std::vector<T> aligned(size_t col, const std::vector<T>& v, T nan) const {
+    std::vector<T> result(hkl.size());
+    for (size_t row = 0; row != hkl.size(); ++row) {
+      int p = pos[row * ncol + col];
+      result[row] = p >= 0 ? v.at(p) : nan;
+    }
+    return result;
+  }
+};
+
+/// Joins N datasets (given as arrays of hkl) in one pass.
+/// n_threads: number of threads, 0 = all hardware threads.
+inline HklJoin join_hkl(const std::vector<std::pair<const Miller*, size_t>>& data,
+                        int n_threads=1) {
+  HklJoin join;
+  join.ncol = data.size();
+  // union of all Miller indices, sorted
+  size_t total = 0;
+  for (const auto& d : data)
+    total += d.second;
+  std::vector<Miller> all;
+  all.reserve(total);
+  for (const auto& d : data)
+    all.insert(all.end(), d.first, d.first + d.second);
+  HklIndex all_index(all);
+  if (all_index.dense) {
+    // walking the dense table gives sorted output for free
+    const HklIndex& idx = all_index;
+    for (int h = 0; h < idx.extent[0]; ++h)
+      for (int k = 0; k < idx.extent[1]; ++k)
+        for (int l = 0; l < idx.extent[2]; ++l)
+          if (idx.table[(size_t(h) * idx.extent[1] + k) * idx.extent[2] + l] >= 0)
+            join.hkl.push_back({{h + idx.lo[0], k + idx.lo[1], l + idx.lo[2]}});
+  } else {
+    std::vector<std::uint64_t> keys;
+    keys.reserve(all.size());
+    for (const Miller& hkl : all)
+      keys.push_back(pack_miller(hkl));
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    join.hkl.reserve(keys.size());
+    for (std::uint64_t key : keys)
+      join.hkl.push_back(unpack_miller(key));
+  }
+  all = std::vector<Miller>();
+  HklIndex row_index(join.hkl);
+
+  // Find rows for all reflections (in parallel), then scatter
+  // positions per dataset, in reverse order so that the first one wins.
+  std::vector<int> rows(total);
+  std::vector<size_t> starts(data.size() + 1, 0);
+  for (size_t i = 0; i < data.size(); ++i)
+    starts[i+1] = starts[i] + data[i].second;
+  n_threads = get_thread_count(n_threads);
+  parallel_for_chunks(total, n_threads, [&](size_t begin, size_t end, int) {
+    size_t col = std::upper_bound(starts.begin(), starts.end(), begin) - starts.begin() - 1;
+    for (size_t n = begin; n < end; ++n) {
+      while (n >= starts[col+1])
+        ++col;
+      rows[n] = row_index.find(data[col].first[n - starts[col]]);
+    }
+  });
+  join.pos.resize(join.hkl.size() * join.ncol, -1);
+  parallel_for(data.size(), n_threads, [&](size_t col) {
+    for (size_t n = starts[col+1]; n-- > starts[col]; )
+      join.pos[rows[n] * join.ncol + col] = int(n - starts[col]);
+  });
+  return join;
+}
+
+inline HklJoin join_hkl(const std::vector<std::vector<Miller>>& data, int n_threads=1) {
+  std::vector<std::pair<const Miller*, size_t>> v;
+  v.reserve(data.size());
+  for (const std::vector<Miller>& d : data)
+    v.emplace_back(d.data(), d.size());
+  return join_hkl(v, n_threads);
+}
+
+} // namespace gemmi
+#endif
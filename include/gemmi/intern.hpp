@@ -0,0 +1,121 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Interning of names (atom, residue, chain names, etc).
+// Each unique string gets a small integer id, so that names can be
+// compared and hashed as integers.
+// Used in FlatStructure (NameTable) and LinkHunt (NamePool). Atom, Residue
+// and Chain keep std::string names, which are short enough to be stored
+// without heap allocation.
+
+#ifndef GEMMI_INTERN_HPP_
+#define GEMMI_INTERN_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>   // for unique_ptr
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>  // for swap
+#include <vector>
+#include "fail.hpp"  // for fail
+
+namespace gemmi {
+
+/// Table of unique strings. Each string gets a small integer id.
+/// Not thread-safe; used as a member of objects such as FlatStructure.
+struct NameTable {
+  std::vector<std::string> names;
+  std::unordered_map<std::string, int> ids;
+
+  int intern(const std::string& s) {
+    auto r = ids.emplace(s, (int) names.size());
+    if (r.second)
+      names.push_back(s);
+    return r.first->second;
+  }
+  /// Returns -1 if the string is not in the table.
+  int find(const std::string& s) const {
+    auto it = ids.find(s);
+    return it != ids.end() ? it->second : -1;
+  }
+  const std::string& operator[](int id) const { return names[id]; }
+  size_t size() const { return names.size(); }
+};
+
+/// Process-wide, thread-safe table of names. Ids never change, so they can
+/// be stored and compared by different objects and threads.
+/// intern() and find() lock a mutex; get() and size() don't lock.
+/// Strings are stored in blocks that are never moved (block k has 64*2^k
+/// strings), so references returned by get() stay valid.
+class NamePool {
+public:
+  int intern(const std::string& s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int id = size_.load(std::memory_order_relaxed);
+    auto r = ids_.emplace(s, id);
+    if (!r.second)
+      return r.first->second;
+    int idx = id;
+    int k = block_index(idx);
+    if (k >= kMaxBlocks) {
+      ids_.erase(r.first);
+      fail("NamePool: too many names");
+    }
+    if (!blocks_[k])
+      blocks_[k].reset(new std::string[kFirstBlockSize << k]);
+    blocks_[k][idx] = s;
+    // publishes the string (and the block) to get() in other threads
+    size_.store(id + 1, std::memory_order_release);
+    return id;
+  }
+  /// Returns -1 if the string was not interned.
+  int find(const std::string& s) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ids_.find(s);
+    return it != ids_.end() ? it->second : -1;
+  }
+  const std::string& get(int id) const {
+    if (id < 0 || id >= size_.load(std::memory_order_acquire))
+      fail("NamePool: wrong id ", std::to_string(id));
+    int k = block_index(id);  // id becomes the index in block k
+    return blocks_[k][id];
+  }
+  size_t size() const { return (size_t) size_.load(std::memory_order_acquire); }
+
+private:
+  static constexpr int kFirstBlockSize = 64;
+  static constexpr int kMaxBlocks = 25;  // enough for 2^31 names
+  mutable std::mutex mutex_;
+  std::atomic<int> size_{0};
+  std::unique_ptr<std::string[]> blocks_[kMaxBlocks];
+  std::unordered_map<std::string, int> ids_;
+
+  // Returns the block of id; id becomes the index in the block.
+  static int block_index(int& id) {
+    int k = 0;
+    while (k < kMaxBlocks && id >= (kFirstBlockSize << k)) {
+      id -= kFirstBlockSize << k;
+      ++k;
+    }
+    return k;
+  }
+};
+
+inline NamePool& global_name_pool() {
+  static NamePool pool;
+  return pool;
+}
+
+inline int intern_name(const std::string& s) { return global_name_pool().intern(s); }
+inline const std::string& interned_name(int id) { return global_name_pool().get(id); }
+
+/// Order-independent key of two name ids, e.g. for atom pairs in bonds.
+inline std::uint64_t name_pair_key(int id1, int id2) {
+  if (id1 > id2)
+    std::swap(id1, id2);
+  return (std::uint64_t(std::uint32_t(id1)) << 32) | std::uint32_t(id2);
+}
+
+} // namespace gemmi
+#endif
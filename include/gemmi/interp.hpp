@@ -0,0 +1,89 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Tricubic interpolation of a grid at many points (e.g. at atom positions),
+// with gradients, optionally on multiple threads.
+
+#ifndef GEMMI_INTERP_HPP_
+#define GEMMI_INTERP_HPP_
+
+#include <algorithm>     // for sort
+#include <array>
+#include <cstdint>       // for uint64_t
+#include <vector>
+#include "grid.hpp"      // for Grid
+#include "model.hpp"     // for Model
+#include "parallel.hpp"  // for parallel_for_chunks
+
+namespace gemmi {
+
+/// Calculates Grid::tricubic_interpolation_der() at n positions.
+/// results[i] is {value, df/dx, df/dy, df/dz} at positions[i], where
+/// the derivatives are with respect to orthogonal coordinates (per A).
+/// Points are processed in the order of grid tiles (8x8x8 points),
+/// so that neighbouring points use the same part of the grid.
+template<typename T>
+void tricubic_interpolation_der_batch(const Grid<T>& grid, const Position* positions,
+                                      size_t n, std::array<double,4>* results,
+                                      int n_threads=1) {
+  grid.check_not_empty();
+  // orthogonal coordinates -> grid coordinates
+  Transform tr = grid.unit_cell.frac;
+  const double dims[3] = {(double)grid.nu, (double)grid.nv, (double)grid.nw};
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j)
+      tr.mat[i][j] *= dims[i];
+    tr.vec.at(i) *= dims[i];
+  }
+  std::vector<Vec3> grid_pos(n);
+  std::vector<std::pair<std::uint64_t, size_t>> order(n);
+  const std::uint64_t tiles_u = (grid.nu + 7) / 8;
+  const std::uint64_t tiles_v = (grid.nv + 7) / 8;
+  for (size_t i = 0; i < n; ++i) {
+    grid_pos[i] = tr.apply(positions[i]);
+    int u, v, w;
+    Grid<T>::grid_modulo(grid_pos[i].x, grid.nu, &u);
+    Grid<T>::grid_modulo(grid_pos[i].y, grid.nv, &v);
+    Grid<T>::grid_modulo(grid_pos[i].z, grid.nw, &w);
+    order[i].first = ((std::uint64_t)(w / 8) * tiles_v + v / 8) * tiles_u + u / 8;
+    order[i].second = i;
+  }
+  std::sort(order.begin(), order.end());
+  parallel_for_chunks(n, get_thread_count(n_threads),
+                      [&](size_t begin, size_t end, int) {
+    for (size_t k = begin; k < end; ++k) {
+      size_t i = order[k].second;
+      const Vec3& p = grid_pos[i];
+      std::array<double,4> r = grid.tricubic_interpolation_der(p.x, p.y, p.z);
+      Vec3 grad = tr.mat.left_multiply(Vec3(r[1], r[2], r[3]));
+      results[i] = {{r[0], grad.x, grad.y, grad.z}};
+    }
+  });
+}
+
+template<typename T>
+std::vector<std::array<double,4>>
+tricubic_interpolation_der_batch(const Grid<T>& grid,
+                                 const std::vector<Position>& positions,
+                                 int n_threads=1) {
+  std::vector<std::array<double,4>> results(positions.size());
+  tricubic_interpolation_der_batch(grid, positions.data(), positions.size(),
+                                   results.data(), n_threads);
+  return results;
+}
+
+/// The same as above, at positions of all atoms in the model,
+/// in the order of atoms in the model.
+template<typename T>
+std::vector<std::array<double,4>>
+tricubic_interpolation_der_of_atoms(const Grid<T>& grid, const Model& model,
+                                    int n_threads=1) {
+  std::vector<Position> positions;
+  for (const Chain& chain : model.chains)
+    for (const Residue& res : chain.residues)
+      for (const Atom& atom : res.atoms)
+        positions.push_back(atom.pos);
+  return tricubic_interpolation_der_batch(grid, positions, n_threads);
+}
+
+} // namespace gemmi
+#endif
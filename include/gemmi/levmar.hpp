@@ -12,6 +12,7 @@
 #include <algorithm>  // for min
 #include <vector>
 #include "fail.hpp"   // for fail
+#include "parallel.hpp"  // for parallel_for_chunks
 
 //#define GEMMI_DEBUG_LEVMAR
 
@@ -93,6 +94,11 @@ struct LevMar {
   double lambda_down_factor = 0.1;
   double lambda_start = 0.001;
 
+  // Number of threads used for computing derivatives (0 = all CPUs).
+  // Partial sums are reduced in fixed order, so the results don't depend on
+  // thread timing (but may differ slightly for different n_threads).
+  int n_threads = 1;
+
   // values set in fit() that can be inspected later
   double initial_wssr;
   int eval_count;  // number of function evaluations
@@ -184,32 +190,51 @@ private:
 #ifdef GEMMI_DEBUG_LEVMAR
     check_derivatives(const_cast<Target&>(target));
 #endif
-    std::fill(alpha.begin(), alpha.end(), 0.0);
-    std::fill(beta.begin(), beta.end(), 0.0);
     // Iterating over points is tiled to limit memory usage. It's also a little
     // faster than a single loop over all points for large number of points.
+    // Each thread has its own partial sums of alpha and beta.
     const size_t kMaxTileSize = 1024;
-    std::vector<double> dy_da;
     size_t n = target.points.size();
-    for (size_t tstart = 0; tstart < n; tstart += kMaxTileSize) {
-      size_t tsize = std::min(n - tstart, kMaxTileSize);
-      std::vector<double> yy(tsize, 0.);
-      dy_da.resize(tsize * na);
-      std::fill(dy_da.begin(), dy_da.end(), 0.);
-      target.compute_values_and_derivatives(tstart, tsize, yy, dy_da);
-      for (size_t i = 0; i != tsize; ++i) {
-        double weight = target.points[tstart + i].get_weight();
-        double dy_sig = weight * (target.points[tstart + i].get_y() - yy[i]);
-        double* t = &dy_da[i * na];
-        for (int j = 0; j != na; ++j) {
-          if (t[j] != 0) {
-            t[j] *= weight;
-            for (int k = j; k != -1; --k)
-              alpha[na * j + k] += t[j] * t[k];
-            beta[j] += dy_sig * t[j];
+    size_t n_tiles = (n + kMaxTileSize - 1) / kMaxTileSize;
+    int nt = std::max(1, std::min(get_thread_count(n_threads), (int) n_tiles));
+    std::vector<double> partial_alpha(nt * alpha.size(), 0.);
+    std::vector<double> partial_beta(nt * beta.size(), 0.);
+    parallel_for_chunks(n_tiles, nt, [&](size_t tile_begin, size_t tile_end, int t_idx) {
+      double* alpha_ = &partial_alpha[t_idx * alpha.size()];
+      double* beta_ = &partial_beta[t_idx * beta.size()];
+      std::vector<double> yy;
+      std::vector<double> dy_da;
+      for (size_t tile = tile_begin; tile < tile_end; ++tile) {
+        size_t tstart = tile * kMaxTileSize;
+        size_t tsize = std::min(n - tstart, kMaxTileSize);
+        // The same buffers are reused for all tiles of the thread. They are
+        // zeroed each time, because the target may leave some derivatives
+        // unset.
+        yy.assign(tsize, 0.);
+        dy_da.assign(tsize * na, 0.);
+        target.compute_values_and_derivatives(tstart, tsize, yy, dy_da);
+        for (size_t i = 0; i != tsize; ++i) {
+          double weight = target.points[tstart + i].get_weight();
+          double dy_sig = weight * (target.points[tstart + i].get_y() - yy[i]);
+          double* t = &dy_da[i * na];
+          for (int j = 0; j != na; ++j) {
+            if (t[j] != 0) {
+              t[j] *= weight;
+              for (int k = j; k != -1; --k)
+                alpha_[na * j + k] += t[j] * t[k];
+              beta_[j] += dy_sig * t[j];
+            }
           }
         }
       }
+    });
+    std::fill(alpha.begin(), alpha.end(), 0.0);
+    std::fill(beta.begin(), beta.end(), 0.0);
+    for (int t_idx = 0; t_idx < nt; ++t_idx) {
+      for (size_t i = 0; i < alpha.size(); ++i)
+        alpha[i] += partial_alpha[t_idx * alpha.size() + i];
+      for (size_t i = 0; i < beta.size(); ++i)
+        beta[i] += partial_beta[t_idx * beta.size() + i];
     }
 
     // Only half of the alpha matrix was filled above. Fill the rest.
@@ -5,6 +5,8 @@
 #ifndef GEMMI_LINKHUNT_HPP_
 #define GEMMI_LINKHUNT_HPP_
 
+#include <algorithm>  // for max, min
+#include <array>
 #include <map>
 #include <unordered_map>
 #include "elem.hpp"
@@ -12,6 +14,8 @@
 #include "monlib.hpp"
 #include "neighbor.hpp"
 #include "contact.hpp"
+#include "intern.hpp"    // for intern_name, name_pair_key
+#include "parallel.hpp"  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -30,6 +34,25 @@ struct LinkHunt {
   double global_max_dist = 2.34; // ZN-CYS
   const MonLib* monlib_ptr = nullptr;
   std::multimap<std::string, const ChemLink*> links;
+  // the same links keyed by name_pair_key() of atom names interned in NamePool
+  std::unordered_multimap<std::uint64_t, const ChemLink*> link_index;
+  // max. bond length in links with an atom of the given name (name id);
+  // used to limit the search radius, because elements of atoms in the model
+  // may differ from the monomer library (or the monomer may be missing).
+  std::unordered_map<int, double> max_link_dist;
+
+  void add_link(const std::string& name1, const std::string& name2,
+                const ChemLink& link) {
+    links.emplace(Restraints::lexicographic_str(name1, name2), &link);
+    int id1 = intern_name(name1);
+    int id2 = intern_name(name2);
+    link_index.emplace(name_pair_key(id1, id2), &link);
+    double value = link.rt.bonds[0].value;
+    for (int id : {id1, id2}) {
+      double& d = max_link_dist[id];
+      d = std::max(d, value);
+    }
+  }
 
   void index_chem_links(const MonLib& monlib, bool use_alias=true) {
     std::map<ChemComp::Group, std::map<std::string, std::vector<std::string>>> aliases;
@@ -56,7 +79,7 @@ struct LinkHunt {
       const Restraints::Bond& bond = link.rt.bonds[0];
       if (bond.value > global_max_dist)
         global_max_dist = bond.value;
-      links.emplace(bond.lexicographic_str(), &link);
+      add_link(bond.id1.atom, bond.id2.atom, link);
 
       if (!use_alias || (!link.side1.comp.empty() && !link.side2.comp.empty()))
         continue;
@@ -80,99 +103,176 @@ struct LinkHunt {
      if (names1 && names2)
        for (const std::string& n1 : *names1)
          for (const std::string& n2 : *names2)
-           links.emplace(Restraints::lexicographic_str(n1, n2), &link);
+           add_link(n1, n2, link);
      else if (names1 || names2) {
        const std::string& n1 = names1 ? bond.id2.atom : bond.id1.atom;
        for (const std::string& n2 : (names1 ? *names1 : *names2))
-         links.emplace(Restraints::lexicographic_str(n1, n2), &link);
+         add_link(n1, n2, link);
      }
     }
     monlib_ptr = &monlib;
   }
 
+  // Searches for contacts that match bonds from chem_links (atom names
+  // and bond length * bond_margin) or that are shorter than the sum of
+  // covalent radii * radius_margin.
+  // With n_threads > 1 the atoms are processed in parallel;
+  // the results are in the same order as from a single thread.
   std::vector<Match> find_possible_links(Structure& st,
                                          double bond_margin,
                                          double radius_margin,
-                                         ContactSearch::Ignore ignore) {
-    std::vector<Match> results;
+                                         ContactSearch::Ignore ignore,
+                                         int n_threads=1) {
     Model& model = st.first_model();
     double search_radius = std::max(global_max_dist * bond_margin,
                                     /*max r1+r2 ~=*/3.0 * radius_margin);
     NeighborSearch ns(model, st.cell, std::max(5.0, search_radius));
     ns.populate();
 
-    ContactSearch contacts((float) search_radius);
-    contacts.ignore = ignore;
-    contacts.for_each_contact(ns, [&](const CRA& cra1, const CRA& cra2,
-                                      int image_idx, double dist_sq) {
-        Match match;
-
-        // search for a match in chem_links
-        if (bond_margin > 0) {
-          auto range = links.equal_range(Restraints::lexicographic_str(
-                                            cra1.atom->name, cra2.atom->name));
-          // similar to MonLib::match_link()
-          for (auto iter = range.first; iter != range.second; ++iter) {
-            const ChemLink& link = *iter->second;
-            const Restraints::Bond& bond = link.rt.bonds[0];
-            if (dist_sq > sq(bond.value * bond_margin))
-              continue;
-            const ChemComp::Aliasing* aliasing1 = nullptr;
-            const ChemComp::Aliasing* aliasing2 = nullptr;
-            bool order1;
-            if (monlib_ptr->link_side_matches_residue(link.side1, cra1.residue->name, &aliasing1) &&
-                monlib_ptr->link_side_matches_residue(link.side2, cra2.residue->name, &aliasing2) &&
-                atom_match_with_alias(bond.id1.atom, cra1.atom->name, aliasing1))
-              order1 = true;
-            else if (monlib_ptr->link_side_matches_residue(link.side2, cra1.residue->name, &aliasing1) &&
-                     monlib_ptr->link_side_matches_residue(link.side1, cra2.residue->name, &aliasing2) &&
-                     atom_match_with_alias(bond.id2.atom, cra1.atom->name, aliasing1))
-              order1 = false;
-            else
-              continue;
-            int link_score = link.calculate_score(
-                    order1 ? *cra1.residue : *cra2.residue,
-                    order1 ? cra2.residue : cra1.residue,
-                    order1 ? cra1.atom->altloc : cra2.atom->altloc,
-                    order1 ? cra2.atom->altloc : cra1.atom->altloc,
-                    order1 ? aliasing1 : aliasing2,
-                    order1 ? aliasing2 : aliasing1);
-            match.chem_link_count++;
-            if (link_score > match.score) {
-              match.chem_link = &link;
-              match.score = link_score;
-              if (order1) {
-                match.cra1 = cra1;
-                match.cra2 = cra2;
-              } else {
-                match.cra1 = cra2;
-                match.cra2 = cra1;
-              }
+    // max. distance from covalent radii for each pair of elements
+    // and search radius for each element
+    const int n_el = (int) El::END;
+    std::vector<double> max_dist(n_el * n_el);
+    std::vector<double> el_radius(n_el, 0.);
+    for (int i = 0; i != n_el; ++i)
+      for (int j = 0; j != n_el; ++j) {
+        double d = (covalent_radius((El)i) + covalent_radius((El)j)) * radius_margin;
+        max_dist[i * n_el + j] = d;
+        el_radius[i] = std::max(el_radius[i], std::min(d, search_radius));
+      }
+
+    // name ids of all atoms in the model (-1 if the name is not in links)
+    // and search radii of atoms
+    std::vector<std::array<int, 3>> atom_indices;
+    std::vector<int> name_ids;
+    std::vector<double> atom_radius;
+    std::vector<size_t> chain_offsets;  // index of the first residue
+    std::vector<size_t> residue_offsets;  // index of the first atom
+    std::vector<PolymerType> polymer_types;
+    for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
+      const Chain& chain = model.chains[n_ch];
+      chain_offsets.push_back(residue_offsets.size());
+      polymer_types.push_back(ignore == ContactSearch::Ignore::AdjacentResidues
+                              ? check_polymer_type(chain.get_polymer())
+                              : PolymerType::Unknown);
+      for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
+        residue_offsets.push_back(name_ids.size());
+        for (int n_atom = 0; n_atom != (int) chain.residues[n_res].atoms.size(); ++n_atom) {
+          const Atom& atom = chain.residues[n_res].atoms[n_atom];
+          atom_indices.push_back({{n_ch, n_res, n_atom}});
+          double radius = el_radius[atom.element.ordinal()];
+          int id = -1;
+          if (bond_margin > 0) {
+            auto it = max_link_dist.find(global_name_pool().find(atom.name));
+            if (it != max_link_dist.end()) {
+              id = it->first;
+              radius = std::max(radius, std::min(it->second * bond_margin,
+                                                 search_radius));
             }
           }
+          name_ids.push_back(id);
+          atom_radius.push_back(radius);
         }
+      }
+    }
+    auto name_id = [&](const CRA& cra) {
+      size_t n_ch = cra.chain - model.chains.data();
+      size_t n_res = cra.residue - cra.chain->residues.data();
+      size_t n_atom = cra.atom - cra.residue->atoms.data();
+      return name_ids[residue_offsets[chain_offsets[n_ch] + n_res] + n_atom];
+    };
 
-        // potential other links according to covalent radii
-        if (!match.chem_link) {
-          float r1 = cra1.atom->element.covalent_r();
-          float r2 = cra2.atom->element.covalent_r();
-          if (dist_sq > sq((r1 + r2) * radius_margin))
+    n_threads = std::max(std::min(get_thread_count(n_threads), (int) atom_indices.size()), 1);
+    std::vector<std::vector<Match>> results(n_threads);
+    parallel_for_chunks(atom_indices.size(), n_threads, [&](size_t begin, size_t end, int t) {
+      ContactSearch contacts((float) search_radius);
+      contacts.ignore = ignore;
+      for (size_t idx = begin; idx != end; ++idx) {
+        const std::array<int, 3>& ai = atom_indices[idx];
+        // atom-specific search radius
+        contacts.search_radius = atom_radius[idx];
+        int id1 = name_ids[idx];
+        contacts.for_each_contact_of_atom(ns, ai[0], ai[1], ai[2], polymer_types[ai[0]],
+                                          [&](const CRA& cra1, const CRA& cra2,
+                                              int image_idx, double dist_sq) {
+          int el1 = cra1.atom->element.ordinal();
+          int el2 = cra2.atom->element.ordinal();
+          // links are matched by atom names, regardless of elements
+          int id2 = id1 >= 0 ? name_id(cra2) : -1;
+          if (id2 < 0 && dist_sq > sq(max_dist[el1 * n_el + el2]))
             return;
-          match.cra1 = cra1;
-          match.cra2 = cra2;
-        }
+          Match match;
+
+          // search for a match in chem_links
+          if (id2 >= 0) {
+            auto range = link_index.equal_range(name_pair_key(id1, id2));
+            // similar to MonLib::match_link()
+            for (auto iter = range.first; iter != range.second; ++iter) {
+              const ChemLink& link = *iter->second;
+              const Restraints::Bond& bond = link.rt.bonds[0];
+              if (dist_sq > sq(bond.value * bond_margin))
+                continue;
+              const ChemComp::Aliasing* aliasing1 = nullptr;
+              const ChemComp::Aliasing* aliasing2 = nullptr;
+              bool order1;
+              if (monlib_ptr->link_side_matches_residue(link.side1, cra1.residue->name, &aliasing1) &&
+                  monlib_ptr->link_side_matches_residue(link.side2, cra2.residue->name, &aliasing2) &&
+                  atom_match_with_alias(bond.id1.atom, cra1.atom->name, aliasing1))
+                order1 = true;
+              else if (monlib_ptr->link_side_matches_residue(link.side2, cra1.residue->name, &aliasing1) &&
+                       monlib_ptr->link_side_matches_residue(link.side1, cra2.residue->name, &aliasing2) &&
+                       atom_match_with_alias(bond.id2.atom, cra1.atom->name, aliasing1))
+                order1 = false;
+              else
+                continue;
+              int link_score = link.calculate_score(
+                      order1 ? *cra1.residue : *cra2.residue,
+                      order1 ? cra2.residue : cra1.residue,
+                      order1 ? cra1.atom->altloc : cra2.atom->altloc,
+                      order1 ? cra2.atom->altloc : cra1.atom->altloc,
+                      order1 ? aliasing1 : aliasing2,
+                      order1 ? aliasing2 : aliasing1);
+              match.chem_link_count++;
+              if (link_score > match.score) {
+                match.chem_link = &link;
+                match.score = link_score;
+                if (order1) {
+                  match.cra1 = cra1;
+                  match.cra2 = cra2;
+                } else {
+                  match.cra1 = cra2;
+                  match.cra2 = cra1;
+                }
+              }
+            }
+          }
+
+          // potential other links according to covalent radii
+          if (!match.chem_link) {
+            float r1 = cra1.atom->element.covalent_r();
+            float r2 = cra2.atom->element.covalent_r();
+            if (dist_sq > sq((r1 + r2) * radius_margin))
+              return;
+            match.cra1 = cra1;
+            match.cra2 = cra2;
+          }
 
-        // finalize
-        match.same_image = !image_idx;
-        match.bond_length = std::sqrt(dist_sq);
-        results.push_back(match);
+          // finalize
+          match.same_image = !image_idx;
+          match.bond_length = std::sqrt(dist_sq);
+          results[t].push_back(match);
+        });
+      }
     });
+    std::vector<Match> matches;
+    for (std::vector<Match>& part : results)
+      vector_move_extend(matches, std::move(part));
 
     // add references to st.connections
-    for (Match& match : results)
+    for (Match& match : matches)
       match.conn = st.find_connection_by_cra(match.cra1, match.cra2);
 
-    return results;
+    return matches;
   }
 };
 
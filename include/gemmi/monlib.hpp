@@ -276,7 +276,14 @@ struct GEMMI_DLL MonLib {
 
     read_monomer_cif(monomer_dir + "list/mon_lib_list.cif", read_cif);
     ener_lib.read((*read_cif)(monomer_dir + "ener_lib.cif"));
+    return read_monomers(resnames, read_cif, error);
+  }
 
+  /// Read required monomers from monomer_dir (without the list and ener_lib).
+  /// Returns true if all requested monomers were added.
+  bool read_monomers(const std::vector<std::string>& resnames,
+                     read_cif_func read_cif,
+                     std::string* error=nullptr) {
     bool ok = true;
     for (const std::string& name : resnames) {
       if (monomers.find(name) != monomers.end())
@@ -320,5 +327,31 @@ inline MonLib read_monomer_lib(const std::string& monomer_dir,
   return monlib;
 }
 
+/// Writes a binary snapshot of MonLib (monomers, links, modifications,
+/// groups and EnerLib) together with sizes and modification times
+/// of the library files that were read. Used as a cache, it loads in
+/// a fraction of the time needed to parse the CIF files.
+GEMMI_DLL void write_monlib_snapshot(const MonLib& monlib, const std::string& path);
+
+/// Reads snapshot written by write_monlib_snapshot().
+/// Returns false (and leaves monlib unchanged) if the file doesn't exist,
+/// was written by a different version of the format, or if any of
+/// the source files changed. Throws if the snapshot is truncated or corrupted.
+GEMMI_DLL bool read_monlib_snapshot(MonLib& monlib, const std::string& path);
+
+/// Like MonLib::read_monomer_lib(), but loads the library from a snapshot
+/// if it's up to date, reads only monomers missing from the snapshot,
+/// and (re-)writes the snapshot if anything had to be read from CIF files.
+/// Definitions already present in monlib (e.g. from user's files)
+/// have priority and are not stored in the snapshot.
+/// A corrupted snapshot is rebuilt. If the snapshot cannot be written,
+/// a warning is appended to error (or, if error is null, printed to stderr).
+GEMMI_DLL bool read_monomer_lib_with_snapshot(MonLib& monlib,
+                                              const std::string& monomer_dir,
+                                              const std::vector<std::string>& resnames,
+                                              read_cif_func read_cif,
+                                              const std::string& snapshot_path,
+                                              std::string* error=nullptr);
+
 } // namespace gemmi
 #endif
@@ -12,6 +12,7 @@
 #include <algorithm>     // for sort, any_of
 #include <array>
 #include <initializer_list>
+#include <memory>        // for unique_ptr
 #include <ostream>
 #include <string>
 #include <vector>
@@ -928,50 +929,7 @@ struct GEMMI_DLL Mtz {
         fail("expected trailing column ", trailing_cols[i], ", found ", src_col.label);
   }
   void do_replace_column(size_t dest_idx, const Column& src_col,
-                         const std::vector<std::string>& trailing_cols) {
-    const Mtz* src_mtz = src_col.parent;
-    for (size_t i = 0; i <= trailing_cols.size(); ++i) {
-      Column& dst = columns[dest_idx + i];
-      const Column& src = src_mtz->columns[src_col.idx + i];
-      dst.type = src.type;
-      dst.label = src.label;
-      dst.min_value = src.min_value;
-      dst.max_value = src.max_value;
-      dst.source = src.source;
-      dst.dataset_id = src.dataset_id;
-    }
-    if (src_mtz == this) {
-      // internal copying
-      for (size_t n = 0; n < data.size(); n += columns.size())
-        for (size_t i = 0; i <= trailing_cols.size(); ++i)
-          data[n + dest_idx + i] = data[n + src_col.idx + i];
-    } else {
-      // external copying - need to match indices
-      std::vector<int> dst_indices = sorted_row_indices();
-      std::vector<int> src_indices = src_mtz->sorted_row_indices();
-      // cf. for_matching_reflections()
-      size_t dst_stride = columns.size();
-      size_t src_stride = src_mtz->columns.size();
-      auto dst = dst_indices.begin();
-      auto src = src_indices.begin();
-      while (dst != dst_indices.end() && src != src_indices.end()) {
-        Miller dst_hkl = get_hkl(*dst * dst_stride);
-        Miller src_hkl = src_mtz->get_hkl(*src * src_stride);
-        if (dst_hkl == src_hkl) {
-          // copy values
-          for (size_t i = 0; i <= trailing_cols.size(); ++i)
-            data[*dst * dst_stride + dest_idx + i] =
-              src_mtz->data[*src * src_stride + src_col.idx + i];
-          ++dst;
-          ++src;
-        } else if (dst_hkl < src_hkl) {
-          ++dst;
-        } else {
-          ++src;
-        }
-      }
-    }
-  }
+                         const std::vector<std::string>& trailing_cols);
 
   // extra_col are columns right after src_col that are also copied.
   Column& replace_column(size_t dest_idx, const Column& src_col,
@@ -1068,6 +1026,7 @@ struct GEMMI_DLL Mtz {
   // Function for writing MTZ file
   void write_to_cstream(std::FILE* stream) const;
   void write_to_string(std::string& str) const;
+  // If path ends with .gz, the file is gzipped (see MtzWriter).
   void write_to_file(const std::string& path) const;
 
 private:
@@ -1075,6 +1034,55 @@ private:
 };
 
 
+/// Writes MTZ file progressively, without keeping all reflections in memory.
+/// The headers are taken from mtz (its data is not used), reflections are
+/// appended with write_rows() and finish() writes the headers (which in MTZ
+/// follow the data) and fills in the header location at the beginning.
+/// If path ends with .gz, the output is gzipped; the data is compressed
+/// in blocks, on n_threads threads, into a single gzip member.
+/// In builds without deflate (GEMMI_NO_DEFLATE) the output is not
+/// compressed and a warning is written to mtz.warnings.
+/// The mtz object must not be destroyed before finish() is called.
+class GEMMI_DLL MtzWriter {
+public:
+  MtzWriter(const Mtz& mtz, const std::string& path, int n_threads=1);
+  ~MtzWriter();
+  MtzWriter(const MtzWriter&) = delete;
+  MtzWriter& operator=(const MtzWriter&) = delete;
+
+  /// rows: nrows x mtz.columns.size() values, row-major
+  void write_rows(const float* rows, size_t nrows);
+  void write_rows(const std::vector<float>& rows) {
+    write_rows(rows.data(), rows.size() / mtz_.columns.size());
+  }
+  void finish();
+
+  const Mtz& mtz() const { return mtz_; }
+  int nreflections() const { return nreflections_; }
+  bool is_gzipped() const { return gz_ != nullptr; }
+  /// false if gemmi was built without deflate (GEMMI_NO_DEFLATE)
+  static bool can_write_gzip();
+  // zlib compression level for .gz output, can be changed before writing
+  int compression_level = 6;
+
+private:
+  struct GzState;
+  const Mtz& mtz_;
+  std::string path_;
+  fileptr_t file_;
+  int n_threads_;
+  int nreflections_ = 0;
+  std::vector<UnitCell> cells_;  // cells used for min/max 1/d^2
+  std::array<double,2> reso_;
+  std::vector<std::array<float,2>> col_minmax_;
+  std::unique_ptr<GzState> gz_;
+  bool finished_ = false;
+
+  void update_stats(const float* rows, size_t nrows);
+  void write_raw(const void* ptr, size_t size);
+};
+
+
 inline Mtz read_mtz_file(const std::string& path) {
   Mtz mtz;
   mtz.read_file(path);
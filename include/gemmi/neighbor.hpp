@@ -9,7 +9,9 @@
 #include <vector>
 #include <cmath>  // for INFINITY, sqrt
 
+#include "assembly.hpp"  // for AssemblyView
 #include "fail.hpp"      // for fail
+#include "flat.hpp"      // for FlatStructure
 #include "grid.hpp"
 #include "model.hpp"
 #include "small.hpp"
@@ -31,6 +33,8 @@ struct NeighborSearch {
     : pos(p), altloc(alt), element(el),
       image_idx(im), chain_idx(ch), residue_idx(res), atom_idx(atom) {}
 
+    // Not for marks from AssemblyView, where chain_idx is the index
+    // of ChainCopy; use AssemblyView::original_atom() instead.
     CRA to_cra(Model& mdl) const {
       Chain& c = mdl.chains.at(chain_idx);
       Residue& r = c.residues.at(residue_idx);
@@ -55,6 +59,9 @@ struct NeighborSearch {
   double radius_specified = 0.;
   Model* model = nullptr;
   SmallStructure* small_structure = nullptr;
+  const FlatStructure* flat_structure = nullptr;
+  size_t flat_model = 0;
+  const AssemblyView* assembly_view = nullptr;
   bool use_pbc = true;
   bool include_h = true;
 
@@ -66,6 +73,25 @@ struct NeighborSearch {
     set_bounding_cell(cell);
     set_grid_size();
   }
+  // Marks store indices of chain, residue and atom as in the corresponding
+  // Model (flat_structure->atom_index() converts them to the flat index).
+  NeighborSearch(const FlatStructure& flat, const UnitCell& cell, double radius,
+                 size_t model_index=0) {
+    flat_structure = &flat;
+    flat_model = flat.check_model(model_index);
+    radius_specified = radius;
+    set_bounding_cell(cell);
+    set_grid_size();
+  }
+  // Marks store index of ChainCopy in assembly_view->copies as chain_idx,
+  // and indices of residue and atom in the original chain.
+  // Positions of atoms are transformed.
+  NeighborSearch(const AssemblyView& view, const UnitCell& cell, double radius) {
+    assembly_view = &view;
+    radius_specified = radius;
+    set_bounding_cell(cell);
+    set_grid_size();
+  }
   NeighborSearch(SmallStructure& small, double radius) {
     small_structure = &small;
     radius_specified = radius;
@@ -76,7 +102,11 @@ struct NeighborSearch {
   NeighborSearch& populate(bool include_h_=true);
   void add_chain(const Chain& chain, bool include_h_=true);
   void add_chain_n(const Chain& chain, int n_ch);
-  void add_atom(const Atom& atom, int n_ch, int n_res, int n_atom);
+  void add_atom(const Atom& atom, int n_ch, int n_res, int n_atom) {
+    add_position(atom.pos, atom.altloc, atom.element.elem, n_ch, n_res, n_atom);
+  }
+  void add_position(const Position& pos, char altloc, El el,
+                    int n_ch, int n_res, int n_atom);
   void add_site(const SmallStructure::Site& site, int n);
 
   // assumes data in [0, 1), but uses index_n to account for numerical errors
@@ -207,18 +237,30 @@ private:
     } else {
       // cf. calculate_box()
       Box<Position> box;
-      for (CRA cra : model->all())
-        box.extend(cra.atom->pos);
       // The box needs to include all NCS images (strict NCS from MTRIXn).
       // To avoid additional function parameter that would pass Structure::ncs,
       // here we obtain NCS transformations from UnitCell::images.
       std::vector<FTransform> ncs = cell.get_ncs_transforms();
-      if (!ncs.empty()) {
+      auto extend = [&](const Position& pos) {
+        box.extend(pos);
+        // images store fractional transforms, but for non-crystal
+        // it should be the same as Cartesian transform.
+        for (const Transform& tr : ncs)
+          box.extend(Position(tr.apply(pos)));
+      };
+      if (model) {
         for (CRA cra : model->all())
-          // images store fractional transforms, but for non-crystal
-          // it should be the same as Cartesian transform.
-          for (const Transform& tr : ncs)
-            box.extend(Position(tr.apply(cra.atom->pos)));
+          extend(cra.atom->pos);
+      } else if (assembly_view) {
+        assembly_view->for_each_atom([&](const AssemblyView::ChainCopy&, const Residue&,
+                                         const Atom&, const Position& pos) {
+          extend(pos);
+        });
+      } else {
+        const FlatStructure& flat = *flat_structure;
+        for (size_t n = flat.model_atom_begin(flat_model);
+             n < flat.model_atom_end(flat_model); ++n)
+          extend(flat.position(n));
       }
       box.add_margin(0.01);
       Position size = box.get_size();
@@ -239,6 +281,33 @@ inline NeighborSearch& NeighborSearch::populate(bool include_h_) {
   if (model) {
     for (int n_ch = 0; n_ch != (int) model->chains.size(); ++n_ch)
       add_chain_n(model->chains[n_ch], n_ch);
+  } else if (flat_structure) {
+    const FlatStructure& flat = *flat_structure;
+    size_t m = flat_model;
+    for (size_t ch = flat.model_start[m]; ch < flat.model_start[m+1]; ++ch)
+      for (size_t r = flat.chain_start[ch]; r < flat.chain_start[ch+1]; ++r)
+        for (size_t n = flat.residue_start[r]; n < flat.residue_start[r+1]; ++n)
+          if (include_h || !flat.is_hydrogen(n))
+            add_position(flat.position(n), flat.altloc[n], flat.element[n],
+                         int(ch - flat.model_start[m]),
+                         int(r - flat.chain_start[ch]),
+                         int(n - flat.residue_start[r]));
+  } else if (assembly_view) {
+    const AssemblyView& view = *assembly_view;
+    for (int n_copy = 0; n_copy != (int) view.copies.size(); ++n_copy) {
+      const AssemblyView::ChainCopy& copy = view.copies[n_copy];
+      const Transform& tr = view.transform(copy);
+      for (int n_res = 0; n_res != (int) copy.chain->residues.size(); ++n_res) {
+        const Residue& res = copy.chain->residues[n_res];
+        if (copy.includes(res))
+          for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
+            const Atom& atom = res.atoms[n_atom];
+            if (include_h || !atom.is_hydrogen())
+              add_position(Position(tr.apply(atom.pos)), atom.altloc, atom.element.elem,
+                           n_copy, n_res, n_atom);
+          }
+      }
+    }
   } else if (small_structure) {
     for (int n = 0; n != (int) small_structure->sites.size(); ++n) {
       SmallStructure::Site& site = small_structure->sites[n];
@@ -275,21 +344,20 @@ inline void NeighborSearch::add_chain_n(const Chain& chain, int n_ch) {
   }
 }
 
-inline void NeighborSearch::add_atom(const Atom& atom,
-                                     int n_ch, int n_res, int n_atom) {
+inline void NeighborSearch::add_position(const Position& atom_pos, char altloc, El el,
+                                         int n_ch, int n_res, int n_atom) {
   const UnitCell& gcell = grid.unit_cell;
-  Fractional frac0 = gcell.fractionalize(atom.pos);
+  Fractional frac0 = gcell.fractionalize(atom_pos);
   {
     Fractional frac = frac0.wrap_to_unit();
-    // for non-crystals, frac==frac0 => pos = atom.pos
-    Position pos = use_pbc ? gcell.orthogonalize(frac) : atom.pos;
-    get_subcell(frac).emplace_back(pos, atom.altloc, atom.element.elem,
-                                   0, n_ch, n_res, n_atom);
+    // for non-crystals, frac==frac0 => pos = atom_pos
+    Position pos = use_pbc ? gcell.orthogonalize(frac) : atom_pos;
+    get_subcell(frac).emplace_back(pos, altloc, el, 0, n_ch, n_res, n_atom);
   }
   for (int n_im = 0; n_im != (int) gcell.images.size(); ++n_im) {
     Fractional frac = gcell.images[n_im].apply(frac0).wrap_to_unit();
     Position pos = gcell.orthogonalize(frac);
-    get_subcell(frac).emplace_back(pos, atom.altloc, atom.element.elem,
+    get_subcell(frac).emplace_back(pos, altloc, el,
                                    short(n_im + 1), n_ch, n_res, n_atom);
   }
 }
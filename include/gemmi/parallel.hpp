@@ -0,0 +1,73 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Minimal helpers for running loops on multiple threads (std::thread).
+
+#ifndef GEMMI_PARALLEL_HPP_
+#define GEMMI_PARALLEL_HPP_
+
+#include <algorithm>  // for min
+#include <cstddef>    // for size_t
+#include <exception>  // for exception_ptr, rethrow_exception
+#include <thread>
+#include <vector>
+
+namespace gemmi {
+
+/// Returns n_threads if it's positive, otherwise the number of hardware
+/// threads (at least 1).
+inline int get_thread_count(int n_threads) {
+  if (n_threads > 0)
+    return n_threads;
+  unsigned hw = std::thread::hardware_concurrency();
+  return hw == 0 ? 1 : (int) hw;
+}
+
+/// Splits [0, n) into (up to) n_threads contiguous chunks and calls
+/// func(begin, end, thread_index) for each chunk, in parallel.
+/// Chunk boundaries depend only on n and n_threads, so per-thread partial
+/// results, combined in thread_index order, give deterministic output.
+/// If func throws, the first exception (in chunk order) is re-thrown.
+template<typename Func>
+void parallel_for_chunks(size_t n, int n_threads, Func func) {
+  if (n_threads < 1)
+    n_threads = 1;
+  if ((size_t) n_threads > n)
+    n_threads = n == 0 ? 1 : (int) n;
+  if (n_threads == 1) {
+    func(size_t(0), n, 0);
+    return;
+  }
+  std::vector<std::thread> threads;
+  std::vector<std::exception_ptr> errors(n_threads);
+  threads.reserve(n_threads - 1);
+  size_t chunk = n / n_threads;
+  size_t rem = n % n_threads;
+  auto chunk_begin = [&](int i) { return i * chunk + std::min((size_t)i, rem); };
+  auto run = [&](int i) {
+    try {
+      func(chunk_begin(i), chunk_begin(i + 1), i);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  };
+  for (int i = 1; i < n_threads; ++i)
+    threads.emplace_back(run, i);
+  run(0);
+  for (std::thread& t : threads)
+    t.join();
+  for (std::exception_ptr& e : errors)
+    if (e)
+      std::rethrow_exception(e);
+}
+
+/// Calls func(i) for i in [0, n) on n_threads threads.
+template<typename Func>
+void parallel_for(size_t n, int n_threads, Func func) {
+  parallel_for_chunks(n, n_threads, [&func](size_t begin, size_t end, int) {
+    for (size_t i = begin; i < end; ++i)
+      func(i);
+  });
+}
+
+} // namespace gemmi
+#endif
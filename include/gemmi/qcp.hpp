@@ -78,6 +78,7 @@
 
 #include <cmath>         // for fabs, sqrt
 #include <cstdio>        // for fprintf (it's temporary)
+#include <vector>
 #include "math.hpp"      // for Mat33
 #include "unitcell.hpp"  // for Position
 
@@ -347,5 +348,103 @@ inline double calculate_rmsd_of_superposed_positions(const Position* pos1,
   return result;
 }
 
+// Sums of (weighted) coordinates and their products for pairs of positions.
+// The inner product used in QCP (qcp_inner_product()) can be calculated
+// from these sums, so the sums can be updated incrementally when pairs
+// are added to or removed from a set, and sums for a range of pairs
+// can be obtained as a difference of prefix sums.
+// Positions should be relative to a nearby origin, to limit rounding errors.
+struct QcpSums {
+  double w = 0.;
+  Vec3 s1, s2;         // sums of w*pos1 and w*pos2
+  double ss = 0.;      // sum of w*(|pos1|^2 + |pos2|^2)
+  Mat33 m = Mat33(0);  // sum of w * pos1 pos2^T
+
+  void add(const Vec3& p1, const Vec3& p2, double weight) {
+    Vec3 v1 = weight * p1;
+    w += weight;
+    s1 += v1;
+    s2 += weight * p2;
+    ss += v1.dot(p1) + weight * p2.length_sq();
+    m[0][0] += v1.x * p2.x;
+    m[0][1] += v1.x * p2.y;
+    m[0][2] += v1.x * p2.z;
+    m[1][0] += v1.y * p2.x;
+    m[1][1] += v1.y * p2.y;
+    m[1][2] += v1.y * p2.z;
+    m[2][0] += v1.z * p2.x;
+    m[2][1] += v1.z * p2.y;
+    m[2][2] += v1.z * p2.z;
+  }
+
+  QcpSums operator-(const QcpSums& o) const {
+    QcpSums r;
+    r.w = w - o.w;
+    r.s1 = s1 - o.s1;
+    r.s2 = s2 - o.s2;
+    r.ss = ss - o.ss;
+    r.m = m - o.m;
+    return r;
+  }
+
+  // Returns E0 and sets mat as qcp_inner_product() would do
+  // for positions centered at s1/w and s2/w.
+  double centered_inner_product(Mat33& mat) const {
+    Vec3 c1 = s1 / w;
+    mat = Mat33(m[0][0] - c1.x * s2.x, m[0][1] - c1.x * s2.y, m[0][2] - c1.x * s2.z,
+                m[1][0] - c1.y * s2.x, m[1][1] - c1.y * s2.y, m[1][2] - c1.y * s2.z,
+                m[2][0] - c1.z * s2.x, m[2][1] - c1.z * s2.y, m[2][2] - c1.z * s2.z);
+    return 0.5 * (ss - (s1.length_sq() + s2.length_sq()) / w);
+  }
+};
+
+// Prefix sums of QcpSums for pairs (pos1[i], pos2[i]). After O(len) setup,
+// superposition of any contiguous range of pairs takes constant time,
+// which makes many overlapping superpositions (moving window) cheap.
+struct QcpPrefixSums {
+  Position origin1, origin2;
+  std::vector<QcpSums> prefix;  // prefix[i] has sums for pairs [0, i)
+
+  QcpPrefixSums(const Position* pos1, const Position* pos2, size_t len,
+                const double* weight) {
+    if (len != 0) {
+      origin1 = qcp_calculate_center(pos1, len, weight);
+      origin2 = qcp_calculate_center(pos2, len, weight);
+    }
+    prefix.resize(len + 1);
+    for (size_t i = 0; i < len; ++i) {
+      prefix[i+1] = prefix[i];
+      prefix[i+1].add(pos1[i] - origin1, pos2[i] - origin2,
+                      weight != nullptr ? weight[i] : 1.);
+    }
+  }
+
+  size_t size() const { return prefix.size() - 1; }
+
+  // the same as superpose_positions(pos1+begin, pos2+begin, end-begin, weight)
+  SupResult superpose(size_t begin, size_t end) const {
+    QcpSums sums = prefix.at(end) - prefix.at(begin);
+    SupResult result;
+    result.count = end - begin;
+    result.center1 = origin1 + Position(sums.s1 / sums.w);
+    result.center2 = origin2 + Position(sums.s2 / sums.w);
+    Mat33 A;
+    double E0 = sums.centered_inner_product(A);
+    fast_calc_rmsd_and_rotation(&result.transform.mat, A, &result.rmsd, E0, sums.w, -1);
+    result.transform.vec = Vec3(result.center1) - result.transform.mat.multiply(result.center2);
+    return result;
+  }
+
+  // the same as calculate_rmsd_of_superposed_positions() for [begin, end)
+  double rmsd(size_t begin, size_t end) const {
+    QcpSums sums = prefix.at(end) - prefix.at(begin);
+    Mat33 A;
+    double E0 = sums.centered_inner_product(A);
+    double result;
+    fast_calc_rmsd_and_rotation(nullptr, A, &result, E0, sums.w, -1);
+    return result;
+  }
+};
+
 } // namespace gemmi
 #endif
@@ -10,7 +10,8 @@
 
 namespace gemmi {
 
-GEMMI_DLL void place_hydrogens_on_all_atoms(Topo& topo);
+// With n_threads > 1 chains are processed in parallel.
+GEMMI_DLL void place_hydrogens_on_all_atoms(Topo& topo, int n_threads=1);
 
 inline void adjust_hydrogen_distances(Topo& topo, Restraints::DistanceOf of,
                                       double default_scale=1.) {
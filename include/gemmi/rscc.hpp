@@ -0,0 +1,98 @@
+// Copyright 2023 Global Phasing Ltd.
+//
+// Local real-space correlation (RSCC) between a map and model density,
+// for each residue or atom.
+
+#ifndef GEMMI_RSCC_HPP_
+#define GEMMI_RSCC_HPP_
+
+#include <algorithm>     // for sort, unique
+#include <cmath>         // for isnan
+#include <vector>
+#include "dencalc.hpp"   // for DensityCalculator
+#include "model.hpp"     // for Model, const_CRA
+#include "parallel.hpp"  // for parallel_for_chunks
+#include "stats.hpp"     // for Correlation
+
+namespace gemmi {
+
+struct LocalCorrelation {
+  const_CRA cra;     // cra.atom is null if it's for the whole residue
+  Correlation corr;  // x - map, y - model density
+  double rscc() const { return corr.coefficient(); }
+};
+
+/// Calculates model density on a grid with the same size as map, using
+/// dencalc (blur, cutoff and addends are used, d_min and rate are not).
+/// The density is left in dencalc.grid.
+/// pre: check if Table::has() all elements in the model
+template<typename Table, typename Real>
+void put_model_density_on_map_grid(DensityCalculator<Table, Real>& dencalc,
+                                   const Model& model, const Grid<Real>& map) {
+  dencalc.grid.copy_metadata_from(map);
+  dencalc.grid.data.assign(map.data.size(), Real(0));
+  dencalc.add_model_density_to_grid(model);
+  dencalc.symmetrize_density();
+}
+
+/// Returns correlations between map and model density (from
+/// put_model_density_on_map_grid()) at grid points within radius from
+/// atoms of each residue, or of each atom if per_atom is set.
+/// The results are in the order of residues (atoms) in the model.
+/// Grid points with NaN are skipped. Runs on n_threads threads.
+template<typename Table, typename Real>
+std::vector<LocalCorrelation>
+calculate_local_correlations(DensityCalculator<Table, Real>& dencalc,
+                             const Model& model, const Grid<Real>& map,
+                             double radius, bool per_atom=false,
+                             int n_threads=1) {
+  Grid<Real>& model_map = dencalc.grid;
+  if (model_map.nu != map.nu || model_map.nv != map.nv || model_map.nw != map.nw ||
+      model_map.data.size() != map.data.size())
+    fail("calculate_local_correlations(): call put_model_density_on_map_grid() first");
+  std::vector<LocalCorrelation> result;
+  for (const Chain& chain : model.chains)
+    for (const Residue& res : chain.residues) {
+      if (per_atom) {
+        for (const Atom& atom : res.atoms)
+          result.push_back({{&chain, &res, &atom}, Correlation()});
+      } else if (!res.atoms.empty()) {
+        result.push_back({{&chain, &res, nullptr}, Correlation()});
+      }
+    }
+  const Real* data0 = model_map.data.data();
+  parallel_for_chunks(result.size(), get_thread_count(n_threads),
+                      [&](size_t begin, size_t end, int) {
+    std::vector<size_t> indices;
+    auto add_points_around = [&](const Atom& atom) {
+      // use_points_around() doesn't modify the grid, it's only non-const
+      model_map.template use_points_around<true>(
+          model_map.unit_cell.fractionalize(atom.pos), radius,
+          [&](Real& ref, double) { indices.push_back(&ref - data0); },
+          /*fail_on_too_large_radius=*/false);
+    };
+    for (size_t i = begin; i < end; ++i) {
+      LocalCorrelation& lc = result[i];
+      indices.clear();
+      if (lc.cra.atom) {
+        add_points_around(*lc.cra.atom);
+      } else {
+        for (const Atom& atom : lc.cra.residue->atoms)
+          add_points_around(atom);
+      }
+      // points around neighbouring atoms overlap
+      std::sort(indices.begin(), indices.end());
+      indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+      for (size_t idx : indices) {
+        Real x = map.data[idx];
+        Real y = model_map.data[idx];
+        if (!std::isnan(x) && !std::isnan(y))
+          lc.corr.add_point(x, y);
+      }
+    }
+  });
+  return result;
+}
+
+} // namespace gemmi
+#endif
@@ -7,6 +7,7 @@
 
 #include "asudata.hpp"
 #include "levmar.hpp"
+#include "parallel.hpp"  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -42,6 +43,8 @@ struct Scaling {
   double k_sol = 0.35;
   double b_sol = 46.0;
   std::vector<Point> points;
+  // number of threads used in fit_parameters() (0 = all CPUs)
+  int n_threads = 1;
 
   // pre: calc and obs are sorted
   Scaling(const UnitCell& cell_, const SpaceGroup* sg)
@@ -245,18 +248,22 @@ struct Scaling {
 
   void fit_parameters() {
     LevMar levmar;
+    levmar.n_threads = n_threads;
     levmar.fit(*this);
   }
 
 
   // interface for fitting
   std::vector<double> compute_values() const {
-    std::vector<double> values;
-    values.reserve(points.size());
-    for (const Point& p : points) {
-      double fcalc = std::abs(p.fcmol + (Real)get_solvent_scale(p.stol2) * p.fmask);
-      values.push_back(fcalc * (Real) get_overall_scale_factor(p.hkl));
-    }
+    std::vector<double> values(points.size());
+    parallel_for_chunks(points.size(), get_thread_count(n_threads),
+                        [&](size_t begin, size_t end, int) {
+      for (size_t i = begin; i < end; ++i) {
+        const Point& p = points[i];
+        double fcalc = std::abs(p.fcmol + (Real)get_solvent_scale(p.stol2) * p.fmask);
+        values[i] = fcalc * (Real) get_overall_scale_factor(p.hkl);
+      }
+    });
     return values;
   }
 
@@ -2,18 +2,25 @@
 //
 // Direct calculation of structure factors.
 //
-// It does not use optimizations described in the literature,
-// cf. Bourhis et al (2014) https://doi.org/10.1107/S2053273314022207,
-// because direct calculations are not used in MX if performance is important.
+// Only simple optimizations are used in the batch calculation for
+// small molecules (symmetry-expanded positions, centrosymmetric and
+// Friedel reduction, multi-threading). More advanced ones are described in
+// Bourhis et al (2014) https://doi.org/10.1107/S2053273314022207.
+// Direct calculations are not used in MX if performance is important.
 // For FFT-based calculations see dencalc.hpp + fourier.hpp.
 
 #ifndef GEMMI_SFCALC_HPP_
 #define GEMMI_SFCALC_HPP_
 
 #include <complex>
-#include "addends.hpp" // for Addends
-#include "model.hpp"   // for Structure, ...
-#include "small.hpp"   // for SmallStructure
+#include <memory>       // for shared_ptr
+#include <vector>
+#include "addends.hpp"  // for Addends
+#include "formfact.hpp" // for TabulatedFormFactors
+#include "hkljoin.hpp"  // for HklIndex
+#include "model.hpp"    // for Structure, ...
+#include "parallel.hpp" // for parallel_for_chunks
+#include "small.hpp"    // for SmallStructure
 
 namespace gemmi {
 
@@ -31,16 +38,28 @@ public:
 
   void set_stol2_and_scattering_factors(const Miller& hkl) {
     stol2_ = cell_.calculate_stol_sq(hkl);
-    scattering_factors_.clear();
-    scattering_factors_.resize(addends.size(), 0.);
+    scattering_factors_.assign(addends.size(), 0.);
   }
 
+  // Form factors will be interpolated from a table for stol^2 <= max_stol2.
+  // The table is shared by copies of this calculator (and their threads).
+  void tabulate_form_factors(double max_stol2, double step=1e-3) {
+    tabulated_ = std::make_shared<const TabulatedFormFactors<Table>>(max_stol2, step);
+  }
+  void tabulate_form_factors_for_dmin(double d_min, double step=1e-3) {
+    tabulate_form_factors(0.25 / (d_min * d_min), step);
+  }
+  void clear_tabulated_form_factors() { tabulated_.reset(); }
+
   double get_scattering_factor(Element element) {
     double& sfactor = scattering_factors_[element.ordinal()];
     if (sfactor == 0.) {
       if (!Table::has(element.elem))
         fail("Missing scattering factor for ", element.name());
-      sfactor = Table::get(element.elem).calculate_sf(stol2_) + addends.get(element);
+      if (tabulated_ && tabulated_->covers(stol2_))
+        sfactor = tabulated_->get(element.elem, stol2_) + addends.get(element);
+      else
+        sfactor = Table::get(element.elem).calculate_sf(stol2_) + addends.get(element);
     }
     return sfactor;
   }
@@ -103,6 +122,38 @@ public:
     return sf;
   }
 
+  // Change of the structure factor when old_atoms are replaced by new_atoms
+  // (usually the same atoms, moved). For a few atoms, it's much cheaper than
+  // calculating the whole model again (directly or with FFT).
+  std::complex<double> calculate_sf_change(const std::vector<Atom>& old_atoms,
+                                           const std::vector<Atom>& new_atoms,
+                                           const Miller& hkl) {
+    std::complex<double> sf = 0.;
+    set_stol2_and_scattering_factors(hkl);
+    for (const Atom& site : new_atoms)
+      sf += calculate_sf_from_atom(cell_.fractionalize(site.pos), site, hkl);
+    for (const Atom& site : old_atoms)
+      sf -= calculate_sf_from_atom(cell_.fractionalize(site.pos), site, hkl);
+    return sf;
+  }
+
+  // Adds calculate_sf_change() to values of structure factors sf for
+  // reflections hkls, using n_threads threads (0 = all cores).
+  void add_sf_change(std::vector<std::complex<double>>& sf,
+                     const std::vector<Miller>& hkls,
+                     const std::vector<Atom>& old_atoms,
+                     const std::vector<Atom>& new_atoms,
+                     int n_threads=1) const {
+    if (sf.size() != hkls.size())
+      fail("add_sf_change(): sf and hkls differ in size");
+    parallel_for_chunks(hkls.size(), get_thread_count(n_threads),
+                        [&](size_t begin, size_t end, int) {
+      StructureFactorCalculator calc(*this);
+      for (size_t i = begin; i < end; ++i)
+        sf[i] += calc.calculate_sf_change(old_atoms, new_atoms, hkls[i]);
+    });
+  }
+
   // Z part of Mott-Bethe formula (when need to use different model)
   std::complex<double> calculate_mb_z(const Model& model, const Miller& hkl, bool only_h) {
     std::complex<double> sf = 0.;
@@ -130,10 +181,127 @@ public:
     return sf;
   }
 
+  // Calculates structure factors for many reflections at once.
+  // Symmetry-expanded positions are prepared only once. If the space group
+  // has inversion centre at the origin, only half of the symmetry images is
+  // used (with 2cos terms). Since f' is real, F(-hkl) = conj(F(hkl)) and
+  // Friedel mates (and repeated hkl) are calculated only once.
+  // Reflections are distributed over n_threads threads (0 = all cores).
+  std::vector<std::complex<double>>
+  calculate_sf_from_small_structure(const SmallStructure& small,
+                                    const std::vector<Miller>& hkls,
+                                    int n_threads=1) const {
+    // images of the unit cell, without centrosymmetric mates
+    std::vector<Transform> ops(1);
+    bool centric = false;
+    for (const FTransform& image : cell_.images) {
+      if (image.mat.approx(Mat33(-1, 0, 0, 0, -1, 0, 0, 0, -1), 1e-9) &&
+          is_integer_vec(image.vec))
+        centric = true;
+      ops.push_back(image);
+    }
+    if (centric) {
+      std::vector<Transform> half;
+      for (const Transform& op : ops) {
+        Mat33 minus_mat = op.mat;
+        for (auto& row : minus_mat.a)
+          for (double& x : row)
+            x = -x;
+        bool has_mate = false;
+        for (const Transform& h : half)
+          if (h.mat.approx(minus_mat, 1e-9) && is_integer_vec(h.vec + op.vec))
+            has_mate = true;
+        if (!has_mate)
+          half.push_back(op);
+      }
+      if (2 * half.size() == ops.size())
+        ops.swap(half);
+      else
+        centric = false;
+    }
+    const size_t nops = ops.size();
+    std::vector<Fractional> positions;
+    positions.reserve(small.sites.size() * nops);
+    for (const SmallStructure::Site& site : small.sites)
+      for (const Transform& op : ops)
+        positions.emplace_back(op.apply(site.fract));
+
+    // reflections that are Friedel mates or repeats of earlier reflections
+    std::vector<int> copy_of(hkls.size(), -1);
+    std::vector<char> conj(hkls.size(), 0);
+    HklIndex index(hkls);
+    for (size_t i = 0; i < hkls.size(); ++i) {
+      int j = index.find(hkls[i]);
+      if (j >= 0 && j < (int) i) {
+        copy_of[i] = j;
+        continue;
+      }
+      j = index.find({{-hkls[i][0], -hkls[i][1], -hkls[i][2]}});
+      if (j >= 0 && j < (int) i) {
+        copy_of[i] = j;
+        conj[i] = 1;
+      }
+    }
+
+    std::vector<std::complex<double>> result(hkls.size());
+    parallel_for_chunks(hkls.size(), get_thread_count(n_threads),
+                        [&](size_t begin, size_t end, int) {
+      StructureFactorCalculator calc(*this);
+      for (size_t i = begin; i < end; ++i) {
+        if (copy_of[i] >= 0)
+          continue;
+        const Miller& hkl = hkls[i];
+        calc.set_stol2_and_scattering_factors(hkl);
+        Vec3 vhkl(hkl[0], hkl[1], hkl[2]);
+        std::complex<double> sf = 0.;
+        const Fractional* pos = positions.data();
+        for (const SmallStructure::Site& site : small.sites) {
+          double oc_sf = site.occ * calc.get_scattering_factor(site.element);
+          std::complex<double> sum = 0.;
+          if (!site.aniso.nonzero()) {
+            if (centric)
+              for (size_t k = 0; k < nops; ++k)
+                sum += 2 * std::cos(2 * pi() * vhkl.dot(pos[k]));
+            else
+              for (size_t k = 0; k < nops; ++k)
+                sum += calculate_sf_part(pos[k], hkl);
+            sum *= calc.dwf_iso(site);
+          } else {
+            for (size_t k = 0; k < nops; ++k) {
+              double dwf = calc.dwf_aniso(site, ops[k].mat.left_multiply(vhkl));
+              if (centric)
+                sum += 2 * std::cos(2 * pi() * vhkl.dot(pos[k])) * dwf;
+              else
+                sum += calculate_sf_part(pos[k], hkl) * dwf;
+            }
+          }
+          sf += oc_sf * sum;
+          pos += nops;
+        }
+        result[i] = sf;
+      }
+    });
+    for (size_t i = 0; i < hkls.size(); ++i)
+      if (copy_of[i] >= 0)
+        result[i] = conj[i] ? std::conj(result[copy_of[i]]) : result[copy_of[i]];
+    return result;
+  }
+
+  double mott_bethe_factor(const Miller& hkl) const {
+    return -mott_bethe_const() / 4 / cell_.calculate_stol_sq(hkl);
+  }
+
 private:
+  static bool is_integer_vec(const Vec3& v) {
+    return std::fabs(v.x - std::round(v.x)) < 1e-9 &&
+           std::fabs(v.y - std::round(v.y)) < 1e-9 &&
+           std::fabs(v.z - std::round(v.z)) < 1e-9;
+  }
+
   const UnitCell& cell_;
   double stol2_;
   std::vector<double> scattering_factors_;
+  std::shared_ptr<const TabulatedFormFactors<Table>> tabulated_;
 public:
   Addends addends;  // usually f' for X-rays
 };
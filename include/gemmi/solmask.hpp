@@ -5,9 +5,12 @@
 #ifndef GEMMI_SOLMASK_HPP_
 #define GEMMI_SOLMASK_HPP_
 
+#include <utility>       // for pair
 #include "grid.hpp"      // for Grid
-#include "floodfill.hpp" // for FloodFill
+#include "ccl.hpp"       // for GridRuns
+#include "flat.hpp"      // for FlatStructure
 #include "model.hpp"     // for Model, Atom, ...
+#include "parallel.hpp"  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -111,6 +114,24 @@ void mask_points_in_constant_radius(Grid<T>& mask, const Model& model,
         mask.set_points_around(atom.pos, radius, value);
 }
 
+template<typename T>
+void mask_points_in_constant_radius(Grid<T>& mask, const FlatStructure& flat,
+                                    size_t model, double radius, T value) {
+  flat.check_model(model);
+  for (size_t n = flat.model_atom_begin(model); n < flat.model_atom_end(model); ++n)
+    mask.set_points_around(flat.position(n), radius, value);
+}
+
+inline double get_atomic_radius(El elem, AtomicRadiiSet atomic_radii_set) {
+  switch (atomic_radii_set) {
+    case AtomicRadiiSet::VanDerWaals: return vdw_radius(elem);
+    case AtomicRadiiSet::Cctbx: return cctbx_vdw_radius(elem);
+    case AtomicRadiiSet::Refmac: return refmac_radius_for_bulk_solvent(elem);
+    case AtomicRadiiSet::Constant: assert(0); break;
+  }
+  return 0;
+}
+
 template<typename T>
 void mask_points_in_varied_radius(Grid<T>& mask, const Model& model,
                                   AtomicRadiiSet atomic_radii_set,
@@ -118,21 +139,55 @@ void mask_points_in_varied_radius(Grid<T>& mask, const Model& model,
   for (const Chain& chain : model.chains)
     for (const Residue& res : chain.residues)
       for (const Atom& atom : res.atoms) {
-        El elem = atom.element.elem;
-        double r = 0;
-        switch (atomic_radii_set) {
-          case AtomicRadiiSet::VanDerWaals: r = vdw_radius(elem); break;
-          case AtomicRadiiSet::Cctbx: r = cctbx_vdw_radius(elem); break;
-          case AtomicRadiiSet::Refmac: r = refmac_radius_for_bulk_solvent(elem); break;
-          case AtomicRadiiSet::Constant: assert(0); break;
-        }
+        double r = get_atomic_radius(atom.element.elem, atomic_radii_set);
         mask.set_points_around(atom.pos, r + r_probe, value);
       }
 }
 
-// All points != value in a distance < r from value are set to margin_value
 template<typename T>
-void set_margin_around(Grid<T>& mask, double r, T value, T margin_value) {
+void mask_points_in_varied_radius(Grid<T>& mask, const FlatStructure& flat,
+                                  size_t model, AtomicRadiiSet atomic_radii_set,
+                                  double r_probe, T value) {
+  flat.check_model(model);
+  for (size_t n = flat.model_atom_begin(model); n < flat.model_atom_end(model); ++n) {
+    double r = get_atomic_radius(flat.element[n], atomic_radii_set);
+    mask.set_points_around(flat.position(n), r + r_probe, value);
+  }
+}
+
+// Multi-threaded equivalent of calling mask.set_points_around(pos, radius, value)
+// for each (pos, radius) in atoms. Each thread goes through all atoms,
+// but sets only points in its own slab of the grid (along w).
+template<typename T>
+void mask_points_in_slabs(Grid<T>& mask,
+                          const std::vector<std::pair<Position, double>>& atoms,
+                          T value, int n_threads) {
+  parallel_for_chunks(mask.nw, n_threads, [&](size_t begin, size_t end, int) {
+    for (const std::pair<Position, double>& atom : atoms) {
+      double radius = atom.second;
+      // cf. use_points_around()
+      int du = (int) std::ceil(radius / mask.spacing[0]);
+      int dv = (int) std::ceil(radius / mask.spacing[1]);
+      int dw = (int) std::ceil(radius / mask.spacing[2]);
+      mask.template check_size_for_points_in_box<true>(du, dv, dw, true);
+      Fractional fctr = mask.unit_cell.fractionalize(atom.first);
+      mask.template do_use_points_in_box<true>(fctr, du, dv, dw,
+                    [&](T& ref, const Position& delta, int, int, int) {
+                      if (delta.length_sq() < radius * radius)
+                        ref = value;
+                    }, (int) begin, (int) end);
+    }
+  });
+}
+
+// All points != value in a distance < r from value are set to margin_value.
+// With n_threads != 1, points at the boundary of value are found first,
+// then each thread sets margin in its own slab (along w) of the grid.
+// Stencils are symmetric, so the result is the same as from the
+// single-threaded code.
+template<typename T>
+void set_margin_around(Grid<T>& mask, double r, T value, T margin_value,
+                       int n_threads=1) {
   int du = (int) std::floor(r / mask.spacing[0]);
   int dv = (int) std::floor(r / mask.spacing[1]);
   int dw = (int) std::floor(r / mask.spacing[2]);
@@ -158,7 +213,51 @@ void set_margin_around(Grid<T>& mask, double r, T value, T margin_value) {
             stencil2.push_back(wvu);
         }
       }
-  if (stencil2.empty()) {
+  n_threads = get_thread_count(n_threads);
+  if (n_threads > 1) {
+    // (u,v) of points == value that have a stencil1 neighbour != value,
+    // listed separately for each w
+    std::vector<std::vector<std::pair<int,int>>> boundary(mask.nw);
+    parallel_for_chunks(mask.nw, n_threads, [&](size_t begin, size_t end, int) {
+      for (int w = (int) begin; w < (int) end; ++w)
+        for (int v = 0; v < mask.nv; ++v)
+          for (int u = 0; u < mask.nu; ++u) {
+            if (mask.data[mask.index_q(u, v, w)] != value)
+              continue;
+            for (const auto& wvu : stencil1)
+              if (mask.data[mask.index_near_zero(u + wvu[2], v + wvu[1], w + wvu[0])] != value) {
+                boundary[w].emplace_back(u, v);
+                break;
+              }
+          }
+    });
+    stencil1.insert(stencil1.end(), stencil2.begin(), stencil2.end());
+    parallel_for_chunks(mask.nw, n_threads, [&](size_t begin, size_t end, int) {
+      int w_begin = (int) begin;
+      int w_end = (int) end;
+      // boundary points with w in [w_begin-dw, w_end+dw) can have margin in this slab
+      int src_begin = w_begin - dw;
+      int src_end = w_end + dw;
+      if (src_end - src_begin >= mask.nw) {
+        src_begin = 0;
+        src_end = mask.nw;
+      }
+      for (int src_w = src_begin; src_w < src_end; ++src_w) {
+        int w = modulo(src_w, mask.nw);
+        for (const std::pair<int,int>& uv : boundary[w])
+          for (const auto& wvu : stencil1) {
+            int w2 = w + wvu[0];
+            if (w2 < 0)
+              w2 += mask.nw;
+            if (w2 < w_begin || w2 >= w_end)
+              continue;
+            size_t idx = mask.index_near_zero(uv.first + wvu[2], uv.second + wvu[1], w2);
+            if (mask.data[idx] != value)
+              mask.data[idx] = margin_value;
+          }
+      }
+    });
+  } else if (stencil2.empty()) {
     for (typename Grid<T>::Point p : mask)
       if (*p.value != value) {
         for (const auto& wvu : stencil1) {
@@ -200,6 +299,9 @@ struct SolventMasker {
   double rshrink;
   double island_min_volume;
   double constant_r;
+  // number of threads for mask_points(), symmetrize(), remove_islands()
+  // and shrink(); 0 = all CPUs. The result doesn't depend on it.
+  int n_threads = 1;
 
   SolventMasker(AtomicRadiiSet choice, double constant_r_=0.) {
     set_radii(choice, constant_r_);
@@ -234,20 +336,75 @@ struct SolventMasker {
 
   template<typename T> void clear(Grid<T>& grid) const { grid.fill((T)1); }
 
-  template<typename T> void mask_points(Grid<T>& grid, const Model& model) const {
+  double get_radius(El el) const {
     if (atomic_radii_set == AtomicRadiiSet::Constant)
+      return constant_r + rprobe;
+    return get_atomic_radius(el, atomic_radii_set) + rprobe;
+  }
+
+  template<typename T> void mask_points(Grid<T>& grid, const Model& model) const {
+    int n = get_thread_count(n_threads);
+    if (n > 1) {
+      std::vector<std::pair<Position, double>> atoms;
+      for (const Chain& chain : model.chains)
+        for (const Residue& res : chain.residues)
+          for (const Atom& atom : res.atoms)
+            atoms.emplace_back(atom.pos, get_radius(atom.element.elem));
+      mask_points_in_slabs(grid, atoms, (T)0, n);
+    } else if (atomic_radii_set == AtomicRadiiSet::Constant)
       mask_points_in_constant_radius(grid, model, constant_r + rprobe, (T)0);
     else
       mask_points_in_varied_radius(grid, model, atomic_radii_set, rprobe, (T)0);
   }
 
+  template<typename T>
+  void mask_points(Grid<T>& grid, const FlatStructure& flat, size_t model=0) const {
+    int n = get_thread_count(n_threads);
+    if (n > 1) {
+      flat.check_model(model);
+      std::vector<std::pair<Position, double>> atoms;
+      for (size_t i = flat.model_atom_begin(model); i < flat.model_atom_end(model); ++i)
+        atoms.emplace_back(flat.position(i), get_radius(flat.element[i]));
+      mask_points_in_slabs(grid, atoms, (T)0, n);
+    } else if (atomic_radii_set == AtomicRadiiSet::Constant)
+      mask_points_in_constant_radius(grid, flat, model, constant_r + rprobe, (T)0);
+    else
+      mask_points_in_varied_radius(grid, flat, model, atomic_radii_set, rprobe, (T)0);
+  }
+
   template<typename T> void symmetrize(Grid<T>& grid) const {
-    grid.symmetrize([&](T a, T b) { return a == (T)0 || b == (T)0 ? (T)0 : (T)1; });
+    int n = get_thread_count(n_threads);
+    if (n == 1) {
+      grid.symmetrize([&](T a, T b) { return a == (T)0 || b == (T)0 ? (T)0 : (T)1; });
+      return;
+    }
+    // Each point is set to 0 if any of its symmetry mates is 0, otherwise
+    // to 1. The input is only read, so no locking is needed.
+    std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+    if (ops.empty())
+      return;
+    check_grid_factors(grid.spacegroup, {{grid.nu, grid.nv, grid.nw}});
+    std::vector<T> result(grid.data.size());
+    parallel_for_chunks(grid.nw, n, [&](size_t begin, size_t end, int) {
+      for (int w = (int) begin; w < (int) end; ++w)
+        for (int v = 0; v != grid.nv; ++v)
+          for (int u = 0; u != grid.nu; ++u) {
+            size_t idx = grid.index_q(u, v, w);
+            T value = grid.data[idx] == (T)0 ? (T)0 : (T)1;
+            for (size_t k = 0; k < ops.size() && value != (T)0; ++k) {
+              std::array<int,3> t = ops[k].apply(u, v, w);
+              if (grid.data[grid.index_n(t[0], t[1], t[2])] == (T)0)
+                value = (T)0;
+            }
+            result[idx] = value;
+          }
+    });
+    grid.data.swap(result);
   }
 
   template<typename T> void shrink(Grid<T>& grid) const {
     if (rshrink > 0) {
-      set_margin_around(grid, rshrink, (T)1, (T)-1);
+      set_margin_around(grid, rshrink, (T)1, (T)-1, n_threads);
       grid.change_values((T)-1, (T)1);
     }
   }
@@ -258,22 +415,31 @@ struct SolventMasker {
   }
 
 
-  // Removes small islands of Land=1 in the sea of 0. Uses flood fill.
-  // cf. find_blobs_by_flood_fill()
+  // Removes small islands of Land=1 in the sea of 0.
+  // Uses connected-component labeling (ccl.hpp).
   template<typename T> int remove_islands(Grid<T>& grid) const {
     if (island_min_volume <= 0)
       return 0;
     size_t limit = static_cast<size_t>(island_min_volume * grid.point_count()
                                        / grid.unit_cell.volume);
     int counter = 0;
-    FloodFill<T,1> flood_fill{grid};
-    flood_fill.for_each_islands([&](typename FloodFill<T,1>::Result& r) {
-        //printf("island %d: %zu in %zu (limit: %zu)\n",
-        //       counter, r.point_count(), lines.size(), limit);
-        if (r.point_count() <= limit) {
-          ++counter;
-          flood_fill.set_volume_values(r, (T)0);
-        }
+    // islands are the same as with FloodFill<T,1> (26-connectivity)
+    GridRuns cc;
+    cc.label(grid, [](T x) { return x == (T)1; }, true, n_threads);
+    std::vector<size_t> sizes(cc.runs.size(), 0);
+    for (size_t i = 0; i < cc.runs.size(); ++i)
+      sizes[cc.parent[i]] += cc.runs[i].len;
+    for (size_t i = 0; i < cc.runs.size(); ++i)
+      if (cc.parent[i] == i && sizes[i] <= limit)
+        ++counter;
+    parallel_for_chunks(cc.row_start.size() - 1, get_thread_count(n_threads),
+                        [&](size_t begin, size_t end, int) {
+      for (size_t row = begin; row < end; ++row)
+        for (size_t i = cc.row_start[row]; i < cc.row_start[row+1]; ++i)
+          if (sizes[cc.parent[i]] <= limit) {
+            T* ptr = &grid.data[row * grid.nu + cc.runs[i].u];
+            std::fill(ptr, ptr + cc.runs[i].len, (T)0);
+          }
     });
     return counter;
   }
@@ -287,6 +453,16 @@ struct SolventMasker {
     shrink(grid);
   }
 
+  template<typename T>
+  void put_mask_on_grid(Grid<T>& grid, const FlatStructure& flat, size_t model=0) const {
+    clear(grid);
+    assert(!grid.data.empty());
+    mask_points(grid, flat, model);
+    symmetrize(grid);
+    remove_islands(grid);
+    shrink(grid);
+  }
+
   void set_to_zero(Grid<float>& grid, const Model& model) const {
     mask_points(grid, model);
     grid.symmetrize([&](float a, float b) { return b == 0.f ? 0.f : a; });
@@ -65,6 +65,12 @@ GEMMI_DLL cif::Block make_mmcif_block(const Structure& st,
 GEMMI_DLL cif::Block make_mmcif_headers(const Structure& st);
 GEMMI_DLL void add_minimal_mmcif_data(const Structure& st, cif::Block& block);
 
+struct AssemblyView;
+/// Writes mmCIF block with atoms of an assembly (as if from make_assembly()),
+/// without materializing the assembly.
+GEMMI_DLL void write_minimal_mmcif(const AssemblyView& view, std::ostream& os,
+                                   const std::string& block_name);
+
 // temporarily we use it in crd.cpp
 GEMMI_DLL void write_struct_conn(const Structure& st, cif::Block& block);
 GEMMI_DLL void write_cispeps(const Structure& st, cif::Block& block);
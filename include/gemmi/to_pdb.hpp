@@ -28,6 +28,12 @@ GEMMI_DLL void write_minimal_pdb(const Structure& st, std::ostream& os,
                                  PdbWriteOptions opt=PdbWriteOptions());
 GEMMI_DLL std::string make_pdb_headers(const Structure& st);
 
+struct AssemblyView;
+/// Writes atoms of an assembly (as if from make_assembly()), without
+/// materializing the assembly. Chain names must have at most 2 characters.
+GEMMI_DLL void write_minimal_pdb(const AssemblyView& view, std::ostream& os,
+                                 PdbWriteOptions opt=PdbWriteOptions());
+
 } // namespace gemmi
 
 #endif
@@ -256,10 +256,13 @@ struct GEMMI_DLL Topo {
   // This step stores pointers to gemmi::Atom's from model0,
   // so after this step don't add or remove atoms.
   // monlib is needed only for links.
-  void apply_all_restraints(const MonLib& monlib);
+  // With n_threads > 1 chains are processed in parallel; the result
+  // (including the order of restraints and warnings) is the same.
+  // n_threads=0 means the number of hardware threads.
+  void apply_all_restraints(const MonLib& monlib, int n_threads=1);
 
   // prepare bond_index, angle_index, torsion_index, plane_index
-  void create_indices();
+  void create_indices(int n_threads=1);
 
   Link* find_polymer_link(const AtomAddress& a1, const AtomAddress& a2) {
     for (ChainInfo& ci : chain_infos)
@@ -297,13 +300,14 @@ private:
 
   void setup_connection(Connection& conn, Model& model0, MonLib& monlib,
                         bool ignore_unknown_links);
+  void apply_restraints_to_chain(ChainInfo& chain_info, const MonLib& monlib);
 };
 
 GEMMI_DLL std::unique_ptr<Topo>
 prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
                  HydrogenChange h_change, bool reorder,
                  std::ostream* warnings=nullptr, bool ignore_unknown_links=false,
-                 bool use_cispeps=false);
+                 bool use_cispeps=false, int n_threads=1);
 
 
 GEMMI_DLL std::unique_ptr<ChemComp> make_chemcomp_with_restraints(const Residue& res);
@@ -5,11 +5,13 @@
 #include <gemmi/model.hpp>
 #include <gemmi/polyheur.hpp>  // for setup_entities, align_sequence_to_polymer
 #include <gemmi/align.hpp>     // for align_sequence_to_polymer
+#include <gemmi/ensemble.hpp>  // for EnsembleRmsd
 #include <gemmi/seqalign.hpp>  // for align_string_sequences
 #include <gemmi/mmread_gz.hpp>
 
+#include <algorithm> // for max
 #include <cstdio>   // for printf, fprintf, putchar
-#include <cstdlib>  // for atoi
+#include <cstdlib>  // for atoi, atof
 #define GEMMI_PROG align
 #include "options.h"
 
@@ -18,7 +20,8 @@ namespace {
 using std::printf;
 
 enum OptionIndex { Match=4, Mismatch, GapOpen, GapExt,
-                   CheckMmcif, PrintOneLetter, Query, Target, TextAlign, Rmsd };
+                   CheckMmcif, PrintOneLetter, Query, Target, TextAlign, Rmsd,
+                   LocalRmsd, RmsdMatrix, Radius, Threads };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -32,6 +35,12 @@ const option::Descriptor Usage[] = {
     "\n    Aligns CHAIN1 from FILE1 to CHAIN2 from FILE2."
     "\n    By default, the sequence of residues in the model is used."
     "\n    To use SEQRES prepend '+' to the chain name (e.g. --query=+A)."
+    "\n\n" EXE_NAME " [options] --local-rmsd FILE"
+    "\n    Superposes main chain of each model from FILE (an ensemble)"
+    "\n    onto model 1 in a moving window and prints per-residue RMSD."
+    "\n\n" EXE_NAME " [options] --rmsd-matrix FILE"
+    "\n    Prints (as TSV) RMSD of CA/P atoms for all pairs of models"
+    "\n    from FILE, after superposition."
     "\n\n" EXE_NAME " [options] --text-align STRING1 STRING2"
     "\n    Aligns two ASCII strings (used for testing)."
     "\n\nOptions:" },
@@ -46,6 +55,15 @@ const option::Descriptor Usage[] = {
     "  --target=[+]CHAIN  \tAlign CHAIN from file INPUT2." },
   { TextAlign, 0, "", "text-align", Arg::None,
     "  --text-align  \tAlign characters in two strings (for testing)." },
+  { LocalRmsd, 0, "", "local-rmsd", Arg::None,
+    "  --local-rmsd  \tPer-residue RMSD of models in moving window." },
+  { RmsdMatrix, 0, "", "rmsd-matrix", Arg::None,
+    "  --rmsd-matrix  \tAll-vs-all RMSD of models." },
+  { Radius, 0, "", "radius", Arg::Float,
+    "  --radius=R  \t(w/ --local-rmsd) Radius of the moving window"
+    " (default: 10.0)." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
 
   { NoOp, 0, "", "", Arg::None, "\nScoring (absolute values):" },
   { Match, 0, "", "match", Arg::Int,
@@ -160,6 +178,68 @@ void print_result_summary(const gemmi::AlignmentResult& result) {
          result.cigar_str().c_str());
 }
 
+void print_local_rmsd(const gemmi::Structure& st, double radius, int n_threads) {
+  if (st.models.size() < 2)
+    gemmi::fail("--local-rmsd needs a file with multiple models");
+  gemmi::PolymerType ptype = gemmi::PolymerType::Unknown;
+  for (const gemmi::Chain& chain : st.models[0].chains)
+    if (gemmi::ConstResidueSpan polymer = chain.get_polymer()) {
+      ptype = gemmi::check_polymer_type(polymer);
+      break;
+    }
+  gemmi::FlatStructure flat(st);
+  std::vector<std::vector<gemmi::SupResult>> result =
+    gemmi::calculate_superpositions_in_moving_window(flat, 0, ptype, radius, n_threads);
+  printf("RMSD of %zu models superposed onto model %s in %g A windows.\n",
+         st.models.size() - 1, st.models[0].name.c_str(), radius);
+  printf("chain  residue   atoms    mean     max\n");
+  size_t n = 0;
+  for (size_t c = flat.model_start[0]; c < flat.model_start[1]; ++c)
+    for (size_t r = flat.chain_start[c]; r < flat.chain_start[c+1]; ++r, ++n) {
+      size_t count = result[0][n].count;
+      if (count == 0)
+        continue;
+      double sum = 0, max = 0;
+      for (size_t m = 1; m < result.size(); ++m) {
+        sum += result[m][n].rmsd;
+        max = std::max(max, result[m][n].rmsd);
+      }
+      const gemmi::SeqId& seqid = flat.seqid[r];
+      printf("%-5s %4d%c %-3s %5zu %7.3f %7.3f\n",
+             flat.names[flat.chain_name[c]].c_str(), *seqid.num, seqid.icode,
+             flat.names[flat.residue_name[r]].c_str(), count,
+             sum / (result.size() - 1), max);
+    }
+}
+
+void print_rmsd_matrix(const gemmi::Structure& st, int n_threads) {
+  gemmi::PolymerType ptype = gemmi::PolymerType::Unknown;
+  for (const gemmi::Chain& chain : st.models.at(0).chains)
+    if (gemmi::ConstResidueSpan polymer = chain.get_polymer()) {
+      ptype = gemmi::check_polymer_type(polymer);
+      break;
+    }
+  gemmi::FlatStructure flat(st);
+  gemmi::EnsembleRmsd ens(flat, ptype, gemmi::SupSelect::CaP);
+  size_t n = ens.n_models;
+  printf("model");
+  for (const gemmi::Model& model : st.models)
+    printf("\t%s", model.name.c_str());
+  printf("\n");
+  // rows are calculated and printed in blocks, to limit memory usage
+  const size_t block = 64;
+  std::vector<double> rows(block * n);
+  for (size_t i0 = 0; i0 < n; i0 += block) {
+    ens.calculate_rows(i0, i0 + block, rows.data(), n_threads);
+    for (size_t i = i0; i < std::min(i0 + block, n); ++i) {
+      printf("%s", st.models[i].name.c_str());
+      for (size_t j = 0; j < n; ++j)
+        printf("\t%.4f", rows[(i - i0) * n + j]);
+      printf("\n");
+    }
+  }
+}
+
 std::vector<std::string> string_to_vector(const std::string& s) {
   std::vector<std::string> v(s.size());
   for (size_t i = 0; i != v.size(); ++i)
@@ -187,6 +267,12 @@ int GEMMI_MAIN(int argc, char **argv) {
     return 1;
   }
   p.check_exclusive_pair(TextAlign, Query);
+  p.check_exclusive_pair(LocalRmsd, Query);
+  p.check_exclusive_pair(LocalRmsd, TextAlign);
+  p.check_exclusive_pair(LocalRmsd, RmsdMatrix);
+  p.check_exclusive_pair(RmsdMatrix, Query);
+  p.check_exclusive_pair(RmsdMatrix, TextAlign);
+  p.check_exclusive_pair(RmsdMatrix, Radius);
 
   if (p.options[TextAlign]) {
     p.require_positional_args(2);
@@ -208,6 +294,23 @@ int GEMMI_MAIN(int argc, char **argv) {
   }
 
   try {
+    if (p.options[LocalRmsd] || p.options[RmsdMatrix]) {
+      p.require_input_files_as_args();
+      double radius = p.options[Radius] ? std::atof(p.options[Radius].arg) : 10.0;
+      int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+      for (int i = 0; i < p.nonOptionsCount(); ++i) {
+        std::string input = p.coordinate_input_file(i);
+        if (p.nonOptionsCount() > 1)
+          printf("%sFile: %s\n", i > 0 ? "\n" : "", input.c_str());
+        gemmi::Structure st = gemmi::read_structure_gz(input);
+        if (p.options[LocalRmsd])
+          print_local_rmsd(st, radius, n_threads);
+        else
+          print_rmsd_matrix(st, n_threads);
+      }
+      return 0;
+    }
+
     if (p.options[Query]) {
       int n_files = p.nonOptionsCount();
       if (n_files != 2 && n_files != 1)
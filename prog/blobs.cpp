@@ -23,7 +23,7 @@ using std::printf;
 enum OptionIndex { SigmaCutoff=AfterMapOptions, AbsCutoff,
                    MaskRadius, MaskWater,
                    MinVolume, MinScore, MinSigma, MinDensity,
-                   Dimple };
+                   Threads, Dimple };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -34,6 +34,8 @@ const option::Descriptor Usage[] = {
   CommonUsage[Help],
   CommonUsage[Version],
   CommonUsage[Verbose],
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
   { NoOp, 0, "", "", Arg::None,
     "\nThe area around model is masked to search only unmodelled density." },
   { MaskRadius, 0, "", "mask-radius", Arg::Float,
@@ -165,7 +167,9 @@ int run(OptParser& p) {
   }
 
   // find and sort blobs
-  std::vector<gemmi::Blob> blobs = gemmi::find_blobs_by_flood_fill(grid, criteria);
+  int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+  std::vector<gemmi::Blob> blobs = gemmi::find_blobs_by_labeling(grid, criteria,
+                                                                 false, n_threads);
   if (p.options[Verbose])
     printf("%zu blob%s found.\n", blobs.size(), blobs.size() == 1 ? "" : "s");
 
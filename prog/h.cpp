@@ -1,7 +1,7 @@
 // Copyright 2017 Global Phasing Ltd.
 
 #include <cstdio>
-#include <cstdlib>   // for getenv
+#include <cstdlib>   // for getenv, atoi
 #include <stdexcept>
 #include <iostream>  // for cout
 #include <gemmi/polyheur.hpp>  // for setup_entities
@@ -23,7 +23,7 @@ namespace cif = gemmi::cif;
 
 namespace {
 
-enum OptionIndex { Monomers=4, FormatIn, RemoveH, KeepH, Water, Sort };
+enum OptionIndex { Monomers=4, Snapshot, FormatIn, RemoveH, KeepH, Water, Sort, Threads };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -38,6 +38,9 @@ const option::Descriptor Usage[] = {
   CommonUsage[Verbose],
   { Monomers, 0, "", "monomers", Arg::Required,
     "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
+  { Snapshot, 0, "", "snapshot", Arg::Required,
+    "  --snapshot=FILE  \tCache the monomer library in binary FILE "
+    "(re-created when the library files change)." },
   { FormatIn, 0, "", "format", Arg::CoorFormat,
     "  --format=FORMAT  \tInput format (default: from the file extension)." },
   { RemoveH, 0, "", "remove", Arg::None,
@@ -48,6 +51,8 @@ const option::Descriptor Usage[] = {
     "  --water  \tAdd hydrogens also to waters." },
   { Sort, 0, "", "sort", Arg::None,
     "  --sort  \tOrder atoms in residues according to _chem_comp_atom." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -113,12 +118,20 @@ int GEMMI_MAIN(int argc, char **argv) {
       if (p.options[Verbose])
         std::printf("Reading %zu monomers and all links from %s\n",
                     res_names.size(), input.c_str());
-      std::string libin;
-      gemmi::MonLib monlib = gemmi::read_monomer_lib(monomer_dir, res_names,
-                                                     gemmi::read_cif_gz, libin, true);
+      gemmi::MonLib monlib;
+      if (p.options[Snapshot]) {
+        gemmi::read_monomer_lib_with_snapshot(monlib, monomer_dir, res_names,
+                                              gemmi::read_cif_gz, p.options[Snapshot].arg);
+      } else {
+        std::string libin;
+        monlib = gemmi::read_monomer_lib(monomer_dir, res_names,
+                                         gemmi::read_cif_gz, libin, true);
+      }
+      int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
       for (size_t i = 0; i != st.models.size(); ++i)
         // preparing topology modifies hydrogens in the model
-        prepare_topology(st, monlib, i, h_change, p.options[Sort], &std::cerr);
+        prepare_topology(st, monlib, i, h_change, p.options[Sort], &std::cerr,
+                         false, false, n_threads);
     }
     if (p.options[Verbose])
       std::printf("Hydrogen site count: %zu in input, %zu in output.\n",
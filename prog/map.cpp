@@ -15,7 +15,7 @@
 namespace {
 
 enum OptionIndex {
-  Dump=4, Deltas, CheckSym, Reorder, Full, Mask, Threshold, Fraction
+  Dump=4, Deltas, CheckSym, Reorder, Full, OutMode, Mask, Threshold, Fraction
 };
 
 const option::Descriptor Usage[] = {
@@ -34,6 +34,9 @@ const option::Descriptor Usage[] = {
     "  --write-xyz=FILE  \tWrite transposed map with fast X axis and slow Z." },
   { Full, 0, "", "write-full", Arg::Required,
     "  --write-full=FILE  \tWrite map extended to cover whole unit cell." },
+  { OutMode, 0, "", "mode", Arg::Int,
+    "  --mode=N  \tMode of maps written with --write-xyz/full: 2 (float32)"
+    " or 12 (float16, half the size). By default, the input mode is kept." },
   { Mask, 0, "", "write-mask", Arg::Required,
     "  --write-mask=FILE  \tMake a mask by thresholding the map." },
   { NoOp, 0, "", "", Arg::None, "\nOptions for making a mask:" },
@@ -180,6 +183,12 @@ int GEMMI_MAIN(int argc, char **argv) {
     return 1;
   }
 
+  int out_mode = p.options[OutMode] ? std::atoi(p.options[OutMode].arg) : 2;
+  if (out_mode != 2 && out_mode != 12) {
+    std::fprintf(stderr, "Option --mode can be only 2 or 12.\n");
+    return 1;
+  }
+
   bool dump = (p.options[Dump] ||
                !(p.options[Deltas] || p.options[CheckSym] ||
                  p.options[Reorder] || p.options[Full] || p.options[Mask]));
@@ -198,6 +207,8 @@ int GEMMI_MAIN(int argc, char **argv) {
         print_deltas(map.grid, stats.dmin, stats.dmax);
       if (p.options[Reorder]) {
         map.setup(NAN, gemmi::MapSetup::ReorderOnly);
+        if (p.options[OutMode])
+          map.set_header_i32(4, out_mode);
         map.write_ccp4_map(p.options[Reorder].arg);
       }
       double max_err = 0.;
@@ -225,6 +236,8 @@ int GEMMI_MAIN(int argc, char **argv) {
                                   [](float x) { return std::isnan(x); });
         if (nn != 0)
           std::fprintf(stderr, "WARNING: %zu unknown values set to NAN\n", nn);
+        if (p.options[OutMode])
+          map.set_header_i32(4, out_mode);
         map.write_ccp4_map(p.options[Full].arg);
       }
       if (p.options[Mask]) {
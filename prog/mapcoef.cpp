@@ -123,11 +123,11 @@ void adjust_size(const DataProxy& data, std::array<int, 3>& size,
   }
 }
 
-gemmi::Grid<float>
-read_sf_and_fft_to_map(const char* input_path,
-                       const std::vector<option::Option>& options,
-                       FILE* output,
-                       bool oversample_by_default) {
+gemmi::FPhiGrid<float>
+read_sf_to_f_phi_grid(const char* input_path,
+                      const std::vector<option::Option>& options,
+                      FILE* output,
+                      bool oversample_by_default) {
   if (options[PhLabel] && !options[FLabel])
     gemmi::fail("Option -p can be given only together with -f");
   if (options[FLabel] && options[Diff])
@@ -210,12 +210,25 @@ read_sf_and_fft_to_map(const char* input_path,
   if (weight_grid.data.size() == grid.data.size())
     for (size_t i = 0; i != grid.data.size(); ++i)
       grid.data[i] *= weight_grid.data[i];
+  return grid;
+}
+
+gemmi::Grid<float>
+read_sf_and_fft_to_map(const char* input_path,
+                       const std::vector<option::Option>& options,
+                       FILE* output,
+                       bool oversample_by_default) {
+  gemmi::FPhiGrid<float> grid = read_sf_to_f_phi_grid(input_path, options, output,
+                                                      oversample_by_default);
+  gemmi::AxisOrder axis_order = grid.axis_order;
+  Timer timer(options[TimingFft]);
   if (output)
     fprintf(output, "Fourier transform...\n");
   timer.start();
   gemmi::Grid<float> map = gemmi::transform_f_phi_grid_to_map(std::move(grid));
   timer.print("FFT in");
   assert(map.axis_order == axis_order);
+  (void) axis_order;  // unused in Release builds
   if (output)
     fprintf(output, "Map size: %d x %d x %d\n", map.nu, map.nv, map.nw);
   return map;
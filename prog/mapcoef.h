@@ -2,6 +2,7 @@
 #pragma once
 
 #include <gemmi/grid.hpp>      // for Grid
+#include <gemmi/recgrid.hpp>   // for FPhiGrid
 #include <optionparser.h>
 
 // used by sf2map and blobs
@@ -11,6 +12,12 @@ enum MapOptions { Diff=4, Section, FLabel, PhLabel, WeightLabel, GridDims,
 
 extern const option::Descriptor MapUsage[];
 
+gemmi::FPhiGrid<float>
+read_sf_to_f_phi_grid(const char* input_path,
+                      const std::vector<option::Option>& options,
+                      FILE* output,
+                      bool oversample_by_default=false);
+
 gemmi::Grid<float>
 read_sf_and_fft_to_map(const char* input_path,
                        const std::vector<option::Option>& options,
@@ -3,6 +3,7 @@
 // A subset of CAD functionality.
 
 #include <gemmi/mtz.hpp>
+#include <gemmi/hkljoin.hpp>  // for join_hkl
 #include <gemmi/fileutil.hpp> // for file_open
 #define GEMMI_PROG mtzmix
 #include "options.h"
@@ -37,20 +38,71 @@ Mtz merge(const std::vector<InputSpec>& input_list) {
   assert(!input_list.empty());
   const InputSpec& input0 = input_list[0];
   const Mtz& mtz0 = input0.mtz;
-  std::vector<int> indices0 = mtz0.sorted_row_indices();
   Mtz out;
-  out.data.reserve(mtz0.data.size());
   out.spacegroup = mtz0.spacegroup;
-  out.nreflections = mtz0.nreflections;
   out.cell = mtz0.cell;
   out.sort_order = {{1, 2, 3, 0, 0}};
   out.columns = mtz0.columns;
+  for (Mtz::Column& col : out.columns)
+    col.parent = &out;
   out.datasets = mtz0.datasets;
   out.history = mtz0.history;
-  //for (int idx : indices0)
-  //  out.data.insert(out.data.end(),
-  //                  mtz0.data.begin() + idx * out.ncol,
-  //                  mtz0.data.begin() + (idx + 1) * out.ncol);
+  // columns other than H, K, L from the remaining files;
+  // out_cols[i][j] is the output column of column j from input i
+  std::vector<std::vector<size_t>> out_cols(input_list.size());
+  for (size_t j = 0; j < mtz0.columns.size(); ++j)
+    out_cols[0].push_back(j);
+  for (size_t i = 1; i < input_list.size(); ++i) {
+    const Mtz& mtz = input_list[i].mtz;
+    // columns are grouped by dataset, so their order may change
+    out_cols[i].resize(mtz.columns.size(), 0);
+    for (const Mtz::Dataset& ds : mtz.datasets) {
+      bool used = false;
+      for (size_t j = 3; j < mtz.columns.size(); ++j)
+        if (mtz.columns[j].dataset_id == ds.id)
+          used = true;
+      if (!used)
+        continue;
+      Mtz::Dataset& new_ds = out.add_dataset(ds.dataset_name);
+      int new_id = new_ds.id;
+      new_ds = ds;
+      new_ds.id = new_id;
+      for (size_t j = 3; j < mtz.columns.size(); ++j)
+        if (mtz.columns[j].dataset_id == ds.id) {
+          const Mtz::Column& col = mtz.columns[j];
+          out_cols[i][j] = out.columns.size();
+          Mtz::Column& new_col = out.add_column(col.label, col.type, new_id, -1, false);
+          new_col.min_value = col.min_value;
+          new_col.max_value = col.max_value;
+          new_col.source = col.source;
+        }
+    }
+  }
+  // match reflections from all files in one pass
+  std::vector<std::vector<gemmi::Miller>> hkls(input_list.size());
+  for (size_t i = 0; i < input_list.size(); ++i) {
+    const Mtz& mtz = input_list[i].mtz;
+    for (size_t n = 0; n < mtz.data.size(); n += mtz.columns.size())
+      hkls[i].push_back(mtz.get_hkl(n));
+  }
+  gemmi::HklJoin join = gemmi::join_hkl(hkls);
+  size_t ncol = out.columns.size();
+  out.nreflections = (int) join.hkl.size();
+  out.data.resize(join.hkl.size() * ncol, NAN);
+  for (size_t row = 0; row < join.hkl.size(); ++row) {
+    float* dst = &out.data[row * ncol];
+    for (int j = 0; j < 3; ++j)
+      dst[j] = (float) join.hkl[row][j];
+    for (size_t i = 0; i < input_list.size(); ++i) {
+      int pos = join.position(row, i);
+      if (pos < 0)
+        continue;
+      const Mtz& mtz = input_list[i].mtz;
+      const float* src = &mtz.data[pos * mtz.columns.size()];
+      for (size_t j = 3; j < mtz.columns.size(); ++j)
+        dst[out_cols[i][j]] = src[j];
+    }
+  }
   return out;
 }
 
@@ -70,7 +122,7 @@ int GEMMI_MAIN(int argc, char **argv) {
         fprintf(stderr, "Reading %s ...\n", path);
       input_list.emplace_back(gemmi::read_mtz_file(path));
       if (p.options[Asu]) {
-        // TODO
+        input_list.back().mtz.ensure_asu();
       }
     }
     Mtz output(merge(input_list));
@@ -1,7 +1,7 @@
 // Copyright 2017-2022 Global Phasing Ltd.
 
 #include <stdio.h>             // for fprintf, stderr, putc
-#include <cstdlib>             // for getenv
+#include <cstdlib>             // for getenv, atoi
 #include <iostream>            // for cerr
 #include <stdexcept>           // for exception
 #include "gemmi/crd.hpp"       // for prepare_refmac_crd
@@ -21,8 +21,8 @@ using namespace gemmi;
 namespace {
 
 enum OptionIndex {
-  Monomers=4, Libin, Libin2, AutoCis, AutoLink, AutoLigand,
-  NoAliases, NoZeroOccRestr, NoHydrogens, KeepHydrogens
+  Monomers=4, Snapshot, Libin, Libin2, AutoCis, AutoLink, AutoLigand,
+  NoAliases, NoZeroOccRestr, NoHydrogens, KeepHydrogens, Threads
 };
 
 const option::Descriptor Usage[] = {
@@ -37,6 +37,9 @@ const option::Descriptor Usage[] = {
   CommonUsage[Verbose],
   { Monomers, 0, "", "monomers", Arg::Required,
     "  --monomers=DIR  \tMonomer library dir (default: $CLIBD_MON)." },
+  { Snapshot, 0, "", "snapshot", Arg::Required,
+    "  --snapshot=FILE  \tCache the monomer library in binary FILE "
+    "(re-created when the library files change)." },
   { Libin, 0, "", "lib", Arg::Required,
     "  --lib=CIF  \tUser's library with priority over the monomer library. "
     "Can be given multiple times. If CIF is '+' reads INPUT_FILE (mmCIF only)." },
@@ -50,6 +53,8 @@ const option::Descriptor Usage[] = {
     "  --auto-ligand=Y|N  \tIf ligand has no definition make ad-hoc restraints (N)." },
   { NoAliases, 0, "", "no-aliases", Arg::None,
     "  --no-aliases  \tIgnore _chem_comp_alias." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
   //{ NoZeroOccRestr, 0, "", "no-zero-occ", Arg::None,
   //  "  --no-zero-occ  \tNo restraints for zero-occupancy atoms." },
   { NoOp, 0, "", "", Arg::None,
@@ -116,7 +121,11 @@ int GEMMI_MAIN(int argc, char **argv) {
     if (verbose)
       fprintf(stderr, "Reading monomer library...\n");
     std::string error;
-    monlib.read_monomer_lib(monomer_dir, needed, read_cif_gz, &error);
+    if (p.options[Snapshot])
+      read_monomer_lib_with_snapshot(monlib, monomer_dir, needed, read_cif_gz,
+                                     p.options[Snapshot].arg, &error);
+    else
+      monlib.read_monomer_lib(monomer_dir, needed, read_cif_gz, &error);
     if (!error.empty())
       fprintf(stderr, "%s", error.c_str());
     for (const option::Option* opt = p.options[Libin2]; opt; opt = opt->next())
@@ -160,8 +169,10 @@ int GEMMI_MAIN(int argc, char **argv) {
       h_change = HydrogenChange::NoChange;
     else
       h_change = HydrogenChange::ReAddButWater;
+    int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
     auto topo = prepare_topology(st, monlib, 0, h_change, reorder,
-                                 &std::cerr, ignore_unknown_links, use_cispeps);
+                                 &std::cerr, ignore_unknown_links, use_cispeps,
+                                 n_threads);
     if (!use_cispeps)
       topo->set_cispeps_in_structure(st);
     if (verbose)
@@ -1,7 +1,7 @@
 // Copyright 2018 Global Phasing Ltd.
 
 #include <stdio.h>
-#include <cstdlib>   // for getenv
+#include <cstdlib>   // for getenv, atoi
 #include <iostream>  // for cerr
 #include <stdexcept>
 #include "gemmi/model.hpp"     // for Structure, Atom, etc
@@ -21,7 +21,7 @@ using gemmi::Topo;
 
 namespace {
 
-enum OptionIndex { Quiet=4, Monomers, FormatIn, Cutoff, Sort };
+enum OptionIndex { Quiet=4, Monomers, FormatIn, Cutoff, Sort, Threads };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -42,6 +42,8 @@ const option::Descriptor Usage[] = {
     "  --cutoff=ZC  \tList bonds and angles with Z score > ZC (default: 2)." },
   { Sort, 0, "s", "sort", Arg::None,
     "  -s, --sort  \tSort output according to |Z|." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
@@ -213,6 +215,7 @@ int GEMMI_MAIN(int argc, char **argv) {
   double cutoff = 2.0;
   if (p.options[Cutoff])
     cutoff = std::strtod(p.options[Cutoff].arg, nullptr);
+  int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
   int verbosity = p.options[Verbose].count() - p.options[Quiet].count();
   for (int i = 0; i < p.nonOptionsCount(); ++i) {
     std::string input = p.coordinate_input_file(i);
@@ -232,7 +235,7 @@ int GEMMI_MAIN(int argc, char **argv) {
         Topo topo;
         topo.warnings = &std::cerr;
         topo.initialize_refmac_topology(st, model, monlib);
-        topo.apply_all_restraints(monlib);
+        topo.apply_all_restraints(monlib, n_threads);
 
         RMSes rmses;
         std::multimap<double, std::string> line_storage;
@@ -0,0 +1,159 @@
+// Copyright 2023 Global Phasing Ltd.
+
+#include <cstdio>
+#include <cmath>               // for NAN
+#include <stdexcept>
+#include "gemmi/rscc.hpp"
+#include "gemmi/ccp4.hpp"      // for Ccp4
+#include "gemmi/gz.hpp"        // for MaybeGzipped
+#include "gemmi/it92.hpp"      // for IT92
+#include "gemmi/modify.hpp"    // for remove_hydrogens
+#include "gemmi/mmread_gz.hpp" // for read_structure_gz
+#include "gemmi/util.hpp"      // for giends_with
+#include "mapcoef.h"
+
+#define GEMMI_PROG rscc
+#include "options.h"
+
+namespace {
+
+using std::printf;
+
+enum OptionIndex { Radius=AfterMapOptions, Blur, PerAtom, NoHydrogens, Threads };
+
+const option::Descriptor Usage[] = {
+  { NoOp, 0, "", "", Arg::None,
+    "Usage:"
+    "\n " EXE_NAME " [options] MAP_OR_MTZ PDB_OR_MMCIF"
+    "\n\nReal-space correlation (RSCC) between the map and model density,"
+    "\nper residue (or per atom), calculated from map points near atoms."
+    "\nMAP_OR_MTZ is a CCP4 map (.ccp4, .map, .mrc) or map coefficients."
+    "\n\nOptions:" },
+  CommonUsage[Help],
+  CommonUsage[Version],
+  CommonUsage[Verbose],
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
+  { Radius, 0, "", "radius", Arg::Float,
+    "  --radius=NUMBER  \tUse map points within this radius from atoms"
+    " (default: 2.0 A)." },
+  { Blur, 0, "", "blur", Arg::Float,
+    "  --blur=BB  \tAdd B to all atoms when calculating model density." },
+  { PerAtom, 0, "", "atoms", Arg::None,
+    "  --atoms  \tPrint RSCC for each atom, not residue." },
+  { NoHydrogens, 0, "", "no-hydrogens", Arg::None,
+    "  --no-hydrogens  \tRemove hydrogens from the model." },
+
+  { NoOp, 0, "", "", Arg::None,
+    "\nOptions for map calculation (if map coefficients are given):" },
+  MapUsage[Diff],
+  MapUsage[Section],
+  MapUsage[FLabel],
+  MapUsage[PhLabel],
+  MapUsage[WeightLabel],
+  MapUsage[GridDims],
+  MapUsage[ExactDims],
+  MapUsage[Sample],
+  MapUsage[TimingFft],
+  { 0, 0, 0, 0, 0, 0 }
+};
+
+bool is_ccp4_map(const std::string& path) {
+  return gemmi::giends_with(path, ".ccp4") || gemmi::giends_with(path, ".map") ||
+         gemmi::giends_with(path, ".mrc");
+}
+
+int run(OptParser& p) {
+  std::string map_path = p.nonOption(0);
+  std::string model_path = p.coordinate_input_file(1);
+  bool verbose = p.options[Verbose];
+
+  if (verbose)
+    printf("Reading coordinates from %s ...\n", model_path.c_str());
+  gemmi::Structure st = gemmi::read_structure_gz(model_path);
+  if (st.models.empty() || st.models[0].chains.empty()) {
+    std::fprintf(stderr, "Not a coordinate file: %s\n", model_path.c_str());
+    return 1;
+  }
+  if (st.models.size() > 1)
+    std::fprintf(stderr, "Note: only the first model is used.\n");
+  gemmi::Model& model = st.models[0];
+  if (p.options[NoHydrogens])
+    gemmi::remove_hydrogens(model);
+
+  gemmi::Grid<float> map;
+  if (is_ccp4_map(map_path)) {
+    if (verbose)
+      printf("Reading map from %s ...\n", map_path.c_str());
+    gemmi::Ccp4<float> ccp4;
+    ccp4.read_ccp4(gemmi::MaybeGzipped(map_path));
+    ccp4.setup(NAN);
+    map = std::move(ccp4.grid);
+  } else {
+    FILE* verbose_output = verbose ? stdout : nullptr;
+    map = read_sf_and_fft_to_map(map_path.c_str(), p.options, verbose_output, true);
+  }
+  if (st.find_spacegroup() != map.spacegroup)
+    std::fprintf(stderr, "Warning: different space groups in model and map.\n");
+  if (!st.cell.approx(map.unit_cell, 0.1))
+    std::fprintf(stderr, "Warning: different unit cells in model and map.\n");
+
+  using Table = gemmi::IT92<double>;
+  auto present_elems = model.present_elements();
+  for (size_t i = 1; i != present_elems.size(); ++i)
+    if (present_elems[i] && !Table::has((gemmi::El)i))
+      gemmi::fail("Missing form factor for element ", element_name((gemmi::El)i));
+  gemmi::DensityCalculator<Table, float> dencalc;
+  if (p.options[Blur])
+    dencalc.blur = std::strtod(p.options[Blur].arg, nullptr);
+  int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+  if (verbose)
+    printf("Calculating model density on %d x %d x %d grid...\n",
+           map.nu, map.nv, map.nw);
+  gemmi::put_model_density_on_map_grid(dencalc, model, map);
+
+  double radius = 2.0;
+  if (p.options[Radius])
+    radius = std::strtod(p.options[Radius].arg, nullptr);
+  bool per_atom = p.options[PerAtom];
+  std::vector<gemmi::LocalCorrelation> result =
+    gemmi::calculate_local_correlations(dencalc, model, map, radius,
+                                        per_atom, n_threads);
+
+  printf("chain residue      %s  RSCC  points\n", per_atom ? "atom    " : "");
+  double sum = 0.;
+  size_t count = 0;
+  for (const gemmi::LocalCorrelation& lc : result) {
+    double rscc = lc.rscc();
+    if (!std::isnan(rscc)) {
+      sum += rscc;
+      ++count;
+    }
+    printf("%-5s %-12s", lc.cra.chain->name.c_str(), lc.cra.residue->str().c_str());
+    if (lc.cra.atom) {
+      std::string atom_name = lc.cra.atom->name;
+      if (lc.cra.atom->altloc)
+        atom_name += std::string(1, ':') + lc.cra.atom->altloc;
+      printf(" %-7s", atom_name.c_str());
+    }
+    printf(" %6.3f %7d\n", rscc, lc.corr.n);
+  }
+  if (count != 0)
+    printf("Mean RSCC: %.3f (%zu %s)\n", sum / count, count,
+           per_atom ? "atoms" : "residues");
+  return 0;
+}
+
+} // anonymous namespace
+
+int GEMMI_MAIN(int argc, char **argv) {
+  OptParser p(EXE_NAME);
+  p.simple_parse(argc, argv, Usage);
+  p.require_positional_args(2);
+  try {
+    return run(p);
+  } catch (std::runtime_error& e) {
+    std::fprintf(stderr, "ERROR: %s\n", e.what());
+    return 1;
+  }
+}
@@ -3,7 +3,9 @@
 // Transform MTZ or SF-mmCIF map coefficients to CCP4 map.
 
 #include <stdio.h>
+#include <cmath>               // for ceil, floor
 #include <gemmi/ccp4.hpp>      // for Ccp4
+#include <gemmi/fourier.hpp>   // for transform_f_phi_grid_to_map_box
 #include <gemmi/calculate.hpp> // for calculate_fractional_box
 #include <gemmi/select.hpp>    // for Selection
 #include <gemmi/mmread_gz.hpp> // for read_structure_gz
@@ -14,7 +16,7 @@
 
 namespace {
 
-enum OptionIndex { Normalize=AfterMapOptions, MapMask, Margin, Select };
+enum OptionIndex { Normalize=AfterMapOptions, MapMask, Margin, Select, BoxOnly };
 
 const option::Descriptor Usage[] = {
   { NoOp, 0, "", "", Arg::None,
@@ -50,44 +52,100 @@ const option::Descriptor Usage[] = {
     "  --margin=N  \t(w/ --mapmask) Border in Angstrom (default: 5)." },
   { Select, 0, "", "select", Arg::Required,
     "  --select=SEL  \t(w/ --mapmask) Selection of atoms in FILE, MMDB syntax." },
+  { BoxOnly, 0, "", "box-only", Arg::None,
+    "  --box-only  \t(w/ --mapmask) Calculate the map only in the output box"
+    " (faster and uses less memory for large cells). DMIN and DMAX in"
+    " the header are then from the box, not from the unit cell." },
   { 0, 0, 0, 0, 0, 0 }
 };
 
 
+gemmi::Box<gemmi::Fractional> get_mapmask_box(OptParser& p) {
+  double margin = 5;
+  if (p.options[Margin])
+    margin = std::atof(p.options[Margin].arg);
+  gemmi::Structure st = gemmi::read_structure_gz(p.options[MapMask].arg);
+  gemmi::Box<gemmi::Fractional> box;
+  if (p.options[Select]) {
+    gemmi::Selection sel(p.options[Select].arg);
+    for (gemmi::Model& model : sel.models(st))
+      for (gemmi::Chain& chain : sel.chains(model))
+        for (gemmi::Residue& res : sel.residues(chain))
+          for (gemmi::Atom& atom : sel.atoms(res))
+            box.extend(st.cell.fractionalize(atom.pos));
+    box.add_margins({margin * st.cell.ar, margin * st.cell.br, margin * st.cell.cr});
+  } else {
+    box = gemmi::calculate_fractional_box(st, margin);
+  }
+  return box;
+}
+
+// Calculates map only in the box, using the same grid points as set_extent().
+void transform_sf_to_map_box(OptParser& p, gemmi::Ccp4<float>& ccp4) {
+  bool verbose = p.options[Verbose];
+  gemmi::FPhiGrid<float> hkl = read_sf_to_f_phi_grid(p.nonOption(0), p.options,
+                                                     verbose ? stderr : nullptr);
+  gemmi::Box<gemmi::Fractional> box = get_mapmask_box(p);
+  gemmi::Grid<float>& grid = ccp4.grid;
+  grid.unit_cell = hkl.unit_cell;
+  grid.spacegroup = hkl.spacegroup;
+  grid.axis_order = gemmi::AxisOrder::XYZ;
+  grid.nu = hkl.nu;
+  grid.nv = hkl.nv;
+  grid.nw = 2 * (hkl.nw - 1);
+  ccp4.prepare_ccp4_header_except_mode_and_stats();
+  std::array<int, 3> start = {{(int)std::ceil(box.minimum.x * grid.nu),
+                               (int)std::ceil(box.minimum.y * grid.nv),
+                               (int)std::ceil(box.minimum.z * grid.nw)}};
+  std::array<int, 3> shape = {{(int)std::floor(box.maximum.x * grid.nu) - start[0] + 1,
+                               (int)std::floor(box.maximum.y * grid.nv) - start[1] + 1,
+                               (int)std::floor(box.maximum.z * grid.nw) - start[2] + 1}};
+  if (verbose)
+    fprintf(stderr, "Fourier transform for %d x %d x %d box...\n",
+            shape[0], shape[1], shape[2]);
+  std::array<double, 2> mean_rms = gemmi::calculate_map_mean_and_rms(hkl);
+  grid.data = gemmi::transform_f_phi_grid_to_map_box(hkl, start, shape);
+  hkl = gemmi::FPhiGrid<float>();
+  if (p.options[Normalize]) {
+    double mult = 1.0 / mean_rms[1];
+    for (float& x : grid.data)
+      x = float((x - mean_rms[0]) * mult);
+    mean_rms = {{0., 1.}};
+  }
+  // DMIN and DMAX are from the box, DMEAN and RMS from the whole cell
+  ccp4.hstats = gemmi::calculate_data_statistics(grid.data);
+  ccp4.hstats.dmean = mean_rms[0];
+  ccp4.hstats.rms = mean_rms[1];
+  ccp4.update_ccp4_header(2, false);
+  grid.nu = shape[0];
+  grid.nv = shape[1];
+  grid.nw = shape[2];
+  ccp4.set_header_3i32(1, grid.nu, grid.nv, grid.nw); // NX, NY, NZ
+  ccp4.set_header_3i32(5, start[0], start[1], start[2]);
+  grid.axis_order = gemmi::AxisOrder::Unknown;
+}
+
 void transform_sf_to_map(OptParser& p) {
   const char* input_path = p.nonOption(0);
   const char* map_path = p.options[GridQuery] ? nullptr : p.nonOption(1);
   gemmi::Ccp4<float> ccp4;
-  ccp4.grid = read_sf_and_fft_to_map(input_path, p.options,
-                                     p.options[Verbose] ? stderr : nullptr);
-  if (p.options[Verbose])
-    fprintf(stderr, "Writing %s ...\n", map_path);
-  ccp4.update_ccp4_header(2);
-  if (p.options[Normalize]) {
-    double mult = 1.0 / ccp4.hstats.rms;
-    for (float& x : ccp4.grid.data)
-      x = float((x - ccp4.hstats.dmean) * mult);
+  if (p.options[BoxOnly]) {
+    transform_sf_to_map_box(p, ccp4);
+  } else {
+    ccp4.grid = read_sf_and_fft_to_map(input_path, p.options,
+                                       p.options[Verbose] ? stderr : nullptr);
     ccp4.update_ccp4_header(2);
-  }
-  if (p.options[MapMask]) {
-    double margin = 5;
-    if (p.options[Margin])
-      margin = std::atof(p.options[Margin].arg);
-    gemmi::Structure st = gemmi::read_structure_gz(p.options[MapMask].arg);
-    gemmi::Box<gemmi::Fractional> box;
-    if (p.options[Select]) {
-      gemmi::Selection sel(p.options[Select].arg);
-      for (gemmi::Model& model : sel.models(st))
-        for (gemmi::Chain& chain : sel.chains(model))
-          for (gemmi::Residue& res : sel.residues(chain))
-            for (gemmi::Atom& atom : sel.atoms(res))
-              box.extend(st.cell.fractionalize(atom.pos));
-      box.add_margins({margin * st.cell.ar, margin * st.cell.br, margin * st.cell.cr});
-    } else {
-      box = gemmi::calculate_fractional_box(st, margin);
+    if (p.options[Normalize]) {
+      double mult = 1.0 / ccp4.hstats.rms;
+      for (float& x : ccp4.grid.data)
+        x = float((x - ccp4.hstats.dmean) * mult);
+      ccp4.update_ccp4_header(2);
     }
-    ccp4.set_extent(box);
+    if (p.options[MapMask])
+      ccp4.set_extent(get_mapmask_box(p));
   }
+  if (p.options[Verbose])
+    fprintf(stderr, "Writing %s ...\n", map_path);
   ccp4.write_ccp4_map(map_path);
 }
 
@@ -100,6 +158,14 @@ int GEMMI_MAIN(int argc, char **argv) {
     p.require_input_files_as_args(0);
   else
     p.require_positional_args(2);
+  if (p.options[BoxOnly] && !p.options[MapMask]) {
+    fprintf(stderr, "Option --box-only requires --mapmask.\n");
+    return 1;
+  }
+  if (p.options[BoxOnly] && p.options[AxesZyx]) {
+    fprintf(stderr, "Option --box-only does not work with --zyx.\n");
+    return 1;
+  }
   try {
     transform_sf_to_map(p);
   } catch (std::runtime_error& e) {
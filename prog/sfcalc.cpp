@@ -33,7 +33,7 @@ namespace {
 enum OptionIndex {
   Hkl=4, Dmin, For, NormalizeIt92, Rate, Blur, RCut, Test, ToMtz, Compare,
   CifFp, Wavelength, Unknown, NoAniso, Margin, ScaleTo, FLabel,
-  PhiLabel, Ksolv, Bsolv, Baniso, RadiiSet, Rprobe, Rshrink, WriteMap
+  PhiLabel, Ksolv, Bsolv, Baniso, RadiiSet, Rprobe, Rshrink, WriteMap, Threads
 };
 
 struct SfCalcArg: public Arg {
@@ -95,6 +95,8 @@ const option::Descriptor Usage[] = {
     "  --noaniso  \tIgnore anisotropic ADPs." },
   { Margin, 0, "", "margin", Arg::Float,
     "  --margin=NUM  \tFor non-crystal use bounding box w/ margin (default: 10)." },
+  { Threads, 0, "j", "threads", Arg::Int,
+    "  -j, --threads=N  \tNumber of threads (default: 1, 0 = all CPUs)." },
 
   { NoOp, 0, "", "", Arg::None,
     "\nOptions for density and FFT calculations (with --dmin):" },
@@ -344,10 +346,9 @@ template<typename Table>
 void print_structure_factors_sm(const gemmi::SmallStructure& small,
                                 gemmi::StructureFactorCalculator<Table>& calc,
                                 bool mott_bethe, double d_min, bool verbose,
-                                const RefFile& file) {
+                                int n_threads, const RefFile& file) {
   Timer timer(verbose);
   timer.start();
-  int counter = 0;
   // cf. prepare_asu_data()
   double max_1_d = 1. / d_min;
   int max_h = int(max_1_d / small.cell.ar);
@@ -357,8 +358,8 @@ void print_structure_factors_sm(const gemmi::SmallStructure& small,
   if (!sg)
     sg = &gemmi::get_spacegroup_p1();
   gemmi::ReciprocalAsu asu(sg);
-  gemmi::AsuData<std::complex<double>> asu_data;
   gemmi::GroupOps gops = sg->operations();
+  std::vector<gemmi::Miller> hkls;
   for (int h = -max_h; h <= max_h; ++h)
     for (int k = -max_k; k <= max_k; ++k)
       for (int l = 0; l <= max_l; ++l) {
@@ -368,26 +369,30 @@ void print_structure_factors_sm(const gemmi::SmallStructure& small,
         if (gops.is_systematically_absent(hkl))
           continue;
         double hkl_1_d2 = small.cell.calculate_1_d2(hkl);
-        if (hkl_1_d2 < max_1_d * max_1_d) {
-          auto value = calc.calculate_sf_from_small_structure(small, hkl);
-          if (mott_bethe)
-            value *= calc.mott_bethe_factor();
-          if (file.mode == RefFile::Mode::WriteMtz)
-            asu_data.v.push_back({hkl, value});
-          else
-            print_sf(value, hkl);
-          ++counter;
-        }
+        if (hkl_1_d2 < max_1_d * max_1_d)
+          hkls.push_back(hkl);
       }
+  calc.tabulate_form_factors_for_dmin(d_min);
+  std::vector<std::complex<double>> values =
+    calc.calculate_sf_from_small_structure(small, hkls, n_threads);
+  if (mott_bethe)
+    for (size_t i = 0; i < hkls.size(); ++i)
+      values[i] *= calc.mott_bethe_factor(hkls[i]);
   if (verbose) {
-    fflush(stdout);
-    fprintf(stderr, "Calculated %d SFs in %g s.\n", counter, timer.count());
+    fprintf(stderr, "Calculated %d SFs in %g s.\n", (int) hkls.size(), timer.count());
     fflush(stderr);
   }
   if (file.mode == RefFile::Mode::WriteMtz) {
+    gemmi::AsuData<std::complex<double>> asu_data;
+    asu_data.v.reserve(hkls.size());
+    for (size_t i = 0; i < hkls.size(); ++i)
+      asu_data.v.push_back({hkls[i], values[i]});
     asu_data.unit_cell_ = small.cell;
     asu_data.spacegroup_ = sg;
     write_asudata_to_mtz(asu_data, file);
+  } else {
+    for (size_t i = 0; i < hkls.size(); ++i)
+      print_sf(values[i], hkls[i]);
   }
 }
 
@@ -638,6 +643,10 @@ void process_with_table(bool use_st, gemmi::Structure& st, const gemmi::SmallStr
         masker.rshrink = std::atof(p.options[Rshrink].arg);
 
       gemmi::Scaling<Real> scaling(cell, st.find_spacegroup());
+      if (p.options[Threads]) {
+        scaling.n_threads = std::atoi(p.options[Threads].arg);
+        masker.n_threads = scaling.n_threads;
+      }
       if (p.options[Ksolv] || p.options[Bsolv]) {
         scaling.use_solvent = true;
         if (p.options[Ksolv])
@@ -664,7 +673,9 @@ void process_with_table(bool use_st, gemmi::Structure& st, const gemmi::SmallStr
           p.options[Test])
         gemmi::fail("Small molecule SFs are calculated directly. Do not use any\n"
                     "of the FFT-related options: --rate, --blur, --rcut, --test.");
-      print_structure_factors_sm(small, calc, mott_bethe, d_min, p.options[Verbose], file);
+      int n_threads = p.options[Threads] ? std::atoi(p.options[Threads].arg) : 1;
+      print_structure_factors_sm(small, calc, mott_bethe, d_min, p.options[Verbose],
+                                 n_threads, file);
     }
 
   // handle option --compare
@@ -2,8 +2,10 @@
 
 #include "gemmi/align.hpp"     // for align_sequence_to_polymer
 #include "gemmi/seqalign.hpp"  // for align_string_sequences
+#include "gemmi/ensemble.hpp"  // for EnsembleRmsd
 
 #include "common.h"
+#include "arrvec.h"  // py_array_from_vector
 #include <pybind11/stl.h>
 
 namespace py = pybind11;
@@ -72,11 +74,60 @@ void add_alignment(py::module& m) {
         }, py::arg("fixed"), py::arg("movable"), py::arg("ptype"), py::arg("sel"),
            py::arg("trim_cycles")=0, py::arg("trim_cutoff")=2.0,
            py::arg("altloc")='\0');
+  m.def("calculate_superposition",
+        [](const FlatStructure& fixed, size_t fixed_model,
+           const FlatStructure& movable, size_t movable_model, PolymerType ptype,
+           SupSelect sel, int trim_cycles, double trim_cutoff, char altloc) {
+          return calculate_superposition(fixed, fixed_model, movable, movable_model,
+                                         ptype, sel, trim_cycles, trim_cutoff, altloc);
+        }, py::arg("fixed"), py::arg("fixed_model"),
+           py::arg("movable"), py::arg("movable_model"),
+           py::arg("ptype"), py::arg("sel"),
+           py::arg("trim_cycles")=0, py::arg("trim_cutoff")=2.0,
+           py::arg("altloc")='\0');
   m.def("calculate_superpositions_in_moving_window",
         [](const ResidueSpan& fixed, const ResidueSpan& movable, PolymerType ptype,
            double radius) {
           return calculate_superpositions_in_moving_window(fixed, movable, ptype, radius);
         }, py::arg("fixed"), py::arg("movable"), py::arg("ptype"), py::arg("radius")=10.0);
+  m.def("calculate_superpositions_in_moving_window",
+        [](const FlatStructure& flat, size_t ref_model, PolymerType ptype,
+           double radius, int n_threads) {
+          py::gil_scoped_release release;
+          return calculate_superpositions_in_moving_window(flat, ref_model, ptype,
+                                                           radius, n_threads);
+        }, py::arg("flat"), py::arg("ref_model"), py::arg("ptype"),
+           py::arg("radius")=10.0, py::arg("n_threads")=1);
+
+  py::class_<EnsembleRmsd>(m, "EnsembleRmsd")
+    .def(py::init<const FlatStructure&, PolymerType, SupSelect, char>(),
+         py::arg("flat"), py::arg("ptype"), py::arg("sel"), py::arg("altloc")='\0')
+    .def_readonly("n_models", &EnsembleRmsd::n_models)
+    .def_readonly("n_atoms", &EnsembleRmsd::n_atoms)
+    .def_readwrite("tile_size", &EnsembleRmsd::tile_size)
+    .def("rmsd", &EnsembleRmsd::rmsd, py::arg("i"), py::arg("j"))
+    .def("calculate_matrix", [](const EnsembleRmsd& self, int n_threads) {
+        std::vector<double> v;
+        {
+          py::gil_scoped_release release;
+          v = self.calculate_matrix(n_threads);
+        }
+        return py_array_from_vector(std::move(v)).attr("reshape")(self.n_models,
+                                                                  self.n_models);
+    }, py::arg("n_threads")=1)
+    .def("calculate_rows", [](const EnsembleRmsd& self, size_t row_begin,
+                              size_t row_end, int n_threads) {
+        row_end = std::min(row_end, self.n_models);
+        size_t n_rows = row_end > row_begin ? row_end - row_begin : 0;
+        std::vector<double> v(n_rows * self.n_models);
+        {
+          py::gil_scoped_release release;
+          self.calculate_rows(row_begin, row_end, v.data(), n_threads);
+        }
+        return py_array_from_vector(std::move(v)).attr("reshape")(n_rows,
+                                                                  self.n_models);
+    }, py::arg("row_begin"), py::arg("row_end"), py::arg("n_threads")=1)
+    ;
 
   m.def("superpose_positions",
         [](std::vector<Position> pos1, std::vector<Position> pos2,
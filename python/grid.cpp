@@ -13,8 +13,10 @@ bool operator>(const std::complex<float>& a, const std::complex<float>& b) {
 #include "gemmi/grid.hpp"
 #include "gemmi/floodfill.hpp"  // for flood_fill_above
 #include "gemmi/solmask.hpp"  // for SolventMasker, mask_points_in_constant_radius
-#include "gemmi/blob.hpp"     // for Blob, find_blobs_by_flood_fill
-#include "gemmi/asumask.hpp"  // for MaskedGrid
+#include "gemmi/blob.hpp"     // for Blob, find_blobs_by_flood_fill, ...
+#include "gemmi/asumask.hpp"  // for MaskedGrid, get_asu_bit_mask
+#include "gemmi/bitgrid.hpp"  // for BitGrid
+#include "gemmi/interp.hpp"   // for tricubic_interpolation_der_batch
 #include "tostr.hpp"
 
 #include "common.h"
@@ -181,6 +183,38 @@ void add_grid_interpolation(py::class_<Grid<T>, GridBase<T>>& grid) {
     .def("tricubic_interpolation_der",
          (std::array<double,4> (Gr::*)(const Fractional&) const)
          &Gr::tricubic_interpolation_der)
+    .def("tricubic_interpolation_der_batch",
+         [](const Gr& self, py::array_t<double> positions, int threads) {
+      auto p = positions.template unchecked<2>();
+      if (p.shape(1) != 3)
+        throw std::domain_error("the positions array must have size N x 3");
+      std::vector<Position> pos;
+      pos.reserve(p.shape(0));
+      for (py::ssize_t i = 0; i < p.shape(0); ++i)
+        pos.emplace_back(p(i, 0), p(i, 1), p(i, 2));
+      py::array_t<double> result({p.shape(0), (py::ssize_t)4});
+      auto r = result.template mutable_unchecked<2>();
+      std::vector<std::array<double,4>> values;
+      {
+        py::gil_scoped_release release;
+        values = tricubic_interpolation_der_batch(self, pos, threads);
+      }
+      for (py::ssize_t i = 0; i < p.shape(0); ++i)
+        for (py::ssize_t j = 0; j < 4; ++j)
+          r(i, j) = values[i][j];
+      return result;
+    }, py::arg("positions"), py::arg("threads")=1)
+    .def("tricubic_interpolation_der_of_atoms",
+         [](const Gr& self, const Model& model, int threads) {
+      std::vector<std::array<double,4>> values =
+          tricubic_interpolation_der_of_atoms(self, model, threads);
+      py::array_t<double> result({(py::ssize_t)values.size(), (py::ssize_t)4});
+      auto r = result.template mutable_unchecked<2>();
+      for (size_t i = 0; i < values.size(); ++i)
+        for (py::ssize_t j = 0; j < 4; ++j)
+          r(i, j) = values[i][j];
+      return result;
+    }, py::arg("model"), py::arg("threads")=1)
     ;
 }
 
@@ -224,6 +258,45 @@ void add_grid(py::module& m) {
 
   add_grid_base<std::complex<float>>(m, "ComplexGridBase");
 
+  py::class_<BitGrid, GridMeta>(m, "BitGrid")
+    .def(py::init<>())
+    .def("set_size", &BitGrid::set_size)
+    .def("copy_metadata_from", &BitGrid::copy_metadata_from)
+    .def("get_value", [](const BitGrid& self, int u, int v, int w) {
+        return self.get_value_q(modulo(u, self.nu), modulo(v, self.nv), modulo(w, self.nw));
+    })
+    .def("set_value", [](BitGrid& self, int u, int v, int w, bool value) {
+        self.set(self.index_q(modulo(u, self.nu), modulo(v, self.nv), modulo(w, self.nw)),
+                 value);
+    })
+    .def("fill", &BitGrid::fill)
+    .def("invert", &BitGrid::invert)
+    .def("count", &BitGrid::count)
+    .def("__iand__", [](py::object self, const BitGrid& other) {
+        self.cast<BitGrid&>() &= other;
+        return self;
+    }, py::is_operator())
+    .def("__ior__", [](py::object self, const BitGrid& other) {
+        self.cast<BitGrid&>() |= other;
+        return self;
+    }, py::is_operator())
+    .def("from_grid", &BitGrid::from_grid<int8_t>)
+    .def("from_grid", &BitGrid::from_grid<float>)
+    .def("to_int8_grid", [](const BitGrid& self) {
+        Grid<int8_t>* grid = new Grid<int8_t>();
+        self.to_grid(*grid);
+        return grid;
+    })
+    .def("to_float_grid", [](const BitGrid& self) {
+        Grid<float>* grid = new Grid<float>();
+        self.to_grid(*grid);
+        return grid;
+    })
+    .def("__repr__", [](const BitGrid& self) {
+        return tostr("<gemmi.BitGrid(", self.nu, ", ", self.nv, ", ", self.nw, ")>");
+    });
+  m.def("get_asu_bit_mask", &get_asu_bit_mask, py::arg("grid"));
+
   // from solmask.hpp
   py::enum_<AtomicRadiiSet>(m, "AtomicRadiiSet")
     .value("VanDerWaals", AtomicRadiiSet::VanDerWaals)
@@ -238,10 +311,23 @@ void add_grid(py::module& m) {
     .def_readwrite("rshrink", &SolventMasker::rshrink)
     .def_readwrite("island_min_volume", &SolventMasker::island_min_volume)
     .def_readwrite("constant_r", &SolventMasker::constant_r)
+    .def_readwrite("n_threads", &SolventMasker::n_threads)
     .def("set_radii", &SolventMasker::set_radii,
          py::arg("choice"), py::arg("constant_r")=0.)
-    .def("put_mask_on_int8_grid", &SolventMasker::put_mask_on_grid<int8_t>)
-    .def("put_mask_on_float_grid", &SolventMasker::put_mask_on_grid<float>)
+    .def("put_mask_on_int8_grid",
+         (void (SolventMasker::*)(Grid<int8_t>&, const Model&) const)
+           &SolventMasker::put_mask_on_grid<int8_t>)
+    .def("put_mask_on_int8_grid",
+         (void (SolventMasker::*)(Grid<int8_t>&, const FlatStructure&, size_t) const)
+           &SolventMasker::put_mask_on_grid<int8_t>,
+         py::arg("grid"), py::arg("flat"), py::arg("model")=0)
+    .def("put_mask_on_float_grid",
+         (void (SolventMasker::*)(Grid<float>&, const Model&) const)
+           &SolventMasker::put_mask_on_grid<float>)
+    .def("put_mask_on_float_grid",
+         (void (SolventMasker::*)(Grid<float>&, const FlatStructure&, size_t) const)
+           &SolventMasker::put_mask_on_grid<float>,
+         py::arg("grid"), py::arg("flat"), py::arg("model")=0)
     .def("set_to_zero", &SolventMasker::set_to_zero)
     ;
   m.def("interpolate_grid", &interpolate_grid<float>,
@@ -270,6 +356,18 @@ void add_grid(py::module& m) {
        return find_blobs_by_flood_fill(grid, crit, negate);
     }, py::arg("grid"), py::arg("cutoff"), py::arg("min_volume")=10.,
        py::arg("min_score")=15., py::arg("min_peak")=0., py::arg("negate")=false);
+  m.def("find_blobs_by_labeling",
+        [](const Grid<float>& grid, double cutoff, double min_volume,
+           double min_score, double min_peak, bool negate, int n_threads) {
+       BlobCriteria crit;
+       crit.cutoff = cutoff;
+       crit.min_volume = min_volume;
+       crit.min_score = min_score;
+       crit.min_peak = min_peak;
+       return find_blobs_by_labeling(grid, crit, negate, n_threads);
+    }, py::arg("grid"), py::arg("cutoff"), py::arg("min_volume")=10.,
+       py::arg("min_score")=15., py::arg("min_peak")=0., py::arg("negate")=false,
+       py::arg("n_threads")=1);
 
   // from floodfill.hpp
   m.def("flood_fill_above", &flood_fill_above,
@@ -78,22 +78,23 @@ void add_hkl(py::module& m) {
                                  const std::string& f_col,
                                  const std::string& phi_col,
                                  std::array<int, 3> size,
-                                 bool half_l, AxisOrder order) {
+                                 bool half_l, AxisOrder order, int threads) {
         size_t f_idx = self.get_column_index(f_col);
         size_t phi_idx = self.get_column_index(phi_col);
         FPhiProxy<ReflnDataProxy> fphi(ReflnDataProxy{self}, f_idx, phi_idx);
-        return get_f_phi_on_grid<float>(fphi, size, half_l, order);
+        return get_f_phi_on_grid<float>(fphi, size, half_l, order, threads);
     }, py::arg("f"), py::arg("phi"), py::arg("size"),
-       py::arg("half_l")=false, py::arg("order")=AxisOrder::XYZ)
+       py::arg("half_l")=false, py::arg("order")=AxisOrder::XYZ,
+       py::arg("threads")=1)
     .def("get_value_on_grid", [](const ReflnBlock& self,
                                  const std::string& column,
                                  std::array<int, 3> size,
-                                 bool half_l, AxisOrder order) {
+                                 bool half_l, AxisOrder order, int threads) {
         size_t col_idx = self.get_column_index(column);
         return get_value_on_grid<float>(ReflnDataProxy(self), col_idx,
-                                        size, half_l, order);
+                                        size, half_l, order, threads);
     }, py::arg("column"), py::arg("size"), py::arg("half_l")=false,
-       py::arg("order")=AxisOrder::XYZ)
+       py::arg("order")=AxisOrder::XYZ, py::arg("threads")=1)
     .def("transform_f_phi_to_map", [](const ReflnBlock& self,
                                       const std::string& f_col,
                                       const std::string& phi_col,
@@ -136,6 +137,18 @@ void add_hkl(py::module& m) {
   m.def("transform_f_phi_grid_to_map", [](FPhiGrid<float> grid) {
           return transform_f_phi_grid_to_map<float>(std::move(grid));
         }, py::arg("grid"));
+  m.def("transform_f_phi_grid_to_map_box", [](const FPhiGrid<float>& grid,
+                                               std::array<int,3> start,
+                                               std::array<int,3> shape) {
+          std::vector<float> v = transform_f_phi_grid_to_map_box(grid, start, shape);
+          // data is copied to the new numpy array
+          return py::array_t<float>({shape[0], shape[1], shape[2]},
+                                    {sizeof(float), sizeof(float)*shape[0],
+                                     sizeof(float)*shape[0]*shape[1]},
+                                    v.data());
+        }, py::arg("grid"), py::arg("start"), py::arg("shape"));
+  m.def("calculate_map_mean_and_rms", &calculate_map_mean_and_rms<float>,
+        py::arg("grid"));
   m.def("transform_map_to_f_phi", &transform_map_to_f_phi<float>,
         py::arg("map"), py::arg("half_l")=false, py::arg("use_scale")=true);
   m.def("cromer_liberman", [](int z, double energy) {
@@ -341,4 +354,42 @@ void add_hkl(py::module& m) {
     })
     .def_readonly("pos", &HklMatch::pos)
     ;
+
+  py::class_<HklJoin>(m, "HklJoin")
+    .def_property_readonly("hkl", [](const HklJoin& self) {
+        return py::array_t<int>({(py::ssize_t)self.hkl.size(), (py::ssize_t)3},
+                                (const int*) self.hkl.data());
+    })
+    .def_property_readonly("pos", [](const HklJoin& self) {
+        return py::array_t<int>({(py::ssize_t)self.hkl.size(), (py::ssize_t)self.ncol},
+                                self.pos.data());
+    })
+    .def("keep_only_complete", &HklJoin::keep_only_complete)
+    .def("aligned", [](const HklJoin& self, size_t col, py::array_t<double> vec) {
+        auto v = vec.unchecked<1>();
+        if (col >= self.ncol)
+          fail("HklJoin.aligned(): wrong column index");
+        py::array_t<double> result(self.hkl.size());
+        double* ptr = (double*) result.request().ptr;
+        for (size_t i = 0; i != self.hkl.size(); ++i) {
+          int p = self.pos[i * self.ncol + col];
+          if (p >= v.shape(0))
+            fail("HklJoin.aligned(): wrong data, too short");
+          ptr[i] = p >= 0 ? v(p) : NAN;
+        }
+        return result;
+    }, py::arg("col"), py::arg("vec"))
+    .def("__len__", [](const HklJoin& self) { return self.hkl.size(); })
+    ;
+  m.def("join_hkl", [](const std::vector<py::array_t<int, py::array::c_style>>& arrays,
+                       int n_threads) {
+    std::vector<std::pair<const Miller*, size_t>> data;
+    for (const auto& arr : arrays) {
+      if (arr.ndim() != 2 || arr.shape(1) != 3)
+        throw std::domain_error("the hkl arrays must have size N x 3");
+      data.emplace_back((const Miller*) arr.data(), arr.shape(0));
+    }
+    py::gil_scoped_release release;
+    return join_hkl(data, n_threads);
+  }, py::arg("hkl_arrays"), py::arg("threads")=1);
 }
@@ -1,16 +1,22 @@
 // Copyright 2017 Global Phasing Ltd.
 
+#include <sstream>  // for ostringstream
 #include "gemmi/model.hpp"
 #include "gemmi/calculate.hpp"  // for calculate_mass, count_atom_sites
 #include "gemmi/modify.hpp"     // for remove_alternative_conformations
 #include "gemmi/polyheur.hpp"   // for one_letter_code, trim_to_alanine
 #include "gemmi/assembly.hpp"   // for expand_ncs, HowToNameCopiedChain
 #include "gemmi/select.hpp"     // for Selection
+#include "gemmi/flat.hpp"       // for FlatStructure
+#include "gemmi/to_pdb.hpp"     // for write_minimal_pdb
+#include "gemmi/to_mmcif.hpp"   // for write_minimal_mmcif
+#include "gemmi/fstream.hpp"    // for Ofstream
 #include "tostr.hpp"
 
 #include "common.h"
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
+#include <pybind11/numpy.h>
 #include "meta.h"
 
 namespace py = pybind11;
@@ -50,6 +56,13 @@ template<typename P> void remove_children(P& parent, py::slice slice) {
   delitem_slice(parent.children(), slice);
 }
 
+// numpy array with a copy of FlatStructure's column (a view would be
+// left dangling when the vector is reallocated, e.g. by set_structure())
+template<typename T>
+py::array_t<T> flat_array(const std::vector<T>& vec) {
+  return py::array_t<T>((py::ssize_t)vec.size(), vec.data());
+}
+
 void add_mol(py::module& m) {
 
   // "Forward declaration" of python classes to avoid
@@ -518,11 +531,59 @@ void add_mol(py::module& m) {
   m.def("calculate_sequence_weight", &calculate_sequence_weight,
         py::arg("sequence"), py::arg("unknown")=0.);
   m.def("make_assembly", [](const Assembly& assembly, const Model& model,
-                            HowToNameCopiedChain how) {
-        return make_assembly(assembly, model, how, nullptr);
-  });
+                            HowToNameCopiedChain how, double merge_dist) {
+        return make_assembly(assembly, model, how, nullptr, merge_dist);
+  }, py::arg("assembly"), py::arg("model"), py::arg("how"), py::arg("merge_dist")=0.);
+  py::class_<AssemblyView> assembly_view(m, "AssemblyView");
+  py::class_<AssemblyView::ChainCopy>(assembly_view, "ChainCopy")
+    .def_readonly("name", &AssemblyView::ChainCopy::name)
+    .def_property_readonly("chain", [](const AssemblyView::ChainCopy& self) {
+        return self.chain;
+    }, py::return_value_policy::reference)
+    .def_readonly("oper_idx", &AssemblyView::ChainCopy::oper_idx)
+    .def_readonly("subchains", &AssemblyView::ChainCopy::subchains)
+    .def("__repr__", [](const AssemblyView::ChainCopy& self) {
+        return "<gemmi.AssemblyView.ChainCopy " + self.name + " of " +
+               self.chain->name + ">";
+    });
+  assembly_view
+    .def_readonly("opers", &AssemblyView::opers)
+    .def_readonly("copies", &AssemblyView::copies)
+    .def("atom_count", &AssemblyView::atom_count)
+    .def("original_atom", &AssemblyView::original_atom,
+         py::arg("n_copy"), py::arg("n_res"), py::arg("n_atom"),
+         py::return_value_policy::reference_internal)
+    .def("to_model", &AssemblyView::to_model)
+    .def("write_minimal_pdb", [](const AssemblyView& self, const std::string& path) {
+       Ofstream f(path);
+       write_minimal_pdb(self, f.ref());
+    }, py::arg("path"))
+    .def("make_minimal_pdb", [](const AssemblyView& self) -> std::string {
+       std::ostringstream os;
+       write_minimal_pdb(self, os);
+       return os.str();
+    })
+    .def("write_minimal_mmcif", [](const AssemblyView& self, const std::string& path,
+                                   const std::string& block_name) {
+       Ofstream f(path);
+       write_minimal_mmcif(self, f.ref(), block_name);
+    }, py::arg("path"), py::arg("block_name"))
+    .def("make_minimal_mmcif", [](const AssemblyView& self, const std::string& block_name) {
+       std::ostringstream os;
+       write_minimal_mmcif(self, os, block_name);
+       return os.str();
+    }, py::arg("block_name"))
+    .def("__repr__", [](const AssemblyView& self) {
+        return cat("<gemmi.AssemblyView with ", self.copies.size(),
+                   " chain copies, ", self.atom_count(), " atoms>");
+    });
+  m.def("make_assembly_view", [](const Assembly& assembly, const Model& model,
+                                 HowToNameCopiedChain how) {
+        return make_assembly_view(assembly, model, how, nullptr);
+  }, py::arg("assembly"), py::arg("model"), py::arg("how"), py::keep_alive<0, 2>());
   m.def("merge_atoms_in_expanded_model", &merge_atoms_in_expanded_model,
-        py::arg("model"), py::arg("cell"), py::arg("max_dist")=0.2);
+        py::arg("model"), py::arg("cell"), py::arg("max_dist")=0.2,
+        py::arg("n_threads")=1);
 
   // select.hpp
   py::class_<FilterProxy<Selection, Model>> pySelectionModelsProxy(m, "SelectionModelsProxy");
@@ -573,4 +634,34 @@ void add_mol(py::module& m) {
     .def("__iter__", [](FilterProxy<Selection, Atom>& self) {
         return py::make_iterator(self);
     }, py::keep_alive<0, 1>());
+
+  py::class_<FlatStructure>(m, "FlatStructure")
+    .def(py::init<>())
+    .def(py::init<const Structure&>(), py::arg("st"))
+    .def("set_structure", &FlatStructure::set_structure, py::arg("st"))
+    .def("to_structure", &FlatStructure::to_structure)
+    .def("copy_to", &FlatStructure::copy_to, py::arg("st"))
+    .def("atom_count", &FlatStructure::atom_count)
+    .def("residue_count", &FlatStructure::residue_count)
+    .def("chain_count", &FlatStructure::chain_count)
+    .def("model_count", &FlatStructure::model_count)
+    .def("position", &FlatStructure::position, py::arg("n"))
+    .def("set_position", &FlatStructure::set_position, py::arg("n"), py::arg("pos"))
+    .def("get_atom_name", &FlatStructure::get_atom_name, py::arg("n"))
+    .def("model_atom_range", [](const FlatStructure& self, size_t m) {
+        self.check_model(m);
+        return py::make_tuple(self.model_atom_begin(m), self.model_atom_end(m));
+    }, py::arg("model"))
+    .def_property_readonly("x", [](const FlatStructure& self) { return flat_array(self.x); })
+    .def_property_readonly("y", [](const FlatStructure& self) { return flat_array(self.y); })
+    .def_property_readonly("z", [](const FlatStructure& self) { return flat_array(self.z); })
+    .def_property_readonly("occ", [](const FlatStructure& self) { return flat_array(self.occ); })
+    .def_property_readonly("b_iso", [](const FlatStructure& self) { return flat_array(self.b_iso); })
+    .def_readonly("name", &FlatStructure::name)
+    .def_readonly("cell", &FlatStructure::cell)
+    .def_readonly("spacegroup_hm", &FlatStructure::spacegroup_hm)
+    .def("__repr__", [](const FlatStructure& self) {
+        return tostr("<gemmi.FlatStructure ", self.name, " with ",
+                     self.atom_count(), " atoms in ", self.model_count(), " model(s)>");
+    });
 }
@@ -104,6 +104,18 @@ void add_monlib(py::module& m) {
                                 const std::vector<std::string>& resnames) {
       return self.read_monomer_lib(monomer_dir, resnames, gemmi::read_cif_gz);
     })
+    .def("read_monomer_lib_with_snapshot", [](MonLib& self, const std::string& monomer_dir,
+                                              const std::vector<std::string>& resnames,
+                                              const std::string& snapshot_path) {
+      return read_monomer_lib_with_snapshot(self, monomer_dir, resnames,
+                                            gemmi::read_cif_gz, snapshot_path);
+    }, py::arg("monomer_dir"), py::arg("resnames"), py::arg("snapshot_path"))
+    .def("write_snapshot", [](const MonLib& self, const std::string& path) {
+      write_monlib_snapshot(self, path);
+    }, py::arg("path"))
+    .def("read_snapshot", [](MonLib& self, const std::string& path) {
+      return read_monlib_snapshot(self, path);
+    }, py::arg("path"))
     .def("find_ideal_distance", [](const MonLib& self, CRA &cra1, CRA cra2) {
       return self.find_ideal_distance(cra1, cra2);
     })
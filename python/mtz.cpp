@@ -146,23 +146,26 @@ void add_mtz(py::module& m) {
                                  const std::string& phi_col,
                                  std::array<int, 3> size,
                                  bool half_l,
-                                 AxisOrder order) {
+                                 AxisOrder order,
+                                 int threads) {
         const Mtz::Column& f = self.get_column_with_label(f_col);
         const Mtz::Column& phi = self.get_column_with_label(phi_col);
         FPhiProxy<MtzDataProxy> fphi(MtzDataProxy{self}, f.idx, phi.idx);
-        return get_f_phi_on_grid<float>(fphi, size, half_l, order);
+        return get_f_phi_on_grid<float>(fphi, size, half_l, order, threads);
     }, py::arg("f"), py::arg("phi"), py::arg("size"),
-       py::arg("half_l")=false, py::arg("order")=AxisOrder::XYZ)
+       py::arg("half_l")=false, py::arg("order")=AxisOrder::XYZ,
+       py::arg("threads")=1)
     .def("get_value_on_grid", [](const Mtz& self,
                                  const std::string& label,
                                  std::array<int, 3> size,
                                  bool half_l,
-                                 AxisOrder order) {
+                                 AxisOrder order,
+                                 int threads) {
         const Mtz::Column& col = self.get_column_with_label(label);
         return get_value_on_grid<float>(MtzDataProxy{self}, col.idx,
-                                        size, half_l, order);
+                                        size, half_l, order, threads);
     }, py::arg("label"), py::arg("size"), py::arg("half_l")=false,
-       py::arg("order")=AxisOrder::XYZ)
+       py::arg("order")=AxisOrder::XYZ, py::arg("threads")=1)
     .def("transform_f_phi_to_map", [](const Mtz& self,
                                       const std::string& f_col,
                                       const std::string& phi_col,
@@ -309,6 +312,24 @@ void add_mtz(py::module& m) {
     .def_readonly("axes", &Mtz::Batch::axes)
     ;
 
+  py::class_<MtzWriter>(m, "MtzWriter")
+    .def(py::init<const Mtz&, const std::string&, int>(),
+         py::arg("mtz"), py::arg("path"), py::arg("threads")=1,
+         py::keep_alive<1, 2>())
+    .def("write_rows", [](MtzWriter& self, py::array_t<float, py::array::c_style> arr) {
+         if (arr.ndim() != 2)
+           fail("MtzWriter.write_rows(): expected 2D array.");
+         if ((size_t) arr.shape(1) != self.mtz().columns.size())
+           fail("MtzWriter.write_rows(): expected " +
+                std::to_string(self.mtz().columns.size()) + " columns.");
+         self.write_rows(arr.data(), (size_t) arr.shape(0));
+    }, py::arg("array"))
+    .def("finish", &MtzWriter::finish)
+    .def_property_readonly("nreflections", &MtzWriter::nreflections)
+    .def_readwrite("compression_level", &MtzWriter::compression_level)
+    .def_static("can_write_gzip", &MtzWriter::can_write_gzip)
+    ;
+
   m.def("read_mtz_file", [](const std::string& path) {
       return read_mtz(MaybeGzipped(path), true);
   }, py::arg("path"), py::return_value_policy::move);
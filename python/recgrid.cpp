@@ -37,7 +37,8 @@ template<> void add_to_asu_data(py::class_<AsuData<std::complex<float>>>& cl) {
          py::arg("min_size")=std::array<int,3>{{0,0,0}}, py::arg("sample_rate")=0.);
   cl.def("data_fits_into", &data_fits_into<AsuData>, py::arg("size"));
   cl.def("get_f_phi_on_grid", get_f_phi_on_grid<float, AsuData>,
-         py::arg("size"), py::arg("half_l")=false, py::arg("order")=AxisOrder::XYZ);
+         py::arg("size"), py::arg("half_l")=false, py::arg("order")=AxisOrder::XYZ,
+         py::arg("threads")=1);
   cl.def("transform_f_phi_to_map", &transform_f_phi_to_map2<float, AsuData>,
          py::arg("min_size")=std::array<int,3>{{0,0,0}},
          py::arg("sample_rate")=0.,
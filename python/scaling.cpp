@@ -20,6 +20,7 @@ void add_scaling(py::module& m) {
     .def_readwrite("use_solvent", &Scaling::use_solvent)
     .def_readwrite("k_sol", &Scaling::k_sol)
     .def_readwrite("b_sol", &Scaling::b_sol)
+    .def_readwrite("n_threads", &Scaling::n_threads)
     .def("prepare_points", &Scaling::prepare_points,
          py::arg("calc"), py::arg("obs"), py::arg("mask")=FPhiData())
     .def("fit_isotropic_b_approximately", &Scaling::fit_isotropic_b_approximately)
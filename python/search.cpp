@@ -44,6 +44,14 @@ void add_search(py::module& m) {
     .def(py::init<SmallStructure&, double>(),
          py::arg("small_structure"), py::arg("max_radius"),
          py::keep_alive<1, 2>())
+    .def(py::init<const FlatStructure&, const UnitCell&, double, size_t>(),
+         py::arg("flat"), py::arg("cell"), py::arg("max_radius"),
+         py::arg("model_index")=0, py::keep_alive<1, 2>())
+    .def(py::init<const AssemblyView&, const UnitCell&, double>(),
+         py::arg("assembly_view"), py::arg("cell"), py::arg("max_radius"),
+         py::keep_alive<1, 2>(),
+         "Mark.chain_idx is then an index in assembly_view.copies;\n"
+         "use AssemblyView.original_atom() instead of Mark.to_cra().")
     .def("populate", &NeighborSearch::populate, py::arg("include_h")=true,
          "Usually run after constructing NeighborSearch.")
     .def("add_chain", &NeighborSearch::add_chain,
@@ -118,7 +126,8 @@ void add_search(py::module& m) {
          py::arg("monlib"), py::arg("use_alias")=true, py::keep_alive<1, 2>())
     .def("find_possible_links", &LinkHunt::find_possible_links,
          py::arg("st"), py::arg("bond_margin"), py::arg("radius_margin"),
-         py::arg("ignore")=ContactSearch::Ignore::SameResidue)
+         py::arg("ignore")=ContactSearch::Ignore::SameResidue,
+         py::arg("n_threads")=1)
     ;
 
   linkhuntmatch
@@ -2,17 +2,22 @@
 
 #include "common.h"
 #include <pybind11/stl.h>
+#include <pybind11/stl_bind.h>
 #include <pybind11/complex.h>
 #include "gemmi/it92.hpp"
 #include "gemmi/c4322.hpp"
 #include "gemmi/neutron92.hpp"
 #include "gemmi/sfcalc.hpp"   // for StructureFactorCalculator
 #include "gemmi/dencalc.hpp"  // for DensityCalculator
+#include "gemmi/rscc.hpp"     // for calculate_local_correlations
 #include "gemmi/fprime.hpp"   // for add_cl_fprime_for_all_elements
 
 namespace py = pybind11;
 using gemmi::Element;
 
+// opaque, so that keep_alive<0, 2> in calculate_local_correlations works
+PYBIND11_MAKE_OPAQUE(std::vector<gemmi::LocalCorrelation>)
+
 template<typename Table>
 void add_sfcalc(py::module& m, const char* name, bool with_mb) {
   using SFC = gemmi::StructureFactorCalculator<Table>;
@@ -20,11 +25,36 @@ void add_sfcalc(py::module& m, const char* name, bool with_mb) {
   sfc
     .def(py::init<const gemmi::UnitCell&>())
     .def_readwrite("addends", &SFC::addends)
+    .def("tabulate_form_factors", &SFC::tabulate_form_factors,
+         py::arg("max_stol2"), py::arg("step")=1e-3)
+    .def("clear_tabulated_form_factors", &SFC::clear_tabulated_form_factors)
     .def("calculate_sf_from_model", &SFC::calculate_sf_from_model)
-    .def("calculate_sf_from_small_structure", &SFC::calculate_sf_from_small_structure);
+    .def("calculate_sf_from_small_structure",
+         (std::complex<double> (SFC::*)(const gemmi::SmallStructure&, const gemmi::Miller&))
+         &SFC::calculate_sf_from_small_structure)
+    .def("calculate_sf_from_small_structure",
+         [](const SFC& self, const gemmi::SmallStructure& small,
+            const std::vector<gemmi::Miller>& hkls, int threads) {
+           py::gil_scoped_release release;
+           return self.calculate_sf_from_small_structure(small, hkls, threads);
+    }, py::arg("small"), py::arg("hkls"), py::arg("threads")=1)
+    .def("calculate_sf_change", &SFC::calculate_sf_change,
+         py::arg("old_atoms"), py::arg("new_atoms"), py::arg("hkl"))
+    .def("add_sf_change",
+         [](const SFC& self, std::vector<std::complex<double>> sf,
+            const std::vector<gemmi::Miller>& hkls,
+            const std::vector<gemmi::Atom>& old_atoms,
+            const std::vector<gemmi::Atom>& new_atoms, int threads) {
+           py::gil_scoped_release release;
+           self.add_sf_change(sf, hkls, old_atoms, new_atoms, threads);
+           return sf;
+    }, py::arg("sf"), py::arg("hkls"), py::arg("old_atoms"), py::arg("new_atoms"),
+       py::arg("threads")=1);
   if (with_mb)
     sfc
-      .def("mott_bethe_factor", &SFC::mott_bethe_factor)
+      .def("mott_bethe_factor", (double (SFC::*)() const) &SFC::mott_bethe_factor)
+      .def("mott_bethe_factor", (double (SFC::*)(const gemmi::Miller&) const)
+           &SFC::mott_bethe_factor)
       .def("calculate_mb_z", &SFC::calculate_mb_z,
            py::arg("model"), py::arg("hkl"), py::arg("only_h")=false);
 }
@@ -40,12 +70,40 @@ void add_dencalc(py::module& m, const char* name) {
     .def_readwrite("blur", &DenCalc::blur)
     .def_readwrite("cutoff", &DenCalc::cutoff)
     .def_readwrite("addends", &DenCalc::addends)
-    .def("set_refmac_compatible_blur", &DenCalc::set_refmac_compatible_blur)
-    .def("put_model_density_on_grid", &DenCalc::put_model_density_on_grid)
+    .def("set_refmac_compatible_blur",
+         (void (DenCalc::*)(const gemmi::Model&)) &DenCalc::set_refmac_compatible_blur)
+    .def("set_refmac_compatible_blur",
+         (void (DenCalc::*)(const gemmi::FlatStructure&, size_t))
+           &DenCalc::set_refmac_compatible_blur,
+         py::arg("flat"), py::arg("model")=0)
+    .def("put_model_density_on_grid",
+         (void (DenCalc::*)(const gemmi::Model&)) &DenCalc::put_model_density_on_grid)
+    .def("put_model_density_on_grid",
+         (void (DenCalc::*)(const gemmi::FlatStructure&, size_t))
+           &DenCalc::put_model_density_on_grid,
+         py::arg("flat"), py::arg("model")=0)
+    .def("put_model_density_on_grid",
+         (void (DenCalc::*)(const gemmi::AssemblyView&)) &DenCalc::put_model_density_on_grid,
+         py::arg("assembly_view"))
     .def("initialize_grid", &DenCalc::initialize_grid)
-    .def("add_model_density_to_grid", &DenCalc::add_model_density_to_grid)
+    .def("add_model_density_to_grid",
+         (void (DenCalc::*)(const gemmi::Model&)) &DenCalc::add_model_density_to_grid)
+    .def("add_model_density_to_grid",
+         (void (DenCalc::*)(const gemmi::FlatStructure&, size_t))
+           &DenCalc::add_model_density_to_grid,
+         py::arg("flat"), py::arg("model")=0)
+    .def("add_model_density_to_grid",
+         (void (DenCalc::*)(const gemmi::AssemblyView&)) &DenCalc::add_model_density_to_grid,
+         py::arg("assembly_view"))
     .def("add_atom_density_to_grid", &DenCalc::add_atom_density_to_grid)
     .def("add_c_contribution_to_grid", &DenCalc::add_c_contribution_to_grid)
+    .def("add_atom_density_with_images", &DenCalc::add_atom_density_with_images,
+         py::arg("atom"), py::arg("factor")=1.f)
+    .def("update_atom_density", &DenCalc::update_atom_density,
+         py::arg("old_atom"), py::arg("new_atom"))
+    .def_readwrite("reuse_orbits", &DenCalc::reuse_orbits)
+    .def_readwrite("track_changes", &DenCalc::track_changes)
+    .def_readwrite("changed_regions", &DenCalc::changed_regions)
     .def("set_grid_cell_and_spacegroup", &DenCalc::set_grid_cell_and_spacegroup)
     .def("reciprocal_space_multiplier", &DenCalc::reciprocal_space_multiplier)
     .def("mott_bethe_factor", &DenCalc::mott_bethe_factor)
@@ -63,6 +121,14 @@ void add_dencalc(py::module& m, const char* name) {
         return self.estimate_radius(precal, b);
     })
     ;
+  m.def("put_model_density_on_map_grid",
+        &gemmi::put_model_density_on_map_grid<Table, float>,
+        py::arg("dencalc"), py::arg("model"), py::arg("map"));
+  m.def("calculate_local_correlations",
+        &gemmi::calculate_local_correlations<Table, float>,
+        py::arg("dencalc"), py::arg("model"), py::arg("map"), py::arg("radius"),
+        py::arg("per_atom")=false, py::arg("threads")=1,
+        py::keep_alive<0, 2>());
 }
 
 void add_sf(py::module& m) {
@@ -77,6 +143,22 @@ void add_sf(py::module& m) {
          py::arg("except_hydrogen")=false)
     ;
 
+  using gemmi::LocalCorrelation;
+  py::class_<LocalCorrelation>(m, "LocalCorrelation")
+    .def_property_readonly("chain", [](const LocalCorrelation& self) {
+        return self.cra.chain;
+    }, py::return_value_policy::reference_internal)
+    .def_property_readonly("residue", [](const LocalCorrelation& self) {
+        return self.cra.residue;
+    }, py::return_value_policy::reference_internal)
+    .def_property_readonly("atom", [](const LocalCorrelation& self) {
+        return self.cra.atom;
+    }, py::return_value_policy::reference_internal)
+    .def_readonly("corr", &LocalCorrelation::corr)
+    .def("rscc", &LocalCorrelation::rscc)
+    ;
+  py::bind_vector<std::vector<LocalCorrelation>>(m, "LocalCorrelations");
+
   using IT92 = gemmi::IT92<double>;
   using C4322 = gemmi::C4322<double>;
   using Neutron92 = gemmi::Neutron92<double>;
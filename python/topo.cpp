@@ -153,7 +153,8 @@ void add_topo(py::module& m) {
   m.def("prepare_topology",
     [](Structure& st, MonLib& monlib, size_t model_index,
        HydrogenChange h_change, bool reorder,
-       const py::object& pywarnings, bool ignore_unknown_links, bool use_cispeps) {
+       const py::object& pywarnings, bool ignore_unknown_links, bool use_cispeps,
+       int n_threads) {
       std::ostream* warnings = nullptr;
       std::ostream os(nullptr);
       std::unique_ptr<py::detail::pythonbuf> buffer;
@@ -163,11 +164,12 @@ void add_topo(py::module& m) {
         warnings = &os;
       }
       return prepare_topology(st, monlib, model_index, h_change, reorder,
-                              warnings, ignore_unknown_links, use_cispeps);
+                              warnings, ignore_unknown_links, use_cispeps,
+                              n_threads);
     }, py::arg("st"), py::arg("monlib"), py::arg("model_index")=0,
        py::arg("h_change")=HydrogenChange::NoChange, py::arg("reorder")=false,
        py::arg("warnings")=py::none(), py::arg("ignore_unknown_links")=false,
-       py::arg("use_cispeps")=false);
+       py::arg("use_cispeps")=false, py::arg("n_threads")=1);
 
   // crd.hpp
   m.def("setup_for_crd", &setup_for_crd);
@@ -32,6 +32,7 @@ class get_pybind_include(object):
 if USE_SYSTEM_ZLIB:
     zlib_library = 'z'
     zlib_include_dirs = []
+    gemmi_macros = []
     build_libs = []
 else:
     zlib_library = 'gemmi_zlib'
@@ -42,6 +43,8 @@ else:
     zlib_macros = [('NO_GZCOMPRESS', '1')]
     if os.name != 'nt':
         zlib_macros += [('Z_HAVE_UNISTD_H', '1')]
+    # third_party/zlib has only the code for decompression
+    gemmi_macros = [('GEMMI_NO_DEFLATE', '1')]
     build_libs = [('gemmi_zlib', {'sources': zlib_files,
                                   'macros': zlib_macros})]
 
@@ -63,6 +66,7 @@ ext_modules = [
                   # Path to pybind11 headers
                   get_pybind_include(),
               ],
+              define_macros=gemmi_macros,
               libraries=[zlib_library],
               language='c++'),
 ]
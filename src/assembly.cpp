@@ -2,9 +2,13 @@
 
 #include "gemmi/assembly.hpp"
 
+#include <algorithm>          // sort
+#include <cstdint>            // uint64_t
 #include <memory>             // unique_ptr
+#include <numeric>            // iota
+#include <tuple>
 #include "gemmi/modify.hpp"   // transform_pos_and_adp
-#include "gemmi/neighbor.hpp" // NeighborSearch
+#include "gemmi/parallel.hpp" // parallel_for
 
 namespace gemmi {
 
@@ -21,15 +25,224 @@ bool any_subchain_matches(const Chain& chain, const Assembly::Gen& gen) {
   return false;
 }
 
+void hash_combine(size_t& seed, size_t h) {
+  seed ^= h + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+// Quantized positions, for finding atoms closer than max_dist.
+// Bins are not narrower than 2*max_dist, so atoms within max_dist are
+// in the same bin or in one of 7 bins adjacent from the nearer sides.
+// If the unit cell is crystal, fractional coordinates of symmetry images
+// are wrapped to the unit cell. max_dist must be positive.
+struct PositionBins {
+  const UnitCell* cell = nullptr;  // set only for crystal
+  double width[3];
+  int n[3] = {0, 0, 0};  // number of bins in the unit cell (only with cell)
+
+  PositionBins(const UnitCell& uc, double max_dist) {
+    if (uc.is_crystal()) {
+      cell = &uc;
+      double rec[3] = {uc.ar, uc.br, uc.cr};
+      for (int k = 0; k < 3; ++k) {
+        n[k] = std::max(1, (int) std::floor(1. / (2 * max_dist * rec[k])));
+        width[k] = 1. / n[k];
+      }
+    } else {
+      for (int k = 0; k < 3; ++k)
+        width[k] = 2 * max_dist;
+    }
+  }
+
+  // position in units of bin width
+  Vec3 scaled(const Position& pos, int image_idx) const {
+    if (!cell)
+      return Vec3(pos.x / width[0], pos.y / width[1], pos.z / width[2]);
+    Fractional fpos = cell->fractionalize(pos);
+    cell->apply_transform(fpos, image_idx, false);
+    fpos = fpos.wrap_to_unit();
+    return Vec3(fpos.x * n[0], fpos.y * n[1], fpos.z * n[2]);
+  }
+
+  int bin_index(const Vec3& v, int k) const {
+    int b = (int) std::floor(v.at(k));
+    return cell ? std::min(b, n[k] - 1) : b;
+  }
+
+  std::uint64_t key(const Position& pos, int image_idx) const {
+    Vec3 v = scaled(pos, image_idx);
+    return make_key(bin_index(v, 0), bin_index(v, 1), bin_index(v, 2));
+  }
+
+  static std::uint64_t make_key(int x, int y, int z) {
+    const std::uint64_t mask = 0x1FFFFF;  // 21 bits for each index
+    return ((x & mask) << 42) | ((y & mask) << 21) | (z & mask);
+  }
+
+  // Calls func(key) for each distinct bin that may contain atoms
+  // within max_dist from pos.
+  template<typename Func>
+  void for_each_neighbor(const Position& pos, Func func) const {
+    Vec3 v = scaled(pos, 0);
+    int idx[3][2];
+    int len[3];
+    for (int k = 0; k < 3; ++k) {
+      int b = bin_index(v, k);
+      idx[k][0] = b;
+      idx[k][1] = v.at(k) - b < 0.5 ? b - 1 : b + 1;
+      len[k] = 2;
+      if (cell) {
+        idx[k][1] = (idx[k][1] + n[k]) % n[k];
+        if (idx[k][1] == b)
+          len[k] = 1;
+      }
+    }
+    for (int i = 0; i < len[0]; ++i)
+      for (int j = 0; j < len[1]; ++j)
+        for (int l = 0; l < len[2]; ++l)
+          func(make_key(idx[0][i], idx[1][j], idx[2][l]));
+  }
+};
+
+// Copies of overlapping atoms created by make_assembly_() are not added,
+// the atom that is already in the model gets averaged position
+// and occupancy multiplied by the number of copies.
+struct CopyMerger {
+  struct Copy {
+    size_t n_ch, n_res, n_atom;  // location in the new model
+    Position pos;
+    Position pos_sum;
+    int count;
+  };
+  double max_dist_sq;
+  std::vector<Copy> copies;
+  // for each original atom, indices of its copies (in the model order)
+  std::vector<std::vector<size_t>> copies_of;
+
+  CopyMerger(double max_dist, size_t n_atoms)
+    : max_dist_sq(sq(max_dist)), copies_of(n_atoms) {}
+
+  // res is the last residue in the last chain of model; src_idx is
+  // the index of the first atom of the original residue.
+  void add_residue(Model& model, Residue& res, size_t src_idx) {
+    size_t n_ch = model.chains.size() - 1;
+    size_t n_res = model.chains.back().residues.size() - 1;
+    size_t n_kept = 0;
+    for (size_t n_atom = 0; n_atom != res.atoms.size(); ++n_atom) {
+      Atom& atom = res.atoms[n_atom];
+      std::vector<size_t>& indices = copies_of[src_idx + n_atom];
+      auto it = indices.begin();
+      while (it != indices.end() && copies[*it].pos.dist_sq(atom.pos) >= max_dist_sq)
+        ++it;
+      if (it != indices.end()) {
+        copies[*it].pos_sum += atom.pos;
+        copies[*it].count++;
+        continue;
+      }
+      indices.push_back(copies.size());
+      copies.push_back({n_ch, n_res, n_kept, atom.pos, atom.pos, 1});
+      if (n_kept != n_atom)
+        res.atoms[n_kept] = std::move(atom);
+      ++n_kept;
+    }
+    res.atoms.erase(res.atoms.begin() + n_kept, res.atoms.end());
+  }
+
+  void finalize(Model& model) const {
+    for (const Copy& copy : copies)
+      if (copy.count > 1) {
+        Atom& atom = model.chains[copy.n_ch].residues[copy.n_res].atoms[copy.n_atom];
+        atom.pos = copy.pos_sum / double(copy.count);
+        atom.occ = std::min(1.f, copy.count * atom.occ);
+      }
+  }
+};
+
 struct AssemblyMapping {
   std::vector<std::string> sub;  // records subchain name correspondence
   std::vector<std::map<std::string, std::string>> chain_maps;
 };
 
-Model make_assembly_(const Assembly& assembly, const Model& model,
-                     HowToNameCopiedChain how, std::ostream* out,
-                     AssemblyMapping* mapping) {
+Model make_assembly_(const AssemblyView& view, AssemblyMapping* mapping,
+                     double merge_dist) {
+  const Model& model = *view.model;
   Model new_model(model.name);
+  std::unique_ptr<CopyMerger> merger;
+  std::vector<size_t> chain_offsets;  // index of the first atom in each chain
+  if (merge_dist > 0) {
+    size_t offset = 0;
+    for (const Chain& chain : model.chains) {
+      chain_offsets.push_back(offset);
+      for (const Residue& res : chain.residues)
+        offset += res.atoms.size();
+    }
+    merger.reset(new CopyMerger(merge_dist, offset));
+  }
+  for (const AssemblyView::ChainCopy& copy : view.copies) {
+    const Chain& chain = *copy.chain;
+    new_model.chains.emplace_back(copy.name);
+    Chain& new_chain = new_model.chains.back();
+    size_t src_idx = merger ? chain_offsets[&chain - model.chains.data()] : 0;
+    // add residues to the chain
+    for (const Residue& res : chain.residues) {
+      if (copy.includes(res)) {
+        new_chain.residues.push_back(res);
+        Residue& new_res = new_chain.residues.back();
+        transform_pos_and_adp(new_res, view.transform(copy));
+        if (!new_res.subchain.empty()) {
+          // change subchain name for the residue
+          if (mapping && !mapping->sub.empty() &&
+              *(mapping->sub.end() - 2) == new_res.subchain) {
+            new_res.subchain = mapping->sub.back();
+          } else {
+            new_res.subchain = view.subchain_name(copy, res.subchain);
+            if (mapping) {
+              mapping->sub.push_back(res.subchain);
+              mapping->sub.push_back(new_res.subchain);
+            }
+          }
+        }
+        if (merger) {
+          merger->add_residue(new_model, new_res, src_idx);
+          if (new_res.atoms.empty() && !res.atoms.empty())
+            new_chain.residues.pop_back();
+        }
+      }
+      src_idx += res.atoms.size();
+    }
+    if (merger && new_chain.residues.empty())
+      new_model.chains.pop_back();
+  }
+  if (mapping) {
+    mapping->chain_maps.resize(view.opers.size());
+    for (const AssemblyView::ChainCopy& copy : view.copies)
+      mapping->chain_maps[copy.oper_idx].emplace(copy.chain->name, copy.name);
+  }
+  if (merger)
+    merger->finalize(new_model);
+  return new_model;
+}
+
+// Hash of properties that are the same in all copies of an atom.
+size_t copied_atom_hash(const Residue& res, const Atom& atom, int n_atom) {
+  size_t h = std::hash<std::string>()(atom.name);
+  hash_combine(h, std::hash<std::string>()(res.name));
+  hash_combine(h, std::hash<int>()(*res.seqid.num));
+  hash_combine(h, std::hash<char>()(res.seqid.icode));
+  hash_combine(h, std::hash<char>()(atom.altloc));
+  hash_combine(h, std::hash<int>()(atom.element.ordinal()));
+  hash_combine(h, std::hash<int>()(atom.serial));
+  hash_combine(h, std::hash<float>()(atom.b_iso));
+  hash_combine(h, std::hash<int>()(n_atom));
+  return h;
+}
+
+} // anonymous namespace
+
+AssemblyView make_assembly_view(const Assembly& assembly, const Model& model,
+                                HowToNameCopiedChain how, std::ostream* out) {
+  AssemblyView view;
+  view.model = &model;
+  view.how = how;
   ChainNameGenerator namegen(how);
   std::map<std::string, std::string> subs = model.subchain_to_chain();
   for (const Assembly::Gen& gen : assembly.generators)
@@ -48,6 +261,7 @@ Model make_assembly_(const Assembly& assembly, const Model& model,
           if (subs.find(subchain_name) == subs.end())
             *out << "Warning: no subchain " << subchain_name << std::endl;
       }
+      view.opers.push_back(oper);
       // chains are not merged here, multiple chains may have the same name
       std::map<std::string, std::string> new_names;
       bool all_chains = (!gen.chains.empty() && gen.chains[0] == "(all)");
@@ -57,124 +271,178 @@ Model make_assembly_(const Assembly& assembly, const Model& model,
         bool whole_chain = (all_chains || in_vector(chain.name, gen.chains));
         if (whole_chain ||
             (!gen.subchains.empty() && any_subchain_matches(chain, gen))) {
-          // add a new empty chain, but first figure out the name for it
+          // figure out the name for the new chain
           auto result = new_names.emplace(chain.name, "");
           if (result.second)  // insertion happened - generate a new chain name
             result.first->second = namegen.make_new_name(chain.name, 1);
-          new_model.chains.emplace_back(result.first->second);
-          Chain& new_chain = new_model.chains.back();
-          // add residues to the chain
-          for (const Residue& res : chain.residues)
-            if (whole_chain || in_vector(res.subchain, gen.subchains)) {
-              new_chain.residues.push_back(res);
-              Residue& new_res = new_chain.residues.back();
-              transform_pos_and_adp(new_res, oper.transform);
-              if (!new_res.subchain.empty()) {
-                // change subchain name for the residue
-                if (mapping && !mapping->sub.empty() &&
-                    *(mapping->sub.end() - 2) == new_res.subchain) {
-                  new_res.subchain = mapping->sub.back();
-                  continue;
-                }
-                if (how == HowToNameCopiedChain::Short)
-                  new_res.subchain = new_chain.name + ":" + new_res.subchain;
-                else if (how == HowToNameCopiedChain::AddNumber)
-                  new_res.subchain += new_chain.name.substr(chain.name.size());
-                if (mapping) {
-                  mapping->sub.push_back(res.subchain);
-                  mapping->sub.push_back(new_res.subchain);
-                }
-              }
-            }
+          view.copies.push_back({result.first->second, &chain, view.opers.size() - 1,
+                                 whole_chain ? std::vector<std::string>() : gen.subchains});
         }
       }
-      if (mapping)
-        mapping->chain_maps.push_back(std::move(new_names));
     }
-  return new_model;
+  return view;
 }
 
-} // anonymous namespace
+Model AssemblyView::to_model() const {
+  return make_assembly_(*this, nullptr, 0.);
+}
 
 Model make_assembly(const Assembly& assembly, const Model& model,
-                    HowToNameCopiedChain how, std::ostream* out) {
-  return make_assembly_(assembly, model, how, out, nullptr);
+                    HowToNameCopiedChain how, std::ostream* out, double merge_dist) {
+  return make_assembly_(make_assembly_view(assembly, model, how, out), nullptr, merge_dist);
 }
 
-static void remove_cras(Model& model, std::vector<CRA>& vec) {
-  // sort in reverse order, so items can be erased without invalidating pointers
-  std::sort(vec.begin(), vec.end(), [](const CRA& a, const CRA& b) {
-      return std::tie(a.chain, a.residue, a.atom) > std::tie(b.chain, b.residue, b.atom);
+void merge_atoms_in_expanded_model(Model& model, const UnitCell& cell,
+                                   double max_dist, int n_threads) {
+  // no atoms are closer than 0 (and bins would have zero width)
+  if (!(max_dist > 0))
+    return;
+  struct AtomRef {
+    Atom* atom;
+    const Residue* res;
+    Position pos;  // position before merging
+    int n_ch;
+    int n_atom;
+    size_t hash;
+  };
+  std::vector<AtomRef> atoms;
+  for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch)
+    for (Residue& res : model.chains[n_ch].residues)
+      for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
+        Atom& atom = res.atoms[n_atom];
+        atoms.push_back({&atom, &res, atom.pos, n_ch, n_atom, 0});
+      }
+  n_threads = get_thread_count(n_threads);
+  parallel_for(atoms.size(), n_threads, [&](size_t i) {
+    atoms[i].hash = copied_atom_hash(*atoms[i].res, *atoms[i].atom, atoms[i].n_atom);
+  });
+
+  // Copies of the same atom have the same hash; sorting puts them together.
+  std::vector<size_t> order(atoms.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return atoms[a].hash < atoms[b].hash || (atoms[a].hash == atoms[b].hash && a < b);
   });
-  const Atom* prev_a = nullptr;
-  for (CRA& cra : vec) {
-    if (cra.atom == prev_a)
-      continue;
-    prev_a = cra.atom;
-    auto atom_idx = cra.atom - cra.residue->atoms.data();
-    cra.residue->atoms.erase(cra.residue->atoms.begin() + atom_idx);
-    if (cra.residue->atoms.empty()) {
-      auto res_idx = cra.residue - cra.chain->residues.data();
-      cra.chain->residues.erase(cra.chain->residues.begin() + res_idx);
-      if (cra.chain->residues.empty()) {
-        auto chain_idx = cra.chain - model.chains.data();
-        model.chains.erase(model.chains.begin() + chain_idx);
+  std::vector<std::pair<size_t, size_t>> groups;  // ranges in order
+  for (size_t start = 0, end = 0; start < order.size(); start = end) {
+    for (end = start + 1; end < order.size(); ++end)
+      if (atoms[order[end]].hash != atoms[order[start]].hash)
+        break;
+    if (end - start > 1)
+      groups.emplace_back(start, end);
+  }
+
+  // Groups are independent, so they can be processed in parallel.
+  std::vector<char> merged(atoms.size(), 0);  // atoms to be deleted
+  const bool crystal = cell.is_crystal();
+  const int n_images = crystal ? (int) cell.images.size() + 1 : 1;
+  const double max_dist_sq = sq(max_dist);
+  PositionBins bins(cell, max_dist);
+  parallel_for_chunks(groups.size(), n_threads, [&](size_t begin, size_t end, int) {
+    // bins of all symmetry images of atoms in a group: (key, atom, image)
+    std::vector<std::tuple<std::uint64_t, size_t, int>> binned;
+    std::vector<std::tuple<size_t, double, int>> equiv;  // (atom, dist_sq, image)
+    for (size_t g = begin; g != end; ++g) {
+      const size_t group_begin = groups[g].first;
+      const size_t group_end = groups[g].second;
+      // bins are used only for large groups (such as in virus capsids)
+      const bool use_bins = (group_end - group_begin) * n_images > 32;
+      if (use_bins) {
+        binned.clear();
+        for (size_t k = group_begin; k != group_end; ++k)
+          for (int image_idx = 0; image_idx != n_images; ++image_idx)
+            binned.emplace_back(bins.key(atoms[order[k]].pos, image_idx),
+                                order[k], image_idx);
+        std::sort(binned.begin(), binned.end());
+      }
+      // atoms in a group are sorted by their index in the model
+      for (size_t k = group_begin; k != group_end; ++k) {
+        size_t i = order[k];
+        if (merged[i])
+          continue;
+        const AtomRef& a = atoms[i];
+        auto check = [&](size_t j, int image_idx) {
+          const AtomRef& b = atoms[j];
+          // We look for the same atoms, but copied to a different chain.
+          if (merged[j] || b.n_ch == a.n_ch || b.n_atom != a.n_atom ||
+              b.atom->altloc != a.atom->altloc ||
+              b.atom->element != a.atom->element ||
+              b.atom->serial != a.atom->serial ||
+              b.atom->name != a.atom->name ||
+              b.atom->b_iso != a.atom->b_iso ||
+              !b.res->matches_noseg(*a.res))
+            return;
+          double dist_sq = crystal
+            ? cell.find_nearest_pbc_image(a.pos, b.pos, image_idx).dist_sq
+            : a.pos.dist_sq(b.pos);
+          if (dist_sq < max_dist_sq)
+            equiv.emplace_back(j, dist_sq, image_idx);
+        };
+        equiv.clear();
+        if (use_bins) {
+          bins.for_each_neighbor(a.pos, [&](std::uint64_t key) {
+            auto it = std::lower_bound(binned.begin(), binned.end(),
+                                       std::make_tuple(key, size_t(0), 0));
+            for (; it != binned.end() && std::get<0>(*it) == key; ++it)
+              check(std::get<1>(*it), std::get<2>(*it));
+          });
+        } else {
+          for (size_t k2 = group_begin; k2 != group_end; ++k2)
+            for (int image_idx = 0; image_idx != n_images; ++image_idx)
+              check(order[k2], image_idx);
+        }
+        if (equiv.empty())
+          continue;
+        // if the atom was found through two images, the nearest one is used
+        std::sort(equiv.begin(), equiv.end());
+        Position pos_sum = a.pos;
+        size_t n = 1;
+        for (size_t e = 0; e != equiv.size(); ++e) {
+          size_t j = std::get<0>(equiv[e]);
+          if (e != 0 && j == std::get<0>(equiv[e-1]))
+            continue;
+          pos_sum += crystal ? cell.find_nearest_pbc_position(a.pos, atoms[j].pos,
+                                                              std::get<2>(equiv[e]))
+                             : atoms[j].pos;
+          merged[j] = 1;
+          ++n;
+        }
+        a.atom->pos = pos_sum / double(n);
+        a.atom->occ = std::min(1.f, n * a.atom->occ);
       }
     }
-  }
-}
+  });
 
-void merge_atoms_in_expanded_model(Model& model, const UnitCell& cell, double max_dist) {
-  using Mark = NeighborSearch::Mark;
-  NeighborSearch ns(model, cell, 4.0);
-  ns.populate(true);
-  std::vector<CRA> to_be_deleted;
-  for (int n_ch = 0; n_ch != (int) model.chains.size(); ++n_ch) {
+  // delete merged atoms, and residues and chains that were left empty
+  size_t idx = 0;
+  size_t n_ch_kept = 0;
+  for (size_t n_ch = 0; n_ch != model.chains.size(); ++n_ch) {
     Chain& chain = model.chains[n_ch];
-    for (int n_res = 0; n_res != (int) chain.residues.size(); ++n_res) {
+    size_t n_res_kept = 0;
+    for (size_t n_res = 0; n_res != chain.residues.size(); ++n_res) {
       Residue& res = chain.residues[n_res];
-      for (int n_atom = 0; n_atom != (int) res.atoms.size(); ++n_atom) {
-        Atom& atom = res.atoms[n_atom];
-        std::vector<std::pair<CRA, int>> equiv;
-        ns.for_each_cell(atom.pos, [&](std::vector<Mark>& marks, const Fractional& fr) {
-            for (Mark& m : marks) {
-              // We look for the same atoms, but copied to a different chain.
-              // First quick check that filters out most of non-matching pairs.
-              if (m.altloc != atom.altloc || m.element != atom.element ||
-                  m.chain_idx == n_ch || m.atom_idx != n_atom)
-                continue;
-              // Now check if everything else matches.
-              CRA cra = m.to_cra(model);
-              if (cra.atom &&
-                  cra.atom->serial == atom.serial &&
-                  cra.atom->name == atom.name &&
-                  cra.atom->b_iso == atom.b_iso &&
-                  cra.residue->matches_noseg(res) &&
-                  m.pos.dist_sq(ns.grid.unit_cell.orthogonalize(fr)) < sq(max_dist))
-                equiv.emplace_back(cra, m.image_idx);
-            }
-        });
-        if (!equiv.empty()) {
-          Position pos_sum = atom.pos;
-          for (auto& t : equiv) {
-            CRA& cra = t.first;
-            pos_sum += ns.grid.unit_cell.find_nearest_pbc_position(
-                                          atom.pos, cra.atom->pos, t.second);
-            // The atoms in equiv are to be discarded later.
-            // Deleting now would invalidate indices in NeighborSearch.
-            to_be_deleted.push_back(cra);
-            // Modify the atoms to avoid processing them again.
-            cra.atom->serial = -1;  // this should be enough
-            cra.atom->name.clear(); // this is just in case
-          }
-          size_t n = 1 + equiv.size();
-          atom.pos = pos_sum / double(n);
-          atom.occ = std::min(1.f, n * atom.occ);
+      size_t n_kept = 0;
+      for (size_t n_atom = 0; n_atom != res.atoms.size(); ++n_atom)
+        if (!merged[idx++]) {
+          if (n_kept != n_atom)
+            res.atoms[n_kept] = std::move(res.atoms[n_atom]);
+          ++n_kept;
         }
-      }
+      if (n_kept == 0 && !res.atoms.empty())
+        continue;
+      res.atoms.erase(res.atoms.begin() + n_kept, res.atoms.end());
+      if (n_res_kept != n_res)
+        chain.residues[n_res_kept] = std::move(res);
+      ++n_res_kept;
     }
+    if (n_res_kept == 0 && !chain.residues.empty())
+      continue;
+    chain.residues.erase(chain.residues.begin() + n_res_kept, chain.residues.end());
+    if (n_ch_kept != n_ch)
+      model.chains[n_ch_kept] = std::move(chain);
+    ++n_ch_kept;
   }
-  remove_cras(model, to_be_deleted);
+  model.chains.erase(model.chains.begin() + n_ch_kept, model.chains.end());
 }
 
 void transform_to_assembly(Structure& st, const std::string& assembly_name,
@@ -195,9 +463,9 @@ void transform_to_assembly(Structure& st, const std::string& assembly_name,
   AssemblyMapping mapping;
   for (Model& model : st.models) {
     bool set_mapping = (&model == &st.models[0] && how != HowToNameCopiedChain::Dup);
-    model = make_assembly_(*assembly, model, how, out,
-                           set_mapping ? &mapping : nullptr);
-    merge_atoms_in_expanded_model(model, gemmi::UnitCell());
+    // overlapping copies of atoms (for example, on symmetry axes) are merged
+    AssemblyView view = make_assembly_view(*assembly, model, how, out);
+    model = make_assembly_(view, set_mapping ? &mapping : nullptr, /*merge_dist=*/0.2);
     assign_serial_numbers(model);
   }
   // update Entity::subchains
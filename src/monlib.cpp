@@ -2,6 +2,16 @@
 
 #include <gemmi/monlib.hpp>
 #include <gemmi/calculate.hpp>  // for calculate_chiral_volume
+#include <gemmi/fileutil.hpp>   // for file_open, file_size
+#include <cstdio>               // for fwrite, fread, rename, remove
+#include <cstring>              // for memcpy, memcmp
+#include <atomic>
+#include <sys/stat.h>           // for stat
+#ifdef _WIN32
+# include <process.h>           // for _getpid
+#else
+# include <unistd.h>            // for getpid
+#endif
 
 namespace gemmi {
 
@@ -514,4 +524,509 @@ double MonLib::find_ideal_distance(const const_CRA& cra1, const const_CRA& cra2)
   return r[0] + r[1];
 }
 
+// Binary snapshot of MonLib
+
+namespace {
+
+const char snapshot_magic[8] = {'G', 'E', 'M', 'M', 'L', 'I', 'B', 'S'};
+// increment when the layout of the snapshot (or of the stored structs) changes
+const std::uint32_t snapshot_version = 1;
+
+struct SourceFile {
+  std::string path;  // relative to monomer_dir
+  std::int64_t mtime;
+  std::int64_t size;
+};
+
+bool stat_file(const std::string& path, SourceFile& out) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return false;
+  out.mtime = (std::int64_t) st.st_mtime;
+  out.size = (std::int64_t) st.st_size;
+  return true;
+}
+
+// Values are written in the native byte order. The snapshot is a local cache,
+// a file from a machine with different byte order is rejected (as outdated).
+struct SnapshotWriter {
+  std::string buf;
+
+  template<typename T> void pod(T v) { buf.append((const char*) &v, sizeof(T)); }
+  void count(size_t n) { pod((std::uint32_t) n); }
+  void put(const std::string& s) { count(s.size()); buf += s; }
+  void put(const std::pair<std::string, std::string>& p) { put(p.first); put(p.second); }
+  void put(const SourceFile& f) { put(f.path); pod(f.mtime); pod(f.size); }
+  void put(const Restraints::AtomId& a) { pod((std::int32_t) a.comp); put(a.atom); }
+  void put(const Restraints::Bond& b) {
+    put(b.id1); put(b.id2);
+    pod((std::uint8_t) b.type);
+    pod((std::uint8_t) b.aromatic);
+    pod(b.value); pod(b.esd); pod(b.value_nucleus); pod(b.esd_nucleus);
+  }
+  void put(const Restraints::Angle& a) {
+    put(a.id1); put(a.id2); put(a.id3);
+    pod(a.value); pod(a.esd);
+  }
+  void put(const Restraints::Torsion& t) {
+    put(t.label);
+    put(t.id1); put(t.id2); put(t.id3); put(t.id4);
+    pod(t.value); pod(t.esd); pod((std::int32_t) t.period);
+  }
+  void put(const Restraints::Chirality& c) {
+    put(c.id_ctr); put(c.id1); put(c.id2); put(c.id3);
+    pod((std::uint8_t) c.sign);
+  }
+  void put(const Restraints::Plane& p) { put(p.label); put_vector(p.ids); pod(p.esd); }
+  void put(const Restraints& rt) {
+    put_vector(rt.bonds);
+    put_vector(rt.angles);
+    put_vector(rt.torsions);
+    put_vector(rt.chirs);
+    put_vector(rt.planes);
+  }
+  void put(const ChemComp::Atom& a) {
+    put(a.id); pod((std::uint8_t) a.el.elem); pod(a.charge); put(a.chem_type);
+  }
+  void put(const ChemComp::Aliasing& a) { pod((std::uint8_t) a.group); put_vector(a.related); }
+  void put(const ChemComp& cc) {
+    put(cc.name);
+    put(cc.type_or_group);
+    pod((std::uint8_t) cc.group);
+    put_vector(cc.atoms);
+    put_vector(cc.aliases);
+    put(cc.rt);
+  }
+  void put(const ChemLink::Side& side) {
+    put(side.comp); put(side.mod); pod((std::uint8_t) side.group);
+  }
+  void put(const ChemLink& link) {
+    put(link.id); put(link.name); put(link.side1); put(link.side2);
+    put(link.rt);
+    put(link.block);
+  }
+  void put(const ChemMod::AtomMod& m) {
+    pod((std::int32_t) m.func);
+    put(m.old_id); put(m.new_id);
+    pod((std::uint8_t) m.el.elem);
+    pod(m.charge);
+    put(m.chem_type);
+  }
+  void put(const ChemMod& mod) {
+    put(mod.id); put(mod.name); put(mod.comp_id); put(mod.group_id);
+    put_vector(mod.atom_mods);
+    put(mod.rt);
+    put(mod.block);
+  }
+  void put(const cif::Block& block) {
+    put(block.name);
+    count(block.items.size());
+    for (const cif::Item& item : block.items) {
+      pod((std::uint8_t) item.type);
+      pod((std::int32_t) item.line_number);
+      switch (item.type) {
+        case cif::ItemType::Pair:
+        case cif::ItemType::Comment:
+          put(item.pair[0]);
+          put(item.pair[1]);
+          break;
+        case cif::ItemType::Loop:
+          put_vector(item.loop.tags);
+          put_vector(item.loop.values);
+          break;
+        case cif::ItemType::Frame:
+          put(item.frame);
+          break;
+        case cif::ItemType::Erased:
+          break;
+      }
+    }
+  }
+  template<typename T> void put_vector(const std::vector<T>& v) {
+    count(v.size());
+    for (const T& x : v)
+      put(x);
+  }
+  template<typename Map> void put_map(const Map& m) {
+    count(m.size());
+    for (const auto& kv : m) {
+      put(kv.first);
+      put(kv.second);
+    }
+  }
+};
+
+struct SnapshotReader {
+  const char* ptr;
+  const char* end;
+
+  void check(size_t n) {
+    if ((size_t)(end - ptr) < n)
+      fail("MonLib snapshot is truncated");
+  }
+  template<typename T> T pod() {
+    check(sizeof(T));
+    T v;
+    std::memcpy(&v, ptr, sizeof(T));
+    ptr += sizeof(T);
+    return v;
+  }
+  // each counted item takes at least one byte; this check prevents
+  // huge allocations when the snapshot is corrupted
+  size_t count() {
+    size_t n = pod<std::uint32_t>();
+    check(n);
+    return n;
+  }
+  void get(std::string& s) {
+    size_t n = count();
+    check(n);
+    s.assign(ptr, n);
+    ptr += n;
+  }
+  std::string str() { std::string s; get(s); return s; }
+  void get(std::pair<std::string, std::string>& p) { get(p.first); get(p.second); }
+  void get(SourceFile& f) { get(f.path); f.mtime = pod<std::int64_t>(); f.size = pod<std::int64_t>(); }
+  void get(Restraints::AtomId& a) { a.comp = pod<std::int32_t>(); get(a.atom); }
+  void get(Restraints::Bond& b) {
+    get(b.id1); get(b.id2);
+    b.type = (BondType) pod<std::uint8_t>();
+    b.aromatic = pod<std::uint8_t>() != 0;
+    b.value = pod<double>();
+    b.esd = pod<double>();
+    b.value_nucleus = pod<double>();
+    b.esd_nucleus = pod<double>();
+  }
+  void get(Restraints::Angle& a) {
+    get(a.id1); get(a.id2); get(a.id3);
+    a.value = pod<double>();
+    a.esd = pod<double>();
+  }
+  void get(Restraints::Torsion& t) {
+    get(t.label);
+    get(t.id1); get(t.id2); get(t.id3); get(t.id4);
+    t.value = pod<double>();
+    t.esd = pod<double>();
+    t.period = pod<std::int32_t>();
+  }
+  void get(Restraints::Chirality& c) {
+    get(c.id_ctr); get(c.id1); get(c.id2); get(c.id3);
+    c.sign = (ChiralityType) pod<std::uint8_t>();
+  }
+  void get(Restraints::Plane& p) { get(p.label); get_vector(p.ids); p.esd = pod<double>(); }
+  void get(Restraints& rt) {
+    get_vector(rt.bonds);
+    get_vector(rt.angles);
+    get_vector(rt.torsions);
+    get_vector(rt.chirs);
+    get_vector(rt.planes);
+  }
+  void get(ChemComp::Aliasing& a) {
+    a.group = (ChemComp::Group) pod<std::uint8_t>();
+    get_vector(a.related);
+  }
+  void get(ChemComp& cc) {
+    get(cc.name);
+    get(cc.type_or_group);
+    cc.group = (ChemComp::Group) pod<std::uint8_t>();
+    size_t n = count();
+    cc.atoms.reserve(n);
+    for (size_t i = 0; i != n; ++i) {
+      std::string id = str();
+      Element el((El) pod<std::uint8_t>());
+      float charge = pod<float>();
+      cc.atoms.push_back(ChemComp::Atom{id, el, charge, str()});
+    }
+    get_vector(cc.aliases);
+    get(cc.rt);
+  }
+  void get(ChemLink::Side& side) {
+    get(side.comp); get(side.mod);
+    side.group = (ChemComp::Group) pod<std::uint8_t>();
+  }
+  void get(ChemLink& link) {
+    get(link.id); get(link.name); get(link.side1); get(link.side2);
+    get(link.rt);
+    get(link.block);
+  }
+  void get(ChemMod& mod) {
+    get(mod.id); get(mod.name); get(mod.comp_id); get(mod.group_id);
+    size_t n = count();
+    mod.atom_mods.reserve(n);
+    for (size_t i = 0; i != n; ++i) {
+      int func = pod<std::int32_t>();
+      std::string old_id = str();
+      std::string new_id = str();
+      Element el((El) pod<std::uint8_t>());
+      float charge = pod<float>();
+      mod.atom_mods.push_back(ChemMod::AtomMod{func, old_id, new_id, el, charge, str()});
+    }
+    get(mod.rt);
+    get(mod.block);
+  }
+  void get(cif::Block& block) {
+    get(block.name);
+    size_t n = count();
+    block.items.reserve(n);
+    for (size_t i = 0; i != n; ++i) {
+      auto type = (cif::ItemType) pod<std::uint8_t>();
+      int line_number = pod<std::int32_t>();
+      switch (type) {
+        case cif::ItemType::Pair: {
+          std::string tag = str();
+          block.items.emplace_back(tag, str());
+          break;
+        }
+        case cif::ItemType::Comment:
+          (void) str();
+          block.items.emplace_back(cif::CommentArg{str()});
+          break;
+        case cif::ItemType::Loop:
+          block.items.emplace_back(cif::LoopArg{});
+          get_vector(block.items.back().loop.tags);
+          get_vector(block.items.back().loop.values);
+          break;
+        case cif::ItemType::Frame:
+          block.items.emplace_back(cif::FrameArg{std::string()});
+          get(block.items.back().frame);
+          break;
+        case cif::ItemType::Erased:
+          block.items.emplace_back(cif::LoopArg{});
+          block.items.back().erase();
+          break;
+        default:
+          fail("MonLib snapshot is corrupted");
+      }
+      block.items.back().line_number = line_number;
+    }
+  }
+  template<typename T> void get_vector(std::vector<T>& v) {
+    size_t n = count();
+    v.resize(n);
+    for (T& x : v)
+      get(x);
+  }
+};
+
+std::vector<SourceFile> get_source_files(const MonLib& monlib) {
+  std::vector<SourceFile> files;
+  SourceFile f;
+  auto add = [&](const std::string& rel_path) {
+    if (stat_file(monlib.monomer_dir + rel_path, f)) {
+      f.path = rel_path;
+      files.push_back(f);
+    }
+  };
+  add("list/mon_lib_list.cif");
+  add("ener_lib.cif");
+  for (const auto& it : monlib.monomers)
+    add(MonLib::relative_monomer_path(it.first));
+  return files;
+}
+
+} // anonymous namespace
+
+void write_monlib_snapshot(const MonLib& monlib, const std::string& path) {
+  SnapshotWriter w;
+  w.buf.append(snapshot_magic, sizeof(snapshot_magic));
+  w.pod(snapshot_version);
+  w.pod((std::uint32_t) 0x01020304);  // byte order mark
+  w.put(monlib.monomer_dir);
+  w.put_vector(get_source_files(monlib));
+  w.put(monlib.lib_version);
+  w.count(monlib.ener_lib.atoms.size());
+  for (const auto& it : monlib.ener_lib.atoms) {
+    const EnerLib::Atom& a = it.second;
+    w.put(it.first);
+    w.pod((std::uint8_t) a.element.elem);
+    w.pod(a.hb_type);
+    w.pod(a.vdw_radius);
+    w.pod(a.vdwh_radius);
+    w.pod(a.ion_radius);
+    w.pod((std::int32_t) a.valency);
+    w.pod((std::int32_t) a.sp);
+  }
+  w.count(monlib.ener_lib.bonds.size());
+  for (const auto& it : monlib.ener_lib.bonds) {
+    const EnerLib::Bond& b = it.second;
+    w.put(it.first);
+    w.put(b.atom_type_2);
+    w.pod((std::uint8_t) b.type);
+    w.pod(b.length);
+    w.pod(b.value_esd);
+  }
+  w.count(monlib.cc_groups.size());
+  for (const auto& it : monlib.cc_groups) {
+    w.put(it.first);
+    w.pod((std::uint8_t) it.second);
+  }
+  w.put_map(monlib.monomers);
+  w.put_map(monlib.links);
+  w.put_map(monlib.modifications);
+
+  // Write to a temporary file and rename it, so that concurrent readers
+  // never see a partially written snapshot.
+  // The name includes the process id and a counter, to be unique also
+  // when several processes or threads write the same snapshot.
+  static std::atomic<int> tmp_counter{0};
+#ifdef _WIN32
+  int pid = _getpid();
+#else
+  int pid = (int) getpid();
+#endif
+  std::string tmp_path = path + ".tmp" + std::to_string(pid) + "-"
+                         + std::to_string(tmp_counter++);
+  {
+    fileptr_t f = file_open(tmp_path.c_str(), "wb");
+    if (std::fwrite(w.buf.data(), w.buf.size(), 1, f.get()) != 1)
+      sys_fail("Failed to write " + tmp_path);
+  }
+#ifdef _WIN32
+  std::remove(path.c_str());  // on Windows rename() doesn't overwrite
+#endif
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    sys_fail("Failed to rename " + tmp_path + " to " + path);
+  }
+}
+
+bool read_monlib_snapshot(MonLib& monlib, const std::string& path) {
+  SourceFile snapshot_file;
+  if (!stat_file(path, snapshot_file))
+    return false;
+  fileptr_t f = file_open(path.c_str(), "rb");
+  std::string buf(file_size(f.get(), path), '\0');
+  if (!buf.empty() && std::fread(&buf[0], buf.size(), 1, f.get()) != 1)
+    sys_fail(path + ": fread failed");
+  SnapshotReader r{buf.data(), buf.data() + buf.size()};
+  if (buf.size() < sizeof(snapshot_magic) + 8 ||
+      std::memcmp(buf.data(), snapshot_magic, sizeof(snapshot_magic)) != 0)
+    return false;
+  r.ptr += sizeof(snapshot_magic);
+  if (r.pod<std::uint32_t>() != snapshot_version ||
+      r.pod<std::uint32_t>() != 0x01020304)
+    return false;
+  std::string monomer_dir = r.str();
+  std::vector<SourceFile> files;
+  r.get_vector(files);
+  for (const SourceFile& file : files) {
+    SourceFile current;
+    if (!stat_file(monomer_dir + file.path, current) ||
+        current.mtime != file.mtime || current.size != file.size)
+      return false;
+  }
+
+  MonLib lib;
+  lib.monomer_dir = monomer_dir;
+  r.get(lib.lib_version);
+  for (size_t n = r.count(); n != 0; --n) {
+    std::string type = r.str();
+    Element el((El) r.pod<std::uint8_t>());
+    char hb_type = r.pod<char>();
+    double vdw = r.pod<double>();
+    double vdwh = r.pod<double>();
+    double ion = r.pod<double>();
+    int valency = r.pod<std::int32_t>();
+    int sp = r.pod<std::int32_t>();
+    lib.ener_lib.atoms.emplace(type, EnerLib::Atom{el, hb_type, vdw, vdwh, ion, valency, sp});
+  }
+  for (size_t n = r.count(); n != 0; --n) {
+    std::string type1 = r.str();
+    std::string type2 = r.str();
+    auto bond_type = (BondType) r.pod<std::uint8_t>();
+    double length = r.pod<double>();
+    double esd = r.pod<double>();
+    lib.ener_lib.bonds.emplace_hint(lib.ener_lib.bonds.end(), type1,
+                                    EnerLib::Bond{type2, bond_type, length, esd});
+  }
+  for (size_t n = r.count(); n != 0; --n) {
+    std::string name = r.str();
+    lib.cc_groups.emplace(name, (ChemComp::Group) r.pod<std::uint8_t>());
+  }
+  for (size_t n = r.count(); n != 0; --n) {
+    std::string name = r.str();
+    r.get(lib.monomers.emplace_hint(lib.monomers.end(), name, ChemComp())->second);
+  }
+  for (size_t n = r.count(); n != 0; --n) {
+    std::string name = r.str();
+    r.get(lib.links.emplace_hint(lib.links.end(), name, ChemLink())->second);
+  }
+  for (size_t n = r.count(); n != 0; --n) {
+    std::string name = r.str();
+    r.get(lib.modifications.emplace_hint(lib.modifications.end(), name, ChemMod())->second);
+  }
+  if (r.ptr != r.end)
+    fail("MonLib snapshot has unexpected data at the end: " + path);
+  monlib = std::move(lib);
+  return true;
+}
+
+bool read_monomer_lib_with_snapshot(MonLib& monlib, const std::string& monomer_dir,
+                                    const std::vector<std::string>& resnames,
+                                    read_cif_func read_cif,
+                                    const std::string& snapshot_path,
+                                    std::string* error) {
+  // Monomers from the library are kept in a separate MonLib, so that the
+  // snapshot doesn't include user's definitions already present in monlib.
+  std::vector<std::string> needed;
+  for (const std::string& name : resnames)
+    if (monlib.monomers.find(name) == monlib.monomers.end())
+      needed.push_back(name);
+  MonLib lib;
+  bool changed = false;
+  bool ok;
+  MonLib tmp;
+  tmp.set_monomer_dir(monomer_dir);
+  // a snapshot made from another monomer library is treated as outdated,
+  // and so is a truncated or corrupted snapshot
+  bool up_to_date = false;
+  try {
+    up_to_date = read_monlib_snapshot(lib, snapshot_path) &&
+                 lib.monomer_dir == tmp.monomer_dir;
+  } catch (std::runtime_error&) {}
+  if (up_to_date) {
+    size_t n_before = lib.monomers.size();
+    ok = lib.read_monomers(needed, read_cif, error);
+    changed = lib.monomers.size() != n_before;
+  } else {
+    lib = MonLib();
+    ok = lib.read_monomer_lib(monomer_dir, needed, read_cif, error);
+    changed = true;
+  }
+  // the snapshot is only a cache, failing to write it is not an error
+  if (changed)
+    try {
+      write_monlib_snapshot(lib, snapshot_path);
+    } catch (std::runtime_error& e) {
+      std::string msg = cat("WARNING: MonLib snapshot not saved: ", e.what(), '\n');
+      if (error)
+        *error += msg;
+      else
+        std::fputs(msg.c_str(), stderr);
+    }
+
+  if (monlib.monomers.empty() && monlib.links.empty() && monlib.modifications.empty()) {
+    std::string lib_version = monlib.lib_version;
+    monlib = std::move(lib);
+    if (!lib_version.empty())
+      monlib.lib_version = lib_version;
+    return ok;
+  }
+  // Merge: definitions already in monlib have priority, like in read_monomer_lib().
+  monlib.monomer_dir = lib.monomer_dir;
+  if (monlib.lib_version.empty())
+    monlib.lib_version = lib.lib_version;
+  if (monlib.ener_lib.atoms.empty())
+    monlib.ener_lib = std::move(lib.ener_lib);
+  for (auto& it : lib.cc_groups)
+    monlib.cc_groups.emplace(it.first, it.second);
+  for (auto& it : lib.monomers)
+    monlib.monomers.emplace(it.first, std::move(it.second));
+  for (auto& it : lib.links)
+    monlib.links.emplace(it.first, std::move(it.second));
+  for (auto& it : lib.modifications)
+    monlib.modifications.emplace(it.first, std::move(it.second));
+  return ok;
+}
+
 } // namespace gemmi
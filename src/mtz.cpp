@@ -2,6 +2,11 @@
 
 #include <gemmi/mtz.hpp>
 #include <gemmi/sprintf.hpp>
+#include <gemmi/hkljoin.hpp>   // for HklIndex
+#include <gemmi/parallel.hpp>  // for parallel_for, get_thread_count
+#ifndef GEMMI_NO_DEFLATE
+# include <zlib.h>
+#endif
 
 namespace gemmi {
 
@@ -65,6 +70,43 @@ void Mtz::ensure_asu(bool tnt_asu) {
   }
 }
 
+void Mtz::do_replace_column(size_t dest_idx, const Column& src_col,
+                            const std::vector<std::string>& trailing_cols) {
+  const Mtz* src_mtz = src_col.parent;
+  for (size_t i = 0; i <= trailing_cols.size(); ++i) {
+    Column& dst = columns[dest_idx + i];
+    const Column& src = src_mtz->columns[src_col.idx + i];
+    dst.type = src.type;
+    dst.label = src.label;
+    dst.min_value = src.min_value;
+    dst.max_value = src.max_value;
+    dst.source = src.source;
+    dst.dataset_id = src.dataset_id;
+  }
+  if (src_mtz == this) {
+    // internal copying
+    for (size_t n = 0; n < data.size(); n += columns.size())
+      for (size_t i = 0; i <= trailing_cols.size(); ++i)
+        data[n + dest_idx + i] = data[n + src_col.idx + i];
+  } else {
+    // external copying - need to match indices
+    size_t dst_stride = columns.size();
+    size_t src_stride = src_mtz->columns.size();
+    std::vector<Miller> src_hkl(src_mtz->data.size() / src_stride);
+    for (size_t n = 0; n < src_hkl.size(); ++n)
+      src_hkl[n] = src_mtz->get_hkl(n * src_stride);
+    HklIndex src_index(src_hkl);
+    for (size_t n = 0; n < data.size(); n += dst_stride) {
+      int src = src_index.find(get_hkl(n));
+      if (src >= 0)
+        // copy values
+        for (size_t i = 0; i <= trailing_cols.size(); ++i)
+          data[n + dest_idx + i] =
+            src_mtz->data[src * src_stride + src_col.idx + i];
+    }
+  }
+}
+
 void Mtz::reindex(const Op& op, std::ostream* out) {
   if (op.tran != Op::Tran{0, 0, 0})
     gemmi::fail("reindexing operator must not have a translation");
@@ -138,16 +180,13 @@ void Mtz::reindex(const Op& op, std::ostream* out) {
       sys_fail("Writing MTZ file failed"); \
   } while(0)
 
-template<typename Write>
-void Mtz::write_to_stream(Write write) const {
-  // uses: data, spacegroup, nreflections, batches, cell, sort_order,
-  //       valm, columns, datasets, history
-  if (!has_data())
-    fail("Cannot write Mtz which has no data");
-  if (!spacegroup)
-    fail("Cannot write Mtz which has no space group");
-  char buf[81] = {'M', 'T', 'Z', ' ', '\0'};
-  std::int64_t real_header_start = (int64_t) columns.size() * nreflections + 21;
+namespace {
+
+// The first 80-byte record contains location of the headers.
+void make_first_record(char* buf, size_t ncol, int nreflections) {
+  std::memset(buf, 0, 80);
+  std::memcpy(buf, "MTZ ", 4);
+  std::int64_t real_header_start = (int64_t) ncol * nreflections + 21;
   std::int32_t header_start = (int32_t) real_header_start;
   if (real_header_start > std::numeric_limits<int32_t>::max()) {
     header_start = -1;
@@ -158,17 +197,26 @@ void Mtz::write_to_stream(Write write) const {
   std::int32_t machst = is_little_endian() ? 0x00004144 : 0x11110000;
   std::memcpy(buf + 8, &machst, 4);
   std::memcpy(buf + 12, &real_header_start, 8);
-  if (write(buf, 80, 1) != 1 ||
-      write(data.data(), 4, data.size()) != data.size())
-    fail("Writing MTZ file failed");
+}
+
+// Writes everything that follows the data. Statistics that depend on
+// the data (resolution range and column ranges) are passed as arguments.
+template<typename Write>
+void write_headers(const Mtz& mtz, Write write, int nreflections,
+                   const std::array<double,2>& reso,
+                   const std::vector<std::array<float,2>>& col_minmax) {
+  char buf[81];
   WRITE("VERS MTZ:V1.1");
-  WRITE("TITLE %s", title.c_str());
-  WRITE("NCOL %8zu %12d %8zu", columns.size(), nreflections, batches.size());
+  WRITE("TITLE %s", mtz.title.c_str());
+  WRITE("NCOL %8zu %12d %8zu", mtz.columns.size(), nreflections, mtz.batches.size());
+  const UnitCell& cell = mtz.cell;
   if (cell.is_crystal())
     WRITE("CELL  %9.4f %9.4f %9.4f %9.4f %9.4f %9.4f",
           cell.a, cell.b, cell.c, cell.alpha, cell.beta, cell.gamma);
+  const std::array<int, 5>& sort_order = mtz.sort_order;
   WRITE("SORT  %3d %3d %3d %3d %3d", sort_order[0], sort_order[1],
         sort_order[2], sort_order[3], sort_order[4]);
+  const SpaceGroup* spacegroup = mtz.spacegroup;
   GroupOps ops = spacegroup->operations();
   char lat_type = spacegroup->ccp4_lattice_type();
   WRITE("SYMINF %3d %2d %c %5d %*s'%c%s' PG%s",
@@ -182,25 +230,25 @@ void Mtz::write_to_stream(Write write) const {
         spacegroup->point_group_hm()); // point group name
   // If we have symops that are the same as spacegroup->operations(),
   // write symops to preserve the order of SYMM records.
-  if (!symops.empty() && ops.is_same_as(split_centering_vectors(symops)))
-    for (Op op : symops)
+  if (!mtz.symops.empty() && ops.is_same_as(split_centering_vectors(mtz.symops)))
+    for (Op op : mtz.symops)
       WRITE("SYMM %s", to_upper(op.triplet()).c_str());
   else
     for (Op op : ops)
       WRITE("SYMM %s", to_upper(op.triplet()).c_str());
-  auto reso = calculate_min_max_1_d2();
   WRITE("RESO %-20.12f %-20.12f", reso[0], reso[1]);
-  if (std::isnan(valm))
+  if (std::isnan(mtz.valm))
     WRITE("VALM NAN");
   else
-    WRITE("VALM %f", valm);
+    WRITE("VALM %f", mtz.valm);
   auto format17 = [](float f) {
     char buffer[18];
     int len = gstb_snprintf(buffer, 18, "%.9f", f);
     return std::string(buffer, len > 0 ? std::min(len, 17) : 0);
   };
-  for (const Column& col : columns) {
-    auto minmax = calculate_min_max_disregarding_nans(col.begin(), col.end());
+  for (size_t i = 0; i < mtz.columns.size(); ++i) {
+    const Mtz::Column& col = mtz.columns[i];
+    const std::array<float,2>& minmax = col_minmax[i];
     const char* label = !col.label.empty() ? col.label.c_str() : "_";
     WRITE("COLUMN %-30s %c %17s %17s %4d",
           label, col.type,
@@ -209,8 +257,8 @@ void Mtz::write_to_stream(Write write) const {
     if (!col.source.empty())
       WRITE("COLSRC %-30s %-36s  %4d", label, col.source.c_str(), col.dataset_id);
   }
-  WRITE("NDIF %8zu", datasets.size());
-  for (const Dataset& ds : datasets) {
+  WRITE("NDIF %8zu", mtz.datasets.size());
+  for (const Mtz::Dataset& ds : mtz.datasets) {
     WRITE("PROJECT %7d %s", ds.id, ds.project_name.c_str());
     WRITE("CRYSTAL %7d %s", ds.id, ds.crystal_name.c_str());
     WRITE("DATASET %7d %s", ds.id, ds.dataset_name.c_str());
@@ -218,10 +266,10 @@ void Mtz::write_to_stream(Write write) const {
     WRITE("DCELL %9d %10.4f%10.4f%10.4f%10.4f%10.4f%10.4f",
           ds.id, uc.a, uc.b, uc.c, uc.alpha, uc.beta, uc.gamma);
     WRITE("DWAVEL %8d %10.5f", ds.id, ds.wavelength);
-    for (size_t i = 0; i < batches.size(); i += 12) {
+    for (size_t i = 0; i < mtz.batches.size(); i += 12) {
       std::memcpy(buf, "BATCH ", 6);
       int pos = 6;
-      for (size_t j = i; j < std::min(batches.size(), i + 12); ++j, pos += 6)
+      for (size_t j = i; j < std::min(mtz.batches.size(), i + 12); ++j, pos += 6)
         gstb_snprintf(buf + pos, 7, "%6zu", j + 1);
       std::memset(buf + pos, ' ', 80 - pos);
       if (write(buf, 80, 1) != 1)
@@ -229,16 +277,16 @@ void Mtz::write_to_stream(Write write) const {
     }
   }
   WRITE("END");
-  if (!history.empty()) {
+  if (!mtz.history.empty()) {
     // According to mtzformat.html the file can have only up to 30 history
     // lines, but we don't enforce it here.
-    WRITE("MTZHIST %3zu", history.size());
-    for (const std::string& line : history)
+    WRITE("MTZHIST %3zu", mtz.history.size());
+    for (const std::string& line : mtz.history)
       WRITE("%s", line.c_str());
   }
-  if (!batches.empty()) {
+  if (!mtz.batches.empty()) {
     WRITE("MTZBATS");
-    for (const Batch& batch : batches) {
+    for (const Mtz::Batch& batch : mtz.batches) {
       // keep the numbers the same as in files written by libccp4
       WRITE("BH %8d %7zu %7zu %7zu",
             batch.number, batch.ints.size() + batch.floats.size(),
@@ -255,14 +303,36 @@ void Mtz::write_to_stream(Write write) const {
     }
   }
   WRITE("MTZENDOFHEADERS");
-  if (!appended_text.empty()) {
-    if (write(appended_text.data(), appended_text.size(), 1) != 1)
+  if (!mtz.appended_text.empty()) {
+    if (write(mtz.appended_text.data(), mtz.appended_text.size(), 1) != 1)
       fail("Writing MTZ file failed");
   }
 }
 
+} // anonymous namespace
+
 #undef WRITE
 
+template<typename Write>
+void Mtz::write_to_stream(Write write) const {
+  // uses: data, spacegroup, nreflections, batches, cell, sort_order,
+  //       valm, columns, datasets, history
+  if (!has_data())
+    fail("Cannot write Mtz which has no data");
+  if (!spacegroup)
+    fail("Cannot write Mtz which has no space group");
+  char buf[80];
+  make_first_record(buf, columns.size(), nreflections);
+  if (write(buf, 80, 1) != 1 ||
+      write(data.data(), 4, data.size()) != data.size())
+    fail("Writing MTZ file failed");
+  std::vector<std::array<float,2>> col_minmax;
+  col_minmax.reserve(columns.size());
+  for (const Column& col : columns)
+    col_minmax.push_back(calculate_min_max_disregarding_nans(col.begin(), col.end()));
+  write_headers(*this, write, nreflections, calculate_min_max_1_d2(), col_minmax);
+}
+
 void Mtz::write_to_cstream(std::FILE* stream) const {
   write_to_stream([&](const void *ptr, size_t size, size_t nmemb) {
       return std::fwrite(ptr, size, nmemb, stream);
@@ -277,6 +347,14 @@ void Mtz::write_to_string(std::string& str) const {
 }
 
 void Mtz::write_to_file(const std::string& path) const {
+  if (iends_with(path, ".gz")) {
+    if (!has_data())
+      fail("Cannot write Mtz which has no data");
+    MtzWriter writer(*this, path);
+    writer.write_rows(data.data(), nreflections);
+    writer.finish();
+    return;
+  }
   fileptr_t f = file_open(path.c_str(), "wb");
   try {
     return write_to_cstream(f.get());
@@ -285,4 +363,238 @@ void Mtz::write_to_file(const std::string& path) const {
   }
 }
 
+// Gzipped output is written as a single gzip member, like in pigz:
+// the data is split into blocks compressed independently (each one
+// primed with the preceding 32KiB as dictionary) as raw deflate streams
+// ending on a byte boundary, so that they can be concatenated.
+// The first MTZ record, written last, is stored uncompressed (in a deflate
+// stored block of a known size) right after the gzip header.
+struct MtzWriter::GzState {
+  static constexpr size_t block_size = 128 * 1024;
+  static constexpr size_t window_size = 32 * 1024;
+  // gzip header (10 bytes) + stored block header (5 bytes) + first record
+  static constexpr long data_offset = 10 + 5 + 80;
+  std::vector<char> pending;  // not yet compressed data
+  std::vector<char> window;   // the last 32KiB of compressed data
+  unsigned long crc = 0;      // crc32 of data after the first record
+  std::uint64_t length = 0;   // length of data after the first record
+};
+
+#ifndef GEMMI_NO_DEFLATE
+namespace {
+
+// Compresses data as raw deflate blocks, ending on a byte boundary
+// (Z_SYNC_FLUSH) or, if last is true, with the final block.
+std::string deflate_block(const char* dict, size_t dict_size,
+                          const char* data, size_t size, int level, bool last) {
+  z_stream zs;
+  zs.zalloc = Z_NULL;
+  zs.zfree = Z_NULL;
+  zs.opaque = Z_NULL;
+  if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    fail("deflateInit2 failed");
+  if (dict_size != 0)
+    deflateSetDictionary(&zs, (const Bytef*) dict, (uInt) dict_size);
+  // deflateBound() is only a guess for Z_SYNC_FLUSH, so the output
+  // buffer is extended if needed
+  std::string out(deflateBound(&zs, (uLong) size) + 16, '\0');
+  zs.next_in = (Bytef*) const_cast<char*>(data);
+  zs.avail_in = (uInt) size;
+  size_t out_size = 0;
+  int ret;
+  for (;;) {
+    zs.next_out = (Bytef*) &out[out_size];
+    zs.avail_out = (uInt) (out.size() - out_size);
+    ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    out_size = out.size() - zs.avail_out;
+    if (zs.avail_out != 0 || (ret != Z_OK && ret != Z_BUF_ERROR))
+      break;
+    out.resize(2 * out.size());
+  }
+  deflateEnd(&zs);
+  // Z_BUF_ERROR: the flush was already completed in the previous call
+  if (ret == Z_BUF_ERROR && !last)
+    ret = Z_OK;
+  if (ret != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0)
+    fail("deflate failed");
+  out.resize(out_size);
+  return out;
+}
+
+void put_le32(unsigned char* p, std::uint32_t n) {
+  for (int i = 0; i < 4; ++i)
+    p[i] = (unsigned char)(n >> (8 * i));
+}
+
+} // anonymous namespace
+#endif
+
+MtzWriter::MtzWriter(const Mtz& mtz, const std::string& path, int n_threads)
+    : mtz_(mtz), path_(path), file_(file_open(path.c_str(), "wb")),
+      n_threads_(get_thread_count(n_threads)),
+      reso_{{INFINITY, 0.}},
+      col_minmax_(mtz.columns.size(), {{NAN, NAN}}) {
+  if (!mtz.spacegroup)
+    fail("Cannot write Mtz which has no space group");
+  if (mtz.columns.size() < 3)
+    fail("Cannot write Mtz with less than 3 columns");
+  // the same cells as in Mtz::calculate_min_max_1_d2()
+  if (mtz.cell.is_crystal() && mtz.cell.a > 0)
+    cells_.push_back(mtz.cell);
+  for (const Mtz::Dataset& ds : mtz.datasets)
+    if (ds.cell.is_crystal() && ds.cell.a > 0 && ds.cell != mtz.cell &&
+        (cells_.empty() || ds.cell != cells_.back()))
+      cells_.push_back(ds.cell);
+  if (iends_with(path, ".gz")) {
+#ifdef GEMMI_NO_DEFLATE
+    mtz.warn("Writing gzipped files is not supported in this build,"
+             " writing uncompressed MTZ to " + path);
+#else
+    gz_.reset(new GzState);
+    gz_->crc = crc32(0L, Z_NULL, 0);
+#endif
+  }
+  // placeholder for data that is written in finish()
+  long offset = gz_ ? GzState::data_offset : 80;
+  std::vector<char> zeros(offset, '\0');
+  write_raw(zeros.data(), zeros.size());
+}
+
+MtzWriter::~MtzWriter() = default;
+
+bool MtzWriter::can_write_gzip() {
+#ifdef GEMMI_NO_DEFLATE
+  return false;
+#else
+  return true;
+#endif
+}
+
+void MtzWriter::write_raw(const void* ptr, size_t size) {
+  if (size != 0 && std::fwrite(ptr, size, 1, file_.get()) != 1)
+    sys_fail("Writing MTZ file failed: " + path_);
+}
+
+void MtzWriter::update_stats(const float* rows, size_t nrows) {
+  size_t ncol = col_minmax_.size();
+  for (size_t n = 0; n < nrows * ncol; n += ncol) {
+    const float* row = rows + n;
+    for (const UnitCell& uc : cells_) {
+      double res = uc.calculate_1_d2_double(row[0], row[1], row[2]);
+      if (res < reso_[0])
+        reso_[0] = res;
+      if (res > reso_[1])
+        reso_[1] = res;
+    }
+    for (size_t i = 0; i < ncol; ++i) {
+      float x = row[i];
+      std::array<float,2>& minmax = col_minmax_[i];
+      if (std::isnan(x))
+        continue;
+      if (!(x >= minmax[0]))  // also if minmax[0] is NaN
+        minmax[0] = x;
+      if (!(x <= minmax[1]))
+        minmax[1] = x;
+    }
+  }
+}
+
+void MtzWriter::write_rows(const float* rows, size_t nrows) {
+  if (finished_)
+    fail("MtzWriter: cannot write rows after finish()");
+  if ((std::int64_t) nreflections_ + (std::int64_t) nrows > std::numeric_limits<int>::max())
+    fail("MtzWriter: too many reflections");
+  update_stats(rows, nrows);
+  nreflections_ += (int) nrows;
+  size_t size = 4 * nrows * col_minmax_.size();
+  if (!gz_) {
+    write_raw(rows, size);
+    return;
+  }
+#ifndef GEMMI_NO_DEFLATE
+  std::vector<char>& pending = gz_->pending;
+  const char* ptr = (const char*) rows;
+  const size_t batch_size = n_threads_ * GzState::block_size;
+  while (size != 0) {
+    size_t n = std::min(size, batch_size - pending.size());
+    pending.insert(pending.end(), ptr, ptr + n);
+    ptr += n;
+    size -= n;
+    if (pending.size() < batch_size)
+      break;
+    // compress blocks in parallel and write them in order
+    size_t n_blocks = pending.size() / GzState::block_size;
+    std::vector<std::string> output(n_blocks);
+    std::vector<unsigned long> crcs(n_blocks);
+    parallel_for(n_blocks, n_threads_, [&](size_t i) {
+      const char* block = pending.data() + i * GzState::block_size;
+      const char* dict = i == 0 ? gz_->window.data() : block - GzState::window_size;
+      size_t dict_size = i == 0 ? gz_->window.size() : GzState::window_size;
+      output[i] = deflate_block(dict, dict_size, block, GzState::block_size,
+                                compression_level, false);
+      crcs[i] = crc32(0L, (const Bytef*) block, (uInt) GzState::block_size);
+    });
+    for (size_t i = 0; i < n_blocks; ++i) {
+      write_raw(output[i].data(), output[i].size());
+      gz_->crc = crc32_combine(gz_->crc, crcs[i], (z_off_t) GzState::block_size);
+    }
+    gz_->length += pending.size();
+    gz_->window.assign(pending.end() - GzState::window_size, pending.end());
+    pending.clear();
+  }
+#endif
+}
+
+void MtzWriter::finish() {
+  if (finished_)
+    fail("MtzWriter: finish() called twice");
+  finished_ = true;
+  if (reso_[0] == INFINITY)
+    reso_[0] = 0;
+  std::string headers;
+  write_headers(mtz_, [&](const void *ptr, size_t size, size_t nmemb) {
+      headers.append(static_cast<const char*>(ptr), size * nmemb);
+      return nmemb;
+  }, nreflections_, reso_, col_minmax_);
+  char first_record[80];
+  make_first_record(first_record, col_minmax_.size(), nreflections_);
+  if (!gz_) {
+    write_raw(headers.data(), headers.size());
+    if (std::fseek(file_.get(), 0, SEEK_SET) != 0)
+      sys_fail("fseek failed: " + path_);
+    write_raw(first_record, 80);
+  } else {
+#ifndef GEMMI_NO_DEFLATE
+    // compress the remaining data together with the headers
+    std::vector<char>& pending = gz_->pending;
+    pending.insert(pending.end(), headers.begin(), headers.end());
+    std::string out = deflate_block(gz_->window.data(), gz_->window.size(),
+                                    pending.data(), pending.size(),
+                                    compression_level, true);
+    write_raw(out.data(), out.size());
+    gz_->crc = crc32_combine(gz_->crc,
+                             crc32(0L, (const Bytef*) pending.data(), (uInt) pending.size()),
+                             (z_off_t) pending.size());
+    gz_->length += pending.size();
+    unsigned long crc = crc32(0L, (const Bytef*) first_record, 80);
+    crc = crc32_combine(crc, gz_->crc, (z_off_t) gz_->length);
+    unsigned char trailer[8];
+    put_le32(trailer, (std::uint32_t) crc);
+    put_le32(trailer + 4, (std::uint32_t) (gz_->length + 80));
+    write_raw(trailer, 8);
+    // gzip header (no file name, mtime=0, OS=unknown)
+    // and deflate stored block (not final, LEN=80) with the first record
+    const unsigned char head[15] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255,
+                                    0, 80, 0, 255-80, 255};
+    if (std::fseek(file_.get(), 0, SEEK_SET) != 0)
+      sys_fail("fseek failed: " + path_);
+    write_raw(head, sizeof(head));
+    write_raw(first_record, 80);
+    pending.clear();
+#endif
+  }
+  if (std::fflush(file_.get()) != 0)
+    sys_fail("Writing MTZ file failed: " + path_);
+}
+
 } // namespace gemmi
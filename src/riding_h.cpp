@@ -1,6 +1,7 @@
 // Copyright 2018-2022 Global Phasing Ltd.
 
 #include <gemmi/riding_h.hpp>
+#include <gemmi/parallel.hpp>  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -113,11 +114,22 @@ struct BondedAtom {
   double dist;
 };
 
+// Like Topo::err(), but for code that may run in parallel: warnings
+// are appended to messages and passed to Topo::err() later. If Topo has
+// no warnings stream, it throws immediately, as Topo::err() does.
+void add_warning(const Topo& topo, std::vector<std::string>& messages,
+                 const std::string& msg) {
+  if (topo.warnings == nullptr)
+    fail(msg);
+  messages.push_back(msg);
+}
+
 // known and hs are lists of heavy atoms and hydrogens bonded to atom.
 // hs is const, but nevertheless atoms it points to are modified.
 void place_hydrogens(const Topo& topo, const Atom& atom,
                      const std::vector<BondedAtom>& known,
-                     const std::vector<BondedAtom>& hs) {
+                     const std::vector<BondedAtom>& hs,
+                     std::vector<std::string>& messages) {
   using Angle = Restraints::Angle;
   assert(!hs.empty());
 
@@ -290,8 +302,8 @@ void place_hydrogens(const Topo& topo, const Atom& atom,
       Vec3 v14 = rotate_about_axis(v12, axis, theta1 * ratio);
       hs[0].pos = atom.pos + Position(hs[0].dist / v14.length() * v14);
       if (hs.size() > 1) {
-        topo.err("Unhandled topology of " + std::to_string(hs.size()) +
-                 " hydrogens bonded to " + atom.name);
+        add_warning(topo, messages, "Unhandled topology of " + std::to_string(hs.size()) +
+                                    " hydrogens bonded to " + atom.name);
         for (size_t i = 1; i < hs.size(); ++i) {
           hs[i].ptr->occ = 0;
           hs[i].ptr->calc_flag = CalcFlag::Dummy;
@@ -365,9 +377,10 @@ void place_hydrogens(const Topo& topo, const Atom& atom,
   }
 }
 
-} // anonymous namespace
-
-void place_hydrogens_on_all_atoms(Topo& topo) {
+// Places hydrogens bonded to atoms of one chain. Only positions of these
+// hydrogens are modified, so different chains can be processed in parallel.
+void place_hydrogens_on_chain(const Topo& topo, Topo::ChainInfo& chain_info,
+                              std::vector<std::string>& messages) {
   std::vector<BondedAtom> known;
   std::vector<BondedAtom> hs;
   auto filter = [](char alt, const std::vector<BondedAtom>& v) {
@@ -378,58 +391,76 @@ void place_hydrogens_on_all_atoms(Topo& topo) {
         out.push_back(ba);
     return out;
   };
-  for (Topo::ChainInfo& chain_info : topo.chain_infos)
-    for (Topo::ResInfo& ri : chain_info.res_infos) {
-      // If we don't have monomer description from a cif file,
-      // only ad-hoc restraints, don't try to place hydrogens.
-      if (ri.orig_chemcomp == nullptr)
+  for (Topo::ResInfo& ri : chain_info.res_infos) {
+    // If we don't have monomer description from a cif file,
+    // only ad-hoc restraints, don't try to place hydrogens.
+    if (ri.orig_chemcomp == nullptr)
+      continue;
+    for (Atom& atom : ri.res->atoms) {
+      if (atom.is_hydrogen())
         continue;
-      for (Atom& atom : ri.res->atoms) {
-        if (atom.is_hydrogen())
-          continue;
-        try {
-          // gather bonded atoms
-          known.clear();
-          hs.clear();
-          auto range = topo.bond_index.equal_range(&atom);
-          for (auto i = range.first; i != range.second; ++i) {
-            const Topo::Bond* t = i->second;
-            Atom* other = t->atoms[t->atoms[0] == &atom ? 1 : 0];
-            if (other->altloc && atom.altloc) {
-              // We support links between different altlocs in Topo (e.g. link A-B),
-              // although these are rare, special cases.
-              // But if we had bonds between atom 1 (A/B) and atom 2 (A/B/C),
-              // and we had bonds B-B and B-C, we'd want to use only one of them (B-B).
-              // Checking atom's name is not robust, but should suffice here.
-              if (atom.altloc != other->altloc &&
-                  in_vector_f([&](const BondedAtom& a) { return a.ptr->name == other->name; },
-                              known))
-                continue;
-            }
-            auto& atom_list = other->is_hydrogen() ? hs : known;
-            atom_list.push_back({other, other->pos, t->restr->value});
+      try {
+        // gather bonded atoms
+        known.clear();
+        hs.clear();
+        auto range = topo.bond_index.equal_range(&atom);
+        for (auto i = range.first; i != range.second; ++i) {
+          const Topo::Bond* t = i->second;
+          Atom* other = t->atoms[t->atoms[0] == &atom ? 1 : 0];
+          if (other->altloc && atom.altloc) {
+            // We support links between different altlocs in Topo (e.g. link A-B),
+            // although these are rare, special cases.
+            // But if we had bonds between atom 1 (A/B) and atom 2 (A/B/C),
+            // and we had bonds B-B and B-C, we'd want to use only one of them (B-B).
+            // Checking atom's name is not robust, but should suffice here.
+            if (atom.altloc != other->altloc &&
+                in_vector_f([&](const BondedAtom& a) { return a.ptr->name == other->name; },
+                            known))
+              continue;
           }
-          if (hs.size() == 0)
+          auto& atom_list = other->is_hydrogen() ? hs : known;
+          atom_list.push_back({other, other->pos, t->restr->value});
+        }
+        if (hs.size() == 0)
+          continue;
+        if (atom.altloc == '\0') {
+          std::string altlocs;  // cf. add_distinct_altlocs
+          for (const auto& h : hs)
+            if (h.ptr->altloc && altlocs.find(h.ptr->altloc) == std::string::npos)
+              altlocs += h.ptr->altloc;
+          if (altlocs.size() > 1) {
+            for (char alt : altlocs)
+              place_hydrogens(topo, atom, filter(alt, known), filter(alt, hs), messages);
             continue;
-          if (atom.altloc == '\0') {
-            std::string altlocs;  // cf. add_distinct_altlocs
-            for (const auto& h : hs)
-              if (h.ptr->altloc && altlocs.find(h.ptr->altloc) == std::string::npos)
-                altlocs += h.ptr->altloc;
-            if (altlocs.size() > 1) {
-              for (char alt : altlocs)
-                place_hydrogens(topo, atom, filter(alt, known), filter(alt, hs));
-              continue;
-            }
           }
-          place_hydrogens(topo, atom, known, hs);
-        } catch (const std::runtime_error& e) {
-          topo.err("Placing of hydrogen bonded to "
-                   + atom_str(chain_info.chain_ref, *ri.res, atom)
-                   + " failed:\n  " + e.what());
         }
+        place_hydrogens(topo, atom, known, hs, messages);
+      } catch (const std::runtime_error& e) {
+        add_warning(topo, messages, "Placing of hydrogen bonded to "
+                                    + atom_str(chain_info.chain_ref, *ri.res, atom)
+                                    + " failed:\n  " + e.what());
       }
     }
+  }
+}
+
+} // anonymous namespace
+
+void place_hydrogens_on_all_atoms(Topo& topo, int n_threads) {
+  std::vector<Topo::ChainInfo>& chains = topo.chain_infos;
+  n_threads = std::max(std::min(get_thread_count(n_threads), (int) chains.size()), 1);
+  // Warnings are collected per thread and reported in the order of chains.
+  // Without topo.warnings, the first error is thrown and ends its chunk;
+  // parallel_for_chunks() re-throws the error from the first chunk,
+  // i.e. the same error as in a single thread.
+  std::vector<std::vector<std::string>> messages(n_threads);
+  parallel_for_chunks(chains.size(), n_threads, [&](size_t begin, size_t end, int i) {
+    for (size_t n = begin; n != end; ++n)
+      place_hydrogens_on_chain(topo, chains[n], messages[i]);
+  });
+  for (const std::vector<std::string>& part : messages)
+    for (const std::string& msg : part)
+      topo.err(msg);
 }
 
 }
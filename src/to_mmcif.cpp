@@ -8,7 +8,9 @@
 #include <string>
 #include <utility>  // std::pair
 
+#include <gemmi/assembly.hpp>   // for AssemblyView
 #include <gemmi/atox.hpp>       // no_sign_atoi
+#include <gemmi/to_cif.hpp>     // for cif::BufOstream
 #include <gemmi/sprintf.hpp>
 #include <gemmi/enumstr.hpp>    // for entity_type_to_string, ...
 
@@ -57,10 +59,9 @@ inline std::string qchain(const std::string& s) {
 }
 
 
-void add_cif_atoms(const Structure& st, cif::Block& block,
-                   bool use_group_pdb, bool auth_all) {
-  // atom list
-  cif::Loop& atom_loop = block.init_mmcif_loop("_atom_site.", {
+// _atom_site items written by add_cif_atoms() and write_minimal_mmcif()
+std::vector<std::string> atom_site_tags(bool use_group_pdb, bool auth_all) {
+  std::vector<std::string> tags = {
       "id",
       "type_symbol",
       "label_atom_id",
@@ -80,11 +81,70 @@ void add_cif_atoms(const Structure& st, cif::Block& block,
       "auth_comp_id",  // optional (tags[16] is removed if !auth_all)
       "auth_seq_id",
       "auth_asym_id",
-      "pdbx_PDB_model_num"});
+      "pdbx_PDB_model_num"};
   if (!auth_all)
-    atom_loop.tags.erase(atom_loop.tags.begin() + 15, atom_loop.tags.begin() + 17);
+    tags.erase(tags.begin() + 15, tags.begin() + 17);
+  if (use_group_pdb)
+    tags.emplace(tags.begin(), "group_PDB");
+  return tags;
+}
+
+// _atom_site values that are the same for all atoms in a residue
+struct AtomSiteResidue {
+  const Residue* res = nullptr;
+  std::string label_asym_id;
+  std::string entity_id;
+  std::string label_seq_id;
+  std::string ins_code;
+  std::string auth_seq_id;
+  std::string auth_asym_id;
+
+  AtomSiteResidue() = default;
+  AtomSiteResidue(const Residue& r, const std::string& subchain,
+                  std::string entity, const std::string& chain_name)
+    : res(&r), label_asym_id(subchain.empty() ? "." : cif::quote(subchain)),
+      entity_id(std::move(entity)), label_seq_id(r.label_seq.str('.')),
+      ins_code(pdbx_icode(r)), auth_seq_id(r.seqid.num.str()),
+      auth_asym_id(qchain(chain_name)) {}
+};
+
+// Appends values of one atom, in the order of atom_site_tags().
+void add_atom_site_values(std::vector<std::string>& vv, const AtomSiteResidue& r,
+                          const Atom& atom, const Position& pos, int serial,
+                          const std::string& model_num,
+                          bool use_group_pdb, bool auth_all) {
   if (use_group_pdb)
-    atom_loop.tags.emplace(atom_loop.tags.begin(), "_atom_site.group_PDB");
+    vv.emplace_back(r.res->het_flag != 'H' ? "ATOM" : "HETATM");
+  vv.emplace_back(std::to_string(serial));
+  vv.emplace_back(atom.element.uname());
+  vv.emplace_back(cif::quote(atom.name));
+  vv.emplace_back(1, atom.altloc_or('.'));
+  vv.emplace_back(cif::quote(r.res->name));
+  vv.emplace_back(r.label_asym_id);
+  vv.emplace_back(r.entity_id);
+  vv.emplace_back(r.label_seq_id);
+  vv.emplace_back(r.ins_code);
+  vv.emplace_back(to_str(pos.x));
+  vv.emplace_back(to_str(pos.y));
+  vv.emplace_back(to_str(pos.z));
+  vv.emplace_back(to_str(atom.occ));
+  vv.emplace_back(to_str(atom.b_iso));
+  vv.emplace_back(atom.charge == 0 ? "?" : std::to_string(atom.charge));
+  if (auth_all) {
+    size_t atom_name_idx = vv.size() - 13;
+    vv.emplace_back(vv[atom_name_idx]);  // auth_atom_id = label_atom_id
+    vv.emplace_back(vv[atom_name_idx + 2]);  // auth_comp_id = label_comp_id
+  }
+  vv.emplace_back(r.auth_seq_id);
+  vv.emplace_back(r.auth_asym_id);
+  vv.emplace_back(model_num);
+}
+
+void add_cif_atoms(const Structure& st, cif::Block& block,
+                   bool use_group_pdb, bool auth_all) {
+  // atom list
+  cif::Loop& atom_loop = block.init_mmcif_loop("_atom_site.",
+                                               atom_site_tags(use_group_pdb, auth_all));
   bool has_calc_flag = false;
   bool has_tls_group_id = false;
   size_t atom_site_count = 0;
@@ -110,41 +170,18 @@ void add_cif_atoms(const Structure& st, cif::Block& block,
   std::vector<std::pair<int, const Atom*>> aniso;
   int serial = 0;
   for (const Model& model : st.models) {
+    std::string model_num = string_or_qmark(model.name);
     for (const Chain& chain : model.chains) {
       for (const Residue& res : chain.residues) {
-        std::string label_seq_id = res.label_seq.str('.');
-        std::string auth_seq_id = res.seqid.num.str();
         std::string entity_id;
         if (const Entity* ent = gemmi::find_entity_of_subchain(res.subchain, st.entities))
           entity_id = cif::quote(ent->name);
         else
           entity_id = string_or_dot(res.entity_id);
+        AtomSiteResidue asr(res, res.subchain, std::move(entity_id), chain.name);
         for (const Atom& atom : res.atoms) {
-          if (use_group_pdb)
-            vv.emplace_back(res.het_flag != 'H' ? "ATOM" : "HETATM");
-          vv.emplace_back(std::to_string(++serial));
-          vv.emplace_back(atom.element.uname());
-          vv.emplace_back(cif::quote(atom.name));
-          vv.emplace_back(1, atom.altloc_or('.'));
-          vv.emplace_back(cif::quote(res.name));
-          vv.emplace_back(subchain_or_dot(res));
-          vv.emplace_back(entity_id);
-          vv.emplace_back(label_seq_id);
-          vv.emplace_back(pdbx_icode(res));
-          vv.emplace_back(to_str(atom.pos.x));
-          vv.emplace_back(to_str(atom.pos.y));
-          vv.emplace_back(to_str(atom.pos.z));
-          vv.emplace_back(to_str(atom.occ));
-          vv.emplace_back(to_str(atom.b_iso));
-          vv.emplace_back(atom.charge == 0 ? "?" : std::to_string(atom.charge));
-          if (auth_all) {
-            size_t atom_name_idx = vv.size() - 13;
-            vv.emplace_back(vv[atom_name_idx]);  // auth_atom_id = label_atom_id
-            vv.emplace_back(vv[atom_name_idx + 2]);  // auth_comp_id = label_comp_id
-          }
-          vv.emplace_back(auth_seq_id);
-          vv.emplace_back(qchain(chain.name));
-          vv.emplace_back(string_or_qmark(model.name));
+          add_atom_site_values(vv, asr, atom, atom.pos, ++serial, model_num,
+                               use_group_pdb, auth_all);
           if (has_calc_flag)
             vv.emplace_back(&".\0d\0c\0dum"[2 * (int) atom.calc_flag]);
           if (has_tls_group_id)
@@ -1154,4 +1191,56 @@ void add_minimal_mmcif_data(const Structure& st, cif::Block& block) {
   add_cif_atoms(st, block, /*use_group_pdb=*/false, /*auth_all=*/false);
 }
 
+void write_minimal_mmcif(const AssemblyView& view, std::ostream& os_,
+                         const std::string& block_name) {
+  cif::BufOstream os(os_);
+  auto write_row = [&os](const std::vector<std::string>& row) {
+    for (size_t i = 0; i != row.size(); ++i) {
+      if (i != 0)
+        os.put(' ');
+      os << row[i];
+    }
+    os.put('\n');
+  };
+  os << "data_" + block_name + "\n\nloop_\n";
+  for (const std::string& tag : atom_site_tags(true, false))
+    os << "_atom_site." + tag + "\n";
+  std::vector<std::string> row;
+  int serial = 0;
+  bool has_aniso = false;
+  std::string model_num = string_or_qmark(view.model->name);
+  AtomSiteResidue asr;
+  const AssemblyView::ChainCopy* asr_copy = nullptr;
+  view.for_each_atom([&](const AssemblyView::ChainCopy& copy, const Residue& res,
+                         const Atom& atom, const Position& pos) {
+    if (asr.res != &res || asr_copy != &copy) {
+      asr = AtomSiteResidue(res, view.subchain_name(copy, res.subchain),
+                            string_or_dot(res.entity_id), copy.name);
+      asr_copy = &copy;
+    }
+    row.clear();
+    add_atom_site_values(row, asr, atom, pos, ++serial, model_num, true, false);
+    write_row(row);
+    if (atom.aniso.nonzero())
+      has_aniso = true;
+  });
+  if (has_aniso) {
+    os << "\nloop_\n";
+    for (const char* tag : {"id", "type_symbol", "U[1][1]", "U[2][2]",
+                            "U[3][3]", "U[1][2]", "U[1][3]", "U[2][3]"})
+      os << std::string("_atom_site_anisotrop.") + tag + "\n";
+    serial = 0;
+    view.for_each_atom([&](const AssemblyView::ChainCopy& copy, const Residue&,
+                           const Atom& atom, const Position&) {
+      ++serial;
+      if (!atom.aniso.nonzero())
+        return;
+      SMat33<float> u = view.transformed_aniso(copy, atom);
+      write_row({std::to_string(serial), atom.element.uname(),
+                 to_str(u.u11), to_str(u.u22), to_str(u.u33),
+                 to_str(u.u12), to_str(u.u13), to_str(u.u23)});
+    });
+  }
+}
+
 } // namespace gemmi
@@ -1,6 +1,7 @@
 // Copyright 2017-2023 Global Phasing Ltd.
 
 #include <gemmi/to_pdb.hpp>
+#include <gemmi/assembly.hpp>  // for AssemblyView
 
 #include <cassert>
 #include <cctype>         // for isdigit
@@ -232,6 +233,97 @@ inline void write_remarks(const Structure& st, std::ostream& os) {
   }
 }
 
+// buf is passed from the caller, because TER record re-uses it
+inline void write_atom_record(std::ostream& os, char* buf, int& serial,
+                              const Atom& a, const Position& pos,
+                              const SMat33<float>& aniso, const Residue& res,
+                              const std::string& chain_name, bool as_het) {
+  //  1- 6  6s  record name
+  //  7-11  5d  integer serial
+  // 12     1   -
+  // 13-16  4s  atom name (from 13 only if 4-char or 2-char symbol)
+  // 17     1c  altloc
+  // 18-20  3s  residue name
+  // 21     1   -
+  // 22     1s  chain
+  // 23-26  4d  integer residue sequence number
+  // 27     1c  insertion code
+  // 28-30  3   -
+  // 31-38  8f  x (8.3)
+  // 39-46  8f  y
+  // 47-54  8f  z
+  // 55-60  6f  occupancy (6.2)
+  // 61-66  6f  temperature factor (6.2)
+  // 67-76  6   -
+  // 73-76      segment identifier, left-justified (non-standard)
+  // 77-78  2s  element symbol, right-justified
+  // 79-80  2s  charge
+  WRITE("%-6s%5s %-4.4s%c%3s"
+        "%2s%5s   %8.3f%8.3f%8.3f"
+        "%6.2f%6.2f      %-4.4s%2s%c%c",
+        as_het ? "HETATM" : "ATOM",
+        encode_serial_in_hybrid36(++serial).data(),
+        a.padded_name().c_str(),
+        a.altloc ? std::toupper(a.altloc) : ' ',
+        res.name.c_str(),
+        chain_name.c_str(),
+        write_seq_id(res.seqid).data(),
+        // We want to avoid negative zero and round the numbers up
+        // if they originally had one digit more and that digit was 5.
+        pos.x > -5e-4 && pos.x < 0 ? 0 : pos.x + 1e-10,
+        pos.y > -5e-4 && pos.y < 0 ? 0 : pos.y + 1e-10,
+        pos.z > -5e-4 && pos.z < 0 ? 0 : pos.z + 1e-10,
+        // Occupancy is stored as single prec, but we know it's <= 1,
+        // so no precision is lost even if it had 6 digits after dot.
+        a.occ + 1e-6,
+        // B is harder to get rounded right. It is stored as float,
+        // and may be given with more than single precision in mmCIF
+        // If it was originally %.5f (5TIS) we need to add 0.5 * 10^-5.
+        std::min(a.b_iso + 0.5e-5, 999.99),
+        res.segment.c_str(),
+        a.element.uname(),
+        // Charge is written as 1+ or 2-, etc, or just empty space.
+        // Sometimes PDB files have explicit 0s (5M05); we ignore them.
+        a.charge ? a.charge > 0 ? '0'+a.charge : '0'-a.charge : ' ',
+        a.charge ? a.charge > 0 ? '+' : '-' : ' ');
+  if (aniso.nonzero()) {
+    // re-using part of the buffer
+    std::memcpy(buf, "ANISOU", 6);
+    const double eps = 1e-6;
+    gstb_snprintf(buf+28, 43, "%7.0f%7.0f%7.0f%7.0f%7.0f%7.0f",
+                  aniso.u11*1e4 + eps, aniso.u22*1e4 + eps,
+                  aniso.u33*1e4 + eps, aniso.u12*1e4 + eps,
+                  aniso.u13*1e4 + eps, aniso.u23*1e4 + eps);
+    buf[28+42] = ' ';
+    buf[80] = '\n';
+    os.write(buf, 81);
+  }
+}
+
+// writes TER after residue res, if needed; buf contains the last atom record
+inline void write_ter_record(std::ostream& os, char* buf, int& serial,
+                             const Residue& res, const Residue* next_res,
+                             PdbWriteOptions opt) {
+  if (opt.ter_records && buf[0] != '\0' &&
+      (opt.ter_ignores_type ? next_res == nullptr
+                            : (res.entity_type == EntityType::Polymer &&
+                               (next_res == nullptr ||
+                                next_res->entity_type != EntityType::Polymer)))) {
+    if (opt.numbered_ter) {
+      // re-using part of the buffer in the middle, e.g.:
+      // TER    4153      LYS B 286
+      gstb_snprintf(buf, 82, "TER   %5s",
+                    encode_serial_in_hybrid36(++serial).data());
+      std::memset(buf+11, ' ', 6);
+      std::memset(buf+28, ' ', 52);
+      buf[80] = '\n';
+      os.write(buf, 81);
+    } else {
+      WRITE("%-80s", "TER");
+    }
+  }
+}
+
 inline void write_chain_atoms(const Chain& chain, std::ostream& os,
                               int& serial, PdbWriteOptions opt) {
   char buf[88];
@@ -240,86 +332,40 @@ inline void write_chain_atoms(const Chain& chain, std::ostream& os,
     fail("long chain name: " + chain.name);
   for (const Residue& res : chain.residues) {
     bool as_het = use_hetatm(res);
-    for (const Atom& a : res.atoms) {
-      //  1- 6  6s  record name
-      //  7-11  5d  integer serial
-      // 12     1   -
-      // 13-16  4s  atom name (from 13 only if 4-char or 2-char symbol)
-      // 17     1c  altloc
-      // 18-20  3s  residue name
-      // 21     1   -
-      // 22     1s  chain
-      // 23-26  4d  integer residue sequence number
-      // 27     1c  insertion code
-      // 28-30  3   -
-      // 31-38  8f  x (8.3)
-      // 39-46  8f  y
-      // 47-54  8f  z
-      // 55-60  6f  occupancy (6.2)
-      // 61-66  6f  temperature factor (6.2)
-      // 67-76  6   -
-      // 73-76      segment identifier, left-justified (non-standard)
-      // 77-78  2s  element symbol, right-justified
-      // 79-80  2s  charge
-      WRITE("%-6s%5s %-4.4s%c%3s"
-            "%2s%5s   %8.3f%8.3f%8.3f"
-            "%6.2f%6.2f      %-4.4s%2s%c%c",
-            as_het ? "HETATM" : "ATOM",
-            encode_serial_in_hybrid36(++serial).data(),
-            a.padded_name().c_str(),
-            a.altloc ? std::toupper(a.altloc) : ' ',
-            res.name.c_str(),
-            chain.name.c_str(),
-            write_seq_id(res.seqid).data(),
-            // We want to avoid negative zero and round the numbers up
-            // if they originally had one digit more and that digit was 5.
-            a.pos.x > -5e-4 && a.pos.x < 0 ? 0 : a.pos.x + 1e-10,
-            a.pos.y > -5e-4 && a.pos.y < 0 ? 0 : a.pos.y + 1e-10,
-            a.pos.z > -5e-4 && a.pos.z < 0 ? 0 : a.pos.z + 1e-10,
-            // Occupancy is stored as single prec, but we know it's <= 1,
-            // so no precision is lost even if it had 6 digits after dot.
-            a.occ + 1e-6,
-            // B is harder to get rounded right. It is stored as float,
-            // and may be given with more than single precision in mmCIF
-            // If it was originally %.5f (5TIS) we need to add 0.5 * 10^-5.
-            std::min(a.b_iso + 0.5e-5, 999.99),
-            res.segment.c_str(),
-            a.element.uname(),
-            // Charge is written as 1+ or 2-, etc, or just empty space.
-            // Sometimes PDB files have explicit 0s (5M05); we ignore them.
-            a.charge ? a.charge > 0 ? '0'+a.charge : '0'-a.charge : ' ',
-            a.charge ? a.charge > 0 ? '+' : '-' : ' ');
-      if (a.aniso.nonzero()) {
-        // re-using part of the buffer
-        std::memcpy(buf, "ANISOU", 6);
-        const double eps = 1e-6;
-        gstb_snprintf(buf+28, 43, "%7.0f%7.0f%7.0f%7.0f%7.0f%7.0f",
-                      a.aniso.u11*1e4 + eps, a.aniso.u22*1e4 + eps,
-                      a.aniso.u33*1e4 + eps, a.aniso.u12*1e4 + eps,
-                      a.aniso.u13*1e4 + eps, a.aniso.u23*1e4 + eps);
-        buf[28+42] = ' ';
-        buf[80] = '\n';
-        os.write(buf, 81);
-      }
-    }
-    if (opt.ter_records && buf[0] != '\0' &&
-        (opt.ter_ignores_type ? &res == &chain.residues.back()
-                              : (res.entity_type == EntityType::Polymer &&
-                                (&res == &chain.residues.back() ||
-                                 (&res + 1)->entity_type != EntityType::Polymer)))) {
-      if (opt.numbered_ter) {
-        // re-using part of the buffer in the middle, e.g.:
-        // TER    4153      LYS B 286
-        gstb_snprintf(buf, 82, "TER   %5s",
-                      encode_serial_in_hybrid36(++serial).data());
-        std::memset(buf+11, ' ', 6);
-        std::memset(buf+28, ' ', 52);
-        buf[80] = '\n';
-        os.write(buf, 81);
-      } else {
-        WRITE("%-80s", "TER");
+    for (const Atom& a : res.atoms)
+      write_atom_record(os, buf, serial, a, a.pos, a.aniso, res, chain.name, as_het);
+    write_ter_record(os, buf, serial, res,
+                     &res != &chain.residues.back() ? &res + 1 : nullptr, opt);
+  }
+}
+
+// atoms from AssemblyView, the same as write_chain_atoms() for each copy
+inline void write_assembly_atoms(const AssemblyView& view, std::ostream& os,
+                                 PdbWriteOptions opt) {
+  char buf[88];
+  int serial = 0;
+  for (const AssemblyView::ChainCopy& copy : view.copies) {
+    if (copy.name.length() > 2)
+      fail("chain name too long for the PDB format: " + copy.name);
+    const Transform& tr = view.transform(copy);
+    buf[0] = '\0';
+    // residues included in the copy
+    const Residue* prev = nullptr;
+    auto write_residue = [&](const Residue& res, const Residue* next) {
+      bool as_het = use_hetatm(res);
+      for (const Atom& a : res.atoms)
+        write_atom_record(os, buf, serial, a, Position(tr.apply(a.pos)),
+                          view.transformed_aniso(copy, a), res, copy.name, as_het);
+      write_ter_record(os, buf, serial, res, next, opt);
+    };
+    for (const Residue& res : copy.chain->residues)
+      if (copy.includes(res)) {
+        if (prev)
+          write_residue(*prev, &res);
+        prev = &res;
       }
-    }
+    if (prev)
+      write_residue(*prev, nullptr);
   }
 }
 
@@ -665,6 +711,11 @@ void write_minimal_pdb(const Structure& st, std::ostream& os,
   write_atoms(st, os, opt);
 }
 
+void write_minimal_pdb(const AssemblyView& view, std::ostream& os,
+                       PdbWriteOptions opt) {
+  write_assembly_atoms(view, os, opt);
+}
+
 #undef WRITE
 #undef WRITEU
 
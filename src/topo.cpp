@@ -3,10 +3,12 @@
 #include <gemmi/topo.hpp>
 #include <cmath>               // for sqrt, round
 #include <map>                 // for multimap
+#include <sstream>             // for ostringstream
 #include <unordered_map>       // for unordered_multimap
 #include <gemmi/polyheur.hpp>  // for get_or_check_polymer_type, ...
 #include <gemmi/riding_h.hpp>  // for place_hydrogens_on_all_atoms, ...
 #include <gemmi/modify.hpp>    // for remove_hydrogens
+#include <gemmi/parallel.hpp>  // for parallel_for_chunks
 
 namespace gemmi {
 
@@ -560,42 +562,101 @@ void Topo::initialize_refmac_topology(Structure& st, Model& model0,
     }
 }
 
-void Topo::apply_all_restraints(const MonLib& monlib) {
-  for (ChainInfo& chain_info : chain_infos)
-    for (ResInfo& ri : chain_info.res_infos) {
-      // link restraints
-      for (Link& link : ri.prev)
-        apply_restraints_from_link(link, monlib);
-      // monomer restraints
-      auto it = ri.chemcomps.cbegin();
-      ri.monomer_rules = apply_restraints(it->cc->rt, *ri.res, nullptr,
-                                          it->altloc, '\0', /*require_alt=*/false);
-      while (++it != ri.chemcomps.end()) {
-        auto rules = apply_restraints(it->cc->rt, *ri.res, nullptr,
-                                      it->altloc, '\0', /*require_alt=*/true);
-        vector_move_extend(ri.monomer_rules, std::move(rules));
-      }
+void Topo::apply_restraints_to_chain(ChainInfo& chain_info, const MonLib& monlib) {
+  for (ResInfo& ri : chain_info.res_infos) {
+    // link restraints
+    for (Link& link : ri.prev)
+      apply_restraints_from_link(link, monlib);
+    // monomer restraints
+    auto it = ri.chemcomps.cbegin();
+    ri.monomer_rules = apply_restraints(it->cc->rt, *ri.res, nullptr,
+                                        it->altloc, '\0', /*require_alt=*/false);
+    while (++it != ri.chemcomps.end()) {
+      auto rules = apply_restraints(it->cc->rt, *ri.res, nullptr,
+                                    it->altloc, '\0', /*require_alt=*/true);
+      vector_move_extend(ri.monomer_rules, std::move(rules));
+    }
+  }
+}
+
+void Topo::apply_all_restraints(const MonLib& monlib, int n_threads) {
+  n_threads = std::min(get_thread_count(n_threads), (int) chain_infos.size());
+  if (n_threads <= 1) {
+    for (ChainInfo& chain_info : chain_infos)
+      apply_restraints_to_chain(chain_info, monlib);
+  } else {
+    // Each thread processes a contiguous range of chains and stores
+    // restraints in a temporary Topo. The parts are then concatenated
+    // in order, so the result is the same as from the serial loop.
+    std::vector<Topo> parts(n_threads);
+    std::vector<std::ostringstream> part_warnings(n_threads);
+    std::vector<std::pair<size_t, size_t>> ranges(n_threads);
+    parallel_for_chunks(chain_infos.size(), n_threads,
+                        [&](size_t begin, size_t end, int i) {
+      Topo& part = parts[i];
+      part.warnings = warnings ? &part_warnings[i] : nullptr;
+      part.only_bonds = only_bonds;
+      ranges[i] = {begin, end};
+      for (size_t n = begin; n != end; ++n)
+        part.apply_restraints_to_chain(chain_infos[n], monlib);
+    });
+    for (int i = 0; i != n_threads; ++i) {
+      Topo& part = parts[i];
+      const size_t offsets[5] = {bonds.size(), angles.size(), torsions.size(),
+                                 chirs.size(), planes.size()};
+      auto shift_rules = [&](std::vector<Rule>& rules) {
+        for (Rule& rule : rules)
+          rule.index += offsets[static_cast<int>(rule.rkind)];
+      };
+      for (size_t n = ranges[i].first; n != ranges[i].second; ++n)
+        for (ResInfo& ri : chain_infos[n].res_infos) {
+          for (Link& link : ri.prev)
+            shift_rules(link.link_rules);
+          shift_rules(ri.monomer_rules);
+        }
+      vector_move_extend(bonds, std::move(part.bonds));
+      vector_move_extend(angles, std::move(part.angles));
+      vector_move_extend(torsions, std::move(part.torsions));
+      vector_move_extend(chirs, std::move(part.chirs));
+      vector_move_extend(planes, std::move(part.planes));
+      vector_move_extend(rt_storage, std::move(part.rt_storage));
+      if (warnings)
+        *warnings << part_warnings[i].str();
     }
+  }
   for (Link& link : extras)
     apply_restraints_from_link(link, monlib);
 }
 
-void Topo::create_indices() {
-  for (Bond& bond : bonds) {
-    bond_index.emplace(bond.atoms[0], &bond);
-    if (bond.atoms[1] != bond.atoms[0])
-      bond_index.emplace(bond.atoms[1], &bond);
-  }
-  for (Angle& ang : angles)
-    angle_index.emplace(ang.atoms[1], &ang);
-  for (Torsion& tor : torsions) {
-    torsion_index.emplace(tor.atoms[1], &tor);
-    if (tor.atoms[1] != tor.atoms[2])
-      torsion_index.emplace(tor.atoms[2], &tor);
-  }
-  for (Plane& plane : planes)
-    for (Atom* atom : plane.atoms)
-      plane_index.emplace(atom, &plane);
+void Topo::create_indices(int n_threads) {
+  // the four indices are independent
+  parallel_for(4, std::min(get_thread_count(n_threads), 4), [&](size_t k) {
+    switch (k) {
+      case 0:
+        for (Bond& bond : bonds) {
+          bond_index.emplace(bond.atoms[0], &bond);
+          if (bond.atoms[1] != bond.atoms[0])
+            bond_index.emplace(bond.atoms[1], &bond);
+        }
+        break;
+      case 1:
+        for (Angle& ang : angles)
+          angle_index.emplace(ang.atoms[1], &ang);
+        break;
+      case 2:
+        for (Torsion& tor : torsions) {
+          torsion_index.emplace(tor.atoms[1], &tor);
+          if (tor.atoms[1] != tor.atoms[2])
+            torsion_index.emplace(tor.atoms[2], &tor);
+        }
+        break;
+      case 3:
+        for (Plane& plane : planes)
+          for (Atom* atom : plane.atoms)
+            plane_index.emplace(atom, &plane);
+        break;
+    }
+  });
 }
 
 // Tries to construct Topo::Link and append it to extras.
@@ -827,7 +888,7 @@ void add_hydrogens_without_positions(Topo::ResInfo& ri, const NeighMap& neighbor
   }
 }
 
-NeighMap prepare_neighbor_data(Topo& topo, const MonLib& monlib) {
+NeighMap prepare_neighbor_data(Topo& topo, const MonLib& monlib, int n_threads) {
   // disable warnings here, so they are not printed twice
   std::streambuf *warnings_orig = nullptr;
   if (topo.warnings)
@@ -836,7 +897,7 @@ NeighMap prepare_neighbor_data(Topo& topo, const MonLib& monlib) {
   // and monomer_rules/link_rules - overwritten if apply_all_restraints()
   // is called again.
   topo.only_bonds = true;
-  topo.apply_all_restraints(monlib);
+  topo.apply_all_restraints(monlib, n_threads);
   topo.only_bonds = false;
   // re-enable warnings
   if (warnings_orig)
@@ -858,7 +919,8 @@ NeighMap prepare_neighbor_data(Topo& topo, const MonLib& monlib) {
 std::unique_ptr<Topo>
 prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
                  HydrogenChange h_change, bool reorder,
-                 std::ostream* warnings, bool ignore_unknown_links, bool use_cispeps) {
+                 std::ostream* warnings, bool ignore_unknown_links, bool use_cispeps,
+                 int n_threads) {
   std::unique_ptr<Topo> topo(new Topo);
   topo->warnings = warnings;
   if (model_index >= st.models.size())
@@ -907,9 +969,10 @@ prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
 
   // add hydrogens
   if (h_change == HydrogenChange::ReAdd || h_change == HydrogenChange::ReAddButWater) {
-    NeighMap neighbors = prepare_neighbor_data(*topo, monlib);
-    for (Topo::ChainInfo& chain_info : topo->chain_infos)
-      for (Topo::ResInfo& ri : chain_info.res_infos) {
+    NeighMap neighbors = prepare_neighbor_data(*topo, monlib, n_threads);
+    // each residue gets its own hydrogens, so chains are independent
+    parallel_for(topo->chain_infos.size(), get_thread_count(n_threads), [&](size_t n) {
+      for (Topo::ResInfo& ri : topo->chain_infos[n].res_infos) {
         Residue& res = *ri.res;
         if (ri.orig_chemcomp != nullptr &&
             (h_change == HydrogenChange::ReAdd || !res.is_water())) {
@@ -923,6 +986,7 @@ prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
           }
         }
       }
+    });
   }
 
   // sort atoms in residues
@@ -967,13 +1031,13 @@ prepare_topology(Structure& st, MonLib& monlib, size_t model_index,
 
   assign_serial_numbers(st.models[model_index]);
   // fill Topo::bonds, angles, ... and ResInfo::monomer_rules, Links::link_rules
-  topo->apply_all_restraints(monlib);
+  topo->apply_all_restraints(monlib, n_threads);
   // fill bond_index, angle_index, etc
-  topo->create_indices();
+  topo->create_indices(n_threads);
 
   // the hydrogens added previously have positions not set
   if (h_change != HydrogenChange::NoChange)
-    place_hydrogens_on_all_atoms(*topo);
+    place_hydrogens_on_all_atoms(*topo, n_threads);
 
   return topo;
 }
@@ -2,14 +2,27 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <algorithm>  // for nth_element
 #include <cstdlib>  // for rand
 #include <climits>  // for INT_MIN, INT_MAX
+#include <thread>
 #include <vector>
 #include <gemmi/atox.hpp>
 #include <gemmi/math.hpp>
 #include <gemmi/it92.hpp>
+#include <gemmi/c4322.hpp>
 #include <gemmi/util.hpp>  // for is_in_list
 #include <gemmi/asudata.hpp>  // for ComplexCorrelation
+#include <gemmi/hkljoin.hpp>  // for HklIndex, join_hkl
+#include <gemmi/intern.hpp>  // for NamePool, name_pair_key
+#include <gemmi/asumask.hpp>  // for get_asu_mask, get_asu_bit_mask, BitGrid
+#include <gemmi/gridorbits.hpp>  // for GridOrbits
+#include <gemmi/blob.hpp>  // for find_blobs_by_flood_fill, find_blobs_by_labeling
+#include <gemmi/solmask.hpp>  // for SolventMasker
+#include <gemmi/floodfill.hpp>  // for FloodFill
+#include <gemmi/interp.hpp>  // for tricubic_interpolation_der_batch
+#include <gemmi/half.hpp>  // for float_to_half, half_to_float
+#include <gemmi/ccp4.hpp>  // for Ccp4
 #include <linalg.h>
 
 static double draw() { return 10.0 * std::rand() / RAND_MAX - 5; }
@@ -175,6 +188,26 @@ TEST_CASE("IT92") {
   CHECK_EQ(dens_a, doctest::Approx(dens_b));
 }
 
+template<typename Table>
+static void check_tabulated_form_factors(double max_rel_err) {
+  gemmi::TabulatedFormFactors<Table> tab(1.5);
+  for (gemmi::El el : {gemmi::El::H, gemmi::El::C, gemmi::El::Li,
+                       gemmi::El::Na, gemmi::El::Fe, gemmi::El::U}) {
+    CHECK(tab.has(el));
+    for (double stol2 = 0; stol2 < 1.5; stol2 += 0.01237) {
+      double exact = Table::get(el).calculate_sf(stol2);
+      double approx = tab.get(el, stol2);
+      CHECK(std::fabs(approx - exact) <= max_rel_err * std::fabs(exact) + 1e-9);
+    }
+  }
+  CHECK(!tab.covers(1.6));
+}
+
+TEST_CASE("TabulatedFormFactors") {
+  check_tabulated_form_factors<gemmi::IT92<double>>(1e-7);
+  check_tabulated_form_factors<gemmi::C4322<double>>(1e-7);
+}
+
 TEST_CASE("vector_Vec3") {
   // superpose_positions depends on the memory layout of Vec3/Position array.
   std::vector<gemmi::Vec3> vec(5);
@@ -183,3 +216,349 @@ TEST_CASE("vector_Vec3") {
   auto offset = x1 - x0;
   CHECK_EQ(offset, 3);
 }
+
+TEST_CASE("HklIndex") {
+  std::srand(12345);
+  std::vector<gemmi::Miller> hkl;
+  for (int i = 0; i < 500; ++i)
+    hkl.push_back({{std::rand() % 11 - 5, std::rand() % 11 - 5, std::rand() % 60}});
+  std::vector<gemmi::Miller> sparse = hkl;
+  sparse.push_back({{-300000, 7, 1}});
+  for (const std::vector<gemmi::Miller>* v : {&hkl, &sparse}) {
+    gemmi::HklIndex index(*v);
+    CHECK_EQ(index.dense, v == &hkl);
+    for (size_t i = 0; i < v->size(); ++i)
+      CHECK_EQ((*v)[index.find((*v)[i])], (*v)[i]);
+    CHECK_EQ(index.find({{0, 0, -1}}), -1);
+    CHECK_EQ(gemmi::unpack_miller(gemmi::pack_miller((*v)[3])), (*v)[3]);
+  }
+  CHECK(gemmi::pack_miller({{-1, 5, 5}}) < gemmi::pack_miller({{0, -5, -5}}));
+
+  std::vector<gemmi::Miller> half(hkl.begin(), hkl.begin() + 250);
+  gemmi::HklJoin join = gemmi::join_hkl({hkl, sparse, half}, 3);
+  CHECK(std::is_sorted(join.hkl.begin(), join.hkl.end()));
+  CHECK_EQ(join.ncol, 3);
+  for (size_t row = 0; row < join.hkl.size(); ++row) {
+    int p = join.position(row, 1);
+    CHECK(p >= 0);
+    CHECK_EQ(sparse[p], join.hkl[row]);
+  }
+  size_t n_all = join.hkl.size();
+  join.keep_only_complete();
+  CHECK(join.hkl.size() < n_all);
+  for (size_t row = 0; row < join.hkl.size(); ++row)
+    CHECK_EQ(half.at(join.position(row, 2)), join.hkl[row]);
+}
+
+TEST_CASE("NamePool") {
+  gemmi::NamePool pool;
+  std::vector<std::thread> threads;
+  std::vector<int> ids(4);
+  for (int i = 0; i < 4; ++i)
+    threads.emplace_back([&pool, &ids, i] {
+      for (int j = 0; j < 100; ++j)
+        pool.intern("N" + std::to_string(j));
+      ids[i] = pool.intern("CA");
+    });
+  for (std::thread& t : threads)
+    t.join();
+  CHECK_EQ(pool.size(), 101);
+  for (int id : ids)
+    CHECK_EQ(id, ids[0]);
+  CHECK_EQ(pool.get(ids[0]), "CA");
+  CHECK_EQ(pool.find("C"), -1);
+  CHECK_EQ(gemmi::name_pair_key(3, 7), gemmi::name_pair_key(7, 3));
+  CHECK(gemmi::name_pair_key(3, 7) != gemmi::name_pair_key(3, 8));
+
+  // get() doesn't lock; read names while other threads add new blocks
+  threads.clear();
+  std::vector<int> errors(4, 0);
+  int n0 = pool.find("N0");
+  for (int i = 0; i < 4; ++i)
+    threads.emplace_back([&pool, &errors, n0, i] {
+      for (int j = 0; j < 1000; ++j) {
+        std::string name = "X" + std::to_string(j);
+        int id = pool.intern(name);
+        if (pool.get(id) != name || pool.get(n0) != "N0")
+          ++errors[i];
+      }
+    });
+  for (std::thread& t : threads)
+    t.join();
+  CHECK_EQ(pool.size(), 1101);
+  CHECK_EQ(errors, std::vector<int>(4, 0));
+  for (int j = 0; j < 1000; j += 37)
+    CHECK_EQ(pool.get(pool.find("X" + std::to_string(j))), "X" + std::to_string(j));
+}
+
+TEST_CASE("BitGrid") {
+  for (const char* hm : {"P 1", "P 21 21 21", "C 1 2 1", "P 61 2 2", "I a -3 d"}) {
+    gemmi::Grid<std::int8_t> grid;
+    grid.spacegroup = gemmi::find_spacegroup_by_name(hm);
+    grid.set_size(24, 24, 24);
+    std::vector<std::int8_t> mask = gemmi::get_asu_mask(grid);
+    gemmi::BitGrid bits = gemmi::get_asu_bit_mask(grid);
+    CHECK_EQ(bits.count(), std::count(mask.begin(), mask.end(), 1));
+    grid.data = mask;
+    gemmi::BitGrid bits2;
+    bits2.from_grid(grid);
+    CHECK(bits2.words == bits.words);
+    // iterating over the asu with BitGrid mask gives the same points
+    gemmi::MaskedGrid<std::int8_t> masked{mask, &grid};
+    gemmi::BitMaskedGrid<std::int8_t> bit_masked{bits, &grid};
+    std::vector<const std::int8_t*> points, bit_points;
+    for (auto point : masked)
+      points.push_back(point.value);
+    for (auto point : bit_masked)
+      bit_points.push_back(point.value);
+    CHECK(points.size() > 1);
+    CHECK(points == bit_points);
+  }
+  gemmi::BitGrid bits;
+  bits.set_size(3, 5, 7);  // 105 points, the last word is not full
+  bits.set(0);
+  bits.set(104);
+  bits.set(64, true);
+  CHECK(bits.get_value_q(2, 4, 6));
+  CHECK_EQ(bits.count(), 3);
+  gemmi::BitGrid other = bits;
+  other.invert();
+  CHECK_EQ(other.count(), 102);
+  other |= bits;
+  CHECK_EQ(other.count(), 105);
+  other.reset(64);
+  other &= bits;
+  CHECK_EQ(other.count(), 2);
+  gemmi::Grid<float> grid;
+  bits.to_grid(grid);
+  CHECK_EQ(grid.data.size(), 105);
+  CHECK_EQ(grid.sum(), 3.f);
+  CHECK_EQ(grid.data[104], 1.f);
+}
+
+TEST_CASE("GridOrbits") {
+  for (const char* hm : {"P 1", "P 21 21 21", "C 1 2 1", "P 61 2 2", "I a -3 d"}) {
+    gemmi::Grid<float> grid;
+    grid.spacegroup = gemmi::find_spacegroup_by_name(hm);
+    grid.set_size(24, 24, 24);
+    for (float& x : grid.data)
+      x = (float) draw();
+    gemmi::Grid<float> grid2 = grid;
+    gemmi::Grid<float> grid3 = grid;
+    grid.symmetrize_sum();
+    gemmi::GridOrbits orbits;
+    orbits.prepare(grid2);
+    gemmi::GridOrbits orbits3;
+    orbits3.prepare(grid3, 3);
+    CHECK(orbits.representatives == orbits3.representatives);
+    CHECK(orbits.mates == orbits3.mates);
+    gemmi::symmetrize_sum(grid2, orbits);
+    gemmi::symmetrize_sum(grid3, orbits3, 3);
+    CHECK(grid2.data == grid.data);
+    CHECK(grid3.data == grid.data);
+  }
+}
+
+TEST_CASE("GridRuns") {
+  gemmi::Grid<float> grid;
+  grid.spacegroup = gemmi::find_spacegroup_by_name("P 1");
+  grid.set_size(8, 6, 5);
+  // a line crossing the cell boundary, and a line wrapping around the cell
+  for (int u : {0, 1, 6, 7})
+    grid.set_value(u, 2, 3, 1.f);
+  for (int u = 0; u < 8; ++u)
+    grid.set_value(u, 4, 0, 1.f);
+  gemmi::GridRuns cc;
+  cc.label(grid, [](float x) { return x > 0.5f; }, false);
+  CHECK(cc.runs.size() == 3);
+  size_t a = cc.find_run(1, 2, 3);
+  size_t b = cc.find_run(6, 2, 3);
+  size_t c = cc.find_run(3, 4, 0);
+  CHECK(cc.find_run(3, 2, 3) == cc.runs.size());
+  CHECK(cc.parent[a] == cc.parent[b]);
+  CHECK(cc.parent[a] != cc.parent[c]);
+  CHECK(!cc.percolating[cc.parent[a]]);
+  CHECK(cc.percolating[cc.parent[c]]);
+  // unwrapped, run b is next to run a
+  CHECK(cc.shift[b][0] - cc.shift[a][0] == -8);
+
+  for (const char* hm : {"P 1", "P 21 21 21", "C 1 2 1", "P 61 2 2"}) {
+    grid.spacegroup = gemmi::find_spacegroup_by_name(hm);
+    grid.set_size(24, 24, 24);
+    for (float& x : grid.data)
+      x = (float) draw();
+    grid.symmetrize_max();
+    // 15% of points above cutoff - blobs don't wrap around the unit cell
+    std::vector<float> values = grid.data;
+    std::nth_element(values.begin(), values.begin() + values.size() * 85 / 100,
+                     values.end());
+    gemmi::BlobCriteria criteria;
+    // equal to a few grid values (symmetry mates), these points are included
+    criteria.cutoff = values[values.size() * 85 / 100];
+    criteria.min_volume = 0;
+    criteria.min_score = 0;
+    std::vector<gemmi::Blob> blobs1 = gemmi::find_blobs_by_flood_fill(grid, criteria);
+    for (int n_threads : {1, 3}) {
+      std::vector<gemmi::Blob> blobs2 =
+        gemmi::find_blobs_by_labeling(grid, criteria, false, n_threads);
+      REQUIRE(blobs1.size() == blobs2.size());
+      for (size_t i = 0; i < blobs1.size(); ++i) {
+        CHECK(blobs1[i].volume == blobs2[i].volume);
+        CHECK(blobs1[i].score == doctest::Approx(blobs2[i].score));
+        CHECK(blobs1[i].peak_value == blobs2[i].peak_value);
+        CHECK(blobs1[i].centroid.dist(blobs2[i].centroid) < 1e-6);
+      }
+    }
+  }
+}
+
+TEST_CASE("SolventMasker::remove_islands") {
+  gemmi::Grid<float> grid;
+  grid.spacegroup = gemmi::find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(30, 30, 30, 90, 90, 90);
+  grid.set_size(30, 30, 30);
+  // 10% of land: many islands of different size, some crossing the cell edge
+  for (float& x : grid.data)
+    x = draw() > 4 ? 1.f : 0.f;
+  gemmi::SolventMasker masker(gemmi::AtomicRadiiSet::Refmac);
+  masker.island_min_volume = 4;
+  // the previous implementation, with flood fill
+  gemmi::Grid<float> expected = grid;
+  int expected_count = 0;
+  gemmi::FloodFill<float,1> flood_fill{expected};
+  flood_fill.for_each_islands([&](gemmi::FloodFill<float,1>::Result& r) {
+      if (r.point_count() <= 4) {
+        ++expected_count;
+        flood_fill.set_volume_values(r, 0.f);
+      }
+  });
+  CHECK(expected_count > 10);
+  for (int n_threads : {1, 2, 3, 7}) {
+    gemmi::Grid<float> grid2 = grid;
+    masker.n_threads = n_threads;
+    CHECK(masker.remove_islands(grid2) == expected_count);
+    CHECK(grid2.data == expected.data);
+  }
+}
+
+TEST_CASE("SolventMasker::n_threads") {
+  gemmi::Model model("1");
+  model.chains.emplace_back("A");
+  model.chains[0].residues.emplace_back();
+  std::vector<gemmi::Atom>& atoms = model.chains[0].residues[0].atoms;
+  const gemmi::El elements[] = {gemmi::El::C, gemmi::El::N, gemmi::El::O, gemmi::El::S};
+  for (int i = 0; i < 150; ++i) {
+    gemmi::Atom atom;
+    atom.element = elements[i % 4];
+    atom.pos = gemmi::Position(3 * draw() + 10, 4 * draw() + 12, 4 * draw() + 15);
+    atoms.push_back(atom);
+  }
+  gemmi::Grid<std::int8_t> grid;
+  grid.spacegroup = gemmi::find_spacegroup_by_name("P 21 21 21");
+  grid.set_unit_cell(30, 34, 40, 90, 90, 90);
+  grid.set_size(30, 36, 40);
+  for (auto radii : {gemmi::AtomicRadiiSet::Refmac, gemmi::AtomicRadiiSet::Cctbx,
+                     gemmi::AtomicRadiiSet::Constant}) {
+    gemmi::SolventMasker masker(radii, 1.5);
+    gemmi::Grid<std::int8_t> expected = grid;
+    masker.put_mask_on_grid(expected, model);
+    size_t zeros = std::count(expected.data.begin(), expected.data.end(), 0);
+    CHECK(zeros > expected.data.size() / 10);
+    CHECK(zeros < expected.data.size() * 9 / 10);
+    for (int n_threads : {2, 3, 7}) {
+      gemmi::Grid<std::int8_t> grid2 = grid;
+      masker.n_threads = n_threads;
+      masker.put_mask_on_grid(grid2, model);
+      CHECK(grid2.data == expected.data);
+    }
+  }
+}
+
+TEST_CASE("tricubic_interpolation_der_batch") {
+  gemmi::Grid<float> grid;
+  grid.unit_cell.set(20, 24, 28, 90, 105, 90);
+  grid.spacegroup = gemmi::find_spacegroup_by_name("P 1");
+  grid.set_size(20, 24, 30);
+  for (float& x : grid.data)
+    x = (float) draw();
+  std::vector<gemmi::Position> positions;
+  for (int i = 0; i < 100; ++i)
+    positions.emplace_back(60 * draw() - 20, 60 * draw() - 20, 60 * draw() - 20);
+  std::vector<std::array<double,4>> r1 =
+    gemmi::tricubic_interpolation_der_batch(grid, positions);
+  std::vector<std::array<double,4>> r3 =
+    gemmi::tricubic_interpolation_der_batch(grid, positions, 3);
+  CHECK(r1 == r3);
+  const double h = 1e-5;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    const gemmi::Position& pos = positions[i];
+    CHECK(r1[i][0] == doctest::Approx(grid.tricubic_interpolation(pos)));
+    for (int j = 0; j < 3; ++j) {
+      gemmi::Position p1 = pos, p2 = pos;
+      p1.at(j) -= h;
+      p2.at(j) += h;
+      double numeric = (grid.tricubic_interpolation(p2) -
+                        grid.tricubic_interpolation(p1)) / (2 * h);
+      CHECK(r1[i][j+1] == doctest::Approx(numeric).epsilon(1e-4));
+    }
+  }
+}
+
+TEST_CASE("half") {
+  CHECK(gemmi::float_to_half(1.f) == 0x3c00);
+  CHECK(gemmi::float_to_half(-2.f) == 0xc000);
+  CHECK(gemmi::float_to_half(65504.f) == 0x7bff);  // max half
+  CHECK(gemmi::float_to_half(65520.f) == 0x7c00);  // rounded to infinity
+  CHECK(gemmi::float_to_half(5.9604645e-08f) == 0x0001);  // min subnormal
+  CHECK(gemmi::float_to_half(1e-9f) == 0);
+  CHECK(gemmi::float_to_half(1.f + 1.f / 2048) == 0x3c00);  // tie to even
+  CHECK(gemmi::float_to_half(1.f + 3.f / 2048) == 0x3c02);
+  CHECK(std::isnan(gemmi::half_to_float(gemmi::float_to_half(NAN))));
+  CHECK(gemmi::half_to_float(0x3555) == doctest::Approx(1. / 3).epsilon(1e-3));
+  std::vector<std::uint16_t> all(65536);
+  for (size_t i = 0; i < all.size(); ++i)
+    all[i] = (std::uint16_t) i;
+  std::vector<float> floats(all.size());
+  gemmi::half_to_float_array(all.data(), floats.data(), all.size());
+  std::vector<std::uint16_t> back(all.size());
+  gemmi::float_to_half_array(floats.data(), back.data(), all.size());
+  size_t mismatches = 0;
+  for (size_t i = 0; i < all.size(); ++i)
+    if (std::isnan(floats[i]) ? (back[i] & 0x7fff) <= 0x7c00 : back[i] != all[i])
+      ++mismatches;
+  CHECK(mismatches == 0);
+}
+
+TEST_CASE("Ccp4<Half>") {
+  gemmi::Ccp4<gemmi::Half> map;
+  map.grid.unit_cell.set(20, 24, 30, 90, 90, 90);
+  map.grid.spacegroup = gemmi::find_spacegroup_by_name("P 21 21 21");
+  map.grid.set_size(12, 16, 20);
+  std::srand(12345);
+  for (gemmi::Half& h : map.grid.data)
+    h = draw();
+  map.grid.data[7] = 65520.f;  // infinity
+  map.grid.data[8] = NAN;
+  map.update_ccp4_header(12);
+  const char* path = "cpptest_half.ccp4";
+  map.write_ccp4_map(path);
+  gemmi::Ccp4<gemmi::Half> map2;
+  map2.read_ccp4_file(path);
+  gemmi::Ccp4<float> map3;
+  map3.read_ccp4_file(path);
+  std::remove(path);
+  CHECK_EQ(map2.header_i32(4), 12);
+  CHECK_EQ(map2.grid.point_count(), map.grid.point_count());
+  CHECK_EQ(map3.grid.point_count(), map.grid.point_count());
+  size_t mismatches = 0;
+  for (size_t i = 0; i < map.grid.data.size(); ++i) {
+    if (map2.grid.data[i].bits != map.grid.data[i].bits)
+      ++mismatches;
+    if (!gemmi::impl::is_same(map3.grid.data[i], float(map.grid.data[i])))
+      ++mismatches;
+  }
+  CHECK(mismatches == 0);
+  CHECK(std::isinf(map3.grid.data[7]));
+  CHECK(std::isnan(map3.grid.data[8]));
+  CHECK(map2.hstats.dmin == doctest::Approx(map.hstats.dmin));
+}
@@ -65,5 +65,113 @@ class TestAlignment(unittest.TestCase):
         for s in [s1, s2, s3]:
             self.assertAlmostEqual(s.transform.vec.y, 17.0, places=1)
 
+    def test_moving_window(self):
+        st = gemmi.read_structure(full_path('4oz7.pdb'))
+        model = st[0]
+        ptype = model['A'].get_polymer().check_polymer_type()
+        radius = 10.0
+        windows = gemmi.calculate_superpositions_in_moving_window(
+                model['A'].get_polymer(), model['B'].get_polymer(), ptype,
+                radius=radius)
+        self.assertEqual(len(windows), 10)
+        # the same windows superposed directly
+        pos1, pos2, ca_offsets = [], [], []
+        for res1, res2 in zip(model['A'].get_polymer(),
+                              model['B'].get_polymer()):
+            self.assertEqual(res1.name, res2.name)
+            ca_offset = None
+            for name, el in [('N', 'N'), ('CA', 'C'), ('C', 'C'), ('O', 'O')]:
+                a1 = res1.find_atom(name, '*', gemmi.Element(el))
+                a2 = res2.find_atom(name, '*', gemmi.Element(el))
+                if a1 and a2:
+                    if name == 'CA':
+                        ca_offset = len(pos1)
+                    pos1.append(a1.pos)
+                    pos2.append(a2.pos)
+            ca_offsets.append(ca_offset)
+        for sup, ca in zip(windows, ca_offsets):
+            self.assertIsNotNone(ca)
+            begin = ca
+            while begin > 0 and pos1[ca].dist(pos1[begin-1]) < radius:
+                begin -= 1
+            end = ca + 1
+            while end < len(pos1) and pos1[ca].dist(pos1[end]) < radius:
+                end += 1
+            expected = gemmi.superpose_positions(pos1[begin:end],
+                                                 pos2[begin:end])
+            self.assertEqual(sup.count, end - begin)
+            self.assertAlmostEqual(sup.rmsd, expected.rmsd, delta=1e-6)
+            self.assertTrue(sup.transform.approx(expected.transform, 1e-6))
+        # ensemble: the second model is the first one moved as a rigid body
+        tr = gemmi.calculate_superposition(model['A'].get_polymer(),
+                                           model['B'].get_polymer(), ptype,
+                                           gemmi.SupSelect.CaP).transform
+        model2 = model.clone()
+        model2.name = '2'
+        model2.transform_pos_and_adp(tr)
+        st.add_model(model2)
+        flat = gemmi.FlatStructure(st)
+        local = gemmi.calculate_superpositions_in_moving_window(
+                flat, 0, ptype, n_threads=2)
+        self.assertEqual(len(local), 2)
+        self.assertEqual(len(local[1]), sum(len(ch) for ch in model))
+        n_windows = 0
+        for ref, sup in zip(local[0], local[1]):
+            self.assertEqual(ref.count, sup.count)
+            if sup.count != 0:
+                n_windows += 1
+                self.assertAlmostEqual(sup.rmsd, 0, delta=1e-5)
+        self.assertEqual(n_windows, 20)
+        # waters and ligands are not used, windows are as in the function above
+        counts = []
+        for ch in model:
+            polymer = ch.get_polymer()
+            if len(polymer) != 0:
+                single = gemmi.calculate_superpositions_in_moving_window(
+                        polymer, polymer, ptype)
+                counts += [sup.count for sup in single]
+            counts += [0] * (len(ch) - len(polymer))
+        self.assertEqual([sup.count for sup in local[0]], counts)
+
+    def test_ensemble_rmsd(self):
+        st = gemmi.read_structure(full_path('4oz7.pdb'))
+        model = st[0]
+        ptype = model['A'].get_polymer().check_polymer_type()
+        for i in range(3):
+            model2 = model.clone()
+            model2.name = str(i + 2)
+            for ch in model2:
+                for res in ch:
+                    for atom in res:
+                        atom.pos += gemmi.Position(0.1 * i * (atom.serial % 3),
+                                                   i, -0.2 * i)
+            st.add_model(model2)
+        flat = gemmi.FlatStructure(st)
+        S = gemmi.SupSelect
+        ens = gemmi.EnsembleRmsd(flat, ptype, S.MainChain)
+        self.assertEqual(ens.n_models, 4)
+        matrix = ens.calculate_matrix(n_threads=2)
+        self.assertEqual(matrix.shape, (4, 4))
+        rows = ens.calculate_rows(1, 3)
+        self.assertEqual(rows.shape, (2, 4))
+        for i in range(4):
+            self.assertEqual(matrix[i][i], 0)
+            for j in range(4):
+                self.assertEqual(matrix[i][j], matrix[j][i])
+                if i != j:
+                    sup = gemmi.calculate_superposition(flat, i, flat, j,
+                                                        ptype, S.MainChain)
+                    self.assertAlmostEqual(matrix[i][j], sup.rmsd, delta=1e-9)
+                    self.assertAlmostEqual(ens.rmsd(i, j), sup.rmsd, delta=1e-9)
+                if 1 <= i < 3:
+                    self.assertEqual(rows[i-1][j], matrix[i][j])
+        ens.tile_size = 3
+        self.assertEqual(ens.calculate_matrix().tolist(), matrix.tolist())
+        ens.tile_size = 0
+        with self.assertRaises(RuntimeError):
+            ens.calculate_matrix()
+        with self.assertRaises(RuntimeError):
+            ens.calculate_rows(0, 4)
+
 if __name__ == '__main__':
     unittest.main()
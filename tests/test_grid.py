@@ -61,6 +61,18 @@ class TestFloatGrid(unittest.TestCase):
             self.assertTrue(numpy.allclose(m.grid, grid2, atol=0.0, rtol=0,
                                            equal_nan=True))
 
+    def test_mode_12(self):
+        m = gemmi.read_ccp4_map(full_path('5i55_tiny.ccp4'))
+        values = [p.value for p in m.grid]
+        m.update_ccp4_header(mode=12)
+        tmp_path = get_path_for_tempfile(suffix='.mrc')
+        m.write_ccp4_map(tmp_path)
+        m2 = gemmi.read_ccp4_map(tmp_path)
+        self.assertEqual(m2.header_i32(4), 12)
+        for a, b in zip(values, m2.grid):
+            # half precision has 11 significant bits
+            self.assertAlmostEqual(a, b.value, delta=abs(a) * 2**-11 + 1e-7)
+
     def test_new(self):
         N = 24
         m = gemmi.FloatGrid(N, N, N)
@@ -82,6 +94,25 @@ class TestFloatGrid(unittest.TestCase):
         m.symmetrize_min()
         self.assertEqual(m.sum(), 2 * N * N * N - 2 * 12)
 
+    def test_bit_grid(self):
+        grid = gemmi.Int8Grid(24, 24, 24)
+        grid.spacegroup = gemmi.find_spacegroup_by_name('P 21 21 21')
+        bits = gemmi.get_asu_bit_mask(grid)
+        self.assertEqual(bits.shape, (24, 24, 24))
+        self.assertEqual(bits.count(), 24**3 * 3 // 4)
+        masked = sum(1 for point in grid.masked_asu())
+        self.assertEqual(bits.count(), 24**3 - masked)
+        bits.invert()
+        self.assertEqual(bits.count(), masked)
+        int8_grid = bits.to_int8_grid()
+        self.assertEqual(int8_grid.sum(), masked)
+        bits2 = gemmi.BitGrid()
+        bits2.from_grid(int8_grid)
+        bits2.set_value(0, 0, -1, False)
+        self.assertFalse(bits2.get_value(0, 0, 23))
+        bits2 |= bits
+        self.assertEqual(bits2.count(), masked)
+
 class TestCcp4Map(unittest.TestCase):
     @unittest.skipIf(numpy is None, "NumPy not installed.")
     def test_567_map(self):
@@ -163,6 +194,25 @@ class TestCcp4Map(unittest.TestCase):
         sub2 = grid.get_subarray([4,-3,20], [5,10,4])
         assert_numpy_equal(self, -sub, sub2)
 
+    @unittest.skipIf(numpy is None, "NumPy not installed.")
+    def test_tricubic_interpolation_der_batch(self):
+        m = gemmi.read_ccp4_map(full_path('5i55_tiny.ccp4'), setup=True)
+        grid = m.grid
+        positions = numpy.array([[2.0, 3.0, 4.0], [-7.5, 11.2, 0.3],
+                                 [30.1, -4.4, 15.6]])
+        result = grid.tricubic_interpolation_der_batch(positions, threads=2)
+        self.assertEqual(result.shape, (3, 4))
+        frac_mat = numpy.array(grid.unit_cell.frac.mat.tolist())
+        for pos, row in zip(positions, result):
+            pos = gemmi.Position(*pos)
+            self.assertAlmostEqual(row[0], grid.tricubic_interpolation(pos))
+            fpos = grid.unit_cell.fractionalize(pos)
+            der = grid.tricubic_interpolation_der(fpos)
+            self.assertAlmostEqual(row[0], der[0])
+            grad = frac_mat.T.dot(der[1:])
+            for i in range(3):
+                self.assertAlmostEqual(row[i+1], grad[i], places=5)
+
     @unittest.skipIf(numpy is None, "NumPy not installed.")
     def test_setup_nosymmetry(self):
         m = gemmi.read_ccp4_map(full_path('5i55_tiny.ccp4'))
@@ -87,6 +87,53 @@ class TestMtz(unittest.TestCase):
             assert_numpy_equal(self, numpy.array(mtz, copy=False), mtz.array)
             assert_numpy_equal(self, mtz.array, mtz2.array)
 
+    @unittest.skipIf(numpy is None, "requires NumPy")
+    def test_mtz_writer(self):
+        mtz = gemmi.read_mtz_file(full_path('5e5z.mtz'))
+        ref_name = get_path_for_tempfile(suffix='.mtz')
+        mtz.write_to_file(ref_name)
+        with open(ref_name, 'rb') as f:
+            expected = f.read()
+        os.remove(ref_name)
+        for suffix in ['.mtz', '.mtz.gz']:
+            out_name = get_path_for_tempfile(suffix=suffix)
+            writer = gemmi.MtzWriter(mtz, out_name, threads=2)
+            writer.write_rows(mtz.array[:100])
+            writer.write_rows(mtz.array[100:])
+            writer.finish()
+            self.assertEqual(writer.nreflections, mtz.nreflections)
+            # without deflate, .gz output is written uncompressed
+            if suffix == '.mtz' or not gemmi.MtzWriter.can_write_gzip():
+                with open(out_name, 'rb') as f:
+                    self.assertEqual(f.read(), expected)
+            else:
+                mtz2 = gemmi.read_mtz_file(out_name)
+                assert_numpy_equal(self, mtz.array, mtz2.array)
+            os.remove(out_name)
+
+    @unittest.skipIf(numpy is None or not gemmi.MtzWriter.can_write_gzip(),
+                     'requires NumPy and zlib')
+    def test_mtz_writer_gzip_blocks(self):
+        import gzip
+        mtz = gemmi.read_mtz_file(full_path('5e5z.mtz'))
+        # more than a few 128KiB blocks, to be compressed on 3 threads
+        data = numpy.tile(mtz.array, (60, 1))
+        self.assertGreater(data.nbytes, 6 * 128 * 1024)
+        mtz.set_data(data)
+        ref_name = get_path_for_tempfile(suffix='.mtz')
+        mtz.write_to_file(ref_name)
+        with open(ref_name, 'rb') as f:
+            expected = f.read()
+        os.remove(ref_name)
+        out_name = get_path_for_tempfile(suffix='.mtz.gz')
+        writer = gemmi.MtzWriter(mtz, out_name, threads=3)
+        for start in range(0, len(data), 5000):
+            writer.write_rows(data[start:start+5000])
+        writer.finish()
+        with gzip.open(out_name, 'rb') as f:
+            self.assertEqual(f.read(), expected)
+        os.remove(out_name)
+
     def test_remove_and_add_column(self):
         path = full_path('5e5z.mtz')
         col_name = 'FREE'
@@ -133,11 +180,34 @@ class TestMtz(unittest.TestCase):
             array1 = numpy.array(grid1, copy=False)
             array2 = numpy.array(grid2, copy=False)
             self.assertTrue((array2 == array1.transpose(2,1,0)).all())
+            grid3 = mtz.get_f_phi_on_grid('FWT', 'PHWT', size, half_l=half_l,
+                                          threads=3)
+            self.assertTrue((numpy.array(grid3, copy=False) == array1).all())
             self.asu_data_test(grid1)
 
         fft_test(self, mtz, 'FWT', 'PHWT', size)
         fft_test(self, mtz, 'FWT', 'PHWT', size, order=gemmi.AxisOrder.ZYX)
 
+    @unittest.skipIf(numpy is None, "requires NumPy")
+    def test_map_box(self):
+        path = full_path('5wkd_phases.mtz.gz')
+        mtz = gemmi.read_mtz_file(path)
+        size = mtz.get_size_for_hkl(sample_rate=3)
+        for half_l in (True, False):
+            grid = mtz.get_f_phi_on_grid('FWT', 'PHWT', size, half_l=half_l)
+            full = gemmi.transform_f_phi_grid_to_map(grid)
+            for start, shape in [([0, 0, 0], [full.nu, full.nv, full.nw]),
+                                 ([-5, 3, 7], [7, 9, 11]),
+                                 ([10, -20, -3], [full.nu + 5, 3, 40])]:
+                box = gemmi.transform_f_phi_grid_to_map_box(grid, start, shape)
+                self.assertEqual(box.shape, tuple(shape))
+                expected = full.get_subarray(start, shape)
+                self.assertTrue(numpy.allclose(box, expected, atol=1e-6))
+            mean, rms = gemmi.calculate_map_mean_and_rms(grid)
+            array = numpy.array(full, copy=False)
+            self.assertAlmostEqual(mean, array.mean(), delta=1e-6)
+            self.assertAlmostEqual(rms, array.std(), delta=1e-5)
+
     def test_value_grid(self):
         #path = full_path('5wkd_phases.mtz.gz')
         path = full_path('5e5z.mtz')
@@ -196,6 +266,15 @@ class TestSfMmcif(unittest.TestCase):
         scaling.fit_isotropic_b_approximately()
         scaling.fit_parameters()
         #print(scaling.k_overall, scaling.b_overall)
+        k_ov = scaling.k_overall
+
+        # the same with multi-threaded fitting
+        scaling2 = gemmi.Scaling(fc_data.unit_cell, fc_data.spacegroup)
+        scaling2.n_threads = 3
+        scaling2.prepare_points(fc_data, fobs_data)
+        scaling2.fit_isotropic_b_approximately()
+        scaling2.fit_parameters()
+        self.assertAlmostEqual(scaling2.k_overall, k_ov, delta=1e-6 * k_ov)
         scaling.scale_data(fc_data)
 
         # with mask
@@ -232,5 +311,27 @@ class TestBinner(unittest.TestCase):
         inv_d2 = [mtz.cell.calculate_1_d2(h) for h in hkls]
         self.assertEqual(list(binner.get_bins_from_1_d2(inv_d2)), bins)
 
+class TestHklJoin(unittest.TestCase):
+    @unittest.skipIf(numpy is None, "requires NumPy")
+    def test_join_hkl(self):
+        mtz = gemmi.read_mtz_file(full_path('5e5z.mtz'))
+        hkl = mtz.make_miller_array()
+        shuffled = hkl[::-1].copy()
+        partial = hkl[::3].copy()
+        join = gemmi.join_hkl([hkl, shuffled, partial], threads=2)
+        self.assertEqual(len(join), len(hkl))
+        self.assertEqual(join.pos.shape, (len(hkl), 3))
+        # the union is sorted
+        self.assertEqual([tuple(h) for h in join.hkl],
+                         sorted(tuple(h) for h in hkl))
+        fp = mtz.column_with_label('FP').array
+        a = join.aligned(0, fp)
+        b = join.aligned(1, fp[::-1].copy())
+        assert_numpy_equal(self, a, b)
+        join.keep_only_complete()
+        self.assertEqual(len(join), len(partial))
+        match = gemmi.HklMatch(shuffled, hkl)
+        self.assertEqual(list(match.pos), list(range(len(hkl)))[::-1])
+
 if __name__ == '__main__':
     unittest.main()
@@ -3,10 +3,11 @@
 import gzip
 from io import StringIO
 import os
+import random
 import sys
 import unittest
 import gemmi
-from common import full_path, get_path_for_tempfile
+from common import full_path, get_path_for_tempfile, numpy
 try:
     from Bio import PDB
 except ImportError:
@@ -319,6 +320,123 @@ class TestMol(unittest.TestCase):
         gemmi.merge_atoms_in_expanded_model(a2, gemmi.UnitCell())
         # 3 atoms are on a 3-fold rotation axis
         self.assertEqual(a2.count_atom_sites(), (site_count - 3) * 3 + 3 * 1)
+        # the same, but merged while making the assembly
+        a3 = gemmi.make_assembly(st.assemblies[1], model, how, merge_dist=0.2)
+        self.assertEqual(a3.count_atom_sites(), a2.count_atom_sites())
+        for cra2, cra3 in zip(a2.all(), a3.all()):
+            self.assertEqual(str(cra2), str(cra3))
+            self.assertAlmostEqual(cra2.atom.pos.dist(cra3.atom.pos), 0, delta=1e-6)
+            self.assertAlmostEqual(cra2.atom.occ, cra3.atom.occ, delta=1e-6)
+
+    def test_merge_atoms_in_crystal(self):
+        # copies made with P 4 3 2 operators, merged with P 4 symmetry;
+        # atoms on the 4-fold and 3-fold axes and at the origin overlap
+        rng = random.Random(1)
+        def rand_pos(k):
+            x, y, z = [30 * rng.random() for _ in range(3)]
+            if k == 1:
+                x = y = 0
+            elif k == 2:
+                y = z = x
+            elif k == 3:
+                x = y = z = 0
+            return gemmi.Position(*[c + rng.uniform(-0.05, 0.05)
+                                    for c in (x, y, z)])
+        st = gemmi.Structure()
+        st.cell = gemmi.UnitCell(30, 30, 30, 90, 90, 90)
+        st.spacegroup_hm = 'P 4 3 2'
+        st.setup_cell_images()
+        chain = gemmi.Chain('A')
+        for n in range(8):
+            res = gemmi.Residue()
+            res.name = 'ALA'
+            res.seqid = gemmi.SeqId(n + 1, ' ')
+            for k in range(5):
+                atom = gemmi.Atom()
+                atom.name = 'C%d' % k
+                atom.element = gemmi.Element('C')
+                atom.occ = 0.01
+                atom.pos = rand_pos(k if k != 3 or n % 2 == 0 else 0)
+                res.add_atom(atom)
+            chain.add_residue(res)
+        model = gemmi.Model('1')
+        model.add_chain(chain)
+        for n, op in enumerate(st.cell.images):
+            copy = chain.clone()
+            copy.name = str(n)
+            for res in copy:
+                for atom in res:
+                    fpos = op.apply(st.cell.fractionalize(atom.pos))
+                    atom.pos = st.cell.orthogonalize(gemmi.Fractional(fpos))
+            model.add_chain(copy)
+        st.spacegroup_hm = 'P 4'
+        st.setup_cell_images()
+        cell = st.cell
+
+        # straightforward O(n^2) merging, as a reference
+        atoms = [(cra.chain.name, cra.residue.seqid.num, cra.atom)
+                 for cra in model.all()]
+        merged = set()
+        expected = []
+        for i, (ch1, num1, a1) in enumerate(atoms):
+            if i in merged:
+                continue
+            pos_sum = gemmi.Position(a1.pos)
+            n = 1
+            for j, (ch2, num2, a2) in enumerate(atoms):
+                if (j in merged or ch2 == ch1 or num2 != num1
+                        or a2.name != a1.name):
+                    continue
+                images = [cell.find_nearest_pbc_image(a1.pos, a2.pos, k)
+                          for k in range(len(cell.images) + 1)]
+                k = min(range(len(images)), key=lambda k: images[k].dist())
+                if images[k].dist() < 0.2:
+                    pos_sum += cell.find_nearest_pbc_position(a1.pos, a2.pos, k)
+                    n += 1
+                    merged.add(j)
+            expected.append((pos_sum / n, min(1, n * a1.occ)))
+        self.assertEqual(len(atoms), 24 * 40)
+        # P 4 copies are merged completely, 24/4=6 copies of each atom
+        # would be left if there were no atoms on special positions
+        self.assertTrue(40 < len(expected) < 6 * 40)
+
+        for n_threads in [1, 3]:
+            m = model.clone()
+            gemmi.merge_atoms_in_expanded_model(m, cell, n_threads=n_threads)
+            self.assertEqual(m.count_atom_sites(), len(expected))
+            for cra, (pos, occ) in zip(m.all(), expected):
+                self.assertAlmostEqual(cra.atom.pos.dist(pos), 0, delta=1e-6)
+                self.assertAlmostEqual(cra.atom.occ, occ, delta=1e-6)
+        m = model.clone()
+        gemmi.merge_atoms_in_expanded_model(m, cell, max_dist=0)
+        self.assertEqual(m.count_atom_sites(), len(atoms))
+
+    def test_assembly_view(self):
+        st = gemmi.read_structure(full_path('5wkd.pdb'))
+        how = gemmi.HowToNameCopiedChain.Short
+        view = gemmi.make_assembly_view(st.assemblies[0], st[0], how)
+        self.assertEqual(len(view.copies), 10)
+        self.assertEqual(view.atom_count(), 500)
+        assem = gemmi.make_assembly(st.assemblies[0], st[0], how)
+        model = view.to_model()
+        self.assertEqual([ch.name for ch in model], [ch.name for ch in assem])
+        for cra1, cra2 in zip(model.all(), assem.all()):
+            self.assertEqual(str(cra1), str(cra2))
+            self.assertEqual(cra1.atom.pos.dist(cra2.atom.pos), 0)
+        st2 = gemmi.Structure()
+        st2.add_model(assem)
+        expected = st2.make_minimal_pdb()
+        # make_minimal_pdb(Structure) starts with CRYST1
+        self.assertEqual(view.make_minimal_pdb(), expected.split('\n', 1)[1])
+        st3 = gemmi.read_pdb_string(view.make_minimal_pdb())
+        st4 = gemmi.cif.read_string(view.make_minimal_mmcif('5wkd'))
+        st4 = gemmi.make_structure_from_block(st4[0])
+        self.assertEqual(st3[0].count_atom_sites(), st4[0].count_atom_sites())
+        ns = gemmi.NeighborSearch(view, gemmi.UnitCell(), 5).populate()
+        ns2 = gemmi.NeighborSearch(assem, gemmi.UnitCell(), 5).populate()
+        pos = assem[3][0][0].pos
+        self.assertEqual(len(ns.find_atoms(pos, '\0', radius=4)),
+                         len(ns2.find_atoms(pos, '\0', radius=4)))
 
     def test_software_category(self):
         doc = gemmi.cif.read_file(full_path('3dg1_final.cif'))
@@ -818,6 +936,76 @@ class TestMol(unittest.TestCase):
         bio = gemmi.make_assembly(a1, model, gemmi.HowToNameCopiedChain.Short)
         self.assertEqual([ch.name for ch in bio], ['B'])
 
+    def test_flat_structure(self):
+        st = gemmi.read_structure(full_path('1pfe.cif.gz'))
+        flat = gemmi.FlatStructure(st)
+        atoms = [cra.atom for cra in st[0].all()]
+        self.assertEqual(flat.atom_count(), len(atoms))
+        self.assertEqual(flat.model_count(), 1)
+        for n in [0, 100, len(atoms) - 1]:
+            self.assertEqual(flat.get_atom_name(n), atoms[n].name)
+            self.assertEqual(flat.position(n).dist(atoms[n].pos), 0)
+        def atom_lines(st):
+            return [line for line in st.make_minimal_pdb().splitlines()
+                    if line.startswith(('ATOM', 'HETATM'))]
+        self.assertEqual(atom_lines(flat.to_structure()), atom_lines(st))
+        pos = gemmi.Position(1, 2, 3)
+        flat.set_position(5, pos)
+        flat.copy_to(st)
+        self.assertEqual(atoms[5].pos.dist(pos), 0)
+        # the same model superposed onto itself
+        sr = gemmi.calculate_superposition(flat, 0, flat, 0,
+                                           gemmi.PolymerType.PeptideL,
+                                           gemmi.SupSelect.All, altloc='*')
+        self.assertEqual(sr.count, len(atoms))
+        self.assertAlmostEqual(sr.rmsd, 0, delta=1e-6)
+
+    @unittest.skipIf(numpy is None, "requires NumPy")
+    def test_flat_structure_instead_of_model(self):
+        st = gemmi.read_structure(full_path('1orc.pdb'))
+        flat = gemmi.FlatStructure(st)
+        atoms = [cra.atom for cra in st[0].all()]
+        # arrays are copies that stay valid when FlatStructure changes
+        x = flat.x
+        flat.set_structure(gemmi.read_structure(full_path('1pfe.cif.gz')))
+        self.assertEqual(list(x), [a.pos.x for a in atoms])
+        flat.set_structure(st)
+
+        for dc_class in [gemmi.DensityCalculatorX, gemmi.DensityCalculatorE]:
+            dc1 = dc_class()
+            dc1.d_min = 2.5
+            dc1.set_grid_cell_and_spacegroup(st)
+            dc1.put_model_density_on_grid(st[0])
+            dc2 = dc_class()
+            dc2.d_min = 2.5
+            dc2.set_grid_cell_and_spacegroup(st)
+            dc2.put_model_density_on_grid(flat)
+            self.assertTrue(numpy.allclose(numpy.array(dc1.grid, copy=False),
+                                           numpy.array(dc2.grid, copy=False),
+                                           atol=1e-6, rtol=0))
+
+        ns1 = gemmi.NeighborSearch(st[0], st.cell, 5).populate()
+        ns2 = gemmi.NeighborSearch(flat, st.cell, 5).populate()
+        def indices(marks):
+            return sorted((m.image_idx, m.chain_idx, m.residue_idx, m.atom_idx)
+                          for m in marks)
+        for atom in atoms[::37]:
+            marks1 = ns1.find_atoms(atom.pos, '\0', radius=4)
+            marks2 = ns2.find_atoms(atom.pos, '\0', radius=4)
+            self.assertGreater(len(marks1), 1)
+            self.assertEqual(indices(marks1), indices(marks2))
+
+        for radii in [gemmi.AtomicRadiiSet.Refmac, gemmi.AtomicRadiiSet.Cctbx]:
+            masker = gemmi.SolventMasker(radii)
+            grid1 = gemmi.Int8Grid()
+            grid1.setup_from(st, spacing=1.0)
+            masker.put_mask_on_int8_grid(grid1, st[0])
+            grid2 = gemmi.Int8Grid()
+            grid2.setup_from(st, spacing=1.0)
+            masker.put_mask_on_int8_grid(grid2, flat)
+            self.assertTrue(numpy.array_equal(numpy.array(grid1, copy=False),
+                                              numpy.array(grid2, copy=False)))
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -1,8 +1,10 @@
 #!/usr/bin/env python
 
+from io import StringIO
 import os
 import unittest
 import gemmi
+from common import get_path_for_tempfile
 
 SO2_FROM_MONOMER = """\
 CRYST1    1.000    1.000    1.000  90.00  90.00  90.00 P 1                      
@@ -106,6 +108,41 @@ class TestMonLib(unittest.TestCase):
         self.assertEqual(monlib.path('ALA'), path + "a/ALA.cif")
         self.assertEqual(monlib.path('CON'), path + "c/CON_CON.cif")
 
+    def test_snapshot(self):
+        path = full_path('')
+        snapshot_path = get_path_for_tempfile(suffix='.bin')
+        os.remove(snapshot_path)
+        monlib = gemmi.MonLib()
+        monlib.read_monomer_lib_with_snapshot(path, ['HEM'], snapshot_path)
+        self.assertTrue(os.path.exists(snapshot_path))
+        monlib2 = gemmi.MonLib()
+        monlib2.read_monomer_lib_with_snapshot(path, ['HEM'], snapshot_path)
+        self.assertEqual(repr(monlib2), repr(monlib))
+        self.assertEqual(monlib2.monomer_dir, monlib.monomer_dir)
+        # the snapshot stores also monomers read from other files
+        monlib.read_monomer_cif(full_path('HEM.cif'))
+        monlib.write_snapshot(snapshot_path)
+        monlib3 = gemmi.MonLib()
+        self.assertTrue(monlib3.read_snapshot(snapshot_path))
+        hem = monlib.monomers['HEM']
+        hem3 = monlib3.monomers['HEM']
+        self.assertEqual([a.id for a in hem3.atoms], [a.id for a in hem.atoms])
+        self.assertEqual(len(hem3.rt.bonds), len(hem.rt.bonds))
+        self.assertEqual(hem3.rt.bonds[5].value, hem.rt.bonds[5].value)
+        # a truncated snapshot is treated as outdated and re-written
+        with open(snapshot_path, 'r+b') as f:
+            f.truncate(100)
+        monlib4 = gemmi.MonLib()
+        monlib4.read_monomer_lib_with_snapshot(path, ['HEM'], snapshot_path)
+        self.assertEqual(repr(monlib4), repr(monlib2))
+        self.assertTrue(gemmi.MonLib().read_snapshot(snapshot_path))
+        os.remove(snapshot_path)
+        # failure to write the snapshot is only a warning
+        bad_path = os.path.join(snapshot_path + '.nonexistent', 'x.bin')
+        monlib5 = gemmi.MonLib()
+        monlib5.read_monomer_lib_with_snapshot(path, ['HEM'], bad_path)
+        self.assertEqual(repr(monlib5), repr(monlib2))
+
     @unittest.skipIf(os.getenv('CLIBD_MON') is None, "$CLIBD_MON not defined.")
     def test_read_monomer_lib(self):
         st = gemmi.read_structure(full_path('4oz7.pdb'))
@@ -122,6 +159,85 @@ class TestMonLib(unittest.TestCase):
         # RuntimeError: Placing of hydrogen bonded to A/22W 6/N failed:
         # Missing angle restraint HN-N-C.
 
+    @unittest.skipIf(os.getenv('CLIBD_MON') is None, "$CLIBD_MON not defined.")
+    def test_topology_on_threads(self):
+        st = gemmi.read_structure(full_path('4oz7.pdb'))
+        monlib = gemmi.MonLib()
+        monlib.read_monomer_lib(os.environ['CLIBD_MON'],
+                                st[0].get_all_residue_names())
+        def summary(n_threads):
+            st2 = st.clone()
+            topo = gemmi.prepare_topology(st2, monlib, warnings=StringIO(),
+                                          n_threads=n_threads)
+            out = []
+            for restraints in [topo.bonds, topo.angles, topo.torsions,
+                               topo.chirs, topo.planes]:
+                out.append([[atom.serial for atom in r.atoms]
+                            for r in restraints])
+            out.append([round(b.calculate_z(), 6) for b in topo.bonds])
+            out.append([round(a.calculate_z(), 6) for a in topo.angles])
+            for i in range(len(topo.chain_infos)):
+                for ri in topo.chain_infos[i].res_infos:
+                    out.append([(r.rkind, r.index) for r in ri.monomer_rules])
+            return out
+        result = summary(n_threads=1)
+        self.assertGreater(len(result[0]), 100)
+        self.assertEqual(summary(n_threads=3), result)
+
+    @unittest.skipIf(os.getenv('CLIBD_MON') is None, "$CLIBD_MON not defined.")
+    def test_readd_hydrogens_on_threads(self):
+        st = gemmi.read_structure(full_path('4oz7.pdb'))
+        monlib = gemmi.MonLib()
+        monlib.read_monomer_lib(os.environ['CLIBD_MON'],
+                                st[0].get_all_residue_names())
+        h_change = gemmi.HydrogenChange.ReAdd
+        def readd(n_threads, warnings):
+            st2 = st.clone()
+            gemmi.prepare_topology(st2, monlib, h_change=h_change,
+                                   warnings=warnings, n_threads=n_threads)
+            return [(str(cra), cra.atom.is_hydrogen(), cra.atom.pos.tolist(),
+                     cra.atom.occ) for cra in st2[0].all()]
+        def first_error(n_threads):
+            try:
+                readd(n_threads, warnings=None)
+            except RuntimeError as e:
+                return str(e)
+            return None
+        # without warnings, the first error is thrown, as in one thread
+        self.assertEqual(first_error(n_threads=3), first_error(n_threads=1))
+        out1 = StringIO()
+        atoms1 = readd(n_threads=1, warnings=out1)
+        self.assertGreater(sum(1 for a in atoms1 if a[1]), 50)
+        out3 = StringIO()
+        self.assertEqual(readd(n_threads=3, warnings=out3), atoms1)
+        self.assertEqual(out3.getvalue(), out1.getvalue())
+
+    @unittest.skipIf(os.getenv('CLIBD_MON') is None, "$CLIBD_MON not defined.")
+    def test_link_hunt(self):
+        st = gemmi.read_structure(full_path('4oz7.pdb'))
+        monlib = gemmi.MonLib()
+        monlib.read_monomer_lib(os.environ['CLIBD_MON'],
+                                st[0].get_all_residue_names())
+        hunt = gemmi.LinkHunt()
+        hunt.index_chem_links(monlib)
+        def summary(**kwargs):
+            matches = hunt.find_possible_links(st, bond_margin=1.3,
+                                               radius_margin=1.1, **kwargs)
+            return [(str(m.cra1), str(m.cra2),
+                     m.chem_link.id if m.chem_link else '',
+                     m.chem_link_count, round(m.bond_length, 4))
+                    for m in matches]
+        result = summary()
+        self.assertEqual(summary(n_threads=3), result)
+        linked = [m for m in result if m[2]]
+        self.assertGreater(len(linked), 10)
+        # links are matched by atom names, elements don't matter
+        for chain in st[0]:
+            for res in chain:
+                for atom in res:
+                    atom.element = gemmi.Element('X')
+        self.assertEqual([m for m in summary() if m[2]], linked)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -1,10 +1,12 @@
 #!/usr/bin/env python
 
 import os
+import shutil
 import sys
 import subprocess
 import unittest
 import gemmi
+from common import get_path_for_tempfile, numpy
 
 TOP_DIR = os.path.join(os.path.dirname(__file__), "..")
 
@@ -125,5 +127,40 @@ metalc7      N   22Q B   1                CU   CU1 A 101     1555   6344  2.07
 metalc8      S   22Q B   1                CU   CU1 A 101     1555   6344  2.22
 ''')
 
+def write_test_mtz(path, datasets, columns, data):
+    mtz = gemmi.Mtz(with_base=True)
+    mtz.spacegroup = gemmi.find_spacegroup_by_name('P 1')
+    mtz.set_cell_for_all(gemmi.UnitCell(10, 10, 10, 90, 90, 90))
+    for name in datasets:
+        mtz.add_dataset(name)
+    for label, col_type, dataset_id in columns:
+        mtz.add_column(label, col_type, dataset_id=dataset_id)
+    mtz.set_data(numpy.array(data, dtype=numpy.float32))
+    mtz.write_to_file(path)
+
+@unittest.skipIf(numpy is None or shutil.which('gemmi-mixmtz') is None,
+                 "NumPy or program gemmi-mixmtz not found.")
+class TestMixMtz(unittest.TestCase):
+    def test_interleaved_datasets(self):
+        path1 = get_path_for_tempfile(suffix='.mtz')
+        path2 = get_path_for_tempfile(suffix='.mtz')
+        out_path = get_path_for_tempfile(suffix='.mtz')
+        write_test_mtz(path1, ['D1'], [('X', 'I', 1)],
+                       [[h, 0, 0, 7] for h in (1, 2, 3)])
+        # columns of datasets D1 and D2 are interleaved
+        write_test_mtz(path2, ['D1', 'D2'],
+                       [('FA', 'F', 1), ('FB', 'F', 2), ('SIGFA', 'Q', 1)],
+                       [[h, 0, 0, 10+h, 20+h, 30+h] for h in (3, 2, 1)])
+        subprocess.check_call(['gemmi-mixmtz', path1, path2, out_path])
+        mtz = gemmi.read_mtz_file(out_path)
+        for path in (path1, path2, out_path):
+            os.remove(path)
+        self.assertEqual(mtz.column_labels(),
+                         ['H', 'K', 'L', 'X', 'FA', 'SIGFA', 'FB'])
+        self.assertEqual(list(mtz.column_with_label('H')), [1, 2, 3])
+        self.assertEqual(list(mtz.column_with_label('FA')), [11, 12, 13])
+        self.assertEqual(list(mtz.column_with_label('FB')), [21, 22, 23])
+        self.assertEqual(list(mtz.column_with_label('SIGFA')), [31, 32, 33])
+
 if __name__ == '__main__':
     unittest.main()
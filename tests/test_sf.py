@@ -2,6 +2,7 @@
 
 import unittest
 import gemmi
+from common import full_path, numpy
 
 # from 5nl9
 FRAGMENT_WITH_UNK = """\
@@ -35,5 +36,88 @@ class TestDensityCalculator(unittest.TestCase):
             # we only check here that it doesn't crash
             dencalc.put_model_density_on_grid(st[0])
 
+    @unittest.skipIf(numpy is None, "NumPy not installed.")
+    def test_reuse_orbits(self):
+        st = gemmi.read_pdb_string(FRAGMENT_WITH_UNK)
+        st.remove_ligands_and_waters()
+        dencalc = gemmi.DensityCalculatorX()
+        self.assertFalse(dencalc.reuse_orbits)
+        dencalc.d_min = 2.5
+        dencalc.set_grid_cell_and_spacegroup(st)
+        dencalc.put_model_density_on_grid(st[0])
+        expected = numpy.array(dencalc.grid, copy=True)
+        dencalc.reuse_orbits = True
+        for _ in range(2):
+            dencalc.put_model_density_on_grid(st[0])
+            self.assertTrue(numpy.allclose(expected, dencalc.grid, atol=1e-6))
+
+    @unittest.skipIf(numpy is None, "NumPy not installed.")
+    def test_density_of_assembly_view(self):
+        # 1pfe has anisotropic ADPs, which are rotated in copies
+        st = gemmi.read_structure(full_path('1pfe.cif.gz'))
+        how = gemmi.HowToNameCopiedChain.Short
+        view = gemmi.make_assembly_view(st.assemblies[0], st[0], how)
+        assem = gemmi.make_assembly(st.assemblies[0], st[0], how)
+        grids = []
+        for model in [view, assem]:
+            dencalc = gemmi.DensityCalculatorX()
+            dencalc.d_min = 2.5
+            dencalc.set_grid_cell_and_spacegroup(st)
+            dencalc.put_model_density_on_grid(model)
+            grids.append(numpy.array(dencalc.grid, copy=True))
+        self.assertTrue(numpy.allclose(grids[0], grids[1], atol=1e-6))
+
+    @unittest.skipIf(numpy is None, "NumPy not installed.")
+    def test_update_atom_density(self):
+        st = gemmi.read_pdb_string(FRAGMENT_WITH_UNK)
+        st.remove_ligands_and_waters()
+        dencalc = gemmi.DensityCalculatorX()
+        dencalc.d_min = 2.5
+        dencalc.set_grid_cell_and_spacegroup(st)
+        dencalc.put_model_density_on_grid(st[0])
+        calc = gemmi.StructureFactorCalculatorX(st.cell)
+        hkls = [[1, 2, 3], [-2, 0, 5], [4, 1, -3]]
+        sf = [calc.calculate_sf_from_model(st[0], hkl) for hkl in hkls]
+        atom = st[0]['B'][0][0]
+        old_atom = atom.clone()
+        atom.pos = gemmi.Position(atom.pos.x + 0.5, atom.pos.y, atom.pos.z - 0.3)
+        dencalc.track_changes = True
+        dencalc.update_atom_density(old_atom, atom)
+        # two atoms (old and new), each in two symmetry images
+        self.assertEqual(len(dencalc.changed_regions), 4)
+        updated = numpy.array(dencalc.grid, copy=True)
+        dencalc.put_model_density_on_grid(st[0])
+        self.assertTrue(numpy.allclose(updated, dencalc.grid, atol=1e-5))
+        sf = calc.add_sf_change(sf, hkls, [old_atom], [atom])
+        for hkl, value in zip(hkls, sf):
+            expected = calc.calculate_sf_from_model(st[0], hkl)
+            self.assertAlmostEqual(abs(value - expected), 0, delta=1e-6)
+
+    def test_local_correlations(self):
+        st = gemmi.read_pdb_string(FRAGMENT_WITH_UNK)
+        st.remove_ligands_and_waters()
+        dencalc = gemmi.DensityCalculatorX()
+        dencalc.d_min = 2.5
+        dencalc.set_grid_cell_and_spacegroup(st)
+        dencalc.put_model_density_on_grid(st[0])
+        map_grid = dencalc.grid.clone()
+        model_calc = gemmi.DensityCalculatorX()
+        gemmi.put_model_density_on_map_grid(model_calc, st[0], map_grid)
+        result = gemmi.calculate_local_correlations(model_calc, st[0], map_grid,
+                                                    radius=1.0, per_atom=True)
+        self.assertEqual([lc.atom.name for lc in result],
+                         [atom.name for atom in st[0]['B'][0]])
+        for lc in result:
+            self.assertGreater(lc.rscc(), 0.999)
+        atom = st[0]['B'][0]['N'][0]
+        atom.pos = gemmi.Position(atom.pos.x + 1.0, atom.pos.y, atom.pos.z)
+        gemmi.put_model_density_on_map_grid(model_calc, st[0], map_grid)
+        result = gemmi.calculate_local_correlations(model_calc, st[0], map_grid,
+                                                    radius=1.0, threads=2)
+        self.assertEqual(len(result), 1)
+        self.assertIsNone(result[0].atom)
+        self.assertEqual(result[0].residue.name, 'PRO')
+        self.assertLess(result[0].rscc(), 0.95)
+
 if __name__ == '__main__':
     unittest.main()
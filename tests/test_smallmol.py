@@ -39,5 +39,21 @@ class TestRealCif(unittest.TestCase):
             u_eq = small.cell.calculate_u_eq(site.aniso)
             self.assertAlmostEqual(u_eq, site.u_iso, delta=0.00012)
 
+class TestSfCalc(unittest.TestCase):
+    def test_batch_sf(self):
+        for name in ['1011031.cif', '2013551.cif', '2242624.cif']:
+            small = gemmi.read_small_structure(full_path(name))
+            small.change_occupancies_to_crystallographic()
+            calc = gemmi.StructureFactorCalculatorX(small.cell)
+            hkls = [(h, k, l) for h in range(-3, 4) for k in range(-2, 3)
+                    for l in range(0, 4)]
+            values = calc.calculate_sf_from_small_structure(small, hkls,
+                                                            threads=3)
+            for hkl, value in zip(hkls, values):
+                if hkl == (0, 0, 0):
+                    continue
+                single = calc.calculate_sf_from_small_structure(small, hkl)
+                self.assertLess(abs(value - single), 1e-6 * abs(single) + 1e-9)
+
 if __name__ == '__main__':
     unittest.main()